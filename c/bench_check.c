@@ -0,0 +1,81 @@
+#include "ws.h"
+#include "station.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+
+/*
+	Throughput of station_check_records() on full history buffers, against checking the
+	same records one at a time with station_check_record().
+*/
+
+#define BENCH_ROUNDS 2000
+
+static double bench_now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char** args)
+{
+	static ws_packed_record packed[WS_HISTORY_RECORDS];
+	static ws_weather_record records[WS_HISTORY_RECORDS];
+	static uint16_t invalid_fields[WS_HISTORY_RECORDS];
+	int rounds = (argc > 1) ? atoi(args[1]) : BENCH_ROUNDS;
+
+	// Plausible records, with every 20th one random so that some of them fail a check
+	srand(1);
+	for (int i = 0; i < WS_HISTORY_RECORDS; i++)
+	{
+		unsigned char data[WS_RECORD_SIZE];
+		for (int j = 0; j < WS_RECORD_SIZE; j++)
+		{
+			data[j] = rand();
+		}
+
+		if (i % 20 != 0)
+		{
+			data[1] = rand() % 100;
+			data[4] = rand() % 100;
+			data[3] = 0;
+			data[6] = 0;
+			data[11] = 0;
+			data[12] = rand() % 16;
+		}
+
+		ws_process_packed_record_data(data, &packed[i]);
+		ws_process_record_data(data, &records[i]);
+		records[i].date_time = NULL;
+	}
+
+	int invalid = 0;
+	double start = bench_now();
+	for (int round = 0; round < rounds; round++)
+	{
+		invalid = station_check_records(packed, WS_HISTORY_RECORDS, invalid_fields);
+	}
+	double batch = bench_now() - start;
+
+	int single_invalid = 0;
+	start = bench_now();
+	for (int round = 0; round < rounds; round++)
+	{
+		single_invalid = 0;
+		for (int i = 0; i < WS_HISTORY_RECORDS; i++)
+		{
+			station_check_record(&records[i]);
+			single_invalid += records[i].data_invalid;
+		}
+	}
+	double single = bench_now() - start;
+
+	double total = (double)rounds * WS_HISTORY_RECORDS;
+	printf("%d batches of %d records, %d invalid\n", rounds, WS_HISTORY_RECORDS, invalid);
+	printf("station_check_records: %.2f ns per record, %.1f M records/s\n", batch * 1e9 / total, total / batch / 1e6);
+	printf("station_check_record:  %.2f ns per record, %.1f M records/s (%d invalid)\n", single * 1e9 / total, total / single / 1e6, single_invalid);
+
+	return 0;
+}
@@ -0,0 +1,237 @@
+#define _GNU_SOURCE
+#include "ws.h"
+#include "ws_store.h"
+#include "ws_json.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+/*
+	Time per call of ws_json_record() and ws_json_extremes(), against an snprintf formatter
+	that writes the same text. The outputs are compared first, so the times are for the
+	same JSON.
+*/
+
+#define BENCH_RECORDS 4096
+#define BENCH_EXTREMES 256
+#define BENCH_ROUNDS 2000000
+
+static double bench_now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Appends to the buffer, carrying on counting once it's full, as ws_format does */
+static void bench_append(char* buffer, int size, int* length, const char* format, ...)
+{
+	va_list args;
+	va_start(args, format);
+
+	int written;
+	if (*length < size)
+	{
+		written = vsnprintf(buffer + *length, size - *length, format, args);
+	} else {
+		written = vsnprintf(NULL, 0, format, args);
+	}
+
+	va_end(args);
+	*length += (written > 0) ? written : 0;
+}
+
+static void bench_int(char* buffer, int size, int* length, int value)
+{
+	bench_append(buffer, size, length, "%d", value);
+}
+
+static void bench_double(char* buffer, int size, int* length, double value)
+{
+	if (!isfinite(value) || fabs(value) >= 1e17)
+	{
+		bench_append(buffer, size, length, "null");
+	} else {
+		// Rounded to tenths the same way, and never "-0.0"
+		bench_append(buffer, size, length, "%.1f", round(value * 10.0) / 10.0 + 0.0);
+	}
+}
+
+static void bench_ws_time(char* buffer, int size, int* length, const ws_time* time)
+{
+	if (time->year == 0 && time->month == 0 && time->day == 0)
+	{
+		bench_append(buffer, size, length, "null");
+	} else {
+		bench_append(buffer, size, length, "\"20%02d-%02d-%02dT%02d:%02d:00\"", time->year, time->month, time->day,
+		             time->hour, time->minute);
+	}
+}
+
+static int bench_snprintf_record(const ws_weather_record* record, char* buffer, int size)
+{
+	const struct tm* date_time = record->date_time;
+	long offset = labs(date_time->tm_gmtoff) / 60;
+	int length = 0;
+
+	bench_append(buffer, size, &length, "{\"time\":\"%04d-%02d-%02dT%02d:%02d:%02d%c%02ld:%02ld\"", date_time->tm_year + 1900,
+	             date_time->tm_mon + 1, date_time->tm_mday, date_time->tm_hour, date_time->tm_min, date_time->tm_sec,
+	             (date_time->tm_gmtoff < 0) ? '-' : '+', offset / 60, offset % 60);
+
+#define BENCH_FIELD(TYPE, NAME, VALUE) 																\
+	bench_append(buffer, size, &length, ",\"" #NAME "\":"); 										\
+	bench_##TYPE(buffer, size, &length, VALUE);
+#define BENCH_RECORD_FIELD(TYPE, NAME, COLUMN, LABEL, UNIT, DECODE) BENCH_FIELD(TYPE, NAME, record->NAME)
+#define BENCH_STATUS_FIELD(TYPE, NAME, COLUMN, LABEL, UNIT, DECODE) BENCH_FIELD(TYPE, NAME, record->status.NAME)
+	FOREACH_WS_RECORD_FIELD(BENCH_RECORD_FIELD)
+	FOREACH_WS_STATUS_FIELD(BENCH_STATUS_FIELD)
+#undef BENCH_FIELD
+#undef BENCH_RECORD_FIELD
+#undef BENCH_STATUS_FIELD
+
+	bench_append(buffer, size, &length, "}");
+	return length;
+}
+
+static int bench_snprintf_extremes(const ws_weather_extremes* extremes, char* buffer, int size)
+{
+	const char* separator = "{";
+	int length = 0;
+
+#define BENCH_EXTREME(FIELD, NAME) 																	\
+	bench_append(buffer, size, &length, "%s\"" #FIELD "\":{\"min\":", separator); 					\
+	bench_double(buffer, size, &length, extremes->FIELD.min); 										\
+	bench_append(buffer, size, &length, ",\"min_time\":"); 											\
+	bench_ws_time(buffer, size, &length, &extremes->FIELD.min_time); 								\
+	bench_append(buffer, size, &length, ",\"max\":"); 												\
+	bench_double(buffer, size, &length, extremes->FIELD.max); 										\
+	bench_append(buffer, size, &length, ",\"max_time\":"); 											\
+	bench_ws_time(buffer, size, &length, &extremes->FIELD.max_time); 								\
+	bench_append(buffer, size, &length, "}"); 														\
+	separator = ",";
+	FOREACH_WS_EXTREME(BENCH_EXTREME)
+#undef BENCH_EXTREME
+
+	bench_append(buffer, size, &length, "}");
+	return length;
+}
+
+static ws_time bench_random_time()
+{
+	ws_time time = { rand() % 100, 1 + rand() % 12, 1 + rand() % 28, rand() % 24, rand() % 60 };
+	return time;
+}
+
+int main(int argc, char** args)
+{
+	static ws_weather_record records[BENCH_RECORDS];
+	static struct tm times[BENCH_RECORDS];
+	static ws_weather_extremes extremes[BENCH_EXTREMES];
+	int rounds = (argc > 1) ? atoi(args[1]) : BENCH_ROUNDS;
+
+	srand(1);
+	for (int i = 0; i < BENCH_RECORDS; i++)
+	{
+		unsigned char data[WS_RECORD_SIZE];
+		for (int j = 0; j < WS_RECORD_SIZE; j++)
+		{
+			data[j] = rand();
+		}
+
+		// A humidity of 0 gives a NaN dew point, written as null
+		if (i % 5 == 0)
+		{
+			data[4] = 0;
+		}
+
+		ws_process_record_data(data, &records[i]);
+		time_t time = 1500000000 + (time_t)rand() * 7;
+		localtime_r(&time, &times[i]);
+		records[i].date_time = &times[i];
+	}
+
+	for (int i = 0; i < BENCH_EXTREMES; i++)
+	{
+		for (int e = 0; e < WS_EXTREME_COUNT; e++)
+		{
+			ws_min_max* value = ws_store_extreme_field(&extremes[i], e);
+			value->min = (rand() % 20000 - 10000) / 10.0;
+			value->max = (rand() % 200000) / 10.0;
+			value->max_time = bench_random_time();
+			value->min_time = (e % 3 == 0) ? (ws_time){ 0 } : bench_random_time();
+		}
+	}
+
+	char json[WS_JSON_EXTREMES_MAX];
+	char reference[WS_JSON_EXTREMES_MAX];
+	int mismatches = 0;
+
+	for (int i = 0; i < BENCH_RECORDS; i++)
+	{
+		int length = ws_json_record(&records[i], WS_FIELD_ALL, json, sizeof(json));
+		if (length != bench_snprintf_record(&records[i], reference, sizeof(reference)) || strcmp(json, reference) != 0)
+		{
+			mismatches++;
+		}
+	}
+
+	for (int i = 0; i < BENCH_EXTREMES; i++)
+	{
+		int length = ws_json_extremes(&extremes[i], json, sizeof(json));
+		if (length != bench_snprintf_extremes(&extremes[i], reference, sizeof(reference)) || strcmp(json, reference) != 0)
+		{
+			mismatches++;
+		}
+	}
+
+	printf("%d records and %d extremes, %d mismatches with snprintf\n", BENCH_RECORDS, BENCH_EXTREMES, mismatches);
+
+	// Summed so the calls can't be optimised out
+	long total = 0;
+
+	double start = bench_now();
+	for (int round = 0; round < rounds; round++)
+	{
+		total += ws_json_record(&records[round % BENCH_RECORDS], WS_FIELD_ALL, json, WS_JSON_RECORD_MAX);
+	}
+	double fast = (bench_now() - start) * 1e9 / rounds;
+
+	start = bench_now();
+	for (int round = 0; round < rounds; round++)
+	{
+		total += bench_snprintf_record(&records[round % BENCH_RECORDS], reference, WS_JSON_RECORD_MAX);
+	}
+	double slow = (bench_now() - start) * 1e9 / rounds;
+	printf("record, all fields: ws_json %.0f ns, snprintf %.0f ns (%.1fx)\n", fast, slow, slow / fast);
+
+	uint32_t fields = WS_FIELD_BIT(WS_FIELD_outdoor_temperature) | WS_FIELD_BIT(WS_FIELD_wind_speed);
+	start = bench_now();
+	for (int round = 0; round < rounds; round++)
+	{
+		total += ws_json_record(&records[round % BENCH_RECORDS], fields, json, WS_JSON_RECORD_MAX);
+	}
+	printf("record, 2 fields:   ws_json %.0f ns\n", (bench_now() - start) * 1e9 / rounds);
+
+	// Extremes are ~5 times longer than a record
+	int extremes_rounds = rounds / 10;
+	start = bench_now();
+	for (int round = 0; round < extremes_rounds; round++)
+	{
+		total += ws_json_extremes(&extremes[round % BENCH_EXTREMES], json, sizeof(json));
+	}
+	fast = (bench_now() - start) * 1e9 / extremes_rounds;
+
+	start = bench_now();
+	for (int round = 0; round < extremes_rounds; round++)
+	{
+		total += bench_snprintf_extremes(&extremes[round % BENCH_EXTREMES], reference, sizeof(reference));
+	}
+	slow = (bench_now() - start) * 1e9 / extremes_rounds;
+	printf("extremes:           ws_json %.0f ns, snprintf %.0f ns (%.1fx)\n", fast, slow, slow / fast);
+
+	return (mismatches == 0 && total > 0) ? 0 : 1;
+}
@@ -0,0 +1,258 @@
+#include "ws.h"
+#include "ws_backend.h"
+#include "ws_seglog.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+/*
+	Sustained append rate of the segmented log against SQLite, and how long the log takes
+	to recover after its writer is killed part way through a commit.
+
+	Usage: bench_seglog <scratch directory> [seconds the writer runs before it is killed]
+	The directory is created if needed, and everything in it may be overwritten.
+*/
+
+#define BENCH_RECORDS 20000
+#define BENCH_WRITER_SECONDS 3
+
+static double bench_now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void bench_record(int64_t epoch, ws_packed_record *record)
+{
+	memset(record, 0, sizeof(ws_packed_record));
+	record->epoch = epoch;
+	record->indoor_temperature = 200 + epoch % 50;
+	record->outdoor_temperature = 100 + epoch % 80;
+	record->dew_point = 50;
+	record->absolute_pressure = 10100;
+	record->wind_speed = epoch % 100;
+	record->gust_speed = epoch % 150;
+	record->indoor_humidity = 45;
+	record->outdoor_humidity = 70;
+	record->wind_direction = epoch % 16;
+}
+
+/* Appends records in batches of batch_size, committing after each, and returns records per second */
+static double bench_append(ws_backend *backend, int batch_size, int total, int64_t *epoch)
+{
+	ws_packed_record *batch = malloc(batch_size * sizeof(ws_packed_record));
+	if (batch == NULL)
+	{
+		return 0;
+	}
+
+	double start = bench_now();
+	for (int done = 0; done < total; done += batch_size)
+	{
+		for (int i = 0; i < batch_size; i++)
+		{
+			*epoch += 300;
+			bench_record(*epoch, &batch[i]);
+		}
+
+		backend->begin(backend);
+		if (backend->append(backend, batch, batch_size) != WS_SUCCESS || backend->commit(backend) != WS_SUCCESS)
+		{
+			printf("%s: append failed\n", backend->name);
+			break;
+		}
+	}
+	double seconds = bench_now() - start;
+
+	free(batch);
+	return total / seconds;
+}
+
+static int bench_count_record(const ws_packed_record *record, void *user)
+{
+	(*(uint64_t*)user)++;
+	return 0;
+}
+
+/* Runs a writer until it is killed, tears the end of the last segment and times reopening the log */
+static int bench_recovery(const char *directory, int writer_seconds)
+{
+	// The writer reports how many records it has committed down a pipe, so the committed count is known
+	int report[2];
+	if (pipe(report) != 0)
+	{
+		return 1;
+	}
+
+	pid_t writer = fork();
+	if (writer == 0)
+	{
+		close(report[0]);
+
+		ws_seglog log;
+		if (ws_seglog_open(&log, directory) != WS_SUCCESS)
+		{
+			_exit(1);
+		}
+
+		ws_packed_record batch[100];
+		int64_t epoch = 1000000000;
+		for (;;)
+		{
+			for (int i = 0; i < 100; i++)
+			{
+				epoch += 300;
+				bench_record(epoch, &batch[i]);
+			}
+
+			ws_seglog_append(&log, batch, 100);
+			if (ws_seglog_commit(&log) != WS_SUCCESS)
+			{
+				_exit(1);
+			}
+
+			ssize_t written = write(report[1], &log.record_count, sizeof(log.record_count));
+			(void)written;
+		}
+	}
+
+	close(report[1]);
+	if (writer < 0)
+	{
+		close(report[0]);
+		return 1;
+	}
+
+	sleep(writer_seconds);
+	kill(writer, SIGKILL);
+	waitpid(writer, NULL, 0);
+
+	uint64_t committed = 0;
+	uint64_t reported;
+	while (read(report[0], &reported, sizeof(reported)) == sizeof(reported))
+	{
+		committed = reported;
+	}
+	close(report[0]);
+
+	// Leave a torn half frame and a run of zeros at the end of the last segment, as a crash mid write can
+	ws_seglog log;
+	if (ws_seglog_open(&log, directory) != WS_SUCCESS)
+	{
+		printf("recovery: could not open the log\n");
+		return 1;
+	}
+
+	char path[PATH_MAX + 32];
+	snprintf(path, sizeof(path), "%s/%.8u.wslog", directory, log.segment);
+	uint32_t segments = log.segment_count;
+	ws_seglog_close(&log);
+
+	int fd = open(path, O_WRONLY | O_APPEND);
+	if (fd >= 0)
+	{
+		unsigned char torn[sizeof(ws_seglog_frame) / 2 + 4 * sizeof(ws_seglog_frame)];
+		memset(torn, 0, sizeof(torn));
+		memset(torn, 0x5A, sizeof(ws_seglog_frame) / 2);
+		ssize_t written = write(fd, torn, sizeof(torn));
+		(void)written;
+		close(fd);
+	}
+
+	double start = bench_now();
+	int status = ws_seglog_open(&log, directory);
+	double open_seconds = bench_now() - start;
+
+	if (status != WS_SUCCESS)
+	{
+		printf("recovery: could not reopen the log\n");
+		return 1;
+	}
+
+	// A day of five minute records from the middle of the log
+	uint64_t in_range = 0;
+	time_t from = 1000000000 + (time_t)(log.record_count / 2) * 300;
+	start = bench_now();
+	ws_seglog_query(&log, from, from + 24 * 60 * 60, bench_count_record, &in_range);
+	double query_seconds = bench_now() - start;
+
+	printf("recovery: writer killed after %d s, %llu records committed in %u segments\n", writer_seconds,
+	       (unsigned long long)committed, segments);
+	printf("recovery: reopened in %.2f ms with %llu records (%s)\n", open_seconds * 1e3, (unsigned long long)log.record_count,
+	       (log.record_count >= committed) ? "every committed record kept" : "COMMITTED RECORDS LOST");
+	printf("recovery: %llu record range query in %.1f us\n", (unsigned long long)in_range, query_seconds * 1e6);
+
+	int lost = log.record_count < committed;
+	ws_seglog_close(&log);
+	return lost;
+}
+
+int main(int argc, char** args)
+{
+	if (argc < 2)
+	{
+		printf("Usage: %s <scratch directory> [writer seconds]\n", args[0]);
+		return 1;
+	}
+
+	int writer_seconds = (argc > 2) ? atoi(args[2]) : BENCH_WRITER_SECONDS;
+
+	// The SQLite backend always uses WeatherDB.sqlite in the working directory
+	mkdir(args[1], 0755);
+	if (chdir(args[1]) != 0)
+	{
+		printf("Could not use %s\n", args[1]);
+		return 1;
+	}
+	unlink("WeatherDB.sqlite");
+
+	static const int batch_sizes[] = { 1, 16, 100, 1000 };
+	for (size_t b = 0; b < sizeof(batch_sizes) / sizeof(batch_sizes[0]); b++)
+	{
+		int batch_size = batch_sizes[b];
+		int total = (batch_size == 1) ? BENCH_RECORDS / 10 : BENCH_RECORDS;
+		total -= total % batch_size;
+
+		char directory[32];
+		snprintf(directory, sizeof(directory), "append-%d", batch_size);
+
+		ws_backend log;
+		ws_backend sqlite;
+		int64_t log_epoch = 1000000000;
+		int64_t sqlite_epoch = 1000000000;
+		double log_rate = 0;
+		double sqlite_rate = 0;
+
+		if (ws_backend_open_log(&log, directory) == WS_SUCCESS)
+		{
+			log.reset(&log);
+			log_rate = bench_append(&log, batch_size, total, &log_epoch);
+			log.close(&log);
+		}
+
+		if (ws_backend_open_sqlite(&sqlite) == WS_SUCCESS)
+		{
+			sqlite.reset(&sqlite);
+			sqlite_rate = bench_append(&sqlite, batch_size, total, &sqlite_epoch);
+			sqlite.close(&sqlite);
+		}
+
+		printf("batch %4d: log %9.0f rec/s   sqlite %9.0f rec/s\n", batch_size, log_rate, sqlite_rate);
+	}
+
+	ws_backend log;
+	if (ws_backend_open_log(&log, "recovery") == WS_SUCCESS)
+	{
+		log.reset(&log);
+		log.close(&log);
+	}
+
+	return bench_recovery("recovery", writer_seconds);
+}
@@ -3,12 +3,274 @@
 #include "station.h"
 #include "ws_store.h"
 #include "config.h"
+#include "ws_dump.h"
+#include "station_import.h"
+#include "ws_snapshot.h"
+#include "ws_shard.h"
+#include "ws_backend.h"
+#include "ws_log.h"
+#include "ws_feed.h"
+#include <string.h>
+#include <stdlib.h>
+
+/* Opens where records are written: the month databases of shard_directory if it was given,
+   with retention started if there are tiers, otherwise WeatherDB.sqlite */
+static int open_backend(const char* shard_directory, const ws_shard_tier* tiers, int tier_count, ws_backend* backend)
+{
+	if (shard_directory == NULL)
+	{
+		return ws_backend_open_sqlite(backend);
+	}
+
+	int status = ws_backend_open_shard(backend, shard_directory);
+	if (status == WS_SUCCESS && tier_count > 0)
+	{
+		status = ws_shard_start_retention(tiers, tier_count);
+		if (status != WS_SUCCESS)
+		{
+			backend->close(backend);
+		}
+	}
+
+	return status;
+}
 
 int main(int argc, char** args)
 {
 
 	ws_device dev;
-	station_download_data(&dev);
+
+	// Errors are written by a background thread, so the USB loop never waits on the console
+	if (ws_log_start(stdout) == WS_SUCCESS)
+	{
+		atexit(ws_log_stop);
+	}
+
+	// Options before the command. --shards <dir> stores the records of downloads, watch and import in a
+	// database per month, and each --retain <days>:<minutes> downsamples the months that ended at least
+	// that many days ago to buckets of that many minutes.
+	const char* shard_directory = NULL;
+	ws_shard_tier tiers[WS_SHARD_MAX_TIERS];
+	int tier_count = 0;
+
+	while (argc >= 3 && (strcmp(args[1], "--shards") == 0 || strcmp(args[1], "--retain") == 0))
+	{
+		if (strcmp(args[1], "--shards") == 0)
+		{
+			shard_directory = args[2];
+		} else {
+			int days;
+			int minutes;
+			int length = 0;
+
+			if (sscanf(args[2], "%d:%d%n", &days, &minutes, &length) != 2 || length != (int)strlen(args[2]) ||
+			    days < 0 || minutes <= 0 || tier_count == WS_SHARD_MAX_TIERS)
+			{
+				printf("--retain takes <days>:<minutes>, at most %d times\n", WS_SHARD_MAX_TIERS);
+				return 1;
+			}
+
+			tiers[tier_count].older_than = (time_t)days * 24 * 60 * 60;
+			tiers[tier_count].bucket_seconds = minutes * 60;
+			tier_count++;
+		}
+
+		// Drop the option, keeping the program name in front of the command
+		args[2] = args[0];
+		args += 2;
+		argc -= 2;
+	}
+
+	if (tier_count > 0 && shard_directory == NULL)
+	{
+		printf("--retain needs --shards\n");
+		return 1;
+	}
+
+	// Save the station's memory to an image file
+	if (argc == 3 && strcmp(args[1], "dump") == 0)
+	{
+		int status = ws_init(&dev);
+		if (status == WS_SUCCESS)
+		{
+			status = ws_initialise_read(&dev);
+		}
+
+		if (status == WS_SUCCESS)
+		{
+			status = ws_dump_capture(&dev, args[2]);
+		}
+
+		if (status != WS_SUCCESS)
+		{
+			printf("Dump failed: %s\n", ws_get_str_error(status));
+			return 1;
+		}
+		return 0;
+	}
+
+	// Print an image file as hex
+	if (argc == 3 && strcmp(args[1], "hexdump") == 0)
+	{
+		ws_dump_header header;
+		static unsigned char memory[WS_MEMORY_SIZE];
+
+		if (ws_dump_load(args[2], &header, memory) != WS_SUCCESS)
+		{
+			printf("Could not load image %s\n", args[2]);
+			return 1;
+		}
+
+		ws_dump_render_hex(memory, 0, WS_MEMORY_SIZE, stdout);
+		return 0;
+	}
+
+	// Import a directory of image files
+	if (argc == 3 && strcmp(args[1], "import") == 0)
+	{
+		station_import_stats stats;
+		memset(&stats, 0, sizeof(stats));
+
+		ws_backend backend;
+		int status = open_backend(shard_directory, tiers, tier_count, &backend);
+		if (status == WS_SUCCESS)
+		{
+			status = station_import_images_to(args[2], 0, &backend, &stats);
+			backend.close(&backend);
+		}
+
+		printf("Imported %d images (%d failed): %d records, %d stored, %d duplicates, %d invalid\n", stats.images,
+		       stats.failed_images, stats.records, stats.stored, stats.duplicates, stats.invalid);
+
+		if (status != WS_SUCCESS)
+		{
+			printf("Import failed: %s\n", ws_get_str_error(status));
+			return 1;
+		}
+		return 0;
+	}
+
+	// Write a snapshot of the database (or of the month databases) for read only queries
+	if (argc == 3 && strcmp(args[1], "snapshot") == 0)
+	{
+		int status;
+		if (shard_directory != NULL)
+		{
+			status = ws_shard_open(shard_directory);
+			if (status == WS_SUCCESS)
+			{
+				status = ws_snapshot_write_shards(args[2]);
+				ws_shard_close();
+			}
+		} else {
+			sqlite3* info = NULL;
+			status = ws_store_open_db(&info);
+			if (status == WS_SUCCESS)
+			{
+				status = ws_snapshot_write(info, args[2]);
+				ws_store_close_db(&info);
+			}
+		}
+
+		if (status != WS_SUCCESS)
+		{
+			printf("Snapshot failed: %s\n", ws_get_str_error(status));
+			return 1;
+		}
+		return 0;
+	}
+
+	// Split the database into a database per month
+	if (argc == 3 && strcmp(args[1], "shard") == 0)
+	{
+		int status = ws_shard_open(args[2]);
+		if (status == WS_SUCCESS)
+		{
+			status = ws_shard_migrate("WeatherDB.sqlite");
+		}
+		ws_shard_close();
+
+		if (status != WS_SUCCESS)
+		{
+			printf("Sharding failed: %s\n", ws_get_str_error(status));
+			return 1;
+		}
+		return 0;
+	}
+
+	// Store new records as they are written, and with --feed <path> publish them on a socket
+	if ((argc == 2 || (argc == 4 && strcmp(args[2], "--feed") == 0)) && strcmp(args[1], "watch") == 0)
+	{
+		if (argc == 4)
+		{
+			int status = ws_feed_start(args[3]);
+			if (status != WS_SUCCESS)
+			{
+				printf("Could not start the feed on %s: %s\n", args[3], ws_get_str_error(status));
+				return 1;
+			}
+			atexit(ws_feed_stop);
+		}
+
+		ws_backend backend;
+		int status = open_backend(shard_directory, tiers, tier_count, &backend);
+		if (status == WS_SUCCESS)
+		{
+			status = station_watch_to(&dev, &backend, 0);
+			backend.close(&backend);
+		}
+		printf("Stopped watching: %s\n", ws_get_str_error(status));
+		return 1;
+	}
+
+	// Store the records for the slots of the history that are missing
+	if (argc == 2 && strcmp(args[1], "gaps") == 0)
+	{
+		int gaps = 0;
+		int filled = 0;
+
+		ws_backend backend;
+		int status = open_backend(shard_directory, tiers, tier_count, &backend);
+		if (status == WS_SUCCESS)
+		{
+			status = station_fill_gaps_to(&dev, &backend, &gaps, &filled);
+			backend.close(&backend);
+		}
+		printf("Found %d gaps, stored %d records\n", gaps, filled);
+
+		if (status != WS_SUCCESS)
+		{
+			printf("Filling gaps failed: %s\n", ws_get_str_error(status));
+			return 1;
+		}
+		return 0;
+	}
+
+	// Download the history into a segmented log rather than the database
+	if (argc == 3 && strcmp(args[1], "log") == 0)
+	{
+		ws_backend backend;
+		int status = ws_backend_open_log(&backend, args[2]);
+		if (status == WS_SUCCESS)
+		{
+			status = station_download_to(&dev, &backend);
+			backend.close(&backend);
+		}
+
+		if (status != WS_SUCCESS)
+		{
+			printf("Download failed: %s\n", ws_get_str_error(status));
+			return 1;
+		}
+		return 0;
+	}
+
+	ws_backend backend;
+	if (open_backend(shard_directory, tiers, tier_count, &backend) == WS_SUCCESS)
+	{
+		station_download_to(&dev, &backend);
+		backend.close(&backend);
+	}
     return 0; 
 	
 }
\ No newline at end of file
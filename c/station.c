@@ -1,163 +1,1159 @@
 #include "station.h"
 #include "ws.h"
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
 #include <math.h>
 #include <time.h>
 #include "ws_store.h"
+#include "ws_anomaly.h"
+#include "ws_log.h"
+#include "ws_feed.h"
+#include "ws_schedule.h"
+#include "ws_sync.h"
+#include "ws_backend.h"
+#include "ws_slots.h"
+#include "ws_queue.h"
 #include <time.h>
 
+#define GENERATE_CHECK_MIN(ENUM, MIN, MAX, RESOLUTION) MIN,
+#define GENERATE_CHECK_MAX(ENUM, MIN, MAX, RESOLUTION) MAX,
+#define GENERATE_CHECK_RESOLUTION(ENUM, MIN, MAX, RESOLUTION) RESOLUTION,
+
+static station_bounds station_active_bounds = {
+	.min = { FOREACH_STATION_CHECK(GENERATE_CHECK_MIN) },
+	.max = { FOREACH_STATION_CHECK(GENERATE_CHECK_MAX) }
+};
+
+// Resolution of each checked value in a ws_packed_record
+static const double station_check_resolution[STATION_CHECK_COUNT] = { FOREACH_STATION_CHECK(GENERATE_CHECK_RESOLUTION) };
+
+void station_default_bounds(station_bounds *bounds)
+{
+	station_bounds defaults = {
+		.min = { FOREACH_STATION_CHECK(GENERATE_CHECK_MIN) },
+		.max = { FOREACH_STATION_CHECK(GENERATE_CHECK_MAX) }
+	};
+	*bounds = defaults;
+}
+
+void station_set_bounds(const station_bounds *bounds)
+{
+	station_active_bounds = *bounds;
+}
+
 void station_check_record(ws_weather_record *record)
 {
-	if (record->outdoor_humidity > 99 || record->outdoor_humidity < 0)
+	double values[STATION_CHECK_COUNT];
+	values[STATION_CHECK_INDOOR_HUMIDITY] = record->indoor_humidity;
+	values[STATION_CHECK_OUTDOOR_HUMIDITY] = record->outdoor_humidity;
+	values[STATION_CHECK_INDOOR_TEMPERATURE] = record->indoor_temperature;
+	values[STATION_CHECK_OUTDOOR_TEMPERATURE] = record->outdoor_temperature;
+	values[STATION_CHECK_DEW_POINT] = record->dew_point;
+	values[STATION_CHECK_ABSOLUTE_PRESSURE] = record->absolute_pressure;
+	values[STATION_CHECK_WIND_SPEED] = record->wind_speed;
+	values[STATION_CHECK_GUST_SPEED] = record->gust_speed;
+	values[STATION_CHECK_WIND_DIRECTION] = record->wind_direction;
+
+	record->data_invalid = 0;
+	for (int i = 0; i < STATION_CHECK_COUNT; i++)
 	{
-		record->data_invalid = 1;
-		return;
+		// NaN (for example the dew point at 0% humidity) is not treated as invalid
+		if (values[i] < station_active_bounds.min[i] || values[i] > station_active_bounds.max[i])
+		{
+			record->data_invalid = 1;
+			return;
+		}
 	}
+}
 
-	if (record->indoor_humidity > 99 || record->indoor_humidity < 0)
+int station_check_records(ws_packed_record *records, int count, uint16_t *invalid_fields)
+{
+	// Convert the bounds to the fixed point units of the packed record, so the checks are integer compares
+	int32_t lo[STATION_CHECK_COUNT];
+	int32_t hi[STATION_CHECK_COUNT];
+
+	for (int i = 0; i < STATION_CHECK_COUNT; i++)
 	{
-		record->data_invalid = 1;
-		return;
+		double min = ceil(station_active_bounds.min[i] / station_check_resolution[i] - 1e-6);
+		double max = floor(station_active_bounds.max[i] / station_check_resolution[i] + 1e-6);
+		lo[i] = (min < INT32_MIN) ? INT32_MIN : (min > INT32_MAX) ? INT32_MAX : (int32_t)min;
+		hi[i] = (max < INT32_MIN) ? INT32_MIN : (max > INT32_MAX) ? INT32_MAX : (int32_t)max;
 	}
 
-	if (record->indoor_temperature >= 255 || record->indoor_temperature <= -255)
+// Sets the bit of a check if the value is out of range
+#define STATION_CHECK_RAW(CHECK, VALUE) \
+	(((uint32_t)(((int32_t)(VALUE) < lo[CHECK]) | ((int32_t)(VALUE) > hi[CHECK]))) << (CHECK))
+
+	int invalid = 0;
+	for (int i = 0; i < count; i++)
 	{
-		record->data_invalid = 1;
-		return;
+		ws_packed_record *r = &records[i];
+		uint32_t failed = 0;
+
+		failed |= STATION_CHECK_RAW(STATION_CHECK_INDOOR_HUMIDITY, r->indoor_humidity);
+		failed |= STATION_CHECK_RAW(STATION_CHECK_OUTDOOR_HUMIDITY, r->outdoor_humidity);
+		failed |= STATION_CHECK_RAW(STATION_CHECK_INDOOR_TEMPERATURE, r->indoor_temperature);
+		failed |= STATION_CHECK_RAW(STATION_CHECK_OUTDOOR_TEMPERATURE, r->outdoor_temperature);
+		failed |= STATION_CHECK_RAW(STATION_CHECK_DEW_POINT, r->dew_point) & -(uint32_t)(r->dew_point != WS_PACKED_NONE);
+		failed |= STATION_CHECK_RAW(STATION_CHECK_ABSOLUTE_PRESSURE, r->absolute_pressure);
+		failed |= STATION_CHECK_RAW(STATION_CHECK_WIND_SPEED, r->wind_speed);
+		failed |= STATION_CHECK_RAW(STATION_CHECK_GUST_SPEED, r->gust_speed);
+		failed |= STATION_CHECK_RAW(STATION_CHECK_WIND_DIRECTION, r->wind_direction);
+
+		uint8_t bad = (failed != 0);
+		r->flags = (r->flags & ~WS_PACKED_INVALID) | (-bad & WS_PACKED_INVALID);
+		invalid += bad;
+
+		if (invalid_fields != NULL)
+		{
+			invalid_fields[i] = failed;
+		}
 	}
 
-	if (record->outdoor_temperature >= 255 || record->outdoor_temperature <= -255)
+#undef STATION_CHECK_RAW
+
+	return invalid;
+}
+
+/* Publishes records to the feed, once the transaction they were stored in has been committed */
+static void station_publish_records(const ws_packed_record *records, int count)
+{
+	for (int i = 0; i < count; i++)
 	{
-		record->data_invalid = 1;
-		return;
+		ws_feed_publish_record(&records[i]);
 	}
+}
 
-	if (record->dew_point >= 255 || record->dew_point <= -255)
+/* Stores the records of a history block that are in the plan, from the first index to the last. The 
+   records are also added to unpublished, to be published once they are committed. */
+static int station_store_block(ws_backend *backend, unsigned char *data, int address, const ws_sync_plan *plan, int first, int last,
+                               ws_anomaly_detector *detector, ws_packed_record *unpublished, int *unpublished_count, int *stored)
+{
+	for (int offset = 0; offset < WS_BLOCK_SIZE; offset += WS_RECORD_SIZE)
 	{
-		record->data_invalid = 1;
-		return;
+		int index = ws_sync_index(plan, address + offset);
+		if (index < first || index > last)
+		{
+			continue;
+		}
+
+		ws_weather_record record;
+		struct tm date_time;
+
+		ws_process_record_data(&data[offset], &record);
+		time_t record_time = ws_sync_time(plan, index);
+		localtime_r(&record_time, &date_time);
+		record.date_time = &date_time;
+
+		station_check_record(&record);
+		if (record.data_invalid)
+		{
+			continue;
+		}
+
+		ws_packed_record packed;
+		ws_pack_record(&record, &packed);
+
+		int status = backend->append(backend, &packed, 1);
+		if (status != WS_SUCCESS)
+		{
+			return status;
+		}
+		(*stored)++;
+
+		uint32_t suspects = ws_anomaly_update(detector, &packed);
+		if (suspects != 0)
+		{
+			status = backend->tag_anomaly(backend, packed.epoch, suspects);
+			if (status != WS_SUCCESS)
+			{
+				return status;
+			}
+		}
+
+		unpublished[(*unpublished_count)++] = packed;
 	}
 
-	if (record->absolute_pressure > 10000000 || record->absolute_pressure < -10000000)
+	return WS_SUCCESS;
+}
+
+/* Checks that the last block stored by an interrupted download still holds what was stored, 
+   so that the history hasn't been overwritten or cleared since */
+static int station_journal_valid(ws_device *dev, const ws_store_journal *journal, const ws_sync_plan *plan)
+{
+	if (ws_sync_index(plan, journal->address) < 0)
 	{
-		record->data_invalid = 1;
-		return;
+		return 0;
 	}
 
-	if (record->wind_speed >= 255 || record->wind_speed < 0)
+	unsigned char data[WS_BLOCK_SIZE];
+	int block = journal->address - (journal->address % WS_BLOCK_SIZE);
+
+	return ws_queue_device_read(dev, block, WS_QUEUE_BACKFILL, 0, data) == WS_SUCCESS && ws_hash_block(data) == journal->hash;
+}
+
+/* Opens the device and starts the read queue on it, so that reads made for other callers while
+   this one runs take turns by priority. If the queue is already running it owns the device, and
+   the reads just join it. own_queue is set if the queue was started here. */
+static int station_open_device(ws_device *dev, int *own_queue)
+{
+	*own_queue = 0;
+	if (ws_queue_is_running())
 	{
-		record->data_invalid = 1;
-		return;
+		return WS_SUCCESS;
 	}
 
-	if (record->gust_speed >= 255 || record->gust_speed < 0)
+	int status = ws_init(dev);
+	if (status == WS_SUCCESS)
 	{
-		record->data_invalid = 1;
-		return;
+		status = ws_initialise_read(dev);
 	}
 
-	if (record->wind_direction > 360 || record->wind_direction < 0)
+	if (status == WS_SUCCESS)
 	{
-		record->data_invalid = 1;
-		return;
+		status = ws_queue_start(dev);
+		*own_queue = (status == WS_SUCCESS);
 	}
 
-	record->data_invalid = 0;
+	return status;
+}
 
+static void station_close_device(int own_queue)
+{
+	if (own_queue)
+	{
+		ws_queue_stop();
+	}
+}
+
+/* Polls once for the station's write window, so that the stable reads of a long run of
+   reads can be kept out of it */
+static int station_backfill_schedule(ws_device *dev, ws_schedule *schedule)
+{
+	int new_records;
+	ws_schedule_init(schedule);
+	return ws_schedule_poll(schedule, dev, &new_records);
 }
 
 int station_download_data(ws_device *dev)
 {
-	// Init USB 
-	ws_init(dev);
-	ws_initialise_read(dev);
+	ws_backend backend;
+	int status = ws_backend_open_sqlite(&backend);
+	if (status != WS_SUCCESS)
+	{
+		return status;
+	}
 
-	// Init DB
-	sqlite3* info = NULL;
-	ws_store_open_db(&info);
-	ws_store_prepare_db(&info);
+	status = station_download_to(dev, &backend);
+	backend.close(&backend);
+	return status;
+}
 
-	int address;
-	int status = ws_latest_record_address(dev, &address);
+/* The time a whole number of periods from a stored record that is nearest to latest_time, which is
+   at most half a period before the stored record */
+static time_t station_align_to(time_t stored, int period, time_t latest_time)
+{
+	time_t seconds = (time_t)period * 60;
+	time_t steps = (latest_time - stored + seconds / 2) / seconds;
+	return stored + steps * seconds;
+}
+
+/* Moves the time the latest record is taken to be for onto the times of the records already 
+   stored, the nearest whole number of periods from the latest of them, so that records read 
+   again are given the same times as when they were stored */
+static int station_align_time(sqlite3 *info, int period, time_t *latest_time)
+{
+	char date[20];
+	struct tm date_time;
+	// Half a period ahead, in case the latest stored record was given a slightly later time
+	time_t limit = *latest_time + (time_t)period * 60 / 2;
+	localtime_r(&limit, &date_time);
+	ws_store_format_date(&date_time, date);
+
+	sqlite3_stmt* statement;
+	int status = ws_store_cached_statement(info, "SELECT MAX(RecordDateTime) FROM WeatherData WHERE RecordDateTime <= ?", &statement);
 	if (status != WS_SUCCESS)
 	{
 		return status;
 	}
 
-	address -= 0x20;
-	int n = 0;
-	
-	int total_record_count = (address - 0x100) / 16;
-	int days_recorded = ceil(total_record_count / 48);
-	double hours_eclapsed = 0.5 * total_record_count;
+	sqlite3_bind_text(statement, 1, date, -1, SQLITE_TRANSIENT);
+	status = ws_store_execute_query(&info, &statement);
+
+	time_t stored;
+	if (status == WS_DB_ROW && ws_store_parse_date((const char*)sqlite3_column_text(statement, 0), &stored))
+	{
+		*latest_time = station_align_to(stored, period, *latest_time);
+	}
+
+	sqlite3_reset(statement);
+	return (status == WS_DB_ROW) ? WS_SUCCESS : status;
+}
+
+/* As station_align_time(), for the records of a backend */
+static int station_align_backend_time(ws_backend *backend, int period, time_t *latest_time)
+{
+	// Only records in the span of the station's history can be read again
+	time_t seconds = (time_t)period * 60;
+	time_t latest;
+	int found;
+	int status = backend->latest_time(backend, *latest_time - WS_HISTORY_RECORDS * seconds, *latest_time + seconds / 2 + 1,
+	                                  &latest, &found);
+
+	if (status == WS_SUCCESS && found)
+	{
+		*latest_time = station_align_to(latest, period, *latest_time);
+	}
+
+	return status;
+}
+
+/* Downloads the history to the backend, once the device is open */
+static int station_download_history(ws_device *dev, ws_backend *backend)
+{
+	ws_schedule schedule;
+	int status;
+	ws_sync_plan plan;
+	ws_store_journal journal;
+	int resume = 0;
+
+	status = backend->load_journal(backend, &journal, &resume);
+	if (status == WS_SUCCESS)
+	{
+		status = station_backfill_schedule(dev, &schedule);
+	}
+
+	if (status == WS_SUCCESS)
+	{
+		ws_schedule_avoid_write_window(&schedule);
+		status = ws_sync_plan_read(dev, &plan);
+	}
+
+	// Carry on from an interrupted download, otherwise start again from the oldest record
+	if (status == WS_SUCCESS && !(resume && station_journal_valid(dev, &journal, &plan)))
+	{
+		resume = 0;
+	}
+
+	// What is already stored is kept, as it can go back further than the station, so the records
+	// read again are given the times they were stored with and replace their rows
+	if (status == WS_SUCCESS)
+	{
+		status = station_align_backend_time(backend, plan.read_period, &plan.latest_time);
+	}
+
+	// Every block of the history, oldest first around the circular buffer
+	int *blocks = malloc((WS_HISTORY_RECORDS / 2 + 1) * sizeof(int));
+	int block_count = 0;
+	int first_index = 0;
+	int last_index = -1;
+
+	// The records stored since the last commit
+	ws_packed_record *unpublished = malloc(WS_HISTORY_RECORDS * sizeof(ws_packed_record));
+	int unpublished_count = 0;
+
+	if (status == WS_SUCCESS && (blocks == NULL || unpublished == NULL))
+	{
+		status = WS_ERR_FILE_IO;
+	}
+
+	if (status != WS_SUCCESS)
+	{
+		free(blocks);
+		free(unpublished);
+		return status;
+	}
+
+	block_count = ws_sync_blocks(&plan, ws_sync_time(&plan, 0), plan.latest_time + 1, blocks, WS_HISTORY_RECORDS / 2 + 1,
+	                             &first_index, &last_index);
+
+	int start = 0;
+	if (resume)
+	{
+		int journal_block = journal.address - (journal.address % WS_BLOCK_SIZE);
+		while (start < block_count && blocks[start] != journal_block)
+		{
+			start++;
+		}
+		start = (start < block_count) ? start + 1 : 0;
+
+		// Records in the block after the journal are newer than anything stored
+		first_index = ws_sync_index(&plan, journal.address) + 1;
+	}
 
-	time_t t_today;
-	struct tm* now = NULL; 
+	// The block being written to can hold completed records too, but can still change
+	int current_block = plan.current_address - (plan.current_address % WS_BLOCK_SIZE);
 
 	// Timing
-	clock_t start, end;
-	start = clock();
+	clock_t start_clock, end_clock;
+	start_clock = clock();
 	int trans = 0;
-	ws_store_begin_transaction(&info);
+	int stored = 0;
+	int journal_pending = 0;
+
+	status = backend->begin(backend);
+	int in_transaction = (status == WS_SUCCESS);
 
-	for (int i = 0x100; i < 0x200; i += 0x10)
+	// The history is read oldest first, so glitches can be spotted as it is stored
+	ws_anomaly_detector detector;
+	ws_anomaly_init(&detector, NULL);
+
+	for (int b = start; b < block_count && status == WS_SUCCESS; b++)
 	{
-		// Calculate when the data was recorded
-		n++;
-		trans++;
+		unsigned char data[WS_BLOCK_SIZE];
+		int address = blocks[b];
+
+		// Only the block being written to can change while it is read, and not at all outside the write window
+		int is_current = address == current_block;
+		if (is_current)
+		{
+			ws_schedule_avoid_write_window(&schedule);
+		}
+		status = ws_queue_device_read(dev, address, is_current ? WS_QUEUE_LIVE : WS_QUEUE_BACKFILL, is_current ? WS_QUEUE_STABLE : 0, data);
+		if (status != WS_SUCCESS)
+		{
+			break;
+		}
+
+		status = station_store_block(backend, data, address, &plan, first_index, last_index, &detector, unpublished,
+		                             &unpublished_count, &stored);
+		if (status != WS_SUCCESS)
+		{
+			break;
+		}
 
-		if (trans == 100)
+		// The block being written to can still change, so the journal never points into it
+		if (is_current)
 		{
-			ws_store_end_transaction(&info);
-			ws_store_begin_transaction(&info);
+			continue;
+		}
+
+		journal.address = address + WS_BLOCK_SIZE - WS_RECORD_SIZE;
+		journal.hash = ws_hash_block(data);
+		journal_pending = 1;
+
+		trans += WS_BLOCK_SIZE / WS_RECORD_SIZE;
+		if (trans >= 100)
+		{
+			status = backend->save_journal(backend, &journal);
+			if (status == WS_SUCCESS)
+			{
+				status = backend->commit(backend);
+			}
+
+			// Nothing since the last commit is stored, so the journal can't be kept either
+			if (status != WS_SUCCESS)
+			{
+				journal_pending = 0;
+				break;
+			}
+
+			station_publish_records(unpublished, unpublished_count);
+			unpublished_count = 0;
+
+			status = backend->begin(backend);
+			in_transaction = (status == WS_SUCCESS);
 			trans = 0;
+			journal_pending = 0;
+		}
+	}
+
+	if (in_transaction && status == WS_SUCCESS)
+	{
+		// The journal is only cleared once everything has been stored
+		status = backend->clear_journal(backend);
+		if (status == WS_SUCCESS)
+		{
+			status = backend->commit(backend);
+		}
+
+		if (status == WS_SUCCESS)
+		{
+			station_publish_records(unpublished, unpublished_count);
+		}
+		in_transaction = (status != WS_SUCCESS);
+	} else if (in_transaction && journal_pending) {
+		// Keep the blocks that were stored before the error, so the next download carries on after them
+		int kept = backend->save_journal(backend, &journal);
+		if (kept == WS_SUCCESS)
+		{
+			kept = backend->commit(backend);
+		}
+
+		if (kept == WS_SUCCESS)
+		{
+			station_publish_records(unpublished, unpublished_count);
+		} else {
+			status = kept;
+		}
+		in_transaction = (kept != WS_SUCCESS);
+	}
+
+	if (in_transaction)
+	{
+		backend->rollback(backend);
+	}
+
+	if (status == WS_ERR_TIMEOUT)
+	{
+		ws_log(WS_EVENT_TIMEOUT, status, "station_download_to", NULL);
+	}
+
+	end_clock = clock();
+	float diff = (float)end_clock - (float)start_clock;
+	diff /= 1000000.0F;
+	diff *= 1000;
+
+	printf("Took %fms, stored %d records\n", diff, stored);
+	free(blocks);
+	free(unpublished);
+	return status;
+}
+
+int station_download_to(ws_device *dev, ws_backend *backend)
+{
+	int own_queue;
+	int status = station_open_device(dev, &own_queue);
+	if (status == WS_SUCCESS)
+	{
+		status = station_download_history(dev, backend);
+	}
+
+	station_close_device(own_queue);
+	return status;
+}
+
+/* Returns 1 if the record has never been written by the station */
+static int station_record_unwritten(unsigned char *data)
+{
+	for (int i = 0; i < WS_RECORD_SIZE; i++)
+	{
+		if (data[i] != 0xFF)
+		{
+			return 0;
 		}
+	}
+
+	return 1;
+}
+
+/* Resyncs the blocks that have changed, once the device is open */
+static int station_resync_blocks(ws_device *dev, int *changed_blocks)
+{
+	// Init DB, keeping what is already stored
+	sqlite3* info = NULL;
+	int status = ws_store_open_db(&info);
+	if (status != WS_SUCCESS)
+	{
+		return status;
+	}
+
+	uint64_t *hashes = malloc(WS_BLOCK_COUNT * sizeof(uint64_t));
+	status = (hashes == NULL) ? WS_ERR_FILE_IO : ws_store_create_tables(&info);
+	if (status == WS_SUCCESS)
+	{
+		status = ws_store_load_fingerprints(info, hashes);
+	}
+
+	ws_schedule schedule;
+	if (status == WS_SUCCESS)
+	{
+		status = station_backfill_schedule(dev, &schedule);
+	}
+
+	ws_sync_plan plan;
+	if (status == WS_SUCCESS)
+	{
+		ws_schedule_avoid_write_window(&schedule);
+		status = ws_sync_plan_read(dev, &plan);
+	}
+
+	if (status != WS_SUCCESS)
+	{
+		free(hashes);
+		ws_store_close_db(&info);
+		return status;
+	}
+
+	// Give the records the same times as when they were stored, so the ones read again replace those rows
+	status = station_align_time(info, plan.read_period, &plan.latest_time);
+
+	if (status != WS_SUCCESS)
+	{
+		free(hashes);
+		ws_store_close_db(&info);
+		return status;
+	}
+
+	ws_store_begin_transaction(&info);
+
+	for (int address = WS_RECORDS_START; address < WS_MEMORY_SIZE; address += WS_BLOCK_SIZE)
+	{
+		unsigned char data[WS_BLOCK_SIZE];
+
+		ws_schedule_avoid_write_window(&schedule);
+		status = ws_queue_device_read(dev, address, WS_QUEUE_BACKFILL, WS_QUEUE_STABLE, data);
+		if (status != WS_SUCCESS)
+		{
+			break;
+		}
+
+		// Only blocks that have changed since the last sync need to be decoded and stored
+		uint64_t hash = ws_hash_block(data);
+		if (hashes[address / WS_BLOCK_SIZE] == hash)
+		{
+			continue;
+		}
+
+		for (int offset = 0; offset < WS_BLOCK_SIZE && status == WS_SUCCESS; offset += WS_RECORD_SIZE)
+		{
+			// The record being written to isn't in the plan, and is stored once it is completed
+			int index = ws_sync_index(&plan, address + offset);
+			if (index < 0 || station_record_unwritten(&data[offset]))
+			{
+				continue;
+			}
+
+			ws_weather_record record;
+			struct tm date_time;
+
+			time_t record_time = ws_sync_time(&plan, index);
+			localtime_r(&record_time, &date_time);
+			ws_process_record_data(&data[offset], &record);
+			record.date_time = &date_time;
+
+			station_check_record(&record);
+			if (!record.data_invalid)
+			{
+				status = ws_store_add_weather_record(info, record);
+			}
+		}
+
+		if (status == WS_SUCCESS)
+		{
+			status = ws_store_save_fingerprint(info, address, hash);
+		}
+
+		if (status != WS_SUCCESS)
+		{
+			break;
+		}
+
+		(*changed_blocks)++;
+	}
+
+	// Everything stored so far is consistent with its fingerprint, so keep it even on error
+	ws_store_end_transaction(&info);
+	ws_store_close_db(&info);
+	free(hashes);
+
+	return status;
+}
 
-		double days = n * (1.0 / 48.0);
-		double record_time = (24 * days) - (24 * floor(days));
-		int day_offset_from_start = floor(days);
+int station_resync(ws_device *dev, int *changed_blocks)
+{
+	*changed_blocks = 0;
 
-		// Calculate the actual date of the data
-	    t_today = time(0);
-		now = localtime(&t_today);
+	int own_queue;
+	int status = station_open_device(dev, &own_queue);
+	if (status == WS_SUCCESS)
+	{
+		status = station_resync_blocks(dev, changed_blocks);
+	}
+
+	station_close_device(own_queue);
+	return status;
+}
+
+/* Stores the records of a block for the slots that have none, from the first index to the last */
+static int station_fill_block(ws_backend *backend, unsigned char *data, int address, const ws_sync_plan *plan, int first, int last,
+                              ws_slots *slots, int *filled)
+{
+	for (int offset = 0; offset < WS_BLOCK_SIZE; offset += WS_RECORD_SIZE)
+	{
+		int index = ws_sync_index(plan, address + offset);
+		if (index < first || index > last)
+		{
+			continue;
+		}
+
+		time_t record_time = ws_sync_time(plan, index);
+		if (ws_slots_has(slots, record_time))
+		{
+			continue;
+		}
 
-		double hours_from_present = hours_eclapsed - 0.5 * (n - 1);
-		now->tm_hour -= floor(hours_from_present);
-		now->tm_min -= (floor(hours_from_present) == hours_from_present) ? 0 : 30;
-		now->tm_isdst = 0;
-		mktime(now);
-		
-		// Download data from address
 		ws_weather_record record;
-		int read;
+		struct tm date_time;
+
+		ws_process_record_data(&data[offset], &record);
+		localtime_r(&record_time, &date_time);
+		record.date_time = &date_time;
+
+		station_check_record(&record);
+		if (record.data_invalid)
+		{
+			continue;
+		}
 
-		status = ws_read_weather_record(dev, i, &record);
-		if (status == WS_ERR_TIMEOUT)
+		ws_packed_record packed;
+		ws_pack_record(&record, &packed);
+
+		int status = backend->append(backend, &packed, 1);
+		if (status == WS_SUCCESS)
 		{
-			printf("Timeout\n");
+			status = ws_slots_mark(slots, record_time, NULL);
 		}
+
 		if (status != WS_SUCCESS)
 		{
 			return status;
 		}
+		(*filled)++;
+	}
 
-		record.date_time = now;
+	return WS_SUCCESS;
+}
 
-		station_check_record(&record);
+typedef struct
+{
+	ws_slots *slots;
+	int status;
+} station_slot_marks;
+
+static int station_mark_slot(time_t record_time, void *user)
+{
+	station_slot_marks *marks = user;
+	marks->status = ws_slots_mark(marks->slots, record_time, NULL);
+	return marks->status != WS_SUCCESS;
+}
+
+/* Fills the gaps in the history, once the device is open */
+static int station_fill_missing(ws_device *dev, ws_backend *backend, int *gaps, int *filled)
+{
+	ws_schedule schedule;
+	ws_sync_plan plan;
+	int status = station_backfill_schedule(dev, &schedule);
+	if (status == WS_SUCCESS)
+	{
+		ws_schedule_avoid_write_window(&schedule);
+		status = ws_sync_plan_read(dev, &plan);
+	}
+
+	if (status != WS_SUCCESS || plan.record_count == 0)
+	{
+		return status;
+	}
+
+	// Give the records the same times as when they were first stored
+	status = station_align_backend_time(backend, plan.read_period, &plan.latest_time);
+
+	// The records around the ends can fall in the slots either side, so those are loaded too
+	time_t period = (time_t)plan.read_period * 60;
+	time_t from = ws_sync_time(&plan, 0);
+	time_t to = plan.latest_time + 1;
+
+	ws_slots slots;
+	ws_slots_init(&slots, plan.read_period, plan.latest_time);
+	station_slot_marks marks = { &slots, WS_SUCCESS };
+	if (status == WS_SUCCESS)
+	{
+		status = backend->query_times(backend, from - period, to + period, station_mark_slot, &marks);
+		status = (status == WS_SUCCESS) ? marks.status : status;
+	}
+
+	// Runs of missing slots alternate with stored ones, so there can't be more than this
+	int max_gaps = plan.record_count / 2 + 1;
+	ws_slots_gap *missing = malloc(max_gaps * sizeof(ws_slots_gap));
+	int *blocks = malloc((WS_HISTORY_RECORDS / 2 + 1) * sizeof(int));
+
+	if (status == WS_SUCCESS && (missing == NULL || blocks == NULL))
+	{
+		status = WS_ERR_FILE_IO;
+	}
+
+	if (status == WS_SUCCESS)
+	{
+		*gaps = ws_slots_gaps(&slots, from, to, missing, max_gaps);
+		*gaps = (*gaps < max_gaps) ? *gaps : max_gaps;
+	}
+
+	int current_block = plan.current_address - (plan.current_address % WS_BLOCK_SIZE);
+	int read_block = -1;
+	unsigned char data[WS_BLOCK_SIZE];
+
+	int in_transaction = 0;
+	if (status == WS_SUCCESS)
+	{
+		status = backend->begin(backend);
+		in_transaction = (status == WS_SUCCESS);
+	}
+
+	for (int g = 0; g < *gaps && status == WS_SUCCESS; g++)
+	{
+		int first_index;
+		int last_index;
+		int block_count = ws_sync_blocks(&plan, missing[g].from, missing[g].to, blocks, WS_HISTORY_RECORDS / 2 + 1,
+		                                 &first_index, &last_index);
+
+		for (int b = 0; b < block_count && status == WS_SUCCESS; b++)
+		{
+			int address = blocks[b];
+
+			// Short gaps next to each other are often in the same block
+			if (address != read_block)
+			{
+				int is_current = address == current_block;
+				if (is_current)
+				{
+					ws_schedule_avoid_write_window(&schedule);
+				}
+				status = ws_queue_device_read(dev, address, is_current ? WS_QUEUE_LIVE : WS_QUEUE_BACKFILL, is_current ? WS_QUEUE_STABLE : 0, data);
+				read_block = (status == WS_SUCCESS) ? address : -1;
+			}
+
+			if (status == WS_SUCCESS)
+			{
+				status = station_fill_block(backend, data, address, &plan, first_index, last_index, &slots, filled);
+			}
+		}
+	}
+
+	// What was stored before an error still fills its slots, so keep it
+	if (in_transaction)
+	{
+		int committed = backend->commit(backend);
+		if (committed != WS_SUCCESS)
+		{
+			backend->rollback(backend);
+			*filled = 0;
+			status = committed;
+		}
+	}
+
+	ws_slots_free(&slots);
+	free(missing);
+	free(blocks);
+
+	return status;
+}
+
+int station_fill_gaps(ws_device *dev, int *gaps, int *filled)
+{
+	ws_backend backend;
+	int status = ws_backend_open_sqlite(&backend);
+	if (status != WS_SUCCESS)
+	{
+		*gaps = 0;
+		*filled = 0;
+		return status;
+	}
+
+	status = station_fill_gaps_to(dev, &backend, gaps, filled);
+	backend.close(&backend);
+	return status;
+}
+
+int station_fill_gaps_to(ws_device *dev, ws_backend *backend, int *gaps, int *filled)
+{
+	*gaps = 0;
+	*filled = 0;
+
+	int own_queue;
+	int status = station_open_device(dev, &own_queue);
+	if (status == WS_SUCCESS)
+	{
+		status = station_fill_missing(dev, backend, gaps, filled);
+	}
+
+	station_close_device(own_queue);
+	return status;
+}
+
+static int station_time_equal(ws_time a, ws_time b)
+{
+	return a.year == b.year && a.month == b.month && a.day == b.day && a.hour == b.hour && a.minute == b.minute;
+}
+
+static int station_min_max_equal(const ws_min_max *a, const ws_min_max *b)
+{
+	return a->min == b->min && a->max == b->max && station_time_equal(a->min_time, b->min_time) &&
+	       station_time_equal(a->max_time, b->max_time);
+}
+
+int station_update_extremes(ws_device *dev, sqlite3 *info, station_extremes_snapshot *snapshot, int *changed)
+{
+	*changed = 0;
+
+	int status;
+	if (!snapshot->loaded)
+	{
+		status = ws_store_load_extremes(info, &snapshot->extremes, &snapshot->present);
+		if (status != WS_SUCCESS)
+		{
+			return status;
+		}
+		snapshot->loaded = 1;
+	}
+
+	// Read a block at a time, so a live read never waits for more than one
+	unsigned char fixed[WS_BLOCK_SIZE * 8];
+	for (int address = 0; address < (int)sizeof(fixed); address += WS_BLOCK_SIZE)
+	{
+		status = ws_queue_device_read(dev, address, WS_QUEUE_EXTREMES, WS_QUEUE_STABLE, &fixed[address]);
+		if (status != WS_SUCCESS)
+		{
+			return status;
+		}
+	}
+
+	ws_weather_extremes extremes;
+	ws_decode_weather_extremes(fixed, &extremes);
+
+	time_t now = time(0);
+	uint32_t saved = 0;
+
+	for (int e = 0; e < WS_EXTREME_COUNT; e++)
+	{
+		ws_min_max *value = ws_store_extreme_field(&extremes, e);
+		ws_min_max *stored = ws_store_extreme_field(&snapshot->extremes, e);
+
+		if ((snapshot->present & (1u << e)) && station_min_max_equal(value, stored))
+		{
+			continue;
+		}
+
+		if (saved == 0)
+		{
+			status = ws_store_begin_transaction(&info);
+			if (status != WS_SUCCESS)
+			{
+				return status;
+			}
+		}
+
+		status = ws_store_save_extreme(info, e, value, now);
+		saved |= (1u << e);
+		if (status != WS_SUCCESS)
+		{
+			break;
+		}
+	}
+
+	if (saved == 0)
+	{
+		return WS_SUCCESS;
+	}
+
+	// The snapshot and the feed only take the changes once they are stored
+	if (status == WS_SUCCESS)
+	{
+		status = ws_store_end_transaction(&info);
+	} else {
+		char sql[] = "ROLLBACK";
+		ws_store_query(&info, sql, sizeof(sql) / sizeof(sql[0]));
+	}
+
+	if (status != WS_SUCCESS)
+	{
+		return status;
+	}
+
+	for (int e = 0; e < WS_EXTREME_COUNT; e++)
+	{
+		if (saved & (1u << e))
+		{
+			ws_min_max *value = ws_store_extreme_field(&extremes, e);
+			*ws_store_extreme_field(&snapshot->extremes, e) = *value;
+			snapshot->present |= (1u << e);
+			(*changed)++;
+
+			ws_feed_publish_extreme(e, value);
+		}
+	}
+
+	return WS_SUCCESS;
+}
 
+/* Stores the records completed since the last poll: those from previous_position up to the new latest record.
+   They are stored in one transaction, and published once it is committed. */
+static int station_store_new_records(ws_device *dev, ws_backend *backend, const ws_schedule *schedule, int previous_position,
+                                     int new_records, ws_anomaly_detector *detector)
+{
+	int history_size = WS_MEMORY_SIZE - WS_RECORDS_START;
+	new_records = (new_records < WS_HISTORY_RECORDS) ? new_records : WS_HISTORY_RECORDS;
+
+	// The records are appended together, so the backend does its per write work once a poll
+	ws_packed_record *packed = malloc(new_records * sizeof(ws_packed_record));
+	if (packed == NULL)
+	{
+		return WS_ERR_FILE_IO;
+	}
+
+	// The latest record was written delay minutes ago, and the ones before it every read_period minutes
+	time_t latest_written = time(0) - (time_t)schedule->delay * 60;
+	int count = 0;
+	int status = WS_SUCCESS;
+	unsigned char data[WS_BLOCK_SIZE];
+	int read_block = -1;
+
+	for (int i = 0; i < new_records; i++)
+	{
+		int address = WS_RECORDS_START + (previous_position - WS_RECORDS_START + i * WS_RECORD_SIZE) % history_size;
+		int block = address - (address % WS_BLOCK_SIZE);
+
+		// Records next to each other are often in the same block
+		if (block != read_block)
+		{
+			status = ws_queue_device_read(dev, block, WS_QUEUE_LIVE, WS_QUEUE_STABLE, data);
+			if (status != WS_SUCCESS)
+			{
+				break;
+			}
+			read_block = block;
+		}
+
+		ws_weather_record record;
+		ws_process_record_data(&data[address - block], &record);
+
+		time_t record_time = latest_written - (time_t)(new_records - 1 - i) * schedule->read_period * 60;
+		struct tm date_time;
+		localtime_r(&record_time, &date_time);
+		record.date_time = &date_time;
+
+		station_check_record(&record);
 		if (!record.data_invalid)
 		{
-			ws_store_add_weather_record(info, record);
+			ws_pack_record(&record, &packed[count++]);
 		}
 	}
-	ws_store_end_transaction(&info);
 
-	end = clock();
-	float diff = (float)end - (float)start;
-	diff /= 1000000.0F;
-	diff *= 1000;
+	if (status != WS_SUCCESS || count == 0)
+	{
+		free(packed);
+		return status;
+	}
+
+	status = backend->begin(backend);
+	if (status != WS_SUCCESS)
+	{
+		free(packed);
+		return status;
+	}
+
+	status = backend->append(backend, packed, count);
+	for (int i = 0; i < count && status == WS_SUCCESS; i++)
+	{
+		uint32_t suspects = ws_anomaly_update(detector, &packed[i]);
+		if (suspects != 0)
+		{
+			status = backend->tag_anomaly(backend, packed[i].epoch, suspects);
+		}
+	}
+
+	if (status == WS_SUCCESS)
+	{
+		status = backend->commit(backend);
+	}
+
+	if (status == WS_SUCCESS)
+	{
+		station_publish_records(packed, count);
+	} else {
+		backend->rollback(backend);
+	}
+
+	free(packed);
+	return status;
+}
+
+int station_watch(ws_device *dev, int polls)
+{
+	ws_backend backend;
+	int status = ws_backend_open_sqlite(&backend);
+	if (status != WS_SUCCESS)
+	{
+		return status;
+	}
+
+	status = station_watch_to(dev, &backend, polls);
+	backend.close(&backend);
+	return status;
+}
+
+/* Polls the station, once the device is open */
+static int station_watch_polls(ws_device *dev, ws_backend *backend, int polls)
+{
+	// The extremes aren't records, so they are kept in WeatherDB.sqlite whatever the backend
+	sqlite3* info = NULL;
+	int status = ws_store_open_db(&info);
+	if (status == WS_SUCCESS)
+	{
+		status = ws_store_create_tables(&info);
+	}
+
+	if (status != WS_SUCCESS)
+	{
+		ws_store_close_db(&info);
+		return status;
+	}
+
+	ws_schedule schedule;
+	ws_schedule_init(&schedule);
+
+	ws_anomaly_detector detector;
+	ws_anomaly_init(&detector, NULL);
+
+	station_extremes_snapshot extremes;
+	memset(&extremes, 0, sizeof(extremes));
+
+	for (int poll = 0; polls == 0 || poll < polls; poll++)
+	{
+		ws_schedule_wait(&schedule);
+
+		int previous_position = schedule.position;
+		int new_records;
+
+		status = ws_schedule_poll(&schedule, dev, &new_records);
+		if (status != WS_SUCCESS)
+		{
+			break;
+		}
+
+		if (new_records == 0)
+		{
+			continue;
+		}
+
+		status = station_store_new_records(dev, backend, &schedule, previous_position, new_records, &detector);
+
+		int changed;
+		if (status == WS_SUCCESS)
+		{
+			status = station_update_extremes(dev, info, &extremes, &changed);
+		}
+
+		if (status != WS_SUCCESS)
+		{
+			break;
+		}
+	}
 
-	printf("Took %fms\n", diff);
 	ws_store_close_db(&info);
-	return WS_SUCCESS;
+	return status;
+}
+
+int station_watch_to(ws_device *dev, ws_backend *backend, int polls)
+{
+	int own_queue;
+	int status = station_open_device(dev, &own_queue);
+	if (status == WS_SUCCESS)
+	{
+		status = station_watch_polls(dev, backend, polls);
+	}
+
+	station_close_device(own_queue);
+	return status;
 }
\ No newline at end of file
@@ -2,6 +2,9 @@
 #define STATION_H
 
 #include "ws.h"
+#include "ws_store.h"
+#include "ws_backend.h"
+#include <time.h>
 
 typedef struct {
 	int year;
@@ -10,7 +13,174 @@ typedef struct {
 } date_t;
 
 
+/**
+	The checks made on each record. Each entry is the enum name, the default lowest and
+	highest valid values (inclusive) in the units of ws_weather_record, and the resolution
+	of the value in a ws_packed_record.
+*/
+#define FOREACH_STATION_CHECK(CHECK) 										\
+	CHECK(STATION_CHECK_INDOOR_HUMIDITY, 0, 99, 1)							\
+	CHECK(STATION_CHECK_OUTDOOR_HUMIDITY, 0, 99, 1)							\
+	CHECK(STATION_CHECK_INDOOR_TEMPERATURE, -254.9, 254.9, 0.1)				\
+	CHECK(STATION_CHECK_OUTDOOR_TEMPERATURE, -254.9, 254.9, 0.1)			\
+	CHECK(STATION_CHECK_DEW_POINT, -254.9, 254.9, 0.1)						\
+	CHECK(STATION_CHECK_ABSOLUTE_PRESSURE, -10000000, 10000000, 0.1)		\
+	CHECK(STATION_CHECK_WIND_SPEED, 0, 254.9, 0.1)							\
+	CHECK(STATION_CHECK_GUST_SPEED, 0, 254.9, 0.1)							\
+	CHECK(STATION_CHECK_WIND_DIRECTION, 0, 360, 22.5)						\
+
+#define GENERATE_CHECK_ENUM(ENUM, MIN, MAX, RESOLUTION) ENUM,
+
+enum station_check {
+	FOREACH_STATION_CHECK(GENERATE_CHECK_ENUM)
+	STATION_CHECK_COUNT
+};
+
+/**
+	The valid range of each checked value, indexed by station_check
+*/
+typedef struct
+{
+	double min[STATION_CHECK_COUNT];
+	double max[STATION_CHECK_COUNT];
+} station_bounds;
+
+/**
+	Downloads the station's history, oldest record first. Progress is journaled in the same
+	transaction as each batch of records, so if the download is interrupted (for example by a
+	USB error) the next call carries on after the last stored block instead of starting again.
+	The journal is only trusted if that block is unchanged on the station. Records already
+	stored are kept, and those read again are given the times they were stored with, so they
+	replace their rows. If a commit fails, what it held is rolled back and the error returned.
+
+	Blocks are read through ws_queue at WS_QUEUE_BACKFILL, so reads for a watch in another
+	thread go first. The queue is started (and stopped after) if it isn't already running.
+
+	Parameters:
+		dev				The device
+*/
 int station_download_data(ws_device *dev);
 
+/**
+	Downloads the station's history, as station_download_data(), into a backend.
+
+	Parameters:
+		dev				The device
+		backend			The backend to write to, which must be open
+*/
+int station_download_to(ws_device *dev, ws_backend *backend);
+
+/**
+	Fills out bounds with the default valid ranges.
+*/
+void station_default_bounds(station_bounds *bounds);
+
+/**
+	Sets the bounds used by station_check_record() and station_check_records(). Until
+	this is called the default bounds are used.
+*/
+void station_set_bounds(const station_bounds *bounds);
+
+/**
+	Checks an array of records against the bounds, without branching on the values.
+
+	Parameters:
+		records 		The records. WS_PACKED_INVALID is set on every record that fails a check
+						(and cleared on every record that passes).
+		count			The number of records
+		invalid_fields	Optional (may be NULL). For each record, a bitmap with bit (1 << station_check)
+						set for every check that failed.
+
+	Return:
+		The number of invalid records
+*/
+int station_check_records(ws_packed_record *records, int count, uint16_t *invalid_fields);
+
+/**
+	Checks a single record against the bounds, setting data_invalid if any check fails.
+*/
 void station_check_record(ws_weather_record *record);
+
+/**
+	Re-reads the whole of the station's history, but only decodes and stores the blocks
+	whose fingerprint differs from the one stored in the last sync. Every completed record in
+	a changed block is upserted, and the record the station is still writing to is left for the
+	next sync, once it is completed. The records are given the times they were stored with (a whole number of read periods from
+	the latest stored record), so those read again replace their rows rather than being
+	duplicated.
+
+	Parameters:
+		dev				The device
+		changed_blocks	The number of blocks that had changed
+*/
+int station_resync(ws_device *dev, int *changed_blocks);
+
+/**
+	Finds the sample slots in the span of the station's history that have no record stored,
+	and reads just the blocks holding the records for them.
+
+	Parameters:
+		dev				The device
+		gaps			The number of runs of missing slots found
+		filled			The number of records stored
+*/
+int station_fill_gaps(ws_device *dev, int *gaps, int *filled);
+
+/**
+	Fills the gaps in the history, as station_fill_gaps(), in the records of a backend.
+
+	Parameters:
+		dev				The device
+		backend			The backend to look for gaps in and write to, which must be open
+		gaps			The number of runs of missing slots found
+		filled			The number of records stored
+*/
+int station_fill_gaps_to(ws_device *dev, ws_backend *backend, int *gaps, int *filled);
+
+/**
+	The weather extremes as last stored in WeatherExtremes. Kept between polls so that
+	the table only has to be read once.
+*/
+typedef struct
+{
+	ws_weather_extremes extremes;
+	uint32_t present;				// Bitmap of (1 << ws_store_extreme) for the stored extremes
+	int loaded;						// Non zero once extremes has been loaded from the table
+} station_extremes_snapshot;
+
+/**
+	Reads the weather extremes from the fixed block and stores those that differ from the
+	snapshot, each with a row in WeatherExtremesHistory. Nothing is written if nothing changed,
+	so it is cheap to call on every poll.
+
+	Parameters:
+		dev				The device, which must have been initialised for reading, unless
+						ws_queue is running, when it is read through that
+		info			The database, with the tables created
+		snapshot		The last stored extremes. Zero it before the first call.
+		changed			The number of extremes that were stored
+*/
+int station_update_extremes(ws_device *dev, sqlite3 *info, station_extremes_snapshot *snapshot, int *changed);
+
+/**
+	Stores each new record as the station writes it. The station is read just after each
+	record is due (see ws_schedule) rather than on a fixed cadence, and the extremes are
+	updated after each new record. Reads go through ws_queue, as station_download_data().
+
+	Parameters:
+		dev				The device
+		polls			The number of times to read the station, 0 to carry on until an error
+*/
+int station_watch(ws_device *dev, int polls);
+
+/**
+	Watches the station, as station_watch(), writing the records to a backend. The extremes
+	are still kept in WeatherDB.sqlite.
+
+	Parameters:
+		dev				The device
+		backend			The backend to write to, which must be open
+		polls			The number of times to read the station, 0 to carry on until an error
+*/
+int station_watch_to(ws_device *dev, ws_backend *backend, int polls);
 #endif 
\ No newline at end of file
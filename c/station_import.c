@@ -0,0 +1,354 @@
+#include "station_import.h"
+#include "station.h"
+#include "ws_store.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <unistd.h>
+
+// How many decoded images can be waiting for the writer, per decoding thread
+#define STATION_IMPORT_AHEAD 2
+
+typedef struct
+{
+	char path[PATH_MAX];
+	int64_t captured_at;
+
+	ws_packed_record *records;			// Set once decoded, freed once stored
+	int count;
+	int min_gap;						// Smallest gap between records (seconds), for spotting overlaps
+	int done;							// Non zero once decoded (or failed to)
+	int failed;
+} station_import_image;
+
+typedef struct
+{
+	station_import_image *images;
+	int image_count;
+
+	pthread_mutex_t lock;
+	pthread_cond_t decoded;				// Signalled when an image has been decoded
+	pthread_cond_t stored;				// Signalled when the writer has stored an image
+	int next;							// Next image to decode
+	int written;						// Images stored by the writer
+	int window;							// Most images decoded ahead of the writer
+	int stop;
+} station_import_job;
+
+static inline int station_import_address(int address)
+{
+	int history_size = WS_MEMORY_SIZE - WS_RECORDS_START;
+	return WS_RECORDS_START + ((address - WS_RECORDS_START) % history_size + history_size) % history_size;
+}
+
+int station_decode_image(const ws_dump_header *header, const unsigned char *memory, ws_packed_record *records)
+{
+	int read_period = memory[0x10] ? memory[0x10] : 30;
+	int data_count = memory[0x1B] | (memory[0x1C] << 8);
+	int latest = header->current_pos;
+
+	if (latest < WS_RECORDS_START || latest >= WS_MEMORY_SIZE || (latest % WS_RECORD_SIZE) != 0)
+	{
+		return 0;
+	}
+
+	data_count = (data_count > WS_HISTORY_RECORDS) ? WS_HISTORY_RECORDS : data_count;
+
+	// The latest record is still being written, and its delay is the time since the one before it
+	int64_t epoch = header->captured_at - (header->captured_at % 60);
+	int count = 0;
+
+	for (int i = 1; i < data_count; i++)
+	{
+		const unsigned char *newer = &memory[station_import_address(latest - (i - 1) * WS_RECORD_SIZE)];
+		const unsigned char *data = &memory[station_import_address(latest - i * WS_RECORD_SIZE)];
+
+		epoch -= (int64_t)(newer[0] ? newer[0] : read_period) * 60;
+
+		// Filled in from the end, so that they come out oldest first
+		ws_packed_record *record = &records[data_count - 1 - i];
+		ws_process_packed_record_data(data, record);
+		record->epoch = epoch;
+		count++;
+	}
+
+	return count;
+}
+
+static void station_import_decode(station_import_image *image)
+{
+	unsigned char *memory = malloc(WS_MEMORY_SIZE);
+	ws_dump_header header;
+
+	image->records = malloc(WS_HISTORY_RECORDS * sizeof(ws_packed_record));
+	if (memory == NULL || image->records == NULL || ws_dump_load(image->path, &header, memory) != WS_SUCCESS)
+	{
+		free(memory);
+		free(image->records);
+		image->records = NULL;
+		image->failed = 1;
+		return;
+	}
+
+	image->count = station_decode_image(&header, memory, image->records);
+	image->min_gap = (memory[0x10] ? memory[0x10] : 30) * 60;
+	free(memory);
+}
+
+static void *station_import_worker(void *arg)
+{
+	station_import_job *job = arg;
+
+	pthread_mutex_lock(&job->lock);
+	for (;;)
+	{
+		// Don't get too far ahead of the writer, so only a few images are held in memory
+		while (!job->stop && job->next < job->image_count && job->next >= job->written + job->window)
+		{
+			pthread_cond_wait(&job->stored, &job->lock);
+		}
+
+		if (job->stop || job->next >= job->image_count)
+		{
+			break;
+		}
+
+		station_import_image *image = &job->images[job->next++];
+		pthread_mutex_unlock(&job->lock);
+
+		station_import_decode(image);
+
+		pthread_mutex_lock(&job->lock);
+		image->done = 1;
+		pthread_cond_broadcast(&job->decoded);
+	}
+	pthread_mutex_unlock(&job->lock);
+
+	return NULL;
+}
+
+static int station_import_compare(const void *a, const void *b)
+{
+	const station_import_image *image_a = a;
+	const station_import_image *image_b = b;
+	return (image_a->captured_at > image_b->captured_at) - (image_a->captured_at < image_b->captured_at);
+}
+
+/* Finds the images in a directory, sorted by when they were captured */
+static int station_import_list(const char *directory, station_import_image **images, int *count, station_import_stats *stats)
+{
+	DIR *dir = opendir(directory);
+	if (dir == NULL)
+	{
+		return WS_ERR_FILE_IO;
+	}
+
+	int capacity = 0;
+	*images = NULL;
+	*count = 0;
+
+	struct dirent *entry;
+	while ((entry = readdir(dir)) != NULL)
+	{
+		if (entry->d_name[0] == '.')
+		{
+			continue;
+		}
+
+		if (*count == capacity)
+		{
+			capacity = capacity ? capacity * 2 : 64;
+			station_import_image *grown = realloc(*images, capacity * sizeof(station_import_image));
+			if (grown == NULL)
+			{
+				closedir(dir);
+				return WS_ERR_FILE_IO;
+			}
+			*images = grown;
+		}
+
+		station_import_image *image = &(*images)[*count];
+		memset(image, 0, sizeof(station_import_image));
+		snprintf(image->path, sizeof(image->path), "%s/%s", directory, entry->d_name);
+
+		ws_dump_header header;
+		if (ws_dump_load_header(image->path, &header) != WS_SUCCESS)
+		{
+			stats->failed_images++;
+			continue;
+		}
+
+		image->captured_at = header.captured_at;
+		(*count)++;
+	}
+
+	closedir(dir);
+	qsort(*images, *count, sizeof(station_import_image), station_import_compare);
+	return WS_SUCCESS;
+}
+
+/* Stores the records of an image that are valid and newer than anything already stored */
+static int station_import_store(ws_backend *backend, station_import_image *image, int64_t *latest_epoch, station_import_stats *stats)
+{
+	stats->records += image->count;
+	stats->invalid += station_check_records(image->records, image->count, NULL);
+
+	// Times from different images can be a little out, so anything within half a gap is the same record
+	int64_t newer_than = *latest_epoch + image->min_gap / 2;
+	int count = 0;
+
+	for (int i = 0; i < image->count; i++)
+	{
+		if (ws_packed_invalid(&image->records[i]))
+		{
+			continue;
+		}
+
+		if (image->records[i].epoch < newer_than)
+		{
+			stats->duplicates++;
+			continue;
+		}
+
+		image->records[count++] = image->records[i];
+	}
+
+	if (count == 0)
+	{
+		return WS_SUCCESS;
+	}
+
+	backend->begin(backend);
+	int status = backend->append(backend, image->records, count);
+	if (status != WS_SUCCESS)
+	{
+		backend->rollback(backend);
+		return status;
+	}
+
+	status = backend->commit(backend);
+	if (status != WS_SUCCESS)
+	{
+		return status;
+	}
+
+	*latest_epoch = image->records[count - 1].epoch;
+	stats->stored += count;
+	return WS_SUCCESS;
+}
+
+int station_import_images(const char *directory, int threads, station_import_stats *stats)
+{
+	ws_backend backend;
+	int status = ws_backend_open_sqlite(&backend);
+	if (status != WS_SUCCESS)
+	{
+		if (stats != NULL)
+		{
+			memset(stats, 0, sizeof(station_import_stats));
+		}
+		return status;
+	}
+
+	status = station_import_images_to(directory, threads, &backend, stats);
+	backend.close(&backend);
+	return status;
+}
+
+int station_import_images_to(const char *directory, int threads, ws_backend *backend, station_import_stats *stats)
+{
+	station_import_stats unused;
+	stats = (stats != NULL) ? stats : &unused;
+	memset(stats, 0, sizeof(station_import_stats));
+
+	station_import_job job;
+	memset(&job, 0, sizeof(job));
+
+	int status = station_import_list(directory, &job.images, &job.image_count, stats);
+	if (status != WS_SUCCESS)
+	{
+		free(job.images);
+		return status;
+	}
+
+	if (threads <= 0)
+	{
+		long cores = sysconf(_SC_NPROCESSORS_ONLN);
+		threads = (cores > 0) ? cores : 1;
+	}
+	threads = (threads > job.image_count) ? job.image_count : threads;
+
+	job.window = threads * STATION_IMPORT_AHEAD;
+	pthread_mutex_init(&job.lock, NULL);
+	pthread_cond_init(&job.decoded, NULL);
+	pthread_cond_init(&job.stored, NULL);
+
+	pthread_t *workers = malloc((threads > 0 ? threads : 1) * sizeof(pthread_t));
+	int started = 0;
+	while (workers != NULL && started < threads && pthread_create(&workers[started], NULL, station_import_worker, &job) == 0)
+	{
+		started++;
+	}
+
+	if (started < threads)
+	{
+		status = WS_ERR_THREAD;
+	}
+
+	// The writer stores the images in the order they were captured, as they are decoded
+	int64_t latest_epoch = INT64_MIN / 2;
+	for (int i = 0; i < job.image_count && status == WS_SUCCESS; i++)
+	{
+		station_import_image *image = &job.images[i];
+
+		pthread_mutex_lock(&job.lock);
+		while (!image->done)
+		{
+			pthread_cond_wait(&job.decoded, &job.lock);
+		}
+		pthread_mutex_unlock(&job.lock);
+
+		if (image->failed)
+		{
+			stats->failed_images++;
+		} else {
+			status = station_import_store(backend, image, &latest_epoch, stats);
+			stats->images += (status == WS_SUCCESS);
+		}
+
+		free(image->records);
+		image->records = NULL;
+
+		pthread_mutex_lock(&job.lock);
+		job.written++;
+		pthread_cond_broadcast(&job.stored);
+		pthread_mutex_unlock(&job.lock);
+	}
+
+	pthread_mutex_lock(&job.lock);
+	job.stop = 1;
+	pthread_cond_broadcast(&job.stored);
+	pthread_mutex_unlock(&job.lock);
+
+	for (int i = 0; i < started; i++)
+	{
+		pthread_join(workers[i], NULL);
+	}
+
+	// Images decoded after an error are never stored
+	for (int i = 0; i < job.image_count; i++)
+	{
+		free(job.images[i].records);
+	}
+
+	pthread_cond_destroy(&job.stored);
+	pthread_cond_destroy(&job.decoded);
+	pthread_mutex_destroy(&job.lock);
+	free(workers);
+	free(job.images);
+
+	return status;
+}
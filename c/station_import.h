@@ -0,0 +1,70 @@
+#ifndef STATION_IMPORT_H
+#define STATION_IMPORT_H
+
+#include "ws.h"
+#include "ws_dump.h"
+#include "ws_backend.h"
+
+/**
+	Counts of what happened during an import
+*/
+typedef struct
+{
+	int images;					// Images imported
+	int failed_images;			// Files that were not complete images, or could not be read
+	int records;				// Records decoded from the images
+	int invalid;				// Records that failed station_check_records()
+	int duplicates;				// Records already imported from an earlier image
+	int stored;					// Records stored
+} station_import_stats;
+
+
+/**
+	Decodes the history held in a memory image into packed records, oldest first. The record
+	being written to when the image was captured is left out, as it wasn't finished.
+
+	Each record's time is worked out backwards from when the image was captured, using the
+	minutes since the previous record held in the first byte of each record. If that is 0 the
+	station's read period is used instead.
+
+	Parameters:
+		header 		The image's header
+		memory		The image's memory (WS_MEMORY_SIZE bytes)
+		records		Filled with the records. Must have room for WS_HISTORY_RECORDS records.
+
+	Return:
+		The number of records
+*/
+int station_decode_image(const ws_dump_header *header, const unsigned char *memory, ws_packed_record *records);
+
+/**
+	Imports every image (see ws_dump_capture()) in a directory into the database. Images are
+	decoded in parallel and stored in the order they were captured by a single writer, one
+	transaction per image. Records that overlap with an earlier image are only stored once.
+
+	All of the images should be from the same station, as records are identified by time alone.
+
+	Parameters:
+		directory	The directory holding the images. Files that aren't images are skipped.
+		threads		The number of decoding threads, or 0 for one per core
+		stats		Optional (may be NULL), filled with counts of what was imported
+
+	Return:
+		- WS_ERR_FILE_IO		The directory could not be read
+		- WS_ERR_THREAD			The decoding threads could not be started
+		- Any error from storing the records
+*/
+int station_import_images(const char *directory, int threads, station_import_stats *stats);
+
+/**
+	Imports every image in a directory, as station_import_images(), into a backend.
+
+	Parameters:
+		directory	The directory holding the images
+		threads		The number of decoding threads, or 0 for one per core
+		backend		The backend to write to, which must be open
+		stats		Optional (may be NULL), filled with counts of what was imported
+*/
+int station_import_images_to(const char *directory, int threads, ws_backend *backend, station_import_stats *stats);
+
+#endif
@@ -1,19 +1,25 @@
 #include <stdio.h>
 #include <string.h>
 #include <math.h>
+#include <time.h>
 #include <libusb-1.0/libusb.h>
 #include <string.h>
 #include "ws.h"
+#include "ws_metrics.h"
+#include "ws_log.h"
 
 void ws_usb_error(int status, const char* additonal_info)
 {
-	printf("[LIBUSB ERR][ERR NO %i] %s (%s)\n", status, libusb_error_name(status), additonal_info);
+	ws_metrics_add(WS_CTR_USB_ERRORS, 1);
+	ws_log(WS_EVENT_USB_ERROR, status, additonal_info, libusb_error_name(status));
 }
 
 int ws_init(ws_device *dev)
 {
 	int status;
 	
+	ws_policy_init(&dev->policy);
+
 	status = libusb_init(NULL);
 	if (status < 0)
 	{
@@ -85,7 +91,7 @@ int ws_initialise_read(ws_device *dev)
 	int req_type = LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE;			
 	unsigned char buf[0];
 
-	status =  libusb_control_transfer(dev->hnd, req_type, 0xA, 0x0, 0x0, buf, sizeof(buf), 0);
+	status =  libusb_control_transfer(dev->hnd, req_type, 0xA, 0x0, 0x0, buf, sizeof(buf), dev->policy.max_timeout);
 	if (status < 0)
 	{
 		ws_usb_error(status, "ws_initialise_read::libusb_control_transfer");
@@ -95,7 +101,8 @@ int ws_initialise_read(ws_device *dev)
 	return WS_SUCCESS;
 }
 
-int ws_read_block(ws_device *dev, int address, unsigned char* data, int* read)
+/* A single attempt at reading a block, with no retries */
+static int ws_read_block_once(ws_device *dev, int address, unsigned char* data, int* read)
 {
 	int status;
 	*read = 0;
@@ -115,28 +122,53 @@ int ws_read_block(ws_device *dev, int address, unsigned char* data, int* read)
 	
 	int req_type = LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE;
 	
-	status =  libusb_control_transfer(dev->hnd, req_type, 0x9, 0x200, 0x0, write_data, sizeof(write_data), 100);
+	uint64_t start = ws_metrics_now();
+	status =  libusb_control_transfer(dev->hnd, req_type, 0x9, 0x200, 0x0, write_data, sizeof(write_data), ws_policy_timeout(&dev->policy));
+	uint64_t elapsed = ws_metrics_now() - start;
+	ws_metrics_observe(WS_HIST_CONTROL_TRANSFER, elapsed);
+	ws_metrics_add(WS_CTR_CONTROL_TRANSFERS, 1);
+
 	if (status < 0)
 	{
 		if (status == LIBUSB_ERROR_TIMEOUT)
 		{
+			ws_metrics_add(WS_CTR_USB_TIMEOUTS, 1);
+			ws_policy_record_timeout(&dev->policy);
 			return WS_ERR_TIMEOUT;
 		}
 		ws_usb_error(status, "ws_read_block::libusb_control_transfer");
 		return WS_ERR_CONTROL_TRANSFER_FAILED;
 	}
+
+	ws_policy_record_latency(&dev->policy, elapsed);
 	
 	for (int i = 0; i < 4; i++)
 	{
 		int transferred;
 		unsigned char buf[8];
 		
-		int status = libusb_bulk_transfer(dev->hnd, 0x81, buf, 8, &transferred, 0);
+		start = ws_metrics_now();
+		int status = libusb_bulk_transfer(dev->hnd, 0x81, buf, 8, &transferred, ws_policy_timeout(&dev->policy));
+		elapsed = ws_metrics_now() - start;
+		ws_metrics_observe(WS_HIST_BULK_TRANSFER, elapsed);
+		ws_metrics_add(WS_CTR_BULK_TRANSFERS, 1);
+
 		if (status < 0)
 		{
+			// Don't leave a partial read in the endpoint for the next attempt to pick up
+			libusb_clear_halt(dev->hnd, 0x81);
+
+			if (status == LIBUSB_ERROR_TIMEOUT)
+			{
+				ws_metrics_add(WS_CTR_USB_TIMEOUTS, 1);
+				ws_policy_record_timeout(&dev->policy);
+				return WS_ERR_TIMEOUT;
+			}
 			ws_usb_error(status, "ws_read_block::libusb_bulk_transfer");
 			return WS_ERR_BULK_TRANSFER_FAILED;
 		}
+
+		ws_policy_record_latency(&dev->policy, elapsed);
 				
 		memcpy(&data[(i * 8)], buf, 8);
 		*read += transferred;
@@ -145,15 +177,97 @@ int ws_read_block(ws_device *dev, int address, unsigned char* data, int* read)
 	return WS_SUCCESS;
 }
 
+/* An attempt at reading a block, recording the result with the policy. reset_failed is set if the
+   device needed resetting and couldn't be, in which case the error is from the reset. */
+static int ws_read_block_try(ws_device *dev, int address, unsigned char* data, int* read, int attempt, int* reset_failed)
+{
+	*reset_failed = 0;
+
+	int status = ws_read_block_once(dev, address, data, read);
+	if (status == WS_SUCCESS)
+	{
+		ws_policy_record_success(&dev->policy);
+		return WS_SUCCESS;
+	}
+
+	if (ws_policy_record_failure(&dev->policy, status, address, attempt))
+	{
+		int reset_status = ws_reset(dev);
+		if (reset_status != WS_SUCCESS)
+		{
+			*reset_failed = 1;
+			return reset_status;
+		}
+	}
+
+	return status;
+}
+
+int ws_read_block_attempt(ws_device *dev, int address, unsigned char* data, int* read, int attempt, int* reset_failed)
+{
+	return ws_read_block_try(dev, address, data, read, attempt, reset_failed);
+}
+
+int ws_read_block(ws_device *dev, int address, unsigned char* data, int* read)
+{
+	int status = WS_SUCCESS;
+	int attempts = (dev->policy.max_attempts > 0) ? dev->policy.max_attempts : 1;
+
+	for (int attempt = 1; attempt <= attempts; attempt++)
+	{
+		int reset_failed;
+		status = ws_read_block_try(dev, address, data, read, attempt, &reset_failed);
+		if (status == WS_SUCCESS || reset_failed)
+		{
+			return status;
+		}
+
+		if (attempt < attempts)
+		{
+			ws_metrics_add(WS_CTR_USB_RETRIES, 1);
+			ws_policy_backoff(&dev->policy, attempt);
+		}
+	}
+
+	return status;
+}
+
+int ws_reset(ws_device *dev)
+{
+	ws_metrics_add(WS_CTR_USB_RESETS, 1);
+
+	int status = libusb_reset_device(dev->hnd);
+	if (status < 0)
+	{
+		ws_usb_error(status, "ws_reset::libusb_reset_device");
+		return WS_ERR_RESET_FAILED;
+	}
+
+	return ws_initialise_read(dev);
+}
+
 int ws_read_stable_block(ws_device *dev, int address, unsigned char* data, int* read)
 {
 	unsigned char block1[32];
 	unsigned char block2[32];
 	int rd = 0;
 	int status;
+	int attempts = 0;
+
+	ws_metrics_add(WS_CTR_STABLE_BLOCK_READS, 1);
 
 	do
 	{
+		if (attempts++ > 0)
+		{
+			ws_metrics_add(WS_CTR_STABLE_BLOCK_RETRIES, 1);
+		}
+
+		if (attempts > WS_STABLE_BLOCK_MAX_READS)
+		{
+			return WS_ERR_UNSTABLE_BLOCK;
+		}
+
 		status = ws_read_block(dev, address, block1, &rd);
 		if (status != WS_SUCCESS)
 		{
@@ -200,38 +314,125 @@ int ws_latest_record_address(ws_device *dev, int *address)
 	return WS_SUCCESS;
 }
 
+/* Calculates the dew point from the temperature and humidity */
+static double ws_dew_point(double temperature, int humidity)
+{
+	double a = 17.27;
+	double b = 237.7;
+	double gamma = (a * temperature / (b + temperature)) + log(humidity / 100.0);
+	return b * gamma / (a - gamma);
+}
+
 int ws_process_record_data(unsigned char *data, ws_weather_record *record)
 {
+	uint64_t start = ws_metrics_now();
+
+	record->delay = data[0];
+
+#define DECODE_FIELD(TYPE, NAME, COLUMN, LABEL, UNIT, DECODE) record->NAME = DECODE;
+#define DECODE_STATUS_FIELD(TYPE, NAME, COLUMN, LABEL, UNIT, DECODE) record->status.NAME = DECODE;
+	FOREACH_WS_RECORD_FIELD(DECODE_FIELD)
+	FOREACH_WS_STATUS_FIELD(DECODE_STATUS_FIELD)
+#undef DECODE_FIELD
+#undef DECODE_STATUS_FIELD
+
+	ws_metrics_observe(WS_HIST_DECODE, ws_metrics_now() - start);
+	ws_metrics_add(WS_CTR_RECORDS_DECODED, 1);
+
+	return WS_SUCCESS;
+}
+
+/* Rounds a value to the given resolution, marking values that can't be stored */
+static int16_t ws_pack_signed(double value, double resolution)
+{
+	double scaled = round(value / resolution);
+	if (!isfinite(scaled) || scaled <= WS_PACKED_NONE || scaled > INT16_MAX)
+	{
+		return WS_PACKED_NONE;
+	}
+	return (int16_t)scaled;
+}
+
+static uint16_t ws_pack_unsigned(double value, double resolution)
+{
+	double scaled = round(value / resolution);
+	if (!isfinite(scaled) || scaled < 0)
+	{
+		return 0;
+	}
+	return (scaled > UINT16_MAX) ? UINT16_MAX : (uint16_t)scaled;
+}
+
+void ws_process_packed_record_data(const unsigned char *data, ws_packed_record *record)
+{
+	record->epoch = 0;
 	record->indoor_humidity = data[1];
 	record->outdoor_humidity = data[4];
-	record->indoor_temperature = 0.1 * ws_decode_signed_short(data[3], data[2]);
-	record->outdoor_temperature = 0.1 * ws_decode_signed_short(data[6], data[5]);
-	record->absolute_pressure = 0.1 * ws_value_of_bytes(data[8], data[7]);
+	record->indoor_temperature = ws_decode_signed_short(data[3], data[2]);
+	record->outdoor_temperature = ws_decode_signed_short(data[6], data[5]);
+	record->absolute_pressure = ws_value_of_bytes(data[8], data[7]);
+	record->wind_speed = ((data[11] & 0xF) << 8) | data[9];
+	record->gust_speed = ((data[11] >> 4) << 8) | data[10];
+	record->wind_direction = data[12];
+	record->total_rain = ws_value_of_bytes(data[14], data[13]);
+
+	record->flags = 0;
+	record->flags |= (data[15] & 0x40) ? WS_PACKED_CONTACT_ERROR : 0;
+	record->flags |= (data[15] & 0x80) ? WS_PACKED_RAIN_OVERFLOW : 0;
+
+	record->dew_point = ws_pack_signed(ws_dew_point(0.1 * record->outdoor_temperature, record->outdoor_humidity), 0.1);
+}
 
-	uint8_t wind_speed_low = data[9];
-	uint8_t wind_speed_high = data[11] & 0xF;
-	record->wind_speed = 0.1 * ((wind_speed_high >> 8) | wind_speed_low);
-	
-	uint8_t gusting_low = data[10];
-	uint8_t gusting_high = (data[11] >> 4);
-	record->gust_speed = 0.1 * ((gusting_high >> 8) | gusting_low);
-	
-	record->wind_direction = 22.5 * data[12];
-	record->total_rain = 0.3 * ws_value_of_bytes(data[14], data[13]);
-	
-	int rain_overflow_mask = 0x80;
-	int contact_lost_mask = 0x40;
-	
-	record->status.sensor_contact_error = ((data[15] & contact_lost_mask) == contact_lost_mask);
-	record->status.rain_counter_overflow = ((data[15] & rain_overflow_mask) == rain_overflow_mask);
+void ws_pack_record(const ws_weather_record *record, ws_packed_record *packed)
+{
+	packed->epoch = 0;
+	if (record->date_time != NULL)
+	{
+		struct tm date_time = *record->date_time;
+		packed->epoch = mktime(&date_time);
+	}
 
-	// Calculate dew point
-	double a = 17.27;
-	double b = 237.7;
-	double gamma = (a * record->outdoor_temperature / (b + record->outdoor_temperature)) + log(record->outdoor_humidity / 100.0);
-	record->dew_point = b * gamma / (a - gamma);
+	packed->indoor_humidity = (record->indoor_humidity < 0) ? 0 : (record->indoor_humidity > 255) ? 255 : record->indoor_humidity;
+	packed->outdoor_humidity = (record->outdoor_humidity < 0) ? 0 : (record->outdoor_humidity > 255) ? 255 : record->outdoor_humidity;
+	packed->indoor_temperature = ws_pack_signed(record->indoor_temperature, 0.1);
+	packed->outdoor_temperature = ws_pack_signed(record->outdoor_temperature, 0.1);
+	packed->dew_point = ws_pack_signed(record->dew_point, 0.1);
+	packed->absolute_pressure = ws_pack_unsigned(record->absolute_pressure, 0.1);
+	packed->wind_speed = ws_pack_unsigned(record->wind_speed, 0.1);
+	packed->gust_speed = ws_pack_unsigned(record->gust_speed, 0.1);
+	packed->wind_direction = ws_pack_unsigned(record->wind_direction, 22.5);
+	packed->total_rain = ws_pack_unsigned(record->total_rain, 0.3);
+
+	packed->flags = 0;
+	packed->flags |= record->status.sensor_contact_error ? WS_PACKED_CONTACT_ERROR : 0;
+	packed->flags |= record->status.rain_counter_overflow ? WS_PACKED_RAIN_OVERFLOW : 0;
+	packed->flags |= record->data_invalid ? WS_PACKED_INVALID : 0;
+}
 
-	return WS_SUCCESS;
+void ws_unpack_record(const ws_packed_record *packed, ws_weather_record *record, struct tm *date_time)
+{
+	record->indoor_humidity = ws_packed_indoor_humidity(packed);
+	record->outdoor_humidity = ws_packed_outdoor_humidity(packed);
+	record->indoor_temperature = ws_packed_indoor_temperature(packed);
+	record->outdoor_temperature = ws_packed_outdoor_temperature(packed);
+	record->dew_point = ws_packed_dew_point(packed);
+	record->absolute_pressure = ws_packed_absolute_pressure(packed);
+	record->wind_speed = ws_packed_wind_speed(packed);
+	record->gust_speed = ws_packed_gust_speed(packed);
+	record->wind_direction = ws_packed_wind_direction(packed);
+	record->total_rain = ws_packed_total_rain(packed);
+	record->status.sensor_contact_error = ws_packed_contact_error(packed);
+	record->status.rain_counter_overflow = ws_packed_rain_overflow(packed);
+	record->delay = 0;
+	record->data_invalid = ws_packed_invalid(packed);
+
+	record->date_time = NULL;
+	if (date_time != NULL)
+	{
+		time_t epoch = packed->epoch;
+		localtime_r(&epoch, date_time);
+		record->date_time = date_time;
+	}
 }
 
 int ws_read_weather_record(ws_device *dev, int address, ws_weather_record *record)
@@ -246,13 +447,55 @@ int ws_read_weather_record(ws_device *dev, int address, ws_weather_record *recor
 	
 	unsigned char data[32];
 	int read;
-	ws_read_stable_block(dev, address, data, &read);  
+	int status = ws_read_stable_block(dev, address, data, &read);  
+	if (status != WS_SUCCESS)
+	{
+		return status;
+	}
+
 	ws_process_record_data(data, record);
 	
 	return WS_SUCCESS;
 
 }
 
+int ws_read_multiple_weather_records(ws_device *dev, int address_from, int address_to, ws_packed_record *records, int max_records, int *record_count)
+{
+	*record_count = 0;
+
+	if (address_from < WS_RECORDS_START || address_to > WS_MEMORY_SIZE || address_from > address_to)
+	{
+		return WS_ERR_INVALID_ADDR;
+	}
+
+	// Round from down and to up to the nearest 16
+	address_from -= address_from % WS_RECORD_SIZE;
+	address_to += (WS_RECORD_SIZE - address_to % WS_RECORD_SIZE) % WS_RECORD_SIZE;
+
+	unsigned char data[WS_BLOCK_SIZE];
+	int read;
+	int block = -1;
+
+	for (int address = address_from; address < address_to && *record_count < max_records; address += WS_RECORD_SIZE)
+	{
+		int block_address = address - (address % WS_BLOCK_SIZE);
+		if (block_address != block)
+		{
+			int status = ws_read_stable_block(dev, block_address, data, &read);
+			if (status != WS_SUCCESS)
+			{
+				return status;
+			}
+			block = block_address;
+		}
+
+		ws_process_packed_record_data(&data[address - block_address], &records[*record_count]);
+		(*record_count)++;
+	}
+
+	return WS_SUCCESS;
+}
+
 int ws_read_fixed_block_data(ws_device *dev, unsigned char* fixed_block_data, int* read)
 {
 	unsigned char data[32];
@@ -273,11 +516,57 @@ int ws_read_fixed_block_data(ws_device *dev, unsigned char* fixed_block_data, in
 	return WS_SUCCESS;
 }
 
+void ws_decode_data_info(const unsigned char *fixed_block, ws_data_info *info)
+{
+	// Unit settings are bit flags in 0x11 and 0x12
+	uint8_t units_1 = fixed_block[0x11];
+	uint8_t units_2 = fixed_block[0x12];
+
+	info->indoor_temp_unit = (units_1 & 0x01) ? FAHRENHEIT : CELSIUS;
+	info->outdoor_temp_unit = (units_1 & 0x02) ? FAHRENHEIT : CELSIUS;
+	info->rain_unit = (units_1 & 0x04) ? INCH : MILLIMETER;
+
+	if (units_1 & 0x40)
+	{
+		info->pressure_unit = INCH_MERCURY;
+	} else if (units_1 & 0x80) {
+		info->pressure_unit = MILLIMETER_MERCURY;
+	} else {
+		info->pressure_unit = HECTOPASCALS;
+	}
+
+	if (units_2 & 0x02)
+	{
+		info->wind_speed_unit = KILOMETERS_HOUR;
+	} else if (units_2 & 0x04) {
+		info->wind_speed_unit = KNOT;
+	} else if (units_2 & 0x08) {
+		info->wind_speed_unit = MILES_HOUR;
+	} else if (units_2 & 0x10) {
+		info->wind_speed_unit = BEAUFORT;
+	} else {
+		info->wind_speed_unit = METRES_SECOND;
+	}
+}
+
+int ws_read_data_info(ws_device *dev, ws_data_info *info)
+{
+	unsigned char data[WS_BLOCK_SIZE];
+	int read;
+
+	int status = ws_read_stable_block(dev, 0x00, data, &read);
+	if (status != WS_SUCCESS)
+	{
+		return status;
+	}
+
+	ws_decode_data_info(data, info);
+	return WS_SUCCESS;
+}
+
 int ws_read_weather_extremes(ws_device *dev, ws_weather_extremes *extremes)
 {
 	unsigned char data[256];
-	unsigned char time_data[5];
-	unsigned char blank_time_data[] = {0x00, 0x00, 0x00, 0x00, 0x00};
 	int read;
 
 	int status = ws_read_fixed_block_data(dev, data, &read);
@@ -286,6 +575,15 @@ int ws_read_weather_extremes(ws_device *dev, ws_weather_extremes *extremes)
 		return status;
 	}
 
+	ws_decode_weather_extremes(data, extremes);
+	return WS_SUCCESS;
+}
+
+void ws_decode_weather_extremes(unsigned char *data, ws_weather_extremes *extremes)
+{
+	unsigned char time_data[5];
+	unsigned char blank_time_data[] = {0x00, 0x00, 0x00, 0x00, 0x00};
+
 	// *** Indoor Humidity *** //
 	extremes->indoor_humidity.max = data[98];
 	extremes->indoor_humidity.min = data[99];
@@ -362,8 +660,6 @@ int ws_read_weather_extremes(ws_device *dev, ws_weather_extremes *extremes)
 	memcpy(time_data, &data[251], 5);
 	extremes->rain_total.max_time = ws_decode_bcd(time_data);
 	extremes->rain_total.min_time = ws_decode_bcd(blank_time_data);
-
-	return WS_SUCCESS;
 }
 
 ws_min_max ws_read_stddec_extreme(unsigned char *data, int is_unsigned, int addr_value_begin, int addr_time_begin)
@@ -429,7 +725,7 @@ void ws_print_block(unsigned char* data)
 
 void ws_print_mem_dump(ws_device *dev, int blocks)
 {	
-	blocks = (blocks == -1) ? 0x10000 : blocks;
+	blocks = (blocks == -1) ? WS_BLOCK_COUNT : blocks;
 	int address = 0x0;
 	unsigned char data[32];
 	int read;
@@ -476,20 +772,24 @@ void ws_print_min_max(ws_min_max max_min, const char* value_name)
 }
 
 
+static void ws_print_int(const char* label, int value, const char* unit)
+{
+	printf("%-24s %i%s\n", label, value, unit);
+}
+
+static void ws_print_double(const char* label, double value, const char* unit)
+{
+	printf("%-24s %f%s\n", label, value, unit);
+}
+
 void ws_print_weather_record(ws_weather_record record)
 {
-	printf("Indoor Humidity:\t\t %i%% \n", record.indoor_humidity);
-	printf("Outdoor Humidity:\t\t %i%% \n", record.outdoor_humidity);
-	printf("Indoor Temperature:\t\t %f°C\n", record.indoor_temperature);
-	printf("Outdoor Temperature:\t\t %f°C\n", record.outdoor_temperature);
-	printf("Dew Point:\t\t\t %f°C\n", record.dew_point);
-	printf("Pressure:\t\t\t %fhPa\n", record.absolute_pressure);
-	printf("Wind Speed:\t\t\t %fm/s\n", record.wind_speed);
-	printf("Gust Speed:\t\t\t %fm/s\n", record.gust_speed);
-	printf("Wind Direction:\t\t\t %f° from north\n", record.wind_direction);
-	printf("Total Rain:\t\t\t %fmm\n", record.total_rain);
-	printf("Counter Overflow:\t\t %s\n", (record.status.rain_counter_overflow) ? "true" : "false");
-	printf("Contact Error:\t\t\t %s\n", (record.status.sensor_contact_error) ? "true" : "false");
+#define PRINT_FIELD(TYPE, NAME, COLUMN, LABEL, UNIT, DECODE) ws_print_##TYPE(LABEL ":", record.NAME, UNIT);
+#define PRINT_STATUS_FIELD(TYPE, NAME, COLUMN, LABEL, UNIT, DECODE) printf("%-24s %s\n", LABEL ":", record.status.NAME ? "true" : "false");
+	FOREACH_WS_RECORD_FIELD(PRINT_FIELD)
+	FOREACH_WS_STATUS_FIELD(PRINT_STATUS_FIELD)
+#undef PRINT_FIELD
+#undef PRINT_STATUS_FIELD
 	printf("\n");
 }
 
@@ -538,6 +838,40 @@ int ws_cmp_data(unsigned char* data_1, unsigned char* data_2, int length)
 	return 1;
 }
 
+static inline uint64_t ws_rotl64(uint64_t x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+uint64_t ws_hash_block(const unsigned char* data)
+{
+	// Murmur3 style mixing of the four 64 bit words in the block
+	const uint64_t c1 = 0x87c37b91114253d5ULL;
+	const uint64_t c2 = 0x4cf5ad432745937fULL;
+	uint64_t h = WS_BLOCK_SIZE;
+
+	for (int i = 0; i < WS_BLOCK_SIZE; i += 8)
+	{
+		uint64_t k;
+		memcpy(&k, &data[i], 8);
+
+		k *= c1;
+		k = ws_rotl64(k, 31);
+		k *= c2;
+
+		h ^= k;
+		h = ws_rotl64(h, 27) * 5 + 0x52dce729;
+	}
+
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+
+	return (h == 0) ? 1 : h;
+}
+
 const char* ws_get_str_error(int error_no)
 {
 	if (error_no == WS_SUCCESS)
@@ -2,6 +2,8 @@
 #define WS_H
 
 #include <libusb-1.0/libusb.h>
+#include <math.h>
+#include "ws_policy.h"
 
 // --------- Enum and Struct Definitions --------- //
 
@@ -27,6 +29,13 @@
 	ERROR(WS_ERR_DB_QUERY)					\
 	ERROR(WS_ERR_DB_PREPARE)				\
 	ERROR(WS_ERR_DEL_STMT)					\
+	ERROR(WS_ERR_FILE_IO)					\
+	ERROR(WS_ERR_SOCKET)					\
+	ERROR(WS_ERR_THREAD)					\
+	ERROR(WS_ERR_RESET_FAILED)				\
+	ERROR(WS_ERR_UNSTABLE_BLOCK)			\
+	ERROR(WS_ERR_QUEUE_FULL)				\
+	ERROR(WS_ERR_NOT_RUNNING)				\
 
 	
 #define GENERATE_ENUM(ENUM) ENUM,
@@ -45,6 +54,17 @@ static const char *ws_errors_string[] = {
 	FOREACH_WS_ERR(GENERATE_STRING)
 };
 
+/*
+	Sizes and positions in the station's memory
+*/
+
+#define WS_MEMORY_SIZE 0x10000
+#define WS_BLOCK_SIZE 0x20
+#define WS_RECORD_SIZE 0x10
+#define WS_RECORDS_START 0x100
+#define WS_BLOCK_COUNT (WS_MEMORY_SIZE / WS_BLOCK_SIZE)
+#define WS_HISTORY_RECORDS ((WS_MEMORY_SIZE - WS_RECORDS_START) / WS_RECORD_SIZE)
+
 /*
 	Following enums define types for units 
 */
@@ -78,6 +98,7 @@ typedef struct
 	libusb_device* dev;
 	struct libusb_device_descriptor* desc;
 	struct libusb_device_handle* hnd;
+	ws_transfer_policy policy;		// Timeouts and retries, set to the defaults by ws_init
 }  ws_device;
 
 
@@ -95,13 +116,58 @@ typedef struct
 } ws_data_info;
 
 
+/**
+	The fields of a weather record. The struct, the decoder, the WeatherData table, the
+	printer and the JSON and CSV writers are all generated from these, so a field only has
+	to be added here. Each entry is:
+
+		TYPE		int or double
+		NAME		The field of ws_weather_record
+		COLUMN		The column of WeatherData
+		LABEL		What the field is printed as
+		UNIT		The unit it is printed with
+		DECODE		How it is worked out from the 16 bytes of a record (data), after
+					the fields before it (record)
+*/
+#define FOREACH_WS_RECORD_FIELD(FIELD) 																									\
+	FIELD(int, indoor_humidity, "IndoorHumidity", "Indoor Humidity", "%", data[1])															\
+	FIELD(int, outdoor_humidity, "OutdoorHumidity", "Outdoor Humidity", "%", data[4])														\
+	FIELD(double, indoor_temperature, "IndoorTemperature", "Indoor Temperature", "°C", 0.1 * ws_decode_signed_short(data[3], data[2]))		\
+	FIELD(double, outdoor_temperature, "OutdoorTemperature", "Outdoor Temperature", "°C", 0.1 * ws_decode_signed_short(data[6], data[5]))	\
+	FIELD(double, dew_point, "DewPoint", "Dew Point", "°C", ws_dew_point(record->outdoor_temperature, record->outdoor_humidity))			\
+	FIELD(double, absolute_pressure, "AbsolutePressure", "Pressure", "hPa", 0.1 * ws_value_of_bytes(data[8], data[7]))						\
+	FIELD(double, wind_speed, "WindSpeed", "Wind Speed", "m/s", 0.1 * (((data[11] & 0xF) << 8) | data[9]))									\
+	FIELD(double, gust_speed, "GuestSpeed", "Gust Speed", "m/s", 0.1 * (((data[11] >> 4) << 8) | data[10]))									\
+	FIELD(double, wind_direction, "WindDirection", "Wind Direction", "° from north", 22.5 * data[12])										\
+	FIELD(double, total_rain, "TotalRain", "Total Rain", "mm", 0.3 * ws_value_of_bytes(data[14], data[13]))								\
+
+/**
+	The fields of ws_station_status, as FOREACH_WS_RECORD_FIELD. They are stored after the
+	record's fields, and printed as true or false.
+*/
+#define FOREACH_WS_STATUS_FIELD(FIELD) 																									\
+	FIELD(int, sensor_contact_error, "SensorContactError", "Contact Error", "", (data[15] & 0x40) != 0)										\
+	FIELD(int, rain_counter_overflow, "RainCounterOverflow", "Counter Overflow", "", (data[15] & 0x80) != 0)								\
+
+#define GENERATE_FIELD_ENUM(TYPE, NAME, COLUMN, LABEL, UNIT, DECODE) WS_FIELD_##NAME,
+#define GENERATE_FIELD_MEMBER(TYPE, NAME, COLUMN, LABEL, UNIT, DECODE) TYPE NAME;
+
+enum ws_record_field {
+	FOREACH_WS_RECORD_FIELD(GENERATE_FIELD_ENUM)
+	FOREACH_WS_STATUS_FIELD(GENERATE_FIELD_ENUM)
+	WS_FIELD_COUNT
+};
+
+// Picks the fields a writer writes
+#define WS_FIELD_BIT(field) (1u << (field))
+#define WS_FIELD_ALL ((1u << WS_FIELD_COUNT) - 1)
+
 /**
 Status of the weather station
 */
 typedef struct
 {
-	int sensor_contact_error;
-	int rain_counter_overflow;
+	FOREACH_WS_STATUS_FIELD(GENERATE_FIELD_MEMBER)
 } ws_station_status;
 
 
@@ -110,21 +176,9 @@ typedef struct
 */
 typedef struct 
 {
-	int indoor_humidity;
-	int outdoor_humidity;
-	
-	double indoor_temperature;
-	double outdoor_temperature;
-	double dew_point;
-	
-	double absolute_pressure;
-	
-	double wind_speed;
-	double gust_speed;
-	double wind_direction;
-	
-	double total_rain;
+	FOREACH_WS_RECORD_FIELD(GENERATE_FIELD_MEMBER)
 	ws_station_status status;
+	int delay;					// Minutes since the previous record. For the latest record, minutes it has been written to.
 
 	// The following is calculated after the data has been read
 	struct tm *date_time;
@@ -132,6 +186,51 @@ typedef struct
 
 } ws_weather_record;  
 
+
+/**
+	A weather record packed into fixed point values, taking 26 bytes rather than the ~100
+	bytes of ws_weather_record. Used wherever many records are held at once. The values
+	are in the same resolution as the station stores them, so no precision is lost.
+
+	Use the ws_packed_* accessors below to get the values in the units of ws_weather_record.
+*/
+typedef struct __attribute__((packed))
+{
+	int64_t epoch;					// Seconds since the Unix epoch, 0 if not known
+	int16_t indoor_temperature;		// 0.1 Degrees Celcius
+	int16_t outdoor_temperature;	// 0.1 Degrees Celcius
+	int16_t dew_point;				// 0.1 Degrees Celcius, WS_PACKED_NONE if it can't be calculated
+	uint16_t absolute_pressure;		// 0.1 Hectopascals
+	uint16_t wind_speed;			// 0.1 Meters per Second
+	uint16_t gust_speed;			// 0.1 Meters per Second
+	uint16_t total_rain;			// Rain counter, 0.3 Millimetre per count
+	uint8_t indoor_humidity;		// Percent
+	uint8_t outdoor_humidity;		// Percent
+	uint8_t wind_direction;			// 22.5 Degrees from North per step
+	uint8_t flags;					// WS_PACKED_* flags
+} ws_packed_record;
+
+#define WS_PACKED_NONE INT16_MIN
+
+#define WS_PACKED_CONTACT_ERROR 	0x01
+#define WS_PACKED_RAIN_OVERFLOW 	0x02
+#define WS_PACKED_INVALID 			0x04
+#define WS_PACKED_SUSPECT 			0x08		// Valid, but looks like a sensor glitch
+
+static inline int ws_packed_indoor_humidity(const ws_packed_record *r) { return r->indoor_humidity; }
+static inline int ws_packed_outdoor_humidity(const ws_packed_record *r) { return r->outdoor_humidity; }
+static inline double ws_packed_indoor_temperature(const ws_packed_record *r) { return 0.1 * r->indoor_temperature; }
+static inline double ws_packed_outdoor_temperature(const ws_packed_record *r) { return 0.1 * r->outdoor_temperature; }
+static inline double ws_packed_dew_point(const ws_packed_record *r) { return (r->dew_point == WS_PACKED_NONE) ? NAN : 0.1 * r->dew_point; }
+static inline double ws_packed_absolute_pressure(const ws_packed_record *r) { return 0.1 * r->absolute_pressure; }
+static inline double ws_packed_wind_speed(const ws_packed_record *r) { return 0.1 * r->wind_speed; }
+static inline double ws_packed_gust_speed(const ws_packed_record *r) { return 0.1 * r->gust_speed; }
+static inline double ws_packed_wind_direction(const ws_packed_record *r) { return 22.5 * r->wind_direction; }
+static inline double ws_packed_total_rain(const ws_packed_record *r) { return 0.3 * r->total_rain; }
+static inline int ws_packed_contact_error(const ws_packed_record *r) { return (r->flags & WS_PACKED_CONTACT_ERROR) != 0; }
+static inline int ws_packed_rain_overflow(const ws_packed_record *r) { return (r->flags & WS_PACKED_RAIN_OVERFLOW) != 0; }
+static inline int ws_packed_invalid(const ws_packed_record *r) { return (r->flags & WS_PACKED_INVALID) != 0; }
+
 /** 
 	Holds a time
 */
@@ -322,6 +421,10 @@ int ws_read_fixed_block_data(ws_device *dev, unsigned char* fixed_block_data, in
 	Reads a single block from a specified address from the weather station. A single 
 	block is 32 bytes.
 	
+	Every transfer is given a timeout from the device's transfer policy. A failed read is 
+	retried (with a backoff) up to policy.max_attempts times, and the device is reset after 
+	policy.reset_after consecutive failures. Each failure is passed to policy.on_failure.
+	
 	Parameters:
 		- dev: 					A device struct for the device to be read from
 		- data:  				The data array
@@ -338,9 +441,38 @@ int ws_read_fixed_block_data(ws_device *dev, unsigned char* fixed_block_data, in
 	Return:
 		- WS_ERR_CONTROL_TRANSFER_FAILED	Request for data write failed
 		- WS_ERR_BULK_TRANSFER_FAILED		Data read failed 
+		- WS_ERR_TIMEOUT					The last attempt timed out
+		- WS_ERR_RESET_FAILED				The device could not be reset after repeated failures
 */
 int ws_read_block(ws_device *dev, int address, unsigned char* data, int* read);
 
+/**
+	A single attempt of ws_read_block(), for callers that retry themselves. Failures are 
+	recorded with the transfer policy, and the device is reset if the policy says so.
+
+	Parameters:
+		- attempt				The attempt, starting at 1
+		- reset_failed			Set if the device needed resetting and couldn't be, in which 
+								case the error is from ws_reset() and retrying won't help
+
+	Return:
+		- Any error from ws_read_block() or ws_reset()
+*/
+int ws_read_block_attempt(ws_device *dev, int address, unsigned char* data, int* read, int attempt, int* reset_failed);
+
+/**
+	Resets the USB device and prepares it for reading again. This is done automatically
+	by ws_read_block() after repeated failures.
+
+	Parameters:
+		- dev: 			A device struct for the device 
+
+	Return:
+		- WS_ERR_RESET_FAILED				libusb failed to reset the device
+		- Any error from ws_initialise_read()
+*/
+int ws_reset(ws_device *dev);
+
 /**
 	Retrieves the address in the device's memory of the latest weather record saved. Useful, as
 	the data is stored in a circular buffer where old data is overwritten when the memory has all
@@ -378,6 +510,38 @@ int ws_latest_record_address(ws_device *dev, int *address);
 int ws_process_record_data(unsigned char *data, ws_weather_record *record);
 
 
+/**
+	Takes a weather record's raw data (16 bytes) and packs it straight into a 
+	ws_packed_record, without going through floating point (other than for the dew point). 
+	The epoch is set to 0.
+	
+	Parameters:
+		data:		16 bytes of record data.
+		record		The packed record to fill
+*/
+void ws_process_packed_record_data(const unsigned char *data, ws_packed_record *record);
+
+/**
+	Converts a ws_weather_record to a ws_packed_record. Values are rounded to the 
+	resolution of the packed record.
+
+	Parameters:
+		record 		The record to pack. If date_time is not NULL it is used for the epoch.
+		packed		The packed record
+*/
+void ws_pack_record(const ws_weather_record *record, ws_packed_record *packed);
+
+/**
+	Converts a ws_packed_record back to a ws_weather_record.
+
+	Parameters:
+		packed		The packed record
+		record 		The record to fill
+		date_time	Storage for the record's time, which record->date_time will point to. 
+					If NULL, record->date_time is set to NULL.
+*/
+void ws_unpack_record(const ws_packed_record *packed, ws_weather_record *record, struct tm *date_time);
+
 /**
 	Reads a weather record, formats the data and puts it in a ws_weather_record stuct.
 	
@@ -400,6 +564,7 @@ int ws_process_record_data(unsigned char *data, ws_weather_record *record);
 		- WS_ERR_CONTROL_TRANSFER_FAILED	Request for data write failed
 		- WS_ERR_BULK_TRANSFER_FAILED		Data read failed 
 		- WS_ERR_INVALID_ADDR				Invalid address provided, most likly out of range.
+		- Any error from ws_read_stable_block()
 */
 int ws_read_weather_record(ws_device *dev, int address, ws_weather_record *record);
 
@@ -417,16 +582,43 @@ int ws_read_weather_record(ws_device *dev, int address, ws_weather_record *recor
 		- address_to:		The address to read to. This number will be up rounded to the 
 							nearest 16 - the size of a weather record.
 							
-		- record			An array of records retrieved from memory
+		- records			An array of packed records retrieved from memory. The epoch of each record is
+							set to 0, as the time can only be worked out by the caller.
+		
+		- max_records		The size of the records array. Reading stops when it is full.
 		
 		- record_count		The number of records read from the device.
+		
+	Each 32 byte block is read once, so both records in a block cost a single read.
 							
 	Return:
 		- WS_ERR_CONTROL_TRANSFER_FAILED	Request for data write failed
 		- WS_ERR_BULK_TRANSFER_FAILED		Data read failed 
 		- WS_ERR_INVALID_ADDR				Invalid address provided, most likly out of range.
 */
-int ws_read_multiple_weather_records(ws_device *dev, int address_from, int address_to, ws_weather_record ***record, int *record_count);
+int ws_read_multiple_weather_records(ws_device *dev, int address_from, int address_to, ws_packed_record *records, int max_records, int *record_count);
+
+/**
+	Decodes the display unit settings from the fixed block. These are the units the user 
+	has chosen on the station's touchscreen.
+
+	Parameters:
+		- fixed_block		The fixed block data. Only the first 32 bytes are needed.
+		- info				The struct to fill with the units
+*/
+void ws_decode_data_info(const unsigned char *fixed_block, ws_data_info *info);
+
+/**
+	Reads the display unit settings from the station.
+
+	Parameters:
+		- dev: 				The weather station device
+		- info				The struct to fill with the units
+
+	Return:
+		- Any error from ws_read_stable_block()
+*/
+int ws_read_data_info(ws_device *dev, ws_data_info *info);
 
 /**
 	Reads the fixed block memory and processes it, filling the weather exteames in the ws_weather_extremes struct
@@ -438,6 +630,15 @@ int ws_read_multiple_weather_records(ws_device *dev, int address_from, int addre
 */
 int ws_read_weather_extremes(ws_device *dev, ws_weather_extremes *extremes);
 
+/**
+	Decodes the weather extremes from the fixed block, as ws_read_weather_extremes()
+
+	Parameters:
+		- data				The fixed block data, all 256 bytes
+		- extremes 			The struct for storing all of the extremes
+*/
+void ws_decode_weather_extremes(unsigned char *data, ws_weather_extremes *extremes);
+
 /**
 	Prints an error from libusb
 	
@@ -469,6 +670,9 @@ void ws_print_block(unsigned char* data);
 	that other parts of the program which assume a constant address end up reading 
 	the wrong data or even worse random garbage from the host's memory.
 	
+	ws_dump_capture() (in ws_dump.h) should be used instead to save the whole memory, as it
+	reads far fewer blocks and can be carried on if it is interrupted.
+	
 	Parameters:
 		blocks		The number of blocks to print, giving -1 will print all of the data
 */
@@ -573,10 +777,25 @@ unsigned char ws_decode_bcd_byte(unsigned char byte);
 */
 int ws_cmp_data(unsigned char* data_1, unsigned char* data_2, int length);
 
+/**
+	Calculates a 64 bit fingerprint of a 32 byte block, used to tell if a block has 
+	changed since it was last read. The fingerprint is never 0, so 0 can be used to mean
+	"no fingerprint".
+
+	Parameters:
+		data		The block. Must be 32 bytes.
+
+	Return:
+		The fingerprint
+*/
+uint64_t ws_hash_block(const unsigned char* data);
+
 /**
 	Function reads a stable block. Reads blocks from the device until they are
 	the same. This prevents reading corrupt data if the device is writing.
 	Therefore, this function is slower then ws_read_block, but much safer.
+
+	At most WS_STABLE_BLOCK_MAX_READS pairs of reads are made.
 	
 	Parameters:
 		- dev: 					A device struct for the device to be read from
@@ -594,8 +813,12 @@ int ws_cmp_data(unsigned char* data_1, unsigned char* data_2, int length);
 	Return:
 		- WS_ERR_CONTROL_TRANSFER_FAILED	Request for data write failed
 		- WS_ERR_BULK_TRANSFER_FAILED		Data read failed 
+		- WS_ERR_UNSTABLE_BLOCK				The block kept changing between reads
+		- Any error from ws_read_block()
 
 */
+#define WS_STABLE_BLOCK_MAX_READS 16
+
 int ws_read_stable_block(ws_device *dev, int address, unsigned char* data, int* read);
 
 /**
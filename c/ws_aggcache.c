@@ -0,0 +1,670 @@
+#include "ws_aggcache.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+// Most connections with records added in a transaction that hasn't been committed yet
+#define WS_AGGCACHE_PENDING 16
+
+typedef struct
+{
+	double min;
+	double max;
+	double sum;
+	int64_t count;
+} ws_aggcache_stats;
+
+/**
+	An entry. Buckets are kept in order of their key, which is the start of the bucket in
+	the seconds strftime('%s', RecordDateTime) gives (the local time read as if it were
+	UTC), so they sort and compare the same way as RecordDateTime. A whole range entry has
+	at most one bucket, keyed by its first record.
+*/
+typedef struct
+{
+	char* file;							// NULL if the entry isn't used
+	uint32_t metrics;
+	int metric_count;
+	int metric_list[WS_METRIC_COUNT];
+	time_t from;
+	time_t to;
+	int bucket_seconds;
+	int64_t from_key;
+	int64_t to_key;
+
+	int count;
+	int capacity;
+	int64_t* keys;
+	time_t* times;						// The time each bucket's row is given, as the query gives it
+	ws_aggcache_stats* stats;			// metric_count per bucket
+
+	size_t bytes;
+	uint64_t last_used;
+} ws_aggcache_entry;
+
+static const char* ws_aggcache_columns[] = {
+#define GENERATE_AGGCACHE_COLUMN(ENUM, COLUMN) COLUMN,
+	FOREACH_WS_STORE_METRIC(GENERATE_AGGCACHE_COLUMN)
+#undef GENERATE_AGGCACHE_COLUMN
+};
+
+static pthread_mutex_t ws_aggcache_lock = PTHREAD_MUTEX_INITIALIZER;
+static ws_aggcache_entry ws_aggcache_entries[WS_AGGCACHE_ENTRIES];
+static atomic_int ws_aggcache_used = 0;
+static size_t ws_aggcache_total = 0;
+static uint64_t ws_aggcache_clock = 0;
+static uint64_t ws_aggcache_changes = 0;				// Bumped by every add and invalidate
+static sqlite3* ws_aggcache_pending[WS_AGGCACHE_PENDING];
+static int ws_aggcache_pending_count = 0;
+
+// Rows of a hit are copied out so the callback runs without the lock
+static __thread ws_store_row* ws_aggcache_rows = NULL;
+static __thread int ws_aggcache_rows_capacity = 0;
+
+/* The seconds strftime('%s', date) would give for a RecordDateTime */
+static int ws_aggcache_key(const char* date, int64_t* key)
+{
+	int y, m, d, hour, minute, second;
+	if (date == NULL || sscanf(date, "%d-%d-%d %d:%d:%d", &y, &m, &d, &hour, &minute, &second) != 6)
+	{
+		return 0;
+	}
+
+	// Days since 1970-01-01 in the proleptic Gregorian calendar
+	y -= (m <= 2);
+	int64_t era = (y >= 0 ? y : y - 399) / 400;
+	int64_t year_of_era = y - era * 400;
+	int64_t day_of_year = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+	int64_t day_of_era = year_of_era * 365 + year_of_era / 4 - year_of_era / 100 + day_of_year;
+	int64_t days = era * 146097 + day_of_era - 719468;
+
+	*key = days * 86400 + hour * 3600 + minute * 60 + second;
+	return 1;
+}
+
+static int64_t ws_aggcache_time_key(time_t time)
+{
+	char date[20];
+	struct tm date_time;
+	int64_t key = 0;
+
+	localtime_r(&time, &date_time);
+	ws_store_format_date(&date_time, date);
+	ws_aggcache_key(date, &key);
+	return key;
+}
+
+/* The time a row with this key is given, the same way as datetime(key, 'unixepoch') would be parsed */
+static time_t ws_aggcache_key_time(int64_t key)
+{
+	// A date is 19 characters, but there is room for six ints at their widest and the separators
+	char date[6 * 11 + 5 + 1];
+	struct tm date_time;
+	time_t seconds = (time_t)key;
+	time_t time = 0;
+
+	gmtime_r(&seconds, &date_time);
+	snprintf(date, sizeof(date), "%.4i-%.2i-%.2i %.2i:%.2i:%.2i", date_time.tm_year + 1900, date_time.tm_mon + 1,
+	         date_time.tm_mday, date_time.tm_hour, date_time.tm_min, date_time.tm_sec);
+	ws_store_parse_date(date, &time);
+	return time;
+}
+
+/* Which bucket a key goes in. SQLite's integer division rounds towards 0, as C's does. */
+static int64_t ws_aggcache_bucket(const ws_aggcache_entry* entry, int64_t key)
+{
+	return (entry->bucket_seconds > 0) ? key / entry->bucket_seconds * entry->bucket_seconds : key;
+}
+
+static size_t ws_aggcache_size(int capacity, int metric_count)
+{
+	return sizeof(ws_aggcache_entry) + (size_t)capacity * (sizeof(int64_t) + sizeof(time_t) + metric_count * sizeof(ws_aggcache_stats));
+}
+
+static void ws_aggcache_free(ws_aggcache_entry* entry)
+{
+	if (entry->file == NULL)
+	{
+		return;
+	}
+
+	ws_aggcache_total -= entry->bytes;
+	free(entry->file);
+	free(entry->keys);
+	free(entry->times);
+	free(entry->stats);
+	memset(entry, 0, sizeof(ws_aggcache_entry));
+	atomic_fetch_sub(&ws_aggcache_used, 1);
+}
+
+/* Makes room for another bucket, returning 0 if it can't. The caller accounts for the change in bytes. */
+static int ws_aggcache_grow(ws_aggcache_entry* entry)
+{
+	if (entry->count < entry->capacity)
+	{
+		return 1;
+	}
+
+	int capacity = (entry->capacity > 0) ? entry->capacity * 2 : 16;
+	int64_t* keys = realloc(entry->keys, capacity * sizeof(int64_t));
+	if (keys != NULL)
+	{
+		entry->keys = keys;
+	}
+	time_t* times = realloc(entry->times, capacity * sizeof(time_t));
+	if (times != NULL)
+	{
+		entry->times = times;
+	}
+	ws_aggcache_stats* stats = realloc(entry->stats, capacity * entry->metric_count * sizeof(ws_aggcache_stats));
+	if (stats != NULL)
+	{
+		entry->stats = stats;
+	}
+
+	if (keys == NULL || times == NULL || stats == NULL)
+	{
+		return 0;
+	}
+
+	entry->bytes = ws_aggcache_size(capacity, entry->metric_count);
+	entry->capacity = capacity;
+	return 1;
+}
+
+static ws_aggcache_entry* ws_aggcache_find(const char* file, const ws_store_range_query* query)
+{
+	for (int i = 0; i < WS_AGGCACHE_ENTRIES; i++)
+	{
+		ws_aggcache_entry* entry = &ws_aggcache_entries[i];
+		if (entry->file != NULL && entry->metrics == query->metrics && entry->from == query->from && entry->to == query->to &&
+		    entry->bucket_seconds == query->bucket_seconds && strcmp(entry->file, file) == 0)
+		{
+			return entry;
+		}
+	}
+	return NULL;
+}
+
+/* Drops the least recently used entries until there is a free entry and room for bytes more */
+static ws_aggcache_entry* ws_aggcache_make_room(size_t bytes)
+{
+	for (;;)
+	{
+		ws_aggcache_entry* free_entry = NULL;
+		ws_aggcache_entry* oldest = NULL;
+
+		for (int i = 0; i < WS_AGGCACHE_ENTRIES; i++)
+		{
+			ws_aggcache_entry* entry = &ws_aggcache_entries[i];
+			if (entry->file == NULL)
+			{
+				free_entry = (free_entry == NULL) ? entry : free_entry;
+			} else if (oldest == NULL || entry->last_used < oldest->last_used) {
+				oldest = entry;
+			}
+		}
+
+		if (free_entry != NULL && ws_aggcache_total + bytes <= WS_AGGCACHE_BYTES)
+		{
+			return free_entry;
+		}
+
+		if (oldest == NULL)
+		{
+			return NULL;
+		}
+		ws_aggcache_free(oldest);
+	}
+}
+
+static int ws_aggcache_is_pending(sqlite3* info)
+{
+	for (int i = 0; i < ws_aggcache_pending_count; i++)
+	{
+		if (ws_aggcache_pending[i] == info)
+		{
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static void ws_aggcache_clear_pending(sqlite3* info)
+{
+	for (int i = 0; i < ws_aggcache_pending_count; i++)
+	{
+		if (ws_aggcache_pending[i] == info)
+		{
+			ws_aggcache_pending[i] = ws_aggcache_pending[--ws_aggcache_pending_count];
+			return;
+		}
+	}
+}
+
+static void ws_aggcache_drop_file(const char* file)
+{
+	for (int i = 0; i < WS_AGGCACHE_ENTRIES; i++)
+	{
+		ws_aggcache_entry* entry = &ws_aggcache_entries[i];
+		if (entry->file != NULL && strcmp(entry->file, file) == 0)
+		{
+			ws_aggcache_free(entry);
+		}
+	}
+	ws_aggcache_changes++;
+}
+
+static const char* ws_aggcache_file(sqlite3* info)
+{
+	const char* file = sqlite3_db_filename(info, "main");
+	return (file != NULL && file[0] != '\0') ? file : NULL;
+}
+
+int ws_aggcache_cacheable(const ws_store_range_query* query)
+{
+	return query->aggregate > WS_AGG_NONE && query->aggregate <= WS_AGG_COUNT && query->bucket_seconds >= 0 && query->metrics != 0 &&
+	       (query->metrics & ~WS_METRIC_ALL) == 0 && (query->schema == NULL || strcmp(query->schema, "main") == 0);
+}
+
+/* Reads an entry's buckets from the database. The entry isn't in the cache yet, so no lock is needed. */
+static int ws_aggcache_fill(sqlite3* info, ws_aggcache_entry* entry)
+{
+	char sql[WS_STORE_SQL_MAX];
+	int length;
+
+	if (entry->bucket_seconds > 0)
+	{
+		length = snprintf(sql, sizeof(sql), "SELECT CAST(strftime('%%s', RecordDateTime) AS INTEGER) / ?3 * ?3");
+	} else {
+		length = snprintf(sql, sizeof(sql), "SELECT MIN(CAST(strftime('%%s', RecordDateTime) AS INTEGER))");
+	}
+
+	for (int j = 0; j < entry->metric_count && length < (int)sizeof(sql); j++)
+	{
+		const char* column = ws_aggcache_columns[entry->metric_list[j]];
+		length += snprintf(sql + length, sizeof(sql) - length, ", MIN(%s), MAX(%s), SUM(%s), COUNT(%s)", column, column, column, column);
+	}
+
+	if (length < (int)sizeof(sql))
+	{
+		length += snprintf(sql + length, sizeof(sql) - length, " FROM main.WeatherData WHERE RecordDateTime >= ?1 AND RecordDateTime < ?2%s",
+		                   (entry->bucket_seconds > 0) ? " GROUP BY 1 ORDER BY 1" : "");
+	}
+
+	if (length >= (int)sizeof(sql))
+	{
+		return WS_ERR_DB_PREPARE;
+	}
+
+	sqlite3_stmt* statement;
+	int status = ws_store_cached_statement(info, sql, &statement);
+	if (status != WS_SUCCESS)
+	{
+		return status;
+	}
+
+	char from[20];
+	char to[20];
+	struct tm date_time;
+
+	localtime_r(&entry->from, &date_time);
+	ws_store_format_date(&date_time, from);
+	localtime_r(&entry->to, &date_time);
+	ws_store_format_date(&date_time, to);
+
+	sqlite3_bind_text(statement, 1, from, -1, SQLITE_TRANSIENT);
+	sqlite3_bind_text(statement, 2, to, -1, SQLITE_TRANSIENT);
+	if (entry->bucket_seconds > 0)
+	{
+		sqlite3_bind_int(statement, 3, entry->bucket_seconds);
+	}
+
+	while ((status = ws_store_execute_query(&info, &statement)) == WS_DB_ROW)
+	{
+		// A whole range aggregate of no rows gives a single row of NULLs
+		if (sqlite3_column_type(statement, 0) == SQLITE_NULL)
+		{
+			continue;
+		}
+
+		if (!ws_aggcache_grow(entry))
+		{
+			status = WS_ERR_FILE_IO;
+			break;
+		}
+
+		int i = entry->count++;
+		entry->keys[i] = sqlite3_column_int64(statement, 0);
+		entry->times[i] = ws_aggcache_key_time(entry->keys[i]);
+
+		for (int j = 0; j < entry->metric_count; j++)
+		{
+			ws_aggcache_stats* stats = &entry->stats[i * entry->metric_count + j];
+			int column = 1 + j * 4;
+			stats->count = sqlite3_column_int64(statement, column + 3);
+			stats->min = stats->count ? sqlite3_column_double(statement, column) : NAN;
+			stats->max = stats->count ? sqlite3_column_double(statement, column + 1) : NAN;
+			stats->sum = stats->count ? sqlite3_column_double(statement, column + 2) : 0;
+		}
+	}
+
+	sqlite3_reset(statement);
+	return (status == WS_SUCCESS || status == WS_DB_ROW) ? WS_SUCCESS : status;
+}
+
+/* Copies the rows a query wants out of an entry. Called with the lock held. */
+static int ws_aggcache_rows_of(const ws_aggcache_entry* entry, const ws_store_range_query* query)
+{
+	int count = entry->count;
+	if (query->limit > 0 && query->limit < count)
+	{
+		count = query->limit;
+	}
+
+	if (count > ws_aggcache_rows_capacity)
+	{
+		ws_store_row* rows = realloc(ws_aggcache_rows, count * sizeof(ws_store_row));
+		if (rows == NULL)
+		{
+			return -1;
+		}
+		ws_aggcache_rows = rows;
+		ws_aggcache_rows_capacity = count;
+	}
+
+	for (int r = 0; r < count; r++)
+	{
+		int i = (query->descending && entry->bucket_seconds > 0) ? entry->count - 1 - r : r;
+		ws_store_row* row = &ws_aggcache_rows[r];
+		row->time = entry->times[i];
+
+		for (int j = 0; j < entry->metric_count; j++)
+		{
+			const ws_aggcache_stats* stats = &entry->stats[i * entry->metric_count + j];
+			double value;
+
+			switch (query->aggregate)
+			{
+				case WS_AGG_MIN: value = stats->count ? stats->min : NAN; break;
+				case WS_AGG_MAX: value = stats->count ? stats->max : NAN; break;
+				case WS_AGG_AVG: value = stats->count ? stats->sum / stats->count : NAN; break;
+				case WS_AGG_SUM: value = stats->count ? stats->sum : NAN; break;
+				default: value = (double)stats->count; break;
+			}
+			row->values[entry->metric_list[j]] = value;
+		}
+	}
+
+	return count;
+}
+
+/* Passes the rows copied out by ws_aggcache_rows_of() to the callback */
+static int ws_aggcache_emit(int count, ws_store_row_cb callback, void* user)
+{
+	if (count < 0)
+	{
+		return WS_ERR_FILE_IO;
+	}
+
+	for (int r = 0; r < count; r++)
+	{
+		if (callback(&ws_aggcache_rows[r], user))
+		{
+			break;
+		}
+	}
+
+	return WS_SUCCESS;
+}
+
+int ws_aggcache_query(sqlite3* info, const ws_store_range_query* query, ws_store_row_cb callback, void* user)
+{
+	const char* file = ws_aggcache_file(info);
+	int count;
+
+	pthread_mutex_lock(&ws_aggcache_lock);
+
+	ws_aggcache_entry* entry = (file != NULL) ? ws_aggcache_find(file, query) : NULL;
+	if (entry != NULL)
+	{
+		entry->last_used = ++ws_aggcache_clock;
+		count = ws_aggcache_rows_of(entry, query);
+		pthread_mutex_unlock(&ws_aggcache_lock);
+		return ws_aggcache_emit(count, callback, user);
+	}
+
+	uint64_t changes = ws_aggcache_changes;
+	pthread_mutex_unlock(&ws_aggcache_lock);
+
+	ws_aggcache_entry fresh;
+	memset(&fresh, 0, sizeof(fresh));
+	fresh.metrics = query->metrics;
+	fresh.from = query->from;
+	fresh.to = query->to;
+	fresh.bucket_seconds = query->bucket_seconds;
+	fresh.from_key = ws_aggcache_time_key(query->from);
+	fresh.to_key = ws_aggcache_time_key(query->to);
+	for (int m = 0; m < WS_METRIC_COUNT; m++)
+	{
+		if (query->metrics & WS_METRIC_BIT(m))
+		{
+			fresh.metric_list[fresh.metric_count++] = m;
+		}
+	}
+
+	// Filled without the lock, as it can take a while
+	int status = ws_aggcache_fill(info, &fresh);
+	if (status != WS_SUCCESS)
+	{
+		free(fresh.keys);
+		free(fresh.times);
+		free(fresh.stats);
+		return status;
+	}
+
+	pthread_mutex_lock(&ws_aggcache_lock);
+
+	/* Only keep it if nothing was added while it was read, and nothing that has been added
+	   is still waiting to be committed (and so might not have been read) */
+	ws_aggcache_entry* slot = NULL;
+	if (file != NULL && changes == ws_aggcache_changes && ws_aggcache_pending_count == 0 &&
+	    fresh.bytes <= WS_AGGCACHE_BYTES / 4 && ws_aggcache_find(file, query) == NULL)
+	{
+		slot = ws_aggcache_make_room(fresh.bytes);
+	}
+
+	if (slot != NULL && (fresh.file = strdup(file)) != NULL)
+	{
+		*slot = fresh;
+		slot->last_used = ++ws_aggcache_clock;
+		ws_aggcache_total += slot->bytes;
+		atomic_fetch_add(&ws_aggcache_used, 1);
+
+		count = ws_aggcache_rows_of(slot, query);
+		pthread_mutex_unlock(&ws_aggcache_lock);
+		return ws_aggcache_emit(count, callback, user);
+	}
+
+	pthread_mutex_unlock(&ws_aggcache_lock);
+
+	count = ws_aggcache_rows_of(&fresh, query);
+	free(fresh.keys);
+	free(fresh.times);
+	free(fresh.stats);
+	return ws_aggcache_emit(count, callback, user);
+}
+
+int ws_aggcache_covers(sqlite3* info, const char* date)
+{
+	int64_t key;
+	const char* file;
+
+	if (atomic_load(&ws_aggcache_used) == 0 || (file = ws_aggcache_file(info)) == NULL || !ws_aggcache_key(date, &key))
+	{
+		return 0;
+	}
+
+	int covered = 0;
+	pthread_mutex_lock(&ws_aggcache_lock);
+
+	for (int i = 0; i < WS_AGGCACHE_ENTRIES && !covered; i++)
+	{
+		ws_aggcache_entry* entry = &ws_aggcache_entries[i];
+		covered = entry->file != NULL && key >= entry->from_key && key < entry->to_key && strcmp(entry->file, file) == 0;
+	}
+
+	pthread_mutex_unlock(&ws_aggcache_lock);
+	return covered;
+}
+
+/* Adds a record to an entry, returning 0 if the entry has to be dropped */
+static int ws_aggcache_add_to(ws_aggcache_entry* entry, int64_t key, const double* values)
+{
+	int i = entry->count;
+
+	if (entry->bucket_seconds == 0 && entry->count > 0)
+	{
+		// A whole range entry has one bucket, given the time of its first record
+		if (key < entry->keys[0])
+		{
+			entry->keys[0] = key;
+			entry->times[0] = ws_aggcache_key_time(key);
+		}
+		i = 1;
+	} else {
+		// Records nearly always go in the last bucket, or a new one after it
+		int64_t bucket = ws_aggcache_bucket(entry, key);
+		while (i > 0 && entry->keys[i - 1] > bucket)
+		{
+			i--;
+		}
+
+		if (i == 0 || entry->keys[i - 1] != bucket)
+		{
+			size_t bytes = entry->bytes;
+			if (!ws_aggcache_grow(entry))
+			{
+				return 0;
+			}
+			ws_aggcache_total += entry->bytes - bytes;
+
+			int after = entry->count - i;
+			memmove(&entry->keys[i + 1], &entry->keys[i], after * sizeof(int64_t));
+			memmove(&entry->times[i + 1], &entry->times[i], after * sizeof(time_t));
+			memmove(&entry->stats[(i + 1) * entry->metric_count], &entry->stats[i * entry->metric_count],
+			        after * entry->metric_count * sizeof(ws_aggcache_stats));
+
+			entry->keys[i] = bucket;
+			entry->times[i] = ws_aggcache_key_time(bucket);
+			memset(&entry->stats[i * entry->metric_count], 0, entry->metric_count * sizeof(ws_aggcache_stats));
+			entry->count++;
+			i++;
+		}
+	}
+
+	// The record goes in bucket i - 1
+	for (int j = 0; j < entry->metric_count; j++)
+	{
+		ws_aggcache_stats* stats = &entry->stats[(i - 1) * entry->metric_count + j];
+		double value = values[entry->metric_list[j]];
+		if (isnan(value))
+		{
+			continue;
+		}
+
+		stats->min = (stats->count == 0 || value < stats->min) ? value : stats->min;
+		stats->max = (stats->count == 0 || value > stats->max) ? value : stats->max;
+		stats->sum += value;
+		stats->count++;
+	}
+
+	return 1;
+}
+
+void ws_aggcache_add(sqlite3* info, const char* date, const double* values, int replaced)
+{
+	int64_t key;
+	const char* file;
+
+	if (atomic_load(&ws_aggcache_used) == 0 || (file = ws_aggcache_file(info)) == NULL || !ws_aggcache_key(date, &key))
+	{
+		return;
+	}
+
+	pthread_mutex_lock(&ws_aggcache_lock);
+	ws_aggcache_changes++;
+
+	// Until it's committed, other connections may not see it and mustn't cache what they read
+	if (!sqlite3_get_autocommit(info) && !ws_aggcache_is_pending(info) && ws_aggcache_pending_count < WS_AGGCACHE_PENDING)
+	{
+		ws_aggcache_pending[ws_aggcache_pending_count++] = info;
+	}
+
+	for (int i = 0; i < WS_AGGCACHE_ENTRIES; i++)
+	{
+		ws_aggcache_entry* entry = &ws_aggcache_entries[i];
+		if (entry->file == NULL || key < entry->from_key || key >= entry->to_key || strcmp(entry->file, file) != 0)
+		{
+			continue;
+		}
+
+		if (replaced || !ws_aggcache_add_to(entry, key, values))
+		{
+			ws_aggcache_free(entry);
+		}
+	}
+
+	// Growing may have gone over the limit
+	if (ws_aggcache_total > WS_AGGCACHE_BYTES)
+	{
+		ws_aggcache_make_room(0);
+	}
+
+	pthread_mutex_unlock(&ws_aggcache_lock);
+}
+
+void ws_aggcache_invalidate(sqlite3* info)
+{
+	const char* file = ws_aggcache_file(info);
+	if (file == NULL)
+	{
+		return;
+	}
+
+	pthread_mutex_lock(&ws_aggcache_lock);
+	ws_aggcache_drop_file(file);
+	pthread_mutex_unlock(&ws_aggcache_lock);
+}
+
+static int ws_aggcache_on_commit(void* user)
+{
+	pthread_mutex_lock(&ws_aggcache_lock);
+	ws_aggcache_clear_pending(user);
+	pthread_mutex_unlock(&ws_aggcache_lock);
+	return 0;
+}
+
+static void ws_aggcache_on_rollback(void* user)
+{
+	sqlite3* info = user;
+	const char* file = ws_aggcache_file(info);
+
+	pthread_mutex_lock(&ws_aggcache_lock);
+	ws_aggcache_clear_pending(info);
+	if (file != NULL)
+	{
+		ws_aggcache_drop_file(file);
+	}
+	pthread_mutex_unlock(&ws_aggcache_lock);
+}
+
+void ws_aggcache_attach(sqlite3* info)
+{
+	sqlite3_commit_hook(info, ws_aggcache_on_commit, info);
+	sqlite3_rollback_hook(info, ws_aggcache_on_rollback, info);
+}
@@ -0,0 +1,77 @@
+#ifndef WS_AGGCACHE_H
+#define WS_AGGCACHE_H
+
+#include "ws_store.h"
+
+/*
+	Cache of aggregate range queries on WeatherData, used by ws_store_query_range() and
+	ws_store_query_range_batch() so that dashboards asking the same question over and over
+	don't scan the table each time.
+
+	Each entry is the per bucket count, sum, min and max of a set of metrics over a range,
+	so MIN, MAX, AVG, SUM and COUNT queries of the same range share an entry. Entries are
+	keyed by database file, metrics, range and bucket size: queries must match exactly, so
+	a dashboard gets hits by rounding its range to its bucket size. Records stored through
+	ws_store are added to the entries whose range they fall in, updating just the bucket
+	they belong to.
+
+	Only the main database is cached, and only if it is a file. The cache is shared by every
+	connection (and thread) to a file, and is dropped when a connection rolls back or the
+	tables are dropped. Writes made other than through ws_store_add_weather_record() and
+	ws_store_add_packed_records() (such as by another process) are not seen.
+*/
+
+// Most entries kept at once, and most memory used by them. The least recently used are dropped first.
+#define WS_AGGCACHE_ENTRIES 64
+#define WS_AGGCACHE_BYTES (4 * 1024 * 1024)
+
+/**
+	Returns 1 if the query can be answered from the cache.
+*/
+int ws_aggcache_cacheable(const ws_store_range_query* query);
+
+/**
+	Answers a query from the cache, first filling an entry from the database if needed.
+	Rows are passed to the callback in the order and number the query asks for.
+
+	Parameters:
+		info 		The database
+		query		The query, which must be cacheable
+		callback	Called for each row
+		user		Passed to the callback
+
+	Return:
+		- Any error from filling the entry
+*/
+int ws_aggcache_query(sqlite3* info, const ws_store_range_query* query, ws_store_row_cb callback, void* user);
+
+/**
+	Returns 1 if a record with the given RecordDateTime would be added to any entry, so the
+	caller knows whether to check for a record it replaces.
+*/
+int ws_aggcache_covers(sqlite3* info, const char* date);
+
+/**
+	Adds a stored record to the entries covering it.
+
+	Parameters:
+		info 		The database it was stored in
+		date		Its RecordDateTime
+		values		The value of each metric, NAN for NULL
+		replaced	Non zero if it replaced a record, whose values are no longer known -
+					the entries covering it are dropped
+*/
+void ws_aggcache_add(sqlite3* info, const char* date, const double* values, int replaced);
+
+/**
+	Drops every entry for the database's file.
+*/
+void ws_aggcache_invalidate(sqlite3* info);
+
+/**
+	Hooks the cache up to a connection, so it is dropped when the connection rolls back.
+	Called by ws_store_open_db().
+*/
+void ws_aggcache_attach(sqlite3* info);
+
+#endif
@@ -0,0 +1,202 @@
+#include "ws_anomaly.h"
+#include <math.h>
+#include <string.h>
+
+// Scales the median absolute deviation to be comparable to a standard deviation
+#define WS_ANOMALY_MAD_SCALE 1.4826
+
+void ws_anomaly_default_config(ws_anomaly_config* config)
+{
+	memset(config, 0, sizeof(ws_anomaly_config));
+
+	config->metrics = WS_METRIC_BIT(WS_METRIC_INDOOR_HUMIDITY) | WS_METRIC_BIT(WS_METRIC_OUTDOOR_HUMIDITY) |
+	                  WS_METRIC_BIT(WS_METRIC_INDOOR_TEMPERATURE) | WS_METRIC_BIT(WS_METRIC_OUTDOOR_TEMPERATURE) |
+	                  WS_METRIC_BIT(WS_METRIC_DEW_POINT) | WS_METRIC_BIT(WS_METRIC_ABSOLUTE_PRESSURE) |
+	                  WS_METRIC_BIT(WS_METRIC_WIND_SPEED) | WS_METRIC_BIT(WS_METRIC_GUST_SPEED);
+
+	// Wind changes too quickly for a rate limit to mean anything, so it is left at 0 (no limit)
+	config->max_rate[WS_METRIC_INDOOR_HUMIDITY] = 2;
+	config->max_rate[WS_METRIC_OUTDOOR_HUMIDITY] = 2;
+	config->max_rate[WS_METRIC_INDOOR_TEMPERATURE] = 0.25;
+	config->max_rate[WS_METRIC_OUTDOOR_TEMPERATURE] = 0.25;
+	config->max_rate[WS_METRIC_DEW_POINT] = 0.25;
+	config->max_rate[WS_METRIC_ABSOLUTE_PRESSURE] = 0.2;
+
+	config->min_spread[WS_METRIC_INDOOR_HUMIDITY] = 2;
+	config->min_spread[WS_METRIC_OUTDOOR_HUMIDITY] = 2;
+	config->min_spread[WS_METRIC_INDOOR_TEMPERATURE] = 0.5;
+	config->min_spread[WS_METRIC_OUTDOOR_TEMPERATURE] = 0.5;
+	config->min_spread[WS_METRIC_DEW_POINT] = 0.5;
+	config->min_spread[WS_METRIC_ABSOLUTE_PRESSURE] = 0.5;
+	config->min_spread[WS_METRIC_WIND_SPEED] = 1;
+	config->min_spread[WS_METRIC_GUST_SPEED] = 1.5;
+
+	config->z_limit = 6;
+	config->mad_limit = 8;
+	config->alpha = 0.05;
+}
+
+void ws_anomaly_init(ws_anomaly_detector* detector, const ws_anomaly_config* config)
+{
+	memset(detector, 0, sizeof(ws_anomaly_detector));
+
+	if (config != NULL)
+	{
+		detector->config = *config;
+	} else {
+		ws_anomaly_default_config(&detector->config);
+	}
+}
+
+static double ws_anomaly_value(const ws_packed_record* record, int metric)
+{
+	switch (metric)
+	{
+		case WS_METRIC_INDOOR_HUMIDITY: return ws_packed_indoor_humidity(record);
+		case WS_METRIC_OUTDOOR_HUMIDITY: return ws_packed_outdoor_humidity(record);
+		case WS_METRIC_INDOOR_TEMPERATURE: return ws_packed_indoor_temperature(record);
+		case WS_METRIC_OUTDOOR_TEMPERATURE: return ws_packed_outdoor_temperature(record);
+		case WS_METRIC_DEW_POINT: return ws_packed_dew_point(record);
+		case WS_METRIC_ABSOLUTE_PRESSURE: return ws_packed_absolute_pressure(record);
+		case WS_METRIC_WIND_SPEED: return ws_packed_wind_speed(record);
+		case WS_METRIC_GUST_SPEED: return ws_packed_gust_speed(record);
+		case WS_METRIC_WIND_DIRECTION: return ws_packed_wind_direction(record);
+		case WS_METRIC_TOTAL_RAIN: return ws_packed_total_rain(record);
+		default: return NAN;
+	}
+}
+
+/* Median of a small array, which is sorted in place */
+static double ws_anomaly_median(double* values, int count)
+{
+	for (int i = 1; i < count; i++)
+	{
+		double value = values[i];
+		int j = i - 1;
+		while (j >= 0 && values[j] > value)
+		{
+			values[j + 1] = values[j];
+			j--;
+		}
+		values[j + 1] = value;
+	}
+
+	return (count % 2) ? values[count / 2] : 0.5 * (values[count / 2 - 1] + values[count / 2]);
+}
+
+/* Checks a single value against the rolling statistics of its metric, then adds it to them */
+static int ws_anomaly_check(ws_anomaly_detector* detector, int metric, double value, double minutes)
+{
+	const ws_anomaly_config* config = &detector->config;
+	ws_anomaly_metric* state = &detector->metrics[metric];
+	double spread = config->min_spread[metric];
+	int suspect = 0;
+
+	// Rate of change since the last value that wasn't suspicious
+	if (state->count > 0 && config->max_rate[metric] > 0)
+	{
+		suspect |= fabs(value - state->last_value) > config->max_rate[metric] * minutes;
+	}
+
+	if (state->count >= WS_ANOMALY_WINDOW)
+	{
+		double sd = sqrt(state->variance);
+		suspect |= fabs(value - state->mean) > config->z_limit * ((sd > spread) ? sd : spread);
+
+		double sorted[WS_ANOMALY_WINDOW];
+		memcpy(sorted, state->window, sizeof(sorted));
+		double median = ws_anomaly_median(sorted, WS_ANOMALY_WINDOW);
+
+		for (int i = 0; i < WS_ANOMALY_WINDOW; i++)
+		{
+			sorted[i] = fabs(sorted[i] - median);
+		}
+
+		double mad = WS_ANOMALY_MAD_SCALE * ws_anomaly_median(sorted, WS_ANOMALY_WINDOW);
+		suspect |= fabs(value - median) > config->mad_limit * ((mad > spread) ? mad : spread);
+	}
+
+	// Exponentially weighted mean and variance
+	if (state->count == 0)
+	{
+		state->mean = value;
+		state->variance = 0;
+	} else {
+		double diff = value - state->mean;
+		double increment = config->alpha * diff;
+		state->mean += increment;
+		state->variance = (1 - config->alpha) * (state->variance + diff * increment);
+	}
+
+	state->window[state->next] = value;
+	state->next = (state->next + 1) % WS_ANOMALY_WINDOW;
+	if (state->count < WS_ANOMALY_WINDOW)
+	{
+		state->count++;
+	}
+
+	// A spike shouldn't make the record after it look like a spike too
+	if (!suspect)
+	{
+		state->last_value = value;
+		state->last_minutes = 0;
+	}
+
+	return suspect;
+}
+
+uint32_t ws_anomaly_update(ws_anomaly_detector* detector, ws_packed_record* record)
+{
+	double minutes = 30;
+	if (detector->has_last && record->epoch != 0 && detector->last_epoch != 0)
+	{
+		minutes = (record->epoch - detector->last_epoch) / 60.0;
+		minutes = (minutes < 1) ? 1 : minutes;
+	}
+
+	detector->has_last = 1;
+	detector->last_epoch = record->epoch;
+
+	uint32_t suspects = 0;
+	for (int m = 0; m < WS_METRIC_COUNT; m++)
+	{
+		if (!(detector->config.metrics & WS_METRIC_BIT(m)))
+		{
+			continue;
+		}
+
+		double value = ws_anomaly_value(record, m);
+		if (isnan(value))
+		{
+			continue;
+		}
+
+		ws_anomaly_metric* state = &detector->metrics[m];
+		state->last_minutes += minutes;
+
+		if (ws_anomaly_check(detector, m, value, state->last_minutes))
+		{
+			suspects |= WS_METRIC_BIT(m);
+		}
+	}
+
+	record->flags = suspects ? (record->flags | WS_PACKED_SUSPECT) : (record->flags & ~WS_PACKED_SUSPECT);
+	return suspects;
+}
+
+int ws_anomaly_update_batch(ws_anomaly_detector* detector, ws_packed_record* records, int count, uint32_t* suspects)
+{
+	int suspicious = 0;
+	for (int i = 0; i < count; i++)
+	{
+		uint32_t result = ws_anomaly_update(detector, &records[i]);
+		suspicious += (result != 0);
+
+		if (suspects != NULL)
+		{
+			suspects[i] = result;
+		}
+	}
+
+	return suspicious;
+}
@@ -0,0 +1,93 @@
+#ifndef WS_ANOMALY_H
+#define WS_ANOMALY_H
+
+#include "ws.h"
+#include "ws_store.h"
+
+/**
+	Number of recent values kept per metric for the median absolute deviation. Odd, so that
+	the median is a single value.
+*/
+#define WS_ANOMALY_WINDOW 15
+
+/**
+	Settings for the anomaly detector. A value is suspicious if it breaks any of the limits.
+*/
+typedef struct
+{
+	uint32_t metrics;						// WS_METRIC_BIT()s of the metrics to check
+	double max_rate[WS_METRIC_COUNT];		// Largest change per minute from the previous record
+	double min_spread[WS_METRIC_COUNT];		// Lowest standard deviation / MAD used, so flat data doesn't make every change suspicious
+	double z_limit;							// Most standard deviations a value can be from the rolling mean
+	double mad_limit;						// Most (scaled) median absolute deviations a value can be from the rolling median
+	double alpha;							// Weight of each new value in the rolling mean and variance
+} ws_anomaly_config;
+
+/**
+	Rolling statistics of a single metric
+*/
+typedef struct
+{
+	double mean;
+	double variance;
+	double window[WS_ANOMALY_WINDOW];
+	int count;
+	int next;
+	double last_value;					// The last value that wasn't suspicious
+	double last_minutes;				// Minutes since last_value
+} ws_anomaly_metric;
+
+/**
+	Online anomaly detector. Records must be given to it in time order. Each update is O(1).
+*/
+typedef struct
+{
+	ws_anomaly_config config;
+	ws_anomaly_metric metrics[WS_METRIC_COUNT];
+	int64_t last_epoch;
+	int has_last;
+} ws_anomaly_detector;
+
+
+/**
+	Fills out the default settings
+*/
+void ws_anomaly_default_config(ws_anomaly_config* config);
+
+/**
+	Initialises a detector.
+
+	Parameters:
+		detector 		The detector
+		config			The settings, or NULL for the defaults
+*/
+void ws_anomaly_init(ws_anomaly_detector* detector, const ws_anomaly_config* config);
+
+/**
+	Checks the next record and adds it to the rolling statistics. Suspicious records have
+	WS_PACKED_SUSPECT set, but are otherwise left alone.
+
+	Parameters:
+		detector 		The detector
+		record			The record. If its epoch is 0 it is assumed to be 30 minutes after the previous one.
+
+	Return:
+		WS_METRIC_BIT()s of the metrics that were suspicious, 0 if none were.
+*/
+uint32_t ws_anomaly_update(ws_anomaly_detector* detector, ws_packed_record* record);
+
+/**
+	Runs ws_anomaly_update() over an array of records in time order.
+
+	Parameters:
+		detector 		The detector
+		records			The records
+		count			The number of records
+		suspects		Optional (may be NULL), filled with the result of ws_anomaly_update() for each record
+
+	Return:
+		The number of suspicious records
+*/
+int ws_anomaly_update_batch(ws_anomaly_detector* detector, ws_packed_record* records, int count, uint32_t* suspects);
+
+#endif
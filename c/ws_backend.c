@@ -0,0 +1,491 @@
+#include "ws_backend.h"
+#include "ws_shard.h"
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct
+{
+	time_t time;
+	int found;
+} ws_backend_latest;
+
+static int ws_backend_latest_row(const ws_store_row* row, void* user)
+{
+	ws_backend_latest* latest = user;
+	latest->time = row->time;
+	latest->found = 1;
+	return 1;
+}
+
+/* The records in a range, with none of their metrics, newest first if latest is set and then only the one */
+static void ws_backend_times_query(time_t from, time_t to, int latest, ws_store_range_query* query)
+{
+	memset(query, 0, sizeof(ws_store_range_query));
+	query->from = from;
+	query->to = to;
+	query->limit = latest ? 1 : 0;
+	query->descending = latest;
+	query->aggregate = WS_AGG_NONE;
+}
+
+typedef struct
+{
+	ws_backend_time_cb callback;
+	void* user;
+} ws_backend_times;
+
+static int ws_backend_time_row(const ws_store_row* row, void* user)
+{
+	ws_backend_times* times = user;
+	return times->callback(row->time, times->user);
+}
+
+/* SQLite, with the records in WeatherData */
+
+static int ws_backend_sqlite_close(ws_backend* backend)
+{
+	sqlite3* info = backend->state;
+	return ws_store_close_db(&info);
+}
+
+static int ws_backend_sqlite_reset(ws_backend* backend)
+{
+	sqlite3* info = backend->state;
+	return ws_store_prepare_db(&info);
+}
+
+static int ws_backend_sqlite_begin(ws_backend* backend)
+{
+	sqlite3* info = backend->state;
+	return ws_store_begin_transaction(&info);
+}
+
+static int ws_backend_sqlite_commit(ws_backend* backend)
+{
+	sqlite3* info = backend->state;
+	return ws_store_end_transaction(&info);
+}
+
+static int ws_backend_sqlite_rollback(ws_backend* backend)
+{
+	// A commit that failed has already been rolled back
+	sqlite3* info = backend->state;
+	if (sqlite3_get_autocommit(info))
+	{
+		return WS_SUCCESS;
+	}
+
+	char sql[] = "ROLLBACK";
+	return ws_store_query(&info, sql, sizeof(sql) / sizeof(sql[0]));
+}
+
+static int ws_backend_sqlite_append(ws_backend* backend, const ws_packed_record* records, int count)
+{
+	return ws_store_add_packed_records(backend->state, records, count);
+}
+
+static int ws_backend_sqlite_tag_anomaly(ws_backend* backend, time_t record_time, uint32_t metrics)
+{
+	return ws_store_tag_anomaly(backend->state, record_time, metrics);
+}
+
+static int ws_backend_sqlite_latest_time(ws_backend* backend, time_t from, time_t to, time_t* latest, int* found)
+{
+	ws_store_range_query query;
+	ws_backend_times_query(from, to, 1, &query);
+
+	ws_backend_latest result = { 0, 0 };
+	int status = ws_store_query_range(backend->state, &query, ws_backend_latest_row, &result);
+
+	*latest = result.time;
+	*found = result.found;
+	return status;
+}
+
+static int ws_backend_sqlite_query_times(ws_backend* backend, time_t from, time_t to, ws_backend_time_cb callback, void* user)
+{
+	ws_store_range_query query;
+	ws_backend_times_query(from, to, 0, &query);
+
+	ws_backend_times times = { callback, user };
+	return ws_store_query_range(backend->state, &query, ws_backend_time_row, &times);
+}
+
+static int ws_backend_sqlite_load_journal(ws_backend* backend, ws_store_journal* journal, int* found)
+{
+	return ws_store_load_journal(backend->state, journal, found);
+}
+
+static int ws_backend_sqlite_save_journal(ws_backend* backend, const ws_store_journal* journal)
+{
+	return ws_store_save_journal(backend->state, journal);
+}
+
+static int ws_backend_sqlite_clear_journal(ws_backend* backend)
+{
+	return ws_store_clear_journal(backend->state);
+}
+
+int ws_backend_open_sqlite(ws_backend* backend)
+{
+	memset(backend, 0, sizeof(ws_backend));
+
+	sqlite3* info = NULL;
+	int status = ws_store_open_db(&info);
+	if (status != WS_SUCCESS)
+	{
+		return status;
+	}
+
+	status = ws_store_create_tables(&info);
+	if (status != WS_SUCCESS)
+	{
+		ws_store_close_db(&info);
+		return status;
+	}
+
+	backend->name = "sqlite";
+	backend->state = info;
+	backend->close = ws_backend_sqlite_close;
+	backend->reset = ws_backend_sqlite_reset;
+	backend->begin = ws_backend_sqlite_begin;
+	backend->commit = ws_backend_sqlite_commit;
+	backend->rollback = ws_backend_sqlite_rollback;
+	backend->append = ws_backend_sqlite_append;
+	backend->tag_anomaly = ws_backend_sqlite_tag_anomaly;
+	backend->latest_time = ws_backend_sqlite_latest_time;
+	backend->query_times = ws_backend_sqlite_query_times;
+	backend->load_journal = ws_backend_sqlite_load_journal;
+	backend->save_journal = ws_backend_sqlite_save_journal;
+	backend->clear_journal = ws_backend_sqlite_clear_journal;
+	return WS_SUCCESS;
+}
+
+/* Segmented log. Nothing is written until commit, so begin has nothing to do. */
+
+static int ws_backend_log_close(ws_backend* backend)
+{
+	int status = ws_seglog_close(backend->state);
+	free(backend->state);
+	backend->state = NULL;
+	return status;
+}
+
+static int ws_backend_log_reset(ws_backend* backend)
+{
+	return ws_seglog_reset(backend->state);
+}
+
+static int ws_backend_log_begin(ws_backend* backend)
+{
+	return WS_SUCCESS;
+}
+
+static int ws_backend_log_commit(ws_backend* backend)
+{
+	return ws_seglog_commit(backend->state);
+}
+
+static int ws_backend_log_rollback(ws_backend* backend)
+{
+	ws_seglog_rollback(backend->state);
+	return WS_SUCCESS;
+}
+
+static int ws_backend_log_append(ws_backend* backend, const ws_packed_record* records, int count)
+{
+	return ws_seglog_append(backend->state, records, count);
+}
+
+static int ws_backend_log_tag_anomaly(ws_backend* backend, time_t record_time, uint32_t metrics)
+{
+	int found;
+	return (metrics != 0) ? ws_seglog_mark_suspect(backend->state, record_time, &found) : WS_SUCCESS;
+}
+
+/* Records are passed oldest first, so the last one is the latest */
+static int ws_backend_log_latest_record(const ws_packed_record* record, void* user)
+{
+	ws_backend_latest* latest = user;
+	latest->time = record->epoch;
+	latest->found = 1;
+	return 0;
+}
+
+static int ws_backend_log_latest_time(ws_backend* backend, time_t from, time_t to, time_t* latest, int* found)
+{
+	ws_backend_latest result = { 0, 0 };
+	int status = ws_seglog_query(backend->state, from, to, ws_backend_log_latest_record, &result);
+
+	*latest = result.time;
+	*found = result.found;
+	return status;
+}
+
+static int ws_backend_log_time_record(const ws_packed_record* record, void* user)
+{
+	ws_backend_times* times = user;
+	return times->callback(record->epoch, times->user);
+}
+
+static int ws_backend_log_query_times(ws_backend* backend, time_t from, time_t to, ws_backend_time_cb callback, void* user)
+{
+	ws_backend_times times = { callback, user };
+	return ws_seglog_query(backend->state, from, to, ws_backend_log_time_record, &times);
+}
+
+static int ws_backend_log_load_journal(ws_backend* backend, ws_store_journal* journal, int* found)
+{
+	return ws_seglog_load_journal(backend->state, journal, found);
+}
+
+static int ws_backend_log_save_journal(ws_backend* backend, const ws_store_journal* journal)
+{
+	return ws_seglog_save_journal(backend->state, journal);
+}
+
+static int ws_backend_log_clear_journal(ws_backend* backend)
+{
+	return ws_seglog_clear_journal(backend->state);
+}
+
+int ws_backend_open_log(ws_backend* backend, const char* directory)
+{
+	memset(backend, 0, sizeof(ws_backend));
+
+	ws_seglog* log = malloc(sizeof(ws_seglog));
+	if (log == NULL)
+	{
+		return WS_ERR_FILE_IO;
+	}
+
+	int status = ws_seglog_open(log, directory);
+	if (status != WS_SUCCESS)
+	{
+		free(log);
+		return status;
+	}
+
+	backend->name = "log";
+	backend->state = log;
+	backend->close = ws_backend_log_close;
+	backend->reset = ws_backend_log_reset;
+	backend->begin = ws_backend_log_begin;
+	backend->commit = ws_backend_log_commit;
+	backend->rollback = ws_backend_log_rollback;
+	backend->append = ws_backend_log_append;
+	backend->tag_anomaly = ws_backend_log_tag_anomaly;
+	backend->latest_time = ws_backend_log_latest_time;
+	backend->query_times = ws_backend_log_query_times;
+	backend->load_journal = ws_backend_log_load_journal;
+	backend->save_journal = ws_backend_log_save_journal;
+	backend->clear_journal = ws_backend_log_clear_journal;
+	return WS_SUCCESS;
+}
+
+/* Month databases. Records are held until commit, so each month is written in one transaction. 
+   Anomalies are held with them, so that they are only tagged once their records are stored. */
+
+typedef struct
+{
+	time_t record_time;
+	uint32_t metrics;
+} ws_backend_shard_tag;
+
+typedef struct
+{
+	ws_packed_record* records;
+	int count;
+	int capacity;
+
+	ws_backend_shard_tag* tags;
+	int tag_count;
+	int tag_capacity;
+
+	ws_store_journal journal;
+	int journal_change;					// 0 for none, 1 to save the journal, 2 to remove it
+} ws_backend_shard_state;
+
+static int ws_backend_shard_close(ws_backend* backend)
+{
+	ws_backend_shard_state* state = backend->state;
+	free(state->records);
+	free(state->tags);
+	free(state);
+	backend->state = NULL;
+	return ws_shard_close();
+}
+
+static int ws_backend_shard_rollback(ws_backend* backend)
+{
+	ws_backend_shard_state* state = backend->state;
+	state->count = 0;
+	state->tag_count = 0;
+	state->journal_change = 0;
+	return WS_SUCCESS;
+}
+
+static int ws_backend_shard_reset(ws_backend* backend)
+{
+	return ws_backend_shard_rollback(backend);
+}
+
+static int ws_backend_shard_begin(ws_backend* backend)
+{
+	return WS_SUCCESS;
+}
+
+static int ws_backend_shard_commit(ws_backend* backend)
+{
+	ws_backend_shard_state* state = backend->state;
+	int status = WS_SUCCESS;
+
+	if (state->count > 0)
+	{
+		status = ws_shard_add_packed_records(state->records, state->count);
+	}
+
+	for (int i = 0; i < state->tag_count && status == WS_SUCCESS; i++)
+	{
+		status = ws_shard_tag_anomaly(state->tags[i].record_time, state->tags[i].metrics);
+	}
+
+	// The journal can only move on once the records it covers are stored
+	if (status == WS_SUCCESS && state->journal_change == 1)
+	{
+		status = ws_shard_save_journal(&state->journal);
+	} else if (status == WS_SUCCESS && state->journal_change == 2) {
+		status = ws_shard_clear_journal();
+	}
+
+	state->count = 0;
+	state->tag_count = 0;
+	state->journal_change = 0;
+	return status;
+}
+
+static int ws_backend_shard_append(ws_backend* backend, const ws_packed_record* records, int count)
+{
+	ws_backend_shard_state* state = backend->state;
+
+	if (state->count + count > state->capacity)
+	{
+		int capacity = (state->capacity > 0) ? state->capacity : 256;
+		while (capacity < state->count + count)
+		{
+			capacity *= 2;
+		}
+
+		ws_packed_record* grown = realloc(state->records, capacity * sizeof(ws_packed_record));
+		if (grown == NULL)
+		{
+			return WS_ERR_FILE_IO;
+		}
+
+		state->records = grown;
+		state->capacity = capacity;
+	}
+
+	memcpy(state->records + state->count, records, count * sizeof(ws_packed_record));
+	state->count += count;
+	return WS_SUCCESS;
+}
+
+static int ws_backend_shard_tag_anomaly(ws_backend* backend, time_t record_time, uint32_t metrics)
+{
+	ws_backend_shard_state* state = backend->state;
+
+	if (state->tag_count == state->tag_capacity)
+	{
+		int capacity = (state->tag_capacity > 0) ? state->tag_capacity * 2 : 16;
+		ws_backend_shard_tag* grown = realloc(state->tags, capacity * sizeof(ws_backend_shard_tag));
+		if (grown == NULL)
+		{
+			return WS_ERR_FILE_IO;
+		}
+
+		state->tags = grown;
+		state->tag_capacity = capacity;
+	}
+
+	state->tags[state->tag_count].record_time = record_time;
+	state->tags[state->tag_count].metrics = metrics;
+	state->tag_count++;
+	return WS_SUCCESS;
+}
+
+static int ws_backend_shard_latest_time(ws_backend* backend, time_t from, time_t to, time_t* latest, int* found)
+{
+	ws_store_range_query query;
+	ws_backend_times_query(from, to, 1, &query);
+
+	ws_backend_latest result = { 0, 0 };
+	int status = ws_shard_query_range(&query, ws_backend_latest_row, &result);
+
+	*latest = result.time;
+	*found = result.found;
+	return status;
+}
+
+static int ws_backend_shard_query_times(ws_backend* backend, time_t from, time_t to, ws_backend_time_cb callback, void* user)
+{
+	ws_store_range_query query;
+	ws_backend_times_query(from, to, 0, &query);
+
+	ws_backend_times times = { callback, user };
+	return ws_shard_query_range(&query, ws_backend_time_row, &times);
+}
+
+static int ws_backend_shard_load_journal(ws_backend* backend, ws_store_journal* journal, int* found)
+{
+	return ws_shard_load_journal(journal, found);
+}
+
+static int ws_backend_shard_save_journal(ws_backend* backend, const ws_store_journal* journal)
+{
+	ws_backend_shard_state* state = backend->state;
+	state->journal = *journal;
+	state->journal_change = 1;
+	return WS_SUCCESS;
+}
+
+static int ws_backend_shard_clear_journal(ws_backend* backend)
+{
+	ws_backend_shard_state* state = backend->state;
+	state->journal_change = 2;
+	return WS_SUCCESS;
+}
+
+int ws_backend_open_shard(ws_backend* backend, const char* directory)
+{
+	memset(backend, 0, sizeof(ws_backend));
+
+	ws_backend_shard_state* state = calloc(1, sizeof(ws_backend_shard_state));
+	if (state == NULL)
+	{
+		return WS_ERR_FILE_IO;
+	}
+
+	int status = ws_shard_open(directory);
+	if (status != WS_SUCCESS)
+	{
+		free(state);
+		return status;
+	}
+
+	backend->name = "shard";
+	backend->state = state;
+	backend->close = ws_backend_shard_close;
+	backend->reset = ws_backend_shard_reset;
+	backend->begin = ws_backend_shard_begin;
+	backend->commit = ws_backend_shard_commit;
+	backend->rollback = ws_backend_shard_rollback;
+	backend->append = ws_backend_shard_append;
+	backend->tag_anomaly = ws_backend_shard_tag_anomaly;
+	backend->latest_time = ws_backend_shard_latest_time;
+	backend->query_times = ws_backend_shard_query_times;
+	backend->load_journal = ws_backend_shard_load_journal;
+	backend->save_journal = ws_backend_shard_save_journal;
+	backend->clear_journal = ws_backend_shard_clear_journal;
+	return WS_SUCCESS;
+}
@@ -0,0 +1,85 @@
+#ifndef WS_BACKEND_H
+#define WS_BACKEND_H
+
+#include "ws.h"
+#include "ws_store.h"
+#include "ws_seglog.h"
+
+/**
+	Called with the time of each record by a backend's query_times. Return 0 to carry on, anything
+	else to stop.
+*/
+typedef int (*ws_backend_time_cb)(time_t record_time, void* user);
+
+/**
+	Where downloaded records are written. Every function returns WS_SUCCESS or a WS_ERR_
+	code, and takes the backend itself as its first argument.
+
+	Records and the journal written between begin and commit are committed together.
+*/
+typedef struct ws_backend
+{
+	const char* name;
+	void* state;
+
+	int (*close)(struct ws_backend* backend);
+
+	// Removes everything stored. Downloads don't, as records downloaded again replace those stored.
+	int (*reset)(struct ws_backend* backend);
+
+	int (*begin)(struct ws_backend* backend);
+	int (*commit)(struct ws_backend* backend);
+	int (*rollback)(struct ws_backend* backend);
+
+	// Records must be appended oldest first
+	int (*append)(struct ws_backend* backend, const ws_packed_record* records, int count);
+	int (*tag_anomaly)(struct ws_backend* backend, time_t record_time, uint32_t metrics);
+
+	// Gets the time of the latest record stored from from (inclusive) to to (exclusive). found is 0 if there is none.
+	int (*latest_time)(struct ws_backend* backend, time_t from, time_t to, time_t* latest, int* found);
+
+	// Passes the time of every record stored from from (inclusive) to to (exclusive) to a callback, oldest first
+	int (*query_times)(struct ws_backend* backend, time_t from, time_t to, ws_backend_time_cb callback, void* user);
+
+	int (*load_journal)(struct ws_backend* backend, ws_store_journal* journal, int* found);
+	int (*save_journal)(struct ws_backend* backend, const ws_store_journal* journal);
+	int (*clear_journal)(struct ws_backend* backend);
+} ws_backend;
+
+
+/**
+	Opens WeatherDB.sqlite as a backend, creating its tables if needed.
+
+	Return:
+		- Any error from ws_store_open_db() or ws_store_create_tables()
+*/
+int ws_backend_open_sqlite(ws_backend* backend);
+
+/**
+	Opens a segmented log (see ws_seglog.h) as a backend. Anomalies are kept as the
+	WS_PACKED_SUSPECT flag of the record.
+
+	Parameters:
+		backend 	The backend
+		directory	The directory of the log, created if needed
+
+	Return:
+		- WS_ERR_FILE_IO	The log could not be opened
+*/
+int ws_backend_open_log(ws_backend* backend, const char* directory);
+
+/**
+	Opens the month databases of a directory (see ws_shard.h) as a backend. Records and the
+	anomalies tagged on them are held until commit and then stored in their months. Resetting keeps the months already stored,
+	as they hold more history than the station, and records downloaded again replace them.
+
+	Parameters:
+		backend 	The backend
+		directory	The directory of the month databases, which must already exist
+
+	Return:
+		- Any error from ws_shard_open()
+*/
+int ws_backend_open_shard(ws_backend* backend, const char* directory);
+
+#endif
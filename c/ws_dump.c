@@ -0,0 +1,352 @@
+#include "ws_dump.h"
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define WS_DUMP_FIXED_BLOCKS (WS_RECORDS_START / WS_BLOCK_SIZE)
+
+// How many blocks are read between saves of the header
+#define WS_DUMP_SAVE_INTERVAL 64
+
+// How many times the fixed block is re-read if records keep being written while it is read
+#define WS_DUMP_MAX_FINAL_READS 4
+
+static inline int ws_dump_is_captured(const ws_dump_header* header, int block)
+{
+	return (header->captured[block / 8] >> (block % 8)) & 1;
+}
+
+static inline void ws_dump_set_captured(ws_dump_header* header, int block, int captured)
+{
+	if (captured)
+	{
+		header->captured[block / 8] |= (1 << (block % 8));
+	} else {
+		header->captured[block / 8] &= ~(1 << (block % 8));
+	}
+}
+
+static void ws_dump_init_header(ws_dump_header* header)
+{
+	memset(header, 0, sizeof(ws_dump_header));
+	memcpy(header->magic, WS_DUMP_MAGIC, 4);
+	header->version = WS_DUMP_VERSION;
+	header->block_size = WS_BLOCK_SIZE;
+	header->memory_size = WS_MEMORY_SIZE;
+}
+
+static int ws_dump_header_valid(const ws_dump_header* header)
+{
+	return memcmp(header->magic, WS_DUMP_MAGIC, 4) == 0 && header->version == WS_DUMP_VERSION &&
+	       header->block_size == WS_BLOCK_SIZE && header->memory_size == WS_MEMORY_SIZE;
+}
+
+static int ws_dump_write(int fd, const void* data, int size, off_t offset)
+{
+	const unsigned char* bytes = data;
+	while (size > 0)
+	{
+		ssize_t written = pwrite(fd, bytes, size, offset);
+		if (written <= 0)
+		{
+			return WS_ERR_FILE_IO;
+		}
+
+		bytes += written;
+		offset += written;
+		size -= written;
+	}
+
+	return WS_SUCCESS;
+}
+
+static int ws_dump_read(int fd, void* data, int size, off_t offset)
+{
+	unsigned char* bytes = data;
+	while (size > 0)
+	{
+		ssize_t got = pread(fd, bytes, size, offset);
+		if (got <= 0)
+		{
+			return WS_ERR_FILE_IO;
+		}
+
+		bytes += got;
+		offset += got;
+		size -= got;
+	}
+
+	return WS_SUCCESS;
+}
+
+/* Marks every history block from the block of address_from to the block of address_to (going
+   forwards around the circular buffer) as not captured */
+static void ws_dump_invalidate(ws_dump_header* header, int address_from, int address_to)
+{
+	int history_blocks = WS_BLOCK_COUNT - WS_DUMP_FIXED_BLOCKS;
+	int from = address_from / WS_BLOCK_SIZE - WS_DUMP_FIXED_BLOCKS;
+	int to = address_to / WS_BLOCK_SIZE - WS_DUMP_FIXED_BLOCKS;
+	int count = ((to - from) % history_blocks + history_blocks) % history_blocks + 1;
+
+	for (int i = 0; i < count; i++)
+	{
+		ws_dump_set_captured(header, WS_DUMP_FIXED_BLOCKS + (from + i) % history_blocks, 0);
+	}
+}
+
+/* Reads a block and writes it to the image. Only blocks the station may be writing to need a stable read. */
+static int ws_dump_block(ws_device *dev, int fd, ws_dump_header* header, int block, int stable)
+{
+	unsigned char data[WS_BLOCK_SIZE];
+	int read;
+	int address = block * WS_BLOCK_SIZE;
+
+	int status = stable ? ws_read_stable_block(dev, address, data, &read) : ws_read_block(dev, address, data, &read);
+	if (status != WS_SUCCESS)
+	{
+		return status;
+	}
+
+	if (read != WS_BLOCK_SIZE)
+	{
+		return WS_ERR_TOO_LITTLE_DATA_READ;
+	}
+
+	status = ws_dump_write(fd, data, WS_BLOCK_SIZE, sizeof(ws_dump_header) + address);
+	if (status != WS_SUCCESS)
+	{
+		return status;
+	}
+
+	ws_dump_set_captured(header, block, 1);
+	return WS_SUCCESS;
+}
+
+int ws_dump_capture(ws_device *dev, const char* path)
+{
+	int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0)
+	{
+		return WS_ERR_FILE_IO;
+	}
+
+	// Carry on from an unfinished capture, otherwise start again
+	ws_dump_header header;
+	struct stat st;
+	int resume = fstat(fd, &st) == 0 && st.st_size == sizeof(ws_dump_header) + WS_MEMORY_SIZE &&
+	             ws_dump_read(fd, &header, sizeof(header), 0) == WS_SUCCESS && ws_dump_header_valid(&header) &&
+	             !(header.flags & WS_DUMP_COMPLETE);
+
+	if (!resume)
+	{
+		ws_dump_init_header(&header);
+		if (ftruncate(fd, sizeof(ws_dump_header) + WS_MEMORY_SIZE) != 0)
+		{
+			close(fd);
+			return WS_ERR_FILE_IO;
+		}
+	}
+
+	int position;
+	int status = ws_latest_record_address(dev, &position);
+	if (status != WS_SUCCESS)
+	{
+		close(fd);
+		return status;
+	}
+
+	// Anything the station has written since the capture was interrupted must be read again
+	if (resume && position != header.current_pos)
+	{
+		ws_dump_invalidate(&header, header.current_pos, position);
+	}
+	header.current_pos = position;
+
+	// The history, apart from the block being written to, can't change so each block only needs capturing once
+	int since_save = 0;
+	for (int block = WS_DUMP_FIXED_BLOCKS; block < WS_BLOCK_COUNT; block++)
+	{
+		if (ws_dump_is_captured(&header, block) || block == position / WS_BLOCK_SIZE)
+		{
+			continue;
+		}
+
+		status = ws_dump_block(dev, fd, &header, block, 0);
+		if (status != WS_SUCCESS)
+		{
+			break;
+		}
+
+		if (++since_save == WS_DUMP_SAVE_INTERVAL)
+		{
+			status = ws_dump_write(fd, &header, sizeof(header), 0);
+			if (status != WS_SUCCESS)
+			{
+				break;
+			}
+			since_save = 0;
+		}
+	}
+
+	// The fixed block and the latest record are read last, and again if a record was written during the capture
+	for (int attempt = 0; status == WS_SUCCESS; attempt++)
+	{
+		if (attempt == WS_DUMP_MAX_FINAL_READS)
+		{
+			status = WS_ERR_UNSTABLE_BLOCK;
+			break;
+		}
+
+		for (int block = 0; block < WS_DUMP_FIXED_BLOCKS && status == WS_SUCCESS; block++)
+		{
+			status = ws_dump_block(dev, fd, &header, block, 1);
+		}
+
+		int new_position = position;
+		if (status == WS_SUCCESS)
+		{
+			status = ws_latest_record_address(dev, &new_position);
+		}
+
+		if (status != WS_SUCCESS)
+		{
+			break;
+		}
+
+		if (new_position != position)
+		{
+			ws_dump_invalidate(&header, position, new_position);
+			position = new_position;
+			header.current_pos = position;
+		}
+
+		for (int block = WS_DUMP_FIXED_BLOCKS; block < WS_BLOCK_COUNT && status == WS_SUCCESS; block++)
+		{
+			if (!ws_dump_is_captured(&header, block))
+			{
+				status = ws_dump_block(dev, fd, &header, block, block == position / WS_BLOCK_SIZE);
+			}
+		}
+
+		// Done once the write position didn't move while the fixed block was being read
+		int final_position = position;
+		if (status == WS_SUCCESS)
+		{
+			status = ws_latest_record_address(dev, &final_position);
+		}
+
+		if (status == WS_SUCCESS && final_position == position)
+		{
+			header.flags |= WS_DUMP_COMPLETE;
+			header.captured_at = time(NULL);
+			break;
+		}
+
+		if (status == WS_SUCCESS)
+		{
+			ws_dump_invalidate(&header, position, final_position);
+			position = final_position;
+			header.current_pos = position;
+		}
+	}
+
+	// Always save the header, so that an interrupted capture can be carried on
+	int save_status = ws_dump_write(fd, &header, sizeof(header), 0);
+	if (close(fd) != 0 && save_status == WS_SUCCESS)
+	{
+		save_status = WS_ERR_FILE_IO;
+	}
+
+	return (status != WS_SUCCESS) ? status : save_status;
+}
+
+int ws_dump_load(const char* path, ws_dump_header* header, unsigned char* memory)
+{
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+	{
+		return WS_ERR_FILE_IO;
+	}
+
+	int status = ws_dump_read(fd, header, sizeof(ws_dump_header), 0);
+	if (status == WS_SUCCESS && (!ws_dump_header_valid(header) || !(header->flags & WS_DUMP_COMPLETE)))
+	{
+		status = WS_ERR_FILE_IO;
+	}
+
+	if (status == WS_SUCCESS)
+	{
+		status = ws_dump_read(fd, memory, WS_MEMORY_SIZE, sizeof(ws_dump_header));
+	}
+
+	close(fd);
+	return status;
+}
+
+int ws_dump_load_header(const char* path, ws_dump_header* header)
+{
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+	{
+		return WS_ERR_FILE_IO;
+	}
+
+	struct stat st;
+	int status = (fstat(fd, &st) == 0 && st.st_size == sizeof(ws_dump_header) + WS_MEMORY_SIZE) ? WS_SUCCESS : WS_ERR_FILE_IO;
+	if (status == WS_SUCCESS)
+	{
+		status = ws_dump_read(fd, header, sizeof(ws_dump_header), 0);
+	}
+
+	if (status == WS_SUCCESS && (!ws_dump_header_valid(header) || !(header->flags & WS_DUMP_COMPLETE)))
+	{
+		status = WS_ERR_FILE_IO;
+	}
+
+	close(fd);
+	return status;
+}
+
+void ws_dump_render_hex(const unsigned char* memory, int from, int to, FILE* out)
+{
+	static const char digits[] = "0123456789abcdef";
+
+	// "0x" + 4 digit address, then 8 "\t" + 2 digit bytes, then a newline
+	char buffer[8192];
+	const int line_length = 6 + 8 * 3 + 1;
+	int length = 0;
+
+	from -= from % 8;
+
+	for (int address = from; address < to; address += 8)
+	{
+		if (length + line_length > (int)sizeof(buffer))
+		{
+			fwrite(buffer, 1, length, out);
+			length = 0;
+		}
+
+		char* line = &buffer[length];
+		line[0] = '0';
+		line[1] = 'x';
+		line[2] = digits[(address >> 12) & 0xF];
+		line[3] = digits[(address >> 8) & 0xF];
+		line[4] = digits[(address >> 4) & 0xF];
+		line[5] = digits[address & 0xF];
+
+		for (int i = 0; i < 8; i++)
+		{
+			unsigned char byte = memory[address + i];
+			line[6 + i * 3] = '\t';
+			line[7 + i * 3] = digits[byte >> 4];
+			line[8 + i * 3] = digits[byte & 0xF];
+		}
+
+		line[line_length - 1] = '\n';
+		length += line_length;
+	}
+
+	fwrite(buffer, 1, length, out);
+}
@@ -0,0 +1,86 @@
+#ifndef WS_DUMP_H
+#define WS_DUMP_H
+
+#include <stdio.h>
+#include "ws.h"
+
+#define WS_DUMP_MAGIC "WSMI"
+#define WS_DUMP_VERSION 1
+
+#define WS_DUMP_COMPLETE 0x01
+
+/**
+	Header at the start of a memory image. It is followed by the whole of the station's
+	memory (WS_MEMORY_SIZE bytes). Values are stored in the host's byte order.
+
+	While a capture is in progress the header records which blocks have been read, so that
+	an interrupted capture can carry on from where it stopped.
+*/
+typedef struct __attribute__((packed))
+{
+	char magic[4];						// WS_DUMP_MAGIC
+	uint16_t version;					// WS_DUMP_VERSION
+	uint16_t block_size;				// WS_BLOCK_SIZE
+	uint32_t memory_size;				// WS_MEMORY_SIZE
+	int64_t captured_at;				// When the capture finished (seconds since the Unix epoch)
+	uint16_t current_pos;				// Address of the latest record when the capture finished
+	uint8_t flags;						// WS_DUMP_* flags
+	uint8_t reserved;
+	uint8_t captured[WS_BLOCK_COUNT / 8];	// Bitmap of blocks that have been read
+} ws_dump_header;
+
+
+/**
+	Captures the whole of the station's memory into an image file. If the file already holds
+	a partial capture it is carried on from where it was left, re-reading any blocks the station
+	has written to since.
+
+	The history blocks can't change while they are being read, so each is captured once with a
+	single read. The fixed block and the block being written to are read last with
+	ws_read_stable_block(), so that the image is consistent with the latest record.
+
+	Parameters:
+		dev 		The device, which must have been initialised for reading
+		path		The file to write the image to
+
+	Return:
+		- WS_ERR_FILE_IO		The image file could not be read or written
+		- Any error from ws_read_block() or ws_read_stable_block()
+*/
+int ws_dump_capture(ws_device *dev, const char* path);
+
+/**
+	Loads a complete image, for decoding offline with the usual ws_* decoding functions.
+
+	Parameters:
+		path 		The image file
+		header		Filled with the image's header
+		memory		Filled with the station's memory. Must be WS_MEMORY_SIZE bytes.
+
+	Return:
+		- WS_ERR_FILE_IO		The file could not be read, is not an image or is incomplete
+*/
+int ws_dump_load(const char* path, ws_dump_header* header, unsigned char* memory);
+
+/**
+	Reads just the header of a complete image, without loading the memory.
+
+	Return:
+		- WS_ERR_FILE_IO		The file could not be read, is not an image or is incomplete
+*/
+int ws_dump_load_header(const char* path, ws_dump_header* header);
+
+/**
+	Writes memory as hex, 8 bytes per line with the address at the start of each line (the
+	same layout as ws_print_mem_dump). Output is built up in a buffer and written in large
+	chunks.
+
+	Parameters:
+		memory 		The memory to print, starting at address 0
+		from		First address to print
+		to			Address to stop printing at
+		out			Where to write the output
+*/
+void ws_dump_render_hex(const unsigned char* memory, int from, int to, FILE* out);
+
+#endif
@@ -0,0 +1,410 @@
+#define _GNU_SOURCE
+#include "ws_feed.h"
+#include <stdio.h>
+#include <stddef.h>
+#include <math.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define WS_FEED_MAX_FRAME (sizeof(ws_feed_frame_header) + sizeof(ws_packed_record))
+
+// Bytes batched up for each write to a subscriber
+#define WS_FEED_BUFFER_SIZE 16384
+
+typedef struct
+{
+	_Atomic int64_t time;				// Time the frame is for, used to find where to replay from
+	uint8_t size;
+	uint8_t frame[WS_FEED_MAX_FRAME];
+} ws_feed_slot;
+
+typedef struct
+{
+	int fd;
+	int subscribed;
+	uint64_t cursor;					// Sequence number of the next frame to send
+
+	unsigned char in[sizeof(ws_feed_frame_header) + sizeof(int64_t)];
+	int in_length;
+
+	unsigned char out[WS_FEED_BUFFER_SIZE];
+	int out_length;
+	int out_sent;
+} ws_feed_subscriber;
+
+static pthread_mutex_t ws_feed_lock = PTHREAD_MUTEX_INITIALIZER;
+static ws_feed_slot ws_feed_history[WS_FEED_HISTORY];
+static uint64_t ws_feed_head = 0;			// Sequence number of the next frame published
+
+static ws_feed_subscriber ws_feed_subscribers[WS_FEED_MAX_SUBSCRIBERS];
+static int ws_feed_subscriber_count = 0;
+
+static pthread_t ws_feed_thread;
+static atomic_int ws_feed_serving = 0;
+static atomic_int ws_feed_wake_pending = 0;
+static int ws_feed_fd = -1;
+static int ws_feed_wake[2] = { -1, -1 };
+static char ws_feed_socket_path[sizeof(((struct sockaddr_un*)0)->sun_path)];
+
+static void ws_feed_publish(uint8_t type, int64_t time, const void* payload, uint8_t length)
+{
+	if (!atomic_load_explicit(&ws_feed_serving, memory_order_relaxed))
+	{
+		return;
+	}
+
+	ws_feed_frame_header header = { type, length };
+
+	pthread_mutex_lock(&ws_feed_lock);
+	ws_feed_slot* slot = &ws_feed_history[ws_feed_head % WS_FEED_HISTORY];
+	atomic_store_explicit(&slot->time, time, memory_order_relaxed);
+	slot->size = sizeof(header) + length;
+	memcpy(slot->frame, &header, sizeof(header));
+	memcpy(slot->frame + sizeof(header), payload, length);
+	ws_feed_head++;
+	pthread_mutex_unlock(&ws_feed_lock);
+
+	// Only the first frame since the thread last woke up needs to wake it
+	if (!atomic_exchange(&ws_feed_wake_pending, 1))
+	{
+		ssize_t written = write(ws_feed_wake[1], "", 1);
+		(void)written;
+	}
+}
+
+void ws_feed_publish_record(const ws_packed_record* record)
+{
+	ws_feed_publish(WS_FEED_RECORD, record->epoch, record, sizeof(ws_packed_record));
+}
+
+static int64_t ws_feed_epoch(ws_time time)
+{
+	if (time.year == 0 && time.month == 0 && time.day == 0)
+	{
+		return 0;
+	}
+
+	struct tm date_time;
+	memset(&date_time, 0, sizeof(date_time));
+	date_time.tm_year = time.year + 100;
+	date_time.tm_mon = time.month - 1;
+	date_time.tm_mday = time.day;
+	date_time.tm_hour = time.hour;
+	date_time.tm_min = time.minute;
+	date_time.tm_isdst = -1;
+
+	return mktime(&date_time);
+}
+
+void ws_feed_publish_extreme(int extreme, const ws_min_max* value)
+{
+	if (!atomic_load_explicit(&ws_feed_serving, memory_order_relaxed))
+	{
+		return;
+	}
+
+	ws_feed_extreme payload;
+	payload.extreme = extreme;
+	payload.min = (int32_t)lround(value->min * 10);
+	payload.max = (int32_t)lround(value->max * 10);
+	payload.min_time = ws_feed_epoch(value->min_time);
+	payload.max_time = ws_feed_epoch(value->max_time);
+
+	ws_feed_publish(WS_FEED_EXTREME, time(NULL), &payload, sizeof(payload));
+}
+
+static void ws_feed_disconnect(int index)
+{
+	close(ws_feed_subscribers[index].fd);
+	ws_feed_subscribers[index] = ws_feed_subscribers[--ws_feed_subscriber_count];
+}
+
+/* Fills a subscriber's buffer with the frames it hasn't been sent yet */
+static void ws_feed_fill(ws_feed_subscriber* subscriber)
+{
+	subscriber->out_length = 0;
+	subscriber->out_sent = 0;
+
+	pthread_mutex_lock(&ws_feed_lock);
+
+	uint64_t oldest = (ws_feed_head > WS_FEED_HISTORY) ? ws_feed_head - WS_FEED_HISTORY : 0;
+	if (subscriber->cursor < oldest)
+	{
+		ws_feed_frame_header header = { WS_FEED_GAP, sizeof(uint32_t) };
+		uint32_t lost = oldest - subscriber->cursor;
+
+		memcpy(subscriber->out, &header, sizeof(header));
+		memcpy(subscriber->out + sizeof(header), &lost, sizeof(lost));
+		subscriber->out_length = sizeof(header) + sizeof(lost);
+		subscriber->cursor = oldest;
+	}
+
+	while (subscriber->cursor < ws_feed_head && subscriber->out_length + WS_FEED_MAX_FRAME <= WS_FEED_BUFFER_SIZE)
+	{
+		const ws_feed_slot* slot = &ws_feed_history[subscriber->cursor % WS_FEED_HISTORY];
+		memcpy(subscriber->out + subscriber->out_length, slot->frame, slot->size);
+		subscriber->out_length += slot->size;
+		subscriber->cursor++;
+	}
+
+	pthread_mutex_unlock(&ws_feed_lock);
+}
+
+/* Sends a subscriber as much as it will take without blocking. Returns 0 if it has disconnected. */
+static int ws_feed_flush(ws_feed_subscriber* subscriber)
+{
+	while (subscriber->subscribed)
+	{
+		if (subscriber->out_sent == subscriber->out_length)
+		{
+			ws_feed_fill(subscriber);
+			if (subscriber->out_length == 0)
+			{
+				return 1;
+			}
+		}
+
+		ssize_t sent = send(subscriber->fd, subscriber->out + subscriber->out_sent, subscriber->out_length - subscriber->out_sent,
+		                    MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (sent < 0)
+		{
+			return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+		}
+
+		subscriber->out_sent += sent;
+	}
+
+	return 1;
+}
+
+/* Finds the first frame kept for a time at or after from */
+static uint64_t ws_feed_replay_from(int64_t from)
+{
+	pthread_mutex_lock(&ws_feed_lock);
+	uint64_t head = ws_feed_head;
+	pthread_mutex_unlock(&ws_feed_lock);
+
+	if (from == WS_FEED_LIVE)
+	{
+		return head;
+	}
+
+	// Scanned without the lock, so publishing never waits for it. A frame published during the
+	// scan only overwrites an older one, so at worst the cursor lands on a frame that has since
+	// been dropped, and ws_feed_fill() sends a gap and carries on from the oldest frame kept.
+	uint64_t oldest = (head > WS_FEED_HISTORY) ? head - WS_FEED_HISTORY : 0;
+	for (uint64_t sequence = oldest; sequence < head; sequence++)
+	{
+		if (atomic_load_explicit(&ws_feed_history[sequence % WS_FEED_HISTORY].time, memory_order_relaxed) >= from)
+		{
+			return sequence;
+		}
+	}
+
+	return head;
+}
+
+/* Reads subscription requests. Returns 0 if the subscriber has disconnected or sent something else. */
+static int ws_feed_receive(ws_feed_subscriber* subscriber)
+{
+	for (;;)
+	{
+		ssize_t got = recv(subscriber->fd, subscriber->in + subscriber->in_length, sizeof(subscriber->in) - subscriber->in_length, MSG_DONTWAIT);
+		if (got == 0)
+		{
+			return 0;
+		}
+
+		if (got < 0)
+		{
+			return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+		}
+
+		subscriber->in_length += got;
+		if (subscriber->in_length < (int)sizeof(subscriber->in))
+		{
+			continue;
+		}
+
+		ws_feed_frame_header header;
+		int64_t from;
+		memcpy(&header, subscriber->in, sizeof(header));
+		memcpy(&from, subscriber->in + sizeof(header), sizeof(from));
+		subscriber->in_length = 0;
+
+		if (header.type != WS_FEED_SUBSCRIBE || header.length != sizeof(from))
+		{
+			return 0;
+		}
+
+		// Subscribing again starts again from the new time, once the frames already batched up are sent
+		subscriber->cursor = ws_feed_replay_from(from);
+		subscriber->subscribed = 1;
+	}
+}
+
+static void ws_feed_accept(void)
+{
+	int fd = accept4(ws_feed_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (fd < 0)
+	{
+		return;
+	}
+
+	if (ws_feed_subscriber_count == WS_FEED_MAX_SUBSCRIBERS)
+	{
+		close(fd);
+		return;
+	}
+
+	ws_feed_subscriber* subscriber = &ws_feed_subscribers[ws_feed_subscriber_count++];
+	memset(subscriber, 0, offsetof(ws_feed_subscriber, out));
+	subscriber->fd = fd;
+	subscriber->out_length = subscriber->out_sent = 0;
+}
+
+static void* ws_feed_loop(void* arg)
+{
+	struct pollfd fds[2 + WS_FEED_MAX_SUBSCRIBERS];
+
+	while (atomic_load(&ws_feed_serving))
+	{
+		fds[0].fd = ws_feed_fd;
+		fds[0].events = POLLIN;
+		fds[1].fd = ws_feed_wake[0];
+		fds[1].events = POLLIN;
+
+		int count = ws_feed_subscriber_count;
+		for (int i = 0; i < count; i++)
+		{
+			ws_feed_subscriber* subscriber = &ws_feed_subscribers[i];
+			fds[2 + i].fd = subscriber->fd;
+			fds[2 + i].events = POLLIN | ((subscriber->out_sent < subscriber->out_length) ? POLLOUT : 0);
+		}
+
+		// Wake up regularly so that ws_feed_stop() doesn't block for long
+		if (poll(fds, 2 + count, 250) <= 0)
+		{
+			continue;
+		}
+
+		if (fds[1].revents & POLLIN)
+		{
+			char drain[64];
+			atomic_store(&ws_feed_wake_pending, 0);
+			while (read(ws_feed_wake[0], drain, sizeof(drain)) > 0)
+			{
+			}
+		}
+
+		// Backwards, as disconnecting moves the last subscriber into the gap
+		for (int i = count - 1; i >= 0; i--)
+		{
+			ws_feed_subscriber* subscriber = &ws_feed_subscribers[i];
+			int connected = !(fds[2 + i].revents & (POLLERR | POLLHUP | POLLNVAL));
+
+			if (connected && (fds[2 + i].revents & POLLIN))
+			{
+				connected = ws_feed_receive(subscriber);
+			}
+
+			// Every subscriber is sent whatever is new, as the wake up may have been for anyone
+			if (connected)
+			{
+				connected = ws_feed_flush(subscriber);
+			}
+
+			if (!connected)
+			{
+				ws_feed_disconnect(i);
+			}
+		}
+
+		if (fds[0].revents & POLLIN)
+		{
+			ws_feed_accept();
+		}
+	}
+
+	return NULL;
+}
+
+int ws_feed_start(const char* path)
+{
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+
+	if (strlen(path) >= sizeof(addr.sun_path) || atomic_load(&ws_feed_serving))
+	{
+		return WS_ERR_SOCKET;
+	}
+
+	strcpy(addr.sun_path, path);
+	unlink(path);
+
+	if (pipe2(ws_feed_wake, O_NONBLOCK | O_CLOEXEC) != 0)
+	{
+		return WS_ERR_SOCKET;
+	}
+
+	ws_feed_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (ws_feed_fd < 0 || bind(ws_feed_fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(ws_feed_fd, 16) != 0)
+	{
+		if (ws_feed_fd >= 0)
+		{
+			close(ws_feed_fd);
+		}
+		close(ws_feed_wake[0]);
+		close(ws_feed_wake[1]);
+		ws_feed_fd = -1;
+		return WS_ERR_SOCKET;
+	}
+
+	strcpy(ws_feed_socket_path, path);
+	atomic_store(&ws_feed_wake_pending, 0);
+	atomic_store(&ws_feed_serving, 1);
+
+	if (pthread_create(&ws_feed_thread, NULL, ws_feed_loop, NULL) != 0)
+	{
+		atomic_store(&ws_feed_serving, 0);
+		close(ws_feed_fd);
+		close(ws_feed_wake[0]);
+		close(ws_feed_wake[1]);
+		unlink(path);
+		ws_feed_fd = -1;
+		return WS_ERR_THREAD;
+	}
+
+	return WS_SUCCESS;
+}
+
+void ws_feed_stop(void)
+{
+	if (!atomic_load(&ws_feed_serving))
+	{
+		return;
+	}
+
+	atomic_store(&ws_feed_serving, 0);
+	pthread_join(ws_feed_thread, NULL);
+
+	while (ws_feed_subscriber_count > 0)
+	{
+		ws_feed_disconnect(ws_feed_subscriber_count - 1);
+	}
+
+	close(ws_feed_fd);
+	close(ws_feed_wake[0]);
+	close(ws_feed_wake[1]);
+	unlink(ws_feed_socket_path);
+	ws_feed_fd = -1;
+}
@@ -0,0 +1,87 @@
+#ifndef WS_FEED_H
+#define WS_FEED_H
+
+#include "ws.h"
+
+/*
+	Frames sent over the feed socket. Each frame is a ws_feed_frame_header followed by
+	length bytes of payload. The structures are copied as they are, so values are in the
+	byte order of the host, which subscribers share as the socket is local.
+*/
+#define WS_FEED_RECORD 0x01			// Payload is a ws_packed_record
+#define WS_FEED_EXTREME 0x02		// Payload is a ws_feed_extreme
+#define WS_FEED_GAP 0x03			// Payload is a uint32_t count of frames the subscriber was too slow to be sent
+#define WS_FEED_SUBSCRIBE 0x80		// Sent by a subscriber. Payload is an int64_t time to replay from.
+
+// Replay time for a subscriber that only wants frames published from now on
+#define WS_FEED_LIVE INT64_MAX
+
+// Frames kept for replaying to subscribers and for subscribers that have fallen behind
+#define WS_FEED_HISTORY 8192
+
+// Most subscribers connected at once
+#define WS_FEED_MAX_SUBSCRIBERS 64
+
+typedef struct __attribute__((packed))
+{
+	uint8_t type;
+	uint8_t length;
+} ws_feed_frame_header;
+
+/**
+	A change to one of the weather extremes. Values are fixed point (value * 10) and times
+	are seconds since the Unix epoch, 0 if the station had no time.
+*/
+typedef struct __attribute__((packed))
+{
+	uint8_t extreme;					// ws_store_extreme
+	int32_t min;
+	int32_t max;
+	int64_t min_time;
+	int64_t max_time;
+} ws_feed_extreme;
+
+
+/**
+	Starts a background thread that publishes records to subscribers on a Unix domain
+	socket. Subscribers send a WS_FEED_SUBSCRIBE frame and are then sent every frame
+	published since the requested time (as far back as WS_FEED_HISTORY frames) followed by
+	every new frame. Frames are written in batches, without blocking. A subscriber that
+	falls more than WS_FEED_HISTORY frames behind is sent a WS_FEED_GAP frame and carries
+	on from the oldest frame kept.
+
+	Parameters:
+		path 		Path of the socket. Any existing file at this path is removed.
+
+	Return:
+		- WS_ERR_SOCKET			The socket could not be created
+		- WS_ERR_THREAD			The publishing thread could not be started
+*/
+int ws_feed_start(const char* path);
+
+/**
+	Stops the thread started by ws_feed_start(), disconnects every subscriber and removes
+	the socket.
+*/
+void ws_feed_stop(void);
+
+/**
+	Publishes a record. Never blocks on subscribers, and does nothing if the feed
+	hasn't been started.
+
+	Parameters:
+		record 		The record, with its epoch set
+*/
+void ws_feed_publish_record(const ws_packed_record* record);
+
+/**
+	Publishes a change to one of the weather extremes. Never blocks on subscribers, and
+	does nothing if the feed hasn't been started.
+
+	Parameters:
+		extreme 	The ws_store_extreme that changed
+		value		Its new value
+*/
+void ws_feed_publish_extreme(int extreme, const ws_min_max* value);
+
+#endif
@@ -0,0 +1,98 @@
+#include "ws_format.h"
+#include <stdio.h>
+#include <stdarg.h>
+#include <math.h>
+#include <time.h>
+
+/* Appends to the buffer, carrying on counting once it's full */
+static void ws_format_append(char* buffer, int size, int* length, const char* format, ...)
+{
+	va_list args;
+	va_start(args, format);
+
+	int written;
+	if (*length < size)
+	{
+		written = vsnprintf(buffer + *length, size - *length, format, args);
+	} else {
+		written = vsnprintf(NULL, 0, format, args);
+	}
+
+	va_end(args);
+	*length += (written > 0) ? written : 0;
+}
+
+static void ws_format_int(char* buffer, int size, int* length, int value)
+{
+	ws_format_append(buffer, size, length, "%d", value);
+}
+
+static void ws_format_double(char* buffer, int size, int* length, double value)
+{
+	if (!isnan(value))
+	{
+		ws_format_append(buffer, size, length, "%.1f", value);
+	}
+}
+
+static void ws_format_time(char* buffer, int size, int* length, const struct tm* date_time)
+{
+	ws_format_append(buffer, size, length, "%.4i-%.2i-%.2i %.2i:%.2i:%.2i", date_time->tm_year + 1900, date_time->tm_mon + 1,
+	                 date_time->tm_mday, date_time->tm_hour, date_time->tm_min, date_time->tm_sec);
+}
+
+int ws_format_record_csv_header(uint32_t fields, char* buffer, int size)
+{
+	int length = 0;
+
+	if (size > 0)
+	{
+		buffer[0] = '\0';
+	}
+
+	ws_format_append(buffer, size, &length, "RecordDateTime");
+
+#define CSV_HEADER_FIELD(TYPE, NAME, COLUMN, LABEL, UNIT, DECODE) 								\
+	if (fields & WS_FIELD_BIT(WS_FIELD_##NAME)) 												\
+	{ 																							\
+		ws_format_append(buffer, size, &length, "," COLUMN); 									\
+	}
+	FOREACH_WS_RECORD_FIELD(CSV_HEADER_FIELD)
+	FOREACH_WS_STATUS_FIELD(CSV_HEADER_FIELD)
+#undef CSV_HEADER_FIELD
+
+	ws_format_append(buffer, size, &length, "\n");
+	return length;
+}
+
+int ws_format_record_csv(const ws_weather_record* record, uint32_t fields, char* buffer, int size)
+{
+	int length = 0;
+
+	if (size > 0)
+	{
+		buffer[0] = '\0';
+	}
+
+	if (record->date_time != NULL)
+	{
+		ws_format_time(buffer, size, &length, record->date_time);
+	}
+
+#define CSV_FIELD(TYPE, NAME, COLUMN, LABEL, UNIT, DECODE, VALUE) 								\
+	if (fields & WS_FIELD_BIT(WS_FIELD_##NAME)) 												\
+	{ 																							\
+		ws_format_append(buffer, size, &length, ","); 											\
+		ws_format_##TYPE(buffer, size, &length, VALUE); 										\
+	}
+#define CSV_RECORD_FIELD(TYPE, NAME, COLUMN, LABEL, UNIT, DECODE) CSV_FIELD(TYPE, NAME, COLUMN, LABEL, UNIT, DECODE, record->NAME)
+#define CSV_STATUS_FIELD(TYPE, NAME, COLUMN, LABEL, UNIT, DECODE) CSV_FIELD(TYPE, NAME, COLUMN, LABEL, UNIT, DECODE, record->status.NAME)
+	FOREACH_WS_RECORD_FIELD(CSV_RECORD_FIELD)
+	FOREACH_WS_STATUS_FIELD(CSV_STATUS_FIELD)
+#undef CSV_FIELD
+#undef CSV_RECORD_FIELD
+#undef CSV_STATUS_FIELD
+
+	ws_format_append(buffer, size, &length, "\n");
+	return length;
+}
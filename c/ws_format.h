@@ -0,0 +1,35 @@
+#ifndef WS_FORMAT_H
+#define WS_FORMAT_H
+
+#include "ws.h"
+#include <stdint.h>
+
+/*
+	CSV writers for weather records, generated from FOREACH_WS_RECORD_FIELD (JSON is written
+	by ws_json.h). Each writes only
+	the fields set in fields (WS_FIELD_BIT(WS_FIELD_...) or WS_FIELD_ALL), in table order,
+	and returns the length it would have written, like snprintf. If that is >= size then
+	the output was cut off (it is always nul terminated if size > 0).
+
+	Values are written with one decimal place, the resolution the station stores them in.
+	Values that aren't known (a dew point that can't be worked out) are left empty.
+*/
+
+/**
+	Writes the header line of a CSV file: RecordDateTime and the WeatherData column of
+	each field, followed by a newline.
+
+	Parameters:
+		fields		The fields to write
+		buffer		Buffer to write to
+		size		The size of the buffer
+*/
+int ws_format_record_csv_header(uint32_t fields, char* buffer, int size);
+
+/**
+	Writes a record as a line of CSV matching ws_format_record_csv_header(), followed by
+	a newline. The time is left empty if the record has no date_time.
+*/
+int ws_format_record_csv(const ws_weather_record* record, uint32_t fields, char* buffer, int size);
+
+#endif
@@ -0,0 +1,269 @@
+#define _GNU_SOURCE
+#include "ws_json.h"
+#include "ws_store.h"
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+typedef struct
+{
+	char* buffer;
+	int size;
+	int length;				// Length of the JSON so far, which may be more than has fit
+} ws_json_out;
+
+// Longest single value: a time with an offset, or a 64 bit number of tenths
+#define WS_JSON_VALUE_MAX 32
+
+static const char ws_json_pairs[] =
+	"00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+	"40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+	"8081828384858687888990919293949596979899";
+
+/* Where to format a value: straight into the buffer when it's sure to fit, otherwise into scratch */
+static inline char* ws_json_begin(ws_json_out* out, char* scratch)
+{
+	return (out->size - out->length > WS_JSON_VALUE_MAX) ? out->buffer + out->length : scratch;
+}
+
+/* Accounts for a value formatted at where ws_json_begin() said, copying as much of it as fits if it went to scratch */
+static inline void ws_json_end(ws_json_out* out, const char* at, int length)
+{
+	if (at != out->buffer + out->length)
+	{
+		int room = out->size - 1 - out->length;
+		if (room > 0)
+		{
+			memcpy(out->buffer + out->length, at, (length < room) ? length : room);
+		}
+	}
+	out->length += length;
+}
+
+static inline void ws_json_raw(ws_json_out* out, const char* text, int length)
+{
+	int room = out->size - 1 - out->length;
+	if (room > 0)
+	{
+		memcpy(out->buffer + out->length, text, (length < room) ? length : room);
+	}
+	out->length += length;
+}
+
+#define WS_JSON_LITERAL(out, text) ws_json_raw(out, text, sizeof(text) - 1)
+
+static inline void ws_json_pair(char* at, unsigned value)
+{
+	at[0] = ws_json_pairs[value * 2];
+	at[1] = ws_json_pairs[value * 2 + 1];
+}
+
+/* Formats an unsigned number, returning its length */
+static int ws_json_format_uint(char* at, uint64_t value)
+{
+	int digits = 1;
+	for (uint64_t rest = value; rest >= 10; rest /= 10)
+	{
+		digits++;
+	}
+
+	char* end = at + digits;
+	while (value >= 100)
+	{
+		end -= 2;
+		ws_json_pair(end, (unsigned)(value % 100));
+		value /= 100;
+	}
+
+	if (value >= 10)
+	{
+		ws_json_pair(end - 2, (unsigned)value);
+	} else {
+		end[-1] = (char)('0' + value);
+	}
+
+	return digits;
+}
+
+static int ws_json_format_signed(char* at, int64_t value)
+{
+	if (value < 0)
+	{
+		at[0] = '-';
+		return 1 + ws_json_format_uint(at + 1, (uint64_t)0 - (uint64_t)value);
+	}
+	return ws_json_format_uint(at, (uint64_t)value);
+}
+
+static void ws_json_int(ws_json_out* out, int value)
+{
+	char scratch[WS_JSON_VALUE_MAX];
+	char* at = ws_json_begin(out, scratch);
+	ws_json_end(out, at, ws_json_format_signed(at, value));
+}
+
+/* Writes a value in fixed point with one decimal place */
+static void ws_json_double(ws_json_out* out, double value)
+{
+	if (!isfinite(value) || fabs(value) >= 1e17)
+	{
+		WS_JSON_LITERAL(out, "null");
+		return;
+	}
+
+	char scratch[WS_JSON_VALUE_MAX];
+	char* at = ws_json_begin(out, scratch);
+	int64_t tenths = (int64_t)(value * 10.0 + ((value < 0) ? -0.5 : 0.5));
+	int length = 0;
+
+	if (tenths < 0)
+	{
+		at[length++] = '-';
+		tenths = -tenths;
+	}
+
+	length += ws_json_format_uint(at + length, (uint64_t)(tenths / 10));
+	at[length++] = '.';
+	at[length++] = (char)('0' + tenths % 10);
+
+	ws_json_end(out, at, length);
+}
+
+/* Writes a local time as "YYYY-MM-DDTHH:MM:SS+HH:MM" */
+static void ws_json_tm(ws_json_out* out, const struct tm* date_time)
+{
+	char scratch[WS_JSON_VALUE_MAX];
+	char* at = ws_json_begin(out, scratch);
+	unsigned year = (unsigned)(date_time->tm_year + 1900) % 10000;
+	long offset = date_time->tm_gmtoff / 60;
+
+	at[0] = '"';
+	ws_json_pair(at + 1, year / 100);
+	ws_json_pair(at + 3, year % 100);
+	at[5] = '-';
+	ws_json_pair(at + 6, (unsigned)(date_time->tm_mon + 1) % 100);
+	at[8] = '-';
+	ws_json_pair(at + 9, (unsigned)date_time->tm_mday % 100);
+	at[11] = 'T';
+	ws_json_pair(at + 12, (unsigned)date_time->tm_hour % 100);
+	at[14] = ':';
+	ws_json_pair(at + 15, (unsigned)date_time->tm_min % 100);
+	at[17] = ':';
+	ws_json_pair(at + 18, (unsigned)date_time->tm_sec % 100);
+	at[20] = (offset < 0) ? '-' : '+';
+	offset = (offset < 0) ? -offset : offset;
+	ws_json_pair(at + 21, (unsigned)(offset / 60) % 100);
+	at[23] = ':';
+	ws_json_pair(at + 24, (unsigned)(offset % 60));
+	at[26] = '"';
+
+	ws_json_end(out, at, 27);
+}
+
+/* Writes a time from the station (two digit year, no seconds) as "YYYY-MM-DDTHH:MM:00", or null if it's blank */
+static void ws_json_ws_time(ws_json_out* out, const ws_time* time)
+{
+	if (time->year == 0 && time->month == 0 && time->day == 0)
+	{
+		WS_JSON_LITERAL(out, "null");
+		return;
+	}
+
+	char scratch[WS_JSON_VALUE_MAX];
+	char* at = ws_json_begin(out, scratch);
+
+	at[0] = '"';
+	ws_json_pair(at + 1, 20);
+	ws_json_pair(at + 3, (unsigned)time->year % 100);
+	at[5] = '-';
+	ws_json_pair(at + 6, (unsigned)time->month % 100);
+	at[8] = '-';
+	ws_json_pair(at + 9, (unsigned)time->day % 100);
+	at[11] = 'T';
+	ws_json_pair(at + 12, (unsigned)time->hour % 100);
+	at[14] = ':';
+	ws_json_pair(at + 15, (unsigned)time->minute % 100);
+	memcpy(at + 17, ":00\"", 4);
+
+	ws_json_end(out, at, 21);
+}
+
+static int ws_json_finish(ws_json_out* out)
+{
+	if (out->size > 0)
+	{
+		out->buffer[(out->length < out->size) ? out->length : out->size - 1] = '\0';
+	}
+	return out->length;
+}
+
+int ws_json_record(const ws_weather_record* record, uint32_t fields, char* buffer, int size)
+{
+	ws_json_out out = { buffer, size, 0 };
+	const char* separator = "";
+
+	WS_JSON_LITERAL(&out, "{");
+
+	if (record->date_time != NULL)
+	{
+		WS_JSON_LITERAL(&out, "\"time\":");
+		ws_json_tm(&out, record->date_time);
+		separator = ",";
+	}
+
+#define JSON_FIELD(TYPE, NAME, VALUE) 																\
+	if (fields & WS_FIELD_BIT(WS_FIELD_##NAME)) 													\
+	{ 																								\
+		ws_json_raw(&out, separator, (int)strlen(separator)); 										\
+		WS_JSON_LITERAL(&out, "\"" #NAME "\":"); 													\
+		ws_json_##TYPE(&out, VALUE); 																\
+		separator = ","; 																			\
+	}
+#define JSON_RECORD_FIELD(TYPE, NAME, COLUMN, LABEL, UNIT, DECODE) JSON_FIELD(TYPE, NAME, record->NAME)
+#define JSON_STATUS_FIELD(TYPE, NAME, COLUMN, LABEL, UNIT, DECODE) JSON_FIELD(TYPE, NAME, record->status.NAME)
+	FOREACH_WS_RECORD_FIELD(JSON_RECORD_FIELD)
+	FOREACH_WS_STATUS_FIELD(JSON_STATUS_FIELD)
+#undef JSON_FIELD
+#undef JSON_RECORD_FIELD
+#undef JSON_STATUS_FIELD
+
+	WS_JSON_LITERAL(&out, "}");
+	return ws_json_finish(&out);
+}
+
+static void ws_json_write_min_max(ws_json_out* out, const ws_min_max* value)
+{
+	WS_JSON_LITERAL(out, "{\"min\":");
+	ws_json_double(out, value->min);
+	WS_JSON_LITERAL(out, ",\"min_time\":");
+	ws_json_ws_time(out, &value->min_time);
+	WS_JSON_LITERAL(out, ",\"max\":");
+	ws_json_double(out, value->max);
+	WS_JSON_LITERAL(out, ",\"max_time\":");
+	ws_json_ws_time(out, &value->max_time);
+	WS_JSON_LITERAL(out, "}");
+}
+
+int ws_json_min_max(const ws_min_max* value, char* buffer, int size)
+{
+	ws_json_out out = { buffer, size, 0 };
+	ws_json_write_min_max(&out, value);
+	return ws_json_finish(&out);
+}
+
+int ws_json_extremes(const ws_weather_extremes* extremes, char* buffer, int size)
+{
+	ws_json_out out = { buffer, size, 0 };
+	const char* separator = "{";
+
+#define JSON_EXTREME(FIELD, NAME) 																	\
+	ws_json_raw(&out, separator, 1); 																\
+	WS_JSON_LITERAL(&out, "\"" #FIELD "\":"); 														\
+	ws_json_write_min_max(&out, &extremes->FIELD); 													\
+	separator = ",";
+	FOREACH_WS_EXTREME(JSON_EXTREME)
+#undef JSON_EXTREME
+
+	WS_JSON_LITERAL(&out, "}");
+	return ws_json_finish(&out);
+}
@@ -0,0 +1,49 @@
+#ifndef WS_JSON_H
+#define WS_JSON_H
+
+#include "ws.h"
+#include <stdint.h>
+
+/*
+	JSON for records and extremes, written straight into the caller's buffer. No memory is
+	allocated and no printf family or locale dependent functions are called, so it is safe
+	to use on the hot paths and gives the same output whatever the locale.
+
+	Values are written in fixed point with one decimal place (the resolution the station
+	stores them in), counts and flags as integers, and values that aren't known as null.
+	Times are ISO 8601: records have the UTC offset of their local time, the station's own
+	times (in extremes) have none, as the station doesn't know its time zone.
+
+	Every function returns the length of the JSON, like snprintf: if it is >= size the
+	output was cut off, but the buffer is still nul terminated if size > 0.
+*/
+
+// Big enough for any record or extremes, so the output is never cut off
+#define WS_JSON_RECORD_MAX 512
+#define WS_JSON_EXTREMES_MAX 2048
+
+/**
+	Writes a record, keyed by field name. If the record has a date_time it is written
+	first as "time".
+
+	Parameters:
+		record 		The record
+		fields		The fields to write (WS_FIELD_BIT(WS_FIELD_...) or WS_FIELD_ALL)
+		buffer		Buffer to write to
+		size		The size of the buffer
+*/
+int ws_json_record(const ws_weather_record* record, uint32_t fields, char* buffer, int size);
+
+/**
+	Writes a min and max and the times they happened, as {"min":..,"min_time":..,"max":..,
+	"max_time":..}. Blank times (as the station gives for the minimum wind and rain) are
+	written as null.
+*/
+int ws_json_min_max(const ws_min_max* value, char* buffer, int size);
+
+/**
+	Writes every extreme, keyed by the field of ws_weather_extremes.
+*/
+int ws_json_extremes(const ws_weather_extremes* extremes, char* buffer, int size);
+
+#endif
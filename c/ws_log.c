@@ -0,0 +1,322 @@
+#define _GNU_SOURCE
+#include "ws_log.h"
+#include "ws.h"
+#include "ws_metrics.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+typedef struct
+{
+	uint64_t time;						// Nanoseconds since the Unix epoch
+	uint16_t event;
+	int32_t status;
+	const char* where;
+	char text[WS_LOG_TEXT_SIZE];
+} ws_log_entry;
+
+/**
+	A ring of entries with one writer (the owning thread) and one reader (the background
+	thread). head is only written by the owner and tail only by the reader, each on its
+	own cache line.
+
+	Rings are never freed, like the metrics shards, so a thread that exits can't leave the
+	reader with a dangling pointer.
+*/
+typedef struct ws_log_ring
+{
+	_Alignas(64) _Atomic uint32_t head;
+	_Alignas(64) _Atomic uint32_t tail;
+	_Atomic uint64_t dropped;
+	uint64_t dropped_reported;			// Only used by the reader
+	ws_log_entry entries[WS_LOG_RING_SIZE];
+	struct ws_log_ring* next;
+} ws_log_ring;
+
+#define GENERATE_LOG_EVENT_LEVEL(ENUM, LEVEL, NAME) LEVEL,
+#define GENERATE_LOG_EVENT_NAME(ENUM, LEVEL, NAME) NAME,
+
+static const int ws_log_event_levels[] = { FOREACH_WS_LOG_EVENT(GENERATE_LOG_EVENT_LEVEL) };
+static const char* ws_log_event_names[] = { FOREACH_WS_LOG_EVENT(GENERATE_LOG_EVENT_NAME) };
+static const char* ws_log_level_names[] = { "DEBUG", "INFO", "WARN", "ERROR" };
+
+static pthread_mutex_t ws_log_lock = PTHREAD_MUTEX_INITIALIZER;			// Starting and stopping
+static pthread_mutex_t ws_log_rings_lock = PTHREAD_MUTEX_INITIALIZER;		// Adding a ring
+static pthread_mutex_t ws_log_write_lock = PTHREAD_MUTEX_INITIALIZER;		// Writing entries out
+static pthread_cond_t ws_log_wake = PTHREAD_COND_INITIALIZER;
+static ws_log_ring* _Atomic ws_log_rings = NULL;
+static __thread ws_log_ring* ws_log_local = NULL;
+static __thread int ws_log_no_ring = 0;
+
+static atomic_int ws_log_level_min = WS_LOG_INFO;
+static atomic_int ws_log_running = 0;
+static int ws_log_stopping = 0;
+static pthread_t ws_log_thread;
+static FILE* ws_log_out = NULL;
+
+// Rate limiting, guarded by ws_log_write_lock
+static int64_t ws_log_window[WS_EVENT_COUNT];
+static int ws_log_window_lines[WS_EVENT_COUNT];
+static uint64_t ws_log_suppressed[WS_EVENT_COUNT];
+
+static ws_log_ring* ws_log_ring_get(void)
+{
+	if (ws_log_local != NULL || ws_log_no_ring)
+	{
+		return ws_log_local;
+	}
+
+	// Only happens once per thread
+	ws_log_ring* ring = calloc(1, sizeof(ws_log_ring));
+	if (ring == NULL)
+	{
+		ws_log_no_ring = 1;
+		return NULL;
+	}
+
+	pthread_mutex_lock(&ws_log_rings_lock);
+	ring->next = atomic_load(&ws_log_rings);
+	atomic_store(&ws_log_rings, ring);
+	pthread_mutex_unlock(&ws_log_rings_lock);
+
+	ws_log_local = ring;
+	return ring;
+}
+
+static void ws_log_fill(ws_log_entry* entry, enum ws_log_event event, int status, const char* where, const char* text)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+
+	entry->time = (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+	entry->event = (uint16_t)event;
+	entry->status = status;
+	entry->where = where;
+
+	int i = 0;
+	if (text != NULL)
+	{
+		for (; i < WS_LOG_TEXT_SIZE - 1 && text[i] != '\0'; i++)
+		{
+			entry->text[i] = text[i];
+		}
+	}
+	entry->text[i] = '\0';
+}
+
+/* Writes one entry, or counts it if its event has already written its share of lines this second. */
+static void ws_log_write(FILE* out, const ws_log_entry* entry)
+{
+	int64_t second = (int64_t)(entry->time / 1000000000ULL);
+	int event = entry->event;
+
+	if (second != ws_log_window[event])
+	{
+		if (ws_log_suppressed[event] > 0)
+		{
+			fprintf(out, "%s suppressed=%llu\n", ws_log_event_names[event], (unsigned long long)ws_log_suppressed[event]);
+			ws_log_suppressed[event] = 0;
+		}
+
+		ws_log_window[event] = second;
+		ws_log_window_lines[event] = 0;
+	}
+
+	if (++ws_log_window_lines[event] > WS_LOG_RATE_LIMIT)
+	{
+		ws_log_suppressed[event]++;
+		return;
+	}
+
+	time_t seconds = (time_t)second;
+	struct tm local;
+	char date[20];
+	localtime_r(&seconds, &local);
+	strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", &local);
+
+	fprintf(out, "%s.%03u %s %s %s status=%d%s%s\n", date, (unsigned)(entry->time % 1000000000ULL / 1000000ULL),
+		ws_log_level_names[ws_log_event_levels[event]], ws_log_event_names[event],
+		(entry->where != NULL) ? entry->where : "-", entry->status,
+		(entry->text[0] != '\0') ? " " : "", entry->text);
+}
+
+static void ws_log_write_suppressed(FILE* out)
+{
+	for (int event = 0; event < WS_EVENT_COUNT; event++)
+	{
+		if (ws_log_suppressed[event] > 0)
+		{
+			fprintf(out, "%s suppressed=%llu\n", ws_log_event_names[event], (unsigned long long)ws_log_suppressed[event]);
+			ws_log_suppressed[event] = 0;
+		}
+	}
+}
+
+void ws_log(enum ws_log_event event, int status, const char* where, const char* text)
+{
+	if (ws_log_event_levels[event] < atomic_load_explicit(&ws_log_level_min, memory_order_relaxed))
+	{
+		return;
+	}
+
+	ws_log_ring* ring = ws_log_ring_get();
+	if (!atomic_load_explicit(&ws_log_running, memory_order_acquire) || ring == NULL)
+	{
+		ws_log_entry entry;
+		ws_log_fill(&entry, event, status, where, text);
+
+		pthread_mutex_lock(&ws_log_write_lock);
+		ws_log_write((ws_log_out != NULL) ? ws_log_out : stdout, &entry);
+		pthread_mutex_unlock(&ws_log_write_lock);
+		return;
+	}
+
+	uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+	if (head - tail >= WS_LOG_RING_SIZE)
+	{
+		atomic_store_explicit(&ring->dropped, atomic_load_explicit(&ring->dropped, memory_order_relaxed) + 1, memory_order_relaxed);
+		ws_metrics_add(WS_CTR_LOG_DROPPED, 1);
+		return;
+	}
+
+	ws_log_fill(&ring->entries[head & (WS_LOG_RING_SIZE - 1)], event, status, where, text);
+	atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+void ws_log_set_level(enum ws_log_level level)
+{
+	atomic_store(&ws_log_level_min, level);
+}
+
+static int ws_log_compare(const void* a, const void* b)
+{
+	uint64_t x = ((const ws_log_entry*)a)->time;
+	uint64_t y = ((const ws_log_entry*)b)->time;
+	return (x > y) - (x < y);
+}
+
+/* Takes everything waiting in the rings and writes it out, oldest first. Called with ws_log_write_lock held. */
+static void ws_log_drain(FILE* out)
+{
+	static ws_log_entry batch[WS_LOG_RING_SIZE * 4];
+	uint64_t dropped = 0;
+	int count = 0;
+
+	for (ws_log_ring* ring = atomic_load(&ws_log_rings); ring != NULL; ring = ring->next)
+	{
+		uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+		uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+		while (tail != head)
+		{
+			if (count == sizeof(batch) / sizeof(batch[0]))
+			{
+				qsort(batch, count, sizeof(ws_log_entry), ws_log_compare);
+				for (int i = 0; i < count; i++)
+				{
+					ws_log_write(out, &batch[i]);
+				}
+				count = 0;
+			}
+
+			batch[count++] = ring->entries[tail & (WS_LOG_RING_SIZE - 1)];
+			tail++;
+			atomic_store_explicit(&ring->tail, tail, memory_order_release);
+		}
+
+		uint64_t ring_dropped = atomic_load_explicit(&ring->dropped, memory_order_relaxed);
+		dropped += ring_dropped - ring->dropped_reported;
+		ring->dropped_reported = ring_dropped;
+	}
+
+	qsort(batch, count, sizeof(ws_log_entry), ws_log_compare);
+	for (int i = 0; i < count; i++)
+	{
+		ws_log_write(out, &batch[i]);
+	}
+
+	if (dropped > 0)
+	{
+		fprintf(out, "log dropped=%llu\n", (unsigned long long)dropped);
+	}
+	fflush(out);
+}
+
+static void* ws_log_loop(void* arg)
+{
+	pthread_mutex_lock(&ws_log_lock);
+
+	while (!ws_log_stopping)
+	{
+		struct timespec until;
+		clock_gettime(CLOCK_REALTIME, &until);
+		until.tv_nsec += WS_LOG_FLUSH_MS * 1000000L;
+		until.tv_sec += until.tv_nsec / 1000000000L;
+		until.tv_nsec %= 1000000000L;
+		pthread_cond_timedwait(&ws_log_wake, &ws_log_lock, &until);
+		pthread_mutex_unlock(&ws_log_lock);
+
+		// Writing may block for a while, which only holds up other writers
+		pthread_mutex_lock(&ws_log_write_lock);
+		ws_log_drain(ws_log_out);
+		pthread_mutex_unlock(&ws_log_write_lock);
+
+		pthread_mutex_lock(&ws_log_lock);
+	}
+
+	pthread_mutex_unlock(&ws_log_lock);
+	return NULL;
+}
+
+int ws_log_start(FILE* out)
+{
+	pthread_mutex_lock(&ws_log_lock);
+
+	if (atomic_load(&ws_log_running))
+	{
+		pthread_mutex_unlock(&ws_log_lock);
+		return WS_SUCCESS;
+	}
+
+	ws_log_out = out;
+	ws_log_stopping = 0;
+
+	if (pthread_create(&ws_log_thread, NULL, ws_log_loop, NULL) != 0)
+	{
+		pthread_mutex_unlock(&ws_log_lock);
+		return WS_ERR_THREAD;
+	}
+
+	atomic_store(&ws_log_running, 1);
+	pthread_mutex_unlock(&ws_log_lock);
+	return WS_SUCCESS;
+}
+
+void ws_log_stop(void)
+{
+	pthread_mutex_lock(&ws_log_lock);
+
+	if (!atomic_load(&ws_log_running))
+	{
+		pthread_mutex_unlock(&ws_log_lock);
+		return;
+	}
+
+	atomic_store(&ws_log_running, 0);
+	ws_log_stopping = 1;
+	pthread_cond_signal(&ws_log_wake);
+	pthread_mutex_unlock(&ws_log_lock);
+
+	pthread_join(ws_log_thread, NULL);
+
+	// Anything logged while the thread was finishing
+	pthread_mutex_lock(&ws_log_write_lock);
+	ws_log_drain(ws_log_out);
+	ws_log_write_suppressed(ws_log_out);
+	fflush(ws_log_out);
+	pthread_mutex_unlock(&ws_log_write_lock);
+}
@@ -0,0 +1,86 @@
+#ifndef WS_LOG_H
+#define WS_LOG_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+/*
+	Logging for the hot paths. ws_log() copies a fixed size entry into a ring that belongs
+	to the calling thread and returns; a background thread formats and writes the entries.
+	Nothing on the logging side takes a lock or makes a system call, so a slow console
+	can't hold up the USB loop. If a ring is full the entry is dropped and counted instead.
+
+	Before ws_log_start() (and after ws_log_stop()) entries are written straight away.
+*/
+
+enum ws_log_level {
+	WS_LOG_DEBUG,
+	WS_LOG_INFO,
+	WS_LOG_WARN,
+	WS_LOG_ERROR
+};
+
+/**
+	Things that are logged. Each entry is the enum name, the level it is logged at and the
+	name it is written with.
+*/
+
+#define FOREACH_WS_LOG_EVENT(EVENT) 											\
+	EVENT(WS_EVENT_USB_ERROR, WS_LOG_ERROR, "usb_error")						\
+	EVENT(WS_EVENT_DB_ERROR, WS_LOG_ERROR, "db_error")							\
+	EVENT(WS_EVENT_TIMEOUT, WS_LOG_WARN, "timeout")								\
+
+#define GENERATE_LOG_EVENT_ENUM(ENUM, LEVEL, NAME) ENUM,
+
+enum ws_log_event {
+	FOREACH_WS_LOG_EVENT(GENERATE_LOG_EVENT_ENUM)
+	WS_EVENT_COUNT
+};
+
+// Entries each thread can have waiting to be written, must be a power of 2
+#define WS_LOG_RING_SIZE 512
+
+// Longest text kept with an entry, anything longer is cut off
+#define WS_LOG_TEXT_SIZE 72
+
+// Most lines written per event per second, the rest are counted and written as one line
+#define WS_LOG_RATE_LIMIT 10
+
+// How often the background thread writes out entries
+#define WS_LOG_FLUSH_MS 20
+
+
+/**
+	Logs an event, if its level isn't filtered out.
+
+	Parameters:
+		event 		The event
+		status		A status or error code to go with it
+		where		Where it happened. Only the pointer is kept, so this must be a string
+					literal (or otherwise live for the life of the program).
+		text		Any text to go with it (can be NULL). This is copied.
+*/
+void ws_log(enum ws_log_event event, int status, const char* where, const char* text);
+
+/**
+	Sets the lowest level that is logged, WS_LOG_INFO by default.
+*/
+void ws_log_set_level(enum ws_log_level level);
+
+/**
+	Starts the thread that writes the entries out.
+
+	Parameters:
+		out 	Where the entries are written
+
+	Return:
+		- WS_ERR_THREAD			The thread could not be started
+*/
+int ws_log_start(FILE* out);
+
+/**
+	Writes out everything logged so far and stops the thread. Can be passed to atexit().
+*/
+void ws_log_stop(void);
+
+#endif
@@ -0,0 +1,336 @@
+#include "ws_metrics.h"
+#include "ws.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/**
+	Every thread gets its own shard. Only the owning thread writes to a shard, so
+	increments are a plain load and store - the atomics are only there so that the
+	exporting thread reads whole values.
+
+	Shards are never freed, so counts from threads that have exited are still exported.
+*/
+typedef struct ws_metrics_shard
+{
+	_Atomic uint64_t counters[WS_COUNTER_COUNT];
+	_Atomic uint64_t buckets[WS_HISTOGRAM_COUNT][WS_HIST_BUCKETS + 1];
+	_Atomic uint64_t sums[WS_HISTOGRAM_COUNT];
+	struct ws_metrics_shard* next;
+} ws_metrics_shard;
+
+#define GENERATE_METRIC_NAME(ENUM, NAME, HELP) NAME,
+#define GENERATE_METRIC_HELP(ENUM, NAME, HELP) HELP,
+
+static const char* ws_counter_names[] = { FOREACH_WS_COUNTER(GENERATE_METRIC_NAME) };
+static const char* ws_counter_help[] = { FOREACH_WS_COUNTER(GENERATE_METRIC_HELP) };
+static const char* ws_histogram_names[] = { FOREACH_WS_HISTOGRAM(GENERATE_METRIC_NAME) };
+static const char* ws_histogram_help[] = { FOREACH_WS_HISTOGRAM(GENERATE_METRIC_HELP) };
+
+static pthread_mutex_t ws_metrics_lock = PTHREAD_MUTEX_INITIALIZER;
+static ws_metrics_shard* _Atomic ws_metrics_shards = NULL;
+static __thread ws_metrics_shard* ws_metrics_local = NULL;
+
+static pthread_t ws_metrics_thread;
+static atomic_int ws_metrics_serving = 0;
+static int ws_metrics_fd = -1;
+static char ws_metrics_socket_path[sizeof(((struct sockaddr_un*)0)->sun_path)];
+
+static ws_metrics_shard* ws_metrics_shard_get(void)
+{
+	if (ws_metrics_local != NULL)
+	{
+		return ws_metrics_local;
+	}
+
+	// Only happens once per thread
+	static ws_metrics_shard fallback;
+	static int fallback_linked = 0;
+	ws_metrics_shard* shard = calloc(1, sizeof(ws_metrics_shard));
+
+	pthread_mutex_lock(&ws_metrics_lock);
+	if (shard == NULL)
+	{
+		// Shared between threads that can't allocate - counts may be lost but never corrupted.
+		// It is linked into the list like any other shard, but only by the first of them.
+		shard = &fallback;
+	}
+
+	if (shard != &fallback || !fallback_linked)
+	{
+		shard->next = atomic_load(&ws_metrics_shards);
+		atomic_store(&ws_metrics_shards, shard);
+		fallback_linked |= (shard == &fallback);
+	}
+	pthread_mutex_unlock(&ws_metrics_lock);
+
+	ws_metrics_local = shard;
+	return shard;
+}
+
+static inline void ws_metrics_inc(_Atomic uint64_t* value, uint64_t amount)
+{
+	atomic_store_explicit(value, atomic_load_explicit(value, memory_order_relaxed) + amount, memory_order_relaxed);
+}
+
+static int ws_metrics_bucket(uint64_t ns)
+{
+	if (ns <= (1ULL << WS_HIST_FIRST_SHIFT))
+	{
+		return 0;
+	}
+
+	// Bucket i holds values in (4^(i+3), 4^(i+4)]
+	int bits = 64 - __builtin_clzll(ns - 1);
+	int bucket = (bits - WS_HIST_FIRST_SHIFT + 1) / 2;
+	return (bucket > WS_HIST_BUCKETS) ? WS_HIST_BUCKETS : bucket;
+}
+
+void ws_metrics_add(enum ws_counter counter, uint64_t value)
+{
+	ws_metrics_inc(&ws_metrics_shard_get()->counters[counter], value);
+}
+
+void ws_metrics_observe(enum ws_histogram histogram, uint64_t ns)
+{
+	ws_metrics_shard* shard = ws_metrics_shard_get();
+	ws_metrics_inc(&shard->buckets[histogram][ws_metrics_bucket(ns)], 1);
+	ws_metrics_inc(&shard->sums[histogram], ns);
+}
+
+uint64_t ws_metrics_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+uint64_t ws_metrics_counter_total(enum ws_counter counter)
+{
+	uint64_t total = 0;
+	for (ws_metrics_shard* s = atomic_load(&ws_metrics_shards); s != NULL; s = s->next)
+	{
+		total += atomic_load_explicit(&s->counters[counter], memory_order_relaxed);
+	}
+
+	return total;
+}
+
+int ws_metrics_format(char* buffer, int size)
+{
+	int written = 0;
+	ws_metrics_shard* shards = atomic_load(&ws_metrics_shards);
+
+// Appends to the buffer, keeping track of the length that would have been written
+#define WS_METRICS_APPEND(...) 																\
+	written += snprintf(buffer + ((written < size) ? written : size), 							\
+	                    (written < size) ? size - written : 0, __VA_ARGS__)
+
+	for (int c = 0; c < WS_COUNTER_COUNT; c++)
+	{
+		WS_METRICS_APPEND("# HELP %s %s\n# TYPE %s counter\n", ws_counter_names[c], ws_counter_help[c], ws_counter_names[c]);
+		WS_METRICS_APPEND("%s %llu\n", ws_counter_names[c], (unsigned long long)ws_metrics_counter_total(c));
+	}
+
+	for (int h = 0; h < WS_HISTOGRAM_COUNT; h++)
+	{
+		uint64_t buckets[WS_HIST_BUCKETS + 1] = { 0 };
+		uint64_t sum = 0;
+
+		for (ws_metrics_shard* s = shards; s != NULL; s = s->next)
+		{
+			for (int b = 0; b <= WS_HIST_BUCKETS; b++)
+			{
+				buckets[b] += atomic_load_explicit(&s->buckets[h][b], memory_order_relaxed);
+			}
+			sum += atomic_load_explicit(&s->sums[h], memory_order_relaxed);
+		}
+
+		WS_METRICS_APPEND("# HELP %s %s\n# TYPE %s histogram\n", ws_histogram_names[h], ws_histogram_help[h], ws_histogram_names[h]);
+
+		uint64_t cumulative = 0;
+		for (int b = 0; b < WS_HIST_BUCKETS; b++)
+		{
+			cumulative += buckets[b];
+			double le = (double)(1ULL << (WS_HIST_FIRST_SHIFT + 2 * b)) / 1e9;
+			WS_METRICS_APPEND("%s_bucket{le=\"%g\"} %llu\n", ws_histogram_names[h], le, (unsigned long long)cumulative);
+		}
+
+		cumulative += buckets[WS_HIST_BUCKETS];
+		WS_METRICS_APPEND("%s_bucket{le=\"+Inf\"} %llu\n", ws_histogram_names[h], (unsigned long long)cumulative);
+		WS_METRICS_APPEND("%s_sum %.9f\n", ws_histogram_names[h], sum / 1e9);
+		WS_METRICS_APPEND("%s_count %llu\n", ws_histogram_names[h], (unsigned long long)cumulative);
+	}
+
+#undef WS_METRICS_APPEND
+
+	return written;
+}
+
+/* Formats the metrics into a heap buffer, growing it until everything fits */
+static char* ws_metrics_format_alloc(int* length)
+{
+	int size = 8192;
+	char* buffer = NULL;
+
+	for (;;)
+	{
+		char* grown = realloc(buffer, size);
+		if (grown == NULL)
+		{
+			free(buffer);
+			return NULL;
+		}
+
+		buffer = grown;
+		*length = ws_metrics_format(buffer, size);
+		if (*length < size)
+		{
+			return buffer;
+		}
+
+		size = *length + 1;
+	}
+}
+
+int ws_metrics_write_file(const char* path)
+{
+	char tmp_path[4096];
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+	int length;
+	char* text = ws_metrics_format_alloc(&length);
+	if (text == NULL)
+	{
+		return WS_ERR_FILE_IO;
+	}
+
+	FILE* file = fopen(tmp_path, "w");
+	if (file == NULL)
+	{
+		free(text);
+		return WS_ERR_FILE_IO;
+	}
+
+	size_t out = fwrite(text, 1, length, file);
+	free(text);
+
+	if (fclose(file) != 0 || out != (size_t)length)
+	{
+		unlink(tmp_path);
+		return WS_ERR_FILE_IO;
+	}
+
+	if (rename(tmp_path, path) != 0)
+	{
+		unlink(tmp_path);
+		return WS_ERR_FILE_IO;
+	}
+
+	return WS_SUCCESS;
+}
+
+static void* ws_metrics_socket_loop(void* arg)
+{
+	struct pollfd pfd = { .fd = ws_metrics_fd, .events = POLLIN };
+
+	while (atomic_load(&ws_metrics_serving))
+	{
+		// Wake up regularly so that ws_metrics_stop_socket() doesn't block for long
+		if (poll(&pfd, 1, 250) <= 0)
+		{
+			continue;
+		}
+
+		int client = accept(ws_metrics_fd, NULL, NULL);
+		if (client < 0)
+		{
+			continue;
+		}
+
+		int length;
+		char* text = ws_metrics_format_alloc(&length);
+		if (text != NULL)
+		{
+			int sent = 0;
+			while (sent < length)
+			{
+				ssize_t n = send(client, text + sent, length - sent, MSG_NOSIGNAL);
+				if (n <= 0)
+				{
+					break;
+				}
+				sent += n;
+			}
+			free(text);
+		}
+
+		close(client);
+	}
+
+	return NULL;
+}
+
+int ws_metrics_serve_socket(const char* path)
+{
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+
+	if (strlen(path) >= sizeof(addr.sun_path) || atomic_load(&ws_metrics_serving))
+	{
+		return WS_ERR_SOCKET;
+	}
+
+	strcpy(addr.sun_path, path);
+	unlink(path);
+
+	ws_metrics_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (ws_metrics_fd < 0)
+	{
+		return WS_ERR_SOCKET;
+	}
+
+	if (bind(ws_metrics_fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(ws_metrics_fd, 8) != 0)
+	{
+		close(ws_metrics_fd);
+		ws_metrics_fd = -1;
+		return WS_ERR_SOCKET;
+	}
+
+	strcpy(ws_metrics_socket_path, path);
+	atomic_store(&ws_metrics_serving, 1);
+
+	if (pthread_create(&ws_metrics_thread, NULL, ws_metrics_socket_loop, NULL) != 0)
+	{
+		atomic_store(&ws_metrics_serving, 0);
+		close(ws_metrics_fd);
+		unlink(path);
+		ws_metrics_fd = -1;
+		return WS_ERR_THREAD;
+	}
+
+	return WS_SUCCESS;
+}
+
+void ws_metrics_stop_socket(void)
+{
+	if (!atomic_load(&ws_metrics_serving))
+	{
+		return;
+	}
+
+	atomic_store(&ws_metrics_serving, 0);
+	pthread_join(ws_metrics_thread, NULL);
+
+	close(ws_metrics_fd);
+	unlink(ws_metrics_socket_path);
+	ws_metrics_fd = -1;
+}
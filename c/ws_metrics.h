@@ -0,0 +1,131 @@
+#ifndef WS_METRICS_H
+#define WS_METRICS_H
+
+#include <stdint.h>
+
+/**
+	Counters that are kept for the hot paths. Each entry is the enum name, the name
+	of the metric when it is exported and a short description of the metric.
+*/
+
+#define FOREACH_WS_COUNTER(COUNTER) 																			\
+	COUNTER(WS_CTR_CONTROL_TRANSFERS, "ws_usb_control_transfers_total", "Control transfers sent to the station")	\
+	COUNTER(WS_CTR_BULK_TRANSFERS, "ws_usb_bulk_transfers_total", "Bulk transfers read from the station")			\
+	COUNTER(WS_CTR_USB_ERRORS, "ws_usb_errors_total", "libusb calls that returned an error")						\
+	COUNTER(WS_CTR_USB_TIMEOUTS, "ws_usb_timeouts_total", "libusb transfers that timed out")						\
+	COUNTER(WS_CTR_USB_RETRIES, "ws_usb_retries_total", "Block reads that were retried")							\
+	COUNTER(WS_CTR_USB_RESETS, "ws_usb_resets_total", "Device resets after repeated failures")						\
+	COUNTER(WS_CTR_STABLE_BLOCK_READS, "ws_stable_block_reads_total", "Calls to ws_read_stable_block")				\
+	COUNTER(WS_CTR_STABLE_BLOCK_RETRIES, "ws_stable_block_retries_total", "Extra iterations of ws_read_stable_block")\
+	COUNTER(WS_CTR_RECORDS_DECODED, "ws_records_decoded_total", "Weather records decoded")							\
+	COUNTER(WS_CTR_ROWS_INSERTED, "ws_store_rows_inserted_total", "Rows inserted into the database")				\
+	COUNTER(WS_CTR_DB_ERRORS, "ws_store_errors_total", "sqlite3 calls that returned an error")						\
+	COUNTER(WS_CTR_COMMITS, "ws_store_commits_total", "Transactions committed")										\
+	COUNTER(WS_CTR_LOG_DROPPED, "ws_log_dropped_total", "Log entries dropped because the thread's ring was full")	\
+
+/**
+	Latency histograms. All latencies are recorded in nanoseconds and exported in seconds.
+*/
+
+#define FOREACH_WS_HISTOGRAM(HISTOGRAM) 																				\
+	HISTOGRAM(WS_HIST_CONTROL_TRANSFER, "ws_usb_control_transfer_seconds", "Latency of control transfers")			\
+	HISTOGRAM(WS_HIST_BULK_TRANSFER, "ws_usb_bulk_transfer_seconds", "Latency of 8 byte bulk transfers")			\
+	HISTOGRAM(WS_HIST_DECODE, "ws_record_decode_seconds", "Time taken by ws_process_record_data")					\
+	HISTOGRAM(WS_HIST_COMMIT, "ws_store_commit_seconds", "Latency of COMMIT statements")							\
+
+#define GENERATE_METRIC_ENUM(ENUM, NAME, HELP) ENUM,
+
+enum ws_counter {
+	FOREACH_WS_COUNTER(GENERATE_METRIC_ENUM)
+	WS_COUNTER_COUNT
+};
+
+enum ws_histogram {
+	FOREACH_WS_HISTOGRAM(GENERATE_METRIC_ENUM)
+	WS_HISTOGRAM_COUNT
+};
+
+/**
+	Histogram buckets are powers of 4 nanoseconds, starting at 256ns (4^4) and ending
+	at ~4.3s (4^16). Anything larger goes in the +Inf bucket.
+*/
+#define WS_HIST_FIRST_SHIFT 8
+#define WS_HIST_BUCKETS 13
+
+
+/**
+	Adds a value to a counter. The counter belongs to the calling thread, so no
+	locking takes place.
+
+	Parameters:
+		counter 	The counter to add to
+		value		The amount to add
+*/
+void ws_metrics_add(enum ws_counter counter, uint64_t value);
+
+/**
+	Records a single latency observation in a histogram.
+
+	Parameters:
+		histogram 	The histogram to record into
+		ns			The latency in nanoseconds
+*/
+void ws_metrics_observe(enum ws_histogram histogram, uint64_t ns);
+
+/**
+	Returns a monotonic timestamp in nanoseconds, used for timing the hot paths.
+	Only the difference between two timestamps has any meaning.
+*/
+uint64_t ws_metrics_now(void);
+
+/**
+	Returns the sum of a counter across every thread.
+*/
+uint64_t ws_metrics_counter_total(enum ws_counter counter);
+
+/**
+	Writes all of the metrics, summed across threads, in the Prometheus text
+	exposition format into the buffer.
+
+	Parameters:
+		buffer 		Buffer to write to
+		size		The size of the buffer
+
+	Return:
+		The number of bytes that would be written (like snprintf). If this is >= size
+		then the output was truncated.
+*/
+int ws_metrics_format(char* buffer, int size);
+
+/**
+	Writes the metrics to a file. The metrics are written to a temporary file which
+	is then renamed, so a reader (for example the node exporter textfile collector)
+	will never see a partially written file.
+
+	Parameters:
+		path 		The path of the file
+
+	Return:
+		- WS_ERR_FILE_IO		The file could not be written
+*/
+int ws_metrics_write_file(const char* path);
+
+/**
+	Starts a background thread that listens on a Unix domain socket. Every
+	connection is sent the current metrics and then closed.
+
+	Parameters:
+		path 		Path of the socket. Any existing file at this path is removed.
+
+	Return:
+		- WS_ERR_SOCKET			The socket could not be created
+		- WS_ERR_THREAD			The listening thread could not be started
+*/
+int ws_metrics_serve_socket(const char* path);
+
+/**
+	Stops the thread started by ws_metrics_serve_socket() and removes the socket.
+*/
+void ws_metrics_stop_socket(void);
+
+#endif
@@ -0,0 +1,136 @@
+#include "ws_policy.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// How often (in samples) the timeout is recalculated, and the samples needed before it is
+#define WS_POLICY_RECALC 8
+#define WS_POLICY_WARMUP 8
+
+void ws_policy_init(ws_transfer_policy* policy)
+{
+	memset(policy, 0, sizeof(ws_transfer_policy));
+
+	policy->percentile = 99;
+	policy->multiplier = 4;
+	policy->min_timeout = 20;
+	policy->max_timeout = 1000;
+	policy->max_attempts = 5;
+	policy->backoff_base = 10;
+	policy->backoff_max = 500;
+	policy->reset_after = 3;
+
+	policy->timeout = 250;
+	policy->seed = (unsigned int)time(NULL) ^ (unsigned int)(uintptr_t)policy;
+}
+
+unsigned int ws_policy_timeout(ws_transfer_policy* policy)
+{
+	return policy->timeout;
+}
+
+static int ws_policy_cmp(const void* a, const void* b)
+{
+	uint32_t x = *(const uint32_t*)a;
+	uint32_t y = *(const uint32_t*)b;
+	return (x > y) - (x < y);
+}
+
+static void ws_policy_recalculate(ws_transfer_policy* policy)
+{
+	uint32_t sorted[WS_POLICY_WINDOW];
+	int count = policy->latency_count;
+
+	memcpy(sorted, policy->latencies, count * sizeof(uint32_t));
+	qsort(sorted, count, sizeof(uint32_t), ws_policy_cmp);
+
+	int index = (count * policy->percentile + 99) / 100 - 1;
+	index = (index < 0) ? 0 : (index >= count) ? count - 1 : index;
+
+	// Microseconds to milliseconds, rounding up
+	uint64_t timeout = ((uint64_t)sorted[index] * policy->multiplier + 999) / 1000;
+
+	if (timeout < policy->min_timeout)
+	{
+		timeout = policy->min_timeout;
+	}
+
+	if (timeout > policy->max_timeout)
+	{
+		timeout = policy->max_timeout;
+	}
+
+	policy->timeout = timeout;
+}
+
+void ws_policy_record_latency(ws_transfer_policy* policy, uint64_t ns)
+{
+	uint64_t us = ns / 1000;
+	policy->latencies[policy->latency_next] = (us > UINT32_MAX) ? UINT32_MAX : us;
+	policy->latency_next = (policy->latency_next + 1) % WS_POLICY_WINDOW;
+
+	if (policy->latency_count < WS_POLICY_WINDOW)
+	{
+		policy->latency_count++;
+	}
+
+	if (policy->latency_count >= WS_POLICY_WARMUP && policy->latency_next % WS_POLICY_RECALC == 0)
+	{
+		ws_policy_recalculate(policy);
+	}
+}
+
+void ws_policy_record_timeout(ws_transfer_policy* policy)
+{
+	// The transfer took at least the timeout, so that is its latency as far as is known
+	ws_policy_record_latency(policy, (uint64_t)policy->timeout * 1000000);
+
+	// Don't wait for the next recalculation, or a bus that has slowed down times out on every transfer until then
+	if (policy->latency_count >= WS_POLICY_WARMUP)
+	{
+		ws_policy_recalculate(policy);
+	}
+}
+
+void ws_policy_record_success(ws_transfer_policy* policy)
+{
+	policy->consecutive_failures = 0;
+}
+
+int ws_policy_record_failure(ws_transfer_policy* policy, int error, int address, int attempt)
+{
+	policy->consecutive_failures++;
+
+	if (policy->on_failure != NULL)
+	{
+		policy->on_failure(error, address, attempt, policy->user);
+	}
+
+	return policy->reset_after > 0 && policy->consecutive_failures % policy->reset_after == 0;
+}
+
+uint64_t ws_policy_backoff_ms(ws_transfer_policy* policy, int attempt)
+{
+	uint64_t backoff = policy->backoff_base;
+	for (int i = 1; i < attempt && backoff < policy->backoff_max; i++)
+	{
+		backoff *= 2;
+	}
+
+	if (backoff > policy->backoff_max)
+	{
+		backoff = policy->backoff_max;
+	}
+
+	return (backoff == 0) ? 0 : rand_r(&policy->seed) % (backoff + 1);
+}
+
+void ws_policy_backoff(ws_transfer_policy* policy, int attempt)
+{
+	uint64_t sleep_ms = ws_policy_backoff_ms(policy, attempt);
+
+	struct timespec ts;
+	ts.tv_sec = sleep_ms / 1000;
+	ts.tv_nsec = (sleep_ms % 1000) * 1000000;
+	nanosleep(&ts, NULL);
+}
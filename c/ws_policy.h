@@ -0,0 +1,123 @@
+#ifndef WS_POLICY_H
+#define WS_POLICY_H
+
+#include <stdint.h>
+
+/**
+	Number of transfer latencies kept for working out the timeout
+*/
+#define WS_POLICY_WINDOW 64
+
+/**
+	Called every time a block read fails, even if a later retry succeeds.
+
+	Parameters:
+		error		The WS_ERR_* error of the failed attempt
+		address		The address that was being read
+		attempt		The attempt number, starting at 1
+		user		The user pointer stored in the policy
+*/
+typedef void (*ws_policy_failure_cb)(int error, int address, int attempt, void* user);
+
+/**
+	Controls how transfers to the station are timed out and retried. The timeout of
+	each transfer is taken from a rolling percentile of the latencies that have been seen,
+	so that a stalled transfer is given up on quickly but a slow bus is not.
+
+	All times are in milliseconds. ws_policy_init() fills in the defaults, which can then
+	be changed.
+*/
+typedef struct
+{
+	// Settings
+	int percentile;					// Percentile of observed latency used (1 - 100)
+	int multiplier;					// Timeout is the percentile multiplied by this
+	unsigned int min_timeout;
+	unsigned int max_timeout;
+	int max_attempts;				// Attempts of a single block read before giving up
+	unsigned int backoff_base;		// Backoff before the second attempt, doubled each attempt
+	unsigned int backoff_max;
+	int reset_after;				// Consecutive failures before the device is reset
+	ws_policy_failure_cb on_failure;
+	void* user;
+
+	// State
+	uint32_t latencies[WS_POLICY_WINDOW];	// Microseconds
+	int latency_count;
+	int latency_next;
+	unsigned int timeout;					// Current timeout
+	int consecutive_failures;
+	unsigned int seed;
+} ws_transfer_policy;
+
+
+/**
+	Fills out a policy with the default settings.
+
+	Parameters:
+		policy 		The policy to initialise
+*/
+void ws_policy_init(ws_transfer_policy* policy);
+
+/**
+	Returns the timeout that the next transfer should use, in milliseconds.
+*/
+unsigned int ws_policy_timeout(ws_transfer_policy* policy);
+
+/**
+	Records the latency of a successful transfer and updates the timeout.
+
+	Parameters:
+		policy 		The policy
+		ns			The latency of the transfer in nanoseconds
+*/
+void ws_policy_record_latency(ws_transfer_policy* policy, uint64_t ns);
+
+/**
+	Records a transfer that timed out, as a latency of the current timeout, and updates the
+	timeout straight away. Without this only transfers that finished in time would be seen,
+	so the timeout could never grow to suit a slower bus.
+
+	Parameters:
+		policy 		The policy
+*/
+void ws_policy_record_timeout(ws_transfer_policy* policy);
+
+/**
+	Records a successful block read, clearing the consecutive failure count.
+*/
+void ws_policy_record_success(ws_transfer_policy* policy);
+
+/**
+	Records a failed block read and reports it to the failure callback.
+
+	Parameters:
+		policy 		The policy
+		error		The WS_ERR_* error
+		address		The address being read
+		attempt		The attempt that failed, starting at 1
+
+	Return:
+		1 if the device should now be reset, otherwise 0.
+*/
+int ws_policy_record_failure(ws_transfer_policy* policy, int error, int address, int attempt);
+
+/**
+	Sleeps before the next attempt. The sleep is a random time between 0 and the
+	backoff for the attempt (full jitter), so retries from different callers don't line up.
+
+	Parameters:
+		policy 		The policy
+		attempt		The attempt that just failed, starting at 1
+*/
+void ws_policy_backoff(ws_transfer_policy* policy, int attempt);
+
+/**
+	Picks how long to wait before the next attempt, as ws_policy_backoff() but without sleeping.
+
+	Return:
+		The time to wait in milliseconds
+*/
+uint64_t ws_policy_backoff_ms(ws_transfer_policy* policy, int attempt);
+
+#endif
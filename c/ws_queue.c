@@ -0,0 +1,482 @@
+#include "ws_queue.h"
+#include "ws_metrics.h"
+#include "ws_policy.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+typedef struct ws_queue_request
+{
+	int address;
+	int stable;
+	int priority;
+	int in_use;
+	int in_flight;
+
+	int attempt;						// Attempt of the next transfer, starting at 1
+	int have_first;						// For a stable read, first holds the previous read
+	int stable_reads;					// Reads that didn't match the one before
+	unsigned char first[WS_BLOCK_SIZE];
+	unsigned char data[WS_BLOCK_SIZE];
+	uint64_t not_before;				// Monotonic time before which a retry mustn't be made
+
+	ws_queue_future* waiters;
+	struct ws_queue_request* next;
+} ws_queue_request;
+
+typedef struct
+{
+	ws_queue_request* head;
+	ws_queue_request* tail;
+} ws_queue_list;
+
+static pthread_mutex_t ws_queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ws_queue_work;				// Signalled when a request is queued
+static pthread_cond_t ws_queue_done;				// Broadcast when a future is done
+static ws_queue_request ws_queue_requests[WS_QUEUE_MAX_REQUESTS];
+static ws_queue_list ws_queue_lists[WS_QUEUE_PRIORITIES];
+static ws_device* ws_queue_device = NULL;
+static pthread_t ws_queue_thread;
+static int ws_queue_running = 0;
+static int ws_queue_in_use = 0;
+
+static void ws_queue_push(ws_queue_request* request, int front)
+{
+	ws_queue_list* list = &ws_queue_lists[request->priority];
+	request->next = NULL;
+
+	if (list->head == NULL)
+	{
+		list->head = list->tail = request;
+	} else if (front) {
+		request->next = list->head;
+		list->head = request;
+	} else {
+		list->tail->next = request;
+		list->tail = request;
+	}
+}
+
+static void ws_queue_remove(ws_queue_request* request)
+{
+	ws_queue_list* list = &ws_queue_lists[request->priority];
+	ws_queue_request* previous = NULL;
+
+	for (ws_queue_request* r = list->head; r != NULL; previous = r, r = r->next)
+	{
+		if (r != request)
+		{
+			continue;
+		}
+
+		if (previous == NULL)
+		{
+			list->head = r->next;
+		} else {
+			previous->next = r->next;
+		}
+
+		if (list->tail == r)
+		{
+			list->tail = previous;
+		}
+		return;
+	}
+}
+
+/* Finds the next request to serve: the first ready request of the highest priority. If none are
+   ready, wake is set to when the first will be (0 if nothing is queued). */
+static ws_queue_request* ws_queue_next(uint64_t now, uint64_t* wake)
+{
+	*wake = 0;
+
+	for (int p = 0; p < WS_QUEUE_PRIORITIES; p++)
+	{
+		for (ws_queue_request* r = ws_queue_lists[p].head; r != NULL; r = r->next)
+		{
+			if (r->not_before <= now)
+			{
+				return r;
+			}
+
+			if (*wake == 0 || r->not_before < *wake)
+			{
+				*wake = r->not_before;
+			}
+		}
+	}
+
+	return NULL;
+}
+
+static int ws_queue_submit(int address, int priority, int flags, ws_queue_future* future)
+{
+	address -= address % WS_BLOCK_SIZE;
+	priority = (priority < 0) ? 0 : (priority >= WS_QUEUE_PRIORITIES) ? WS_QUEUE_PRIORITIES - 1 : priority;
+	int stable = (flags & WS_QUEUE_STABLE) != 0;
+
+	future->done = 0;
+	future->next = NULL;
+
+	pthread_mutex_lock(&ws_queue_lock);
+
+	if (!ws_queue_running)
+	{
+		pthread_mutex_unlock(&ws_queue_lock);
+		return WS_ERR_NOT_RUNNING;
+	}
+
+	ws_queue_request* request = NULL;
+	ws_queue_request* free_request = NULL;
+
+	for (int i = 0; i < WS_QUEUE_MAX_REQUESTS; i++)
+	{
+		ws_queue_request* r = &ws_queue_requests[i];
+		if (!r->in_use)
+		{
+			free_request = (free_request == NULL) ? r : free_request;
+		} else if (r->address == address && r->stable == stable) {
+			request = r;
+			break;
+		}
+	}
+
+	if (request != NULL)
+	{
+		// Already queued or being read, so wait for that read, moving it up if this one is more urgent
+		future->next = request->waiters;
+		request->waiters = future;
+
+		if (priority < request->priority)
+		{
+			if (!request->in_flight)
+			{
+				ws_queue_remove(request);
+				request->priority = priority;
+				ws_queue_push(request, 0);
+			} else {
+				request->priority = priority;
+			}
+		}
+
+		pthread_mutex_unlock(&ws_queue_lock);
+		return WS_SUCCESS;
+	}
+
+	int limit = (priority == WS_QUEUE_BACKFILL) ? WS_QUEUE_MAX_REQUESTS - WS_QUEUE_RESERVED : WS_QUEUE_MAX_REQUESTS;
+	if (free_request == NULL || ws_queue_in_use >= limit)
+	{
+		pthread_mutex_unlock(&ws_queue_lock);
+		return WS_ERR_QUEUE_FULL;
+	}
+
+	request = free_request;
+	memset(request, 0, sizeof(ws_queue_request));
+	request->address = address;
+	request->stable = stable;
+	request->priority = priority;
+	request->in_use = 1;
+	request->attempt = 1;
+	ws_queue_in_use++;
+	request->waiters = future;
+
+	if (stable)
+	{
+		ws_metrics_add(WS_CTR_STABLE_BLOCK_READS, 1);
+	}
+
+	ws_queue_push(request, 0);
+	pthread_cond_signal(&ws_queue_work);
+	pthread_mutex_unlock(&ws_queue_lock);
+	return WS_SUCCESS;
+}
+
+/* Hands the result to every waiter. Called without the lock, once the request has been freed. */
+static void ws_queue_complete(ws_queue_future* waiters, int status, const unsigned char* data)
+{
+	while (waiters != NULL)
+	{
+		// The future may be gone as soon as it's marked done
+		ws_queue_future* next = waiters->next;
+
+		if (waiters->callback != NULL)
+		{
+			waiters->callback(status, data, waiters->user);
+			free(waiters);
+		} else {
+			pthread_mutex_lock(&ws_queue_lock);
+			waiters->status = status;
+			memcpy(waiters->data, data, WS_BLOCK_SIZE);
+			waiters->done = 1;
+			pthread_cond_broadcast(&ws_queue_done);
+			pthread_mutex_unlock(&ws_queue_lock);
+		}
+
+		waiters = next;
+	}
+}
+
+/* Works out what happens to a request after one transfer. Returns 1 if it is finished. */
+static int ws_queue_advance(ws_queue_request* request, int status, int reset_failed, const unsigned char* data, int* result)
+{
+	ws_transfer_policy* policy = &ws_queue_device->policy;
+	int attempts = (policy->max_attempts > 0) ? policy->max_attempts : 1;
+
+	if (status == WS_SUCCESS)
+	{
+		request->attempt = 1;
+		request->not_before = 0;
+
+		if (request->stable && !request->have_first)
+		{
+			memcpy(request->first, data, WS_BLOCK_SIZE);
+			request->have_first = 1;
+			return 0;
+		}
+
+		if (request->stable && !ws_cmp_data(request->first, (unsigned char*)data, WS_BLOCK_SIZE))
+		{
+			// Compare the next read with this one
+			ws_metrics_add(WS_CTR_STABLE_BLOCK_RETRIES, 1);
+			memcpy(request->first, data, WS_BLOCK_SIZE);
+
+			if (++request->stable_reads >= WS_STABLE_BLOCK_MAX_READS)
+			{
+				*result = WS_ERR_UNSTABLE_BLOCK;
+				return 1;
+			}
+			return 0;
+		}
+
+		memcpy(request->data, data, WS_BLOCK_SIZE);
+		*result = WS_SUCCESS;
+		return 1;
+	}
+
+	// A device that couldn't be reset or initialised again won't do any better for retrying
+	if (reset_failed || request->attempt >= attempts)
+	{
+		*result = status;
+		return 1;
+	}
+
+	// Wait out the backoff without holding up the other requests
+	ws_metrics_add(WS_CTR_USB_RETRIES, 1);
+	request->not_before = ws_metrics_now() + ws_policy_backoff_ms(policy, request->attempt) * 1000000ULL;
+	request->attempt++;
+	return 0;
+}
+
+static void* ws_queue_loop(void* arg)
+{
+	pthread_mutex_lock(&ws_queue_lock);
+
+	while (ws_queue_running)
+	{
+		uint64_t wake;
+		ws_queue_request* request = ws_queue_next(ws_metrics_now(), &wake);
+
+		if (request == NULL)
+		{
+			if (wake == 0)
+			{
+				pthread_cond_wait(&ws_queue_work, &ws_queue_lock);
+			} else {
+				struct timespec until = { (time_t)(wake / 1000000000ULL), (long)(wake % 1000000000ULL) };
+				pthread_cond_timedwait(&ws_queue_work, &ws_queue_lock, &until);
+			}
+			continue;
+		}
+
+		ws_queue_remove(request);
+		request->in_flight = 1;
+		int address = request->address;
+		int attempt = request->attempt;
+		pthread_mutex_unlock(&ws_queue_lock);
+
+		// Only ever one transfer between looking at the queue, so a live read waits for one transfer at most
+		unsigned char data[WS_BLOCK_SIZE];
+		int read = 0;
+		int reset_failed = 0;
+		int status = ws_read_block_attempt(ws_queue_device, address, data, &read, attempt, &reset_failed);
+		if (status == WS_SUCCESS && read != WS_BLOCK_SIZE)
+		{
+			status = WS_ERR_TOO_LITTLE_DATA_READ;
+		}
+
+		pthread_mutex_lock(&ws_queue_lock);
+		request->in_flight = 0;
+
+		int result;
+		if (!ws_queue_advance(request, status, reset_failed, data, &result))
+		{
+			// A stable read or retry carries on ahead of requests of the same priority
+			ws_queue_push(request, 1);
+			continue;
+		}
+
+		ws_queue_future* waiters = request->waiters;
+		unsigned char block[WS_BLOCK_SIZE];
+		memcpy(block, request->data, WS_BLOCK_SIZE);
+		request->in_use = 0;
+		ws_queue_in_use--;
+		pthread_mutex_unlock(&ws_queue_lock);
+
+		ws_queue_complete(waiters, result, block);
+		pthread_mutex_lock(&ws_queue_lock);
+	}
+
+	// Fail everything still queued
+	for (int p = 0; p < WS_QUEUE_PRIORITIES; p++)
+	{
+		while (ws_queue_lists[p].head != NULL)
+		{
+			ws_queue_request* request = ws_queue_lists[p].head;
+			ws_queue_lists[p].head = request->next;
+
+			ws_queue_future* waiters = request->waiters;
+			request->in_use = 0;
+			ws_queue_in_use--;
+
+			unsigned char empty[WS_BLOCK_SIZE];
+			memset(empty, 0, sizeof(empty));
+
+			pthread_mutex_unlock(&ws_queue_lock);
+			ws_queue_complete(waiters, WS_ERR_NOT_RUNNING, empty);
+			pthread_mutex_lock(&ws_queue_lock);
+		}
+		ws_queue_lists[p].tail = NULL;
+	}
+
+	pthread_mutex_unlock(&ws_queue_lock);
+	return NULL;
+}
+
+int ws_queue_start(ws_device* dev)
+{
+	pthread_condattr_t attributes;
+	pthread_condattr_init(&attributes);
+	pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC);
+	pthread_cond_init(&ws_queue_work, &attributes);
+	pthread_cond_init(&ws_queue_done, NULL);
+	pthread_condattr_destroy(&attributes);
+
+	memset(ws_queue_requests, 0, sizeof(ws_queue_requests));
+	memset(ws_queue_lists, 0, sizeof(ws_queue_lists));
+	ws_queue_in_use = 0;
+	ws_queue_device = dev;
+	ws_queue_running = 1;
+
+	if (pthread_create(&ws_queue_thread, NULL, ws_queue_loop, NULL) != 0)
+	{
+		ws_queue_running = 0;
+		return WS_ERR_THREAD;
+	}
+
+	return WS_SUCCESS;
+}
+
+void ws_queue_stop(void)
+{
+	pthread_mutex_lock(&ws_queue_lock);
+	if (!ws_queue_running)
+	{
+		pthread_mutex_unlock(&ws_queue_lock);
+		return;
+	}
+
+	ws_queue_running = 0;
+	pthread_cond_signal(&ws_queue_work);
+	pthread_mutex_unlock(&ws_queue_lock);
+
+	pthread_join(ws_queue_thread, NULL);
+	pthread_cond_destroy(&ws_queue_work);
+	pthread_cond_destroy(&ws_queue_done);
+	ws_queue_device = NULL;
+}
+
+int ws_queue_read(int address, int priority, int flags, ws_queue_future* future)
+{
+	future->callback = NULL;
+	future->user = NULL;
+	return ws_queue_submit(address, priority, flags, future);
+}
+
+int ws_queue_wait(ws_queue_future* future)
+{
+	pthread_mutex_lock(&ws_queue_lock);
+	while (!future->done)
+	{
+		pthread_cond_wait(&ws_queue_done, &ws_queue_lock);
+	}
+	pthread_mutex_unlock(&ws_queue_lock);
+
+	return future->status;
+}
+
+int ws_queue_read_async(int address, int priority, int flags, ws_queue_cb callback, void* user)
+{
+	ws_queue_future* future = malloc(sizeof(ws_queue_future));
+	if (future == NULL)
+	{
+		return WS_ERR_FILE_IO;
+	}
+
+	future->callback = callback;
+	future->user = user;
+
+	int status = ws_queue_submit(address, priority, flags, future);
+	if (status != WS_SUCCESS)
+	{
+		free(future);
+	}
+
+	return status;
+}
+
+int ws_queue_read_block(int address, int priority, int flags, unsigned char* data)
+{
+	ws_queue_future future;
+	int status = ws_queue_read(address, priority, flags, &future);
+	if (status != WS_SUCCESS)
+	{
+		return status;
+	}
+
+	status = ws_queue_wait(&future);
+	if (status == WS_SUCCESS)
+	{
+		memcpy(data, future.data, WS_BLOCK_SIZE);
+	}
+
+	return status;
+}
+
+int ws_queue_is_running(void)
+{
+	pthread_mutex_lock(&ws_queue_lock);
+	int running = ws_queue_running;
+	pthread_mutex_unlock(&ws_queue_lock);
+
+	return running;
+}
+
+int ws_queue_device_read(ws_device* dev, int address, int priority, int flags, unsigned char* data)
+{
+	address -= address % WS_BLOCK_SIZE;
+
+	if (ws_queue_is_running())
+	{
+		return ws_queue_read_block(address, priority, flags, data);
+	}
+
+	int read = 0;
+	int status = (flags & WS_QUEUE_STABLE) ? ws_read_stable_block(dev, address, data, &read) : ws_read_block(dev, address, data, &read);
+	if (status == WS_SUCCESS && read != WS_BLOCK_SIZE)
+	{
+		status = WS_ERR_TOO_LITTLE_DATA_READ;
+	}
+
+	return status;
+}
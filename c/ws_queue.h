@@ -0,0 +1,144 @@
+#ifndef WS_QUEUE_H
+#define WS_QUEUE_H
+
+#include "ws.h"
+
+/*
+	A thread that owns a ws_device and reads blocks for any number of other threads.
+
+	Requests are served in priority order, one transfer at a time: a stable read is two
+	or more transfers and a failed transfer is retried after the policy's backoff, but
+	each transfer is queued again in between, so a live read never waits for more than
+	the one transfer in progress. Requests for a block that is already queued (or being
+	read) wait for that read rather than reading it again.
+*/
+
+enum ws_queue_priority {
+	WS_QUEUE_LIVE,					// The record being written and the fixed block
+	WS_QUEUE_EXTREMES,
+	WS_QUEUE_BACKFILL,				// History
+	WS_QUEUE_PRIORITIES
+};
+
+// Read the block until two reads in a row agree, as ws_read_stable_block()
+#define WS_QUEUE_STABLE 0x01
+
+// Most requests queued at once, not counting the requests merged with them
+#define WS_QUEUE_MAX_REQUESTS 256
+
+// Requests kept free for reads more urgent than backfill, so backfill can't crowd them out
+#define WS_QUEUE_RESERVED 32
+
+/**
+	Called on the queue's thread when a read finishes. It should return quickly, as no other
+	reads are made while it runs.
+
+	Parameters:
+		status 		WS_SUCCESS or the error from the read
+		data		The block (WS_BLOCK_SIZE bytes), only valid during the call
+		user		As passed to ws_queue_read_async()
+*/
+typedef void (*ws_queue_cb)(int status, const unsigned char* data, void* user);
+
+/**
+	The result of a read, filled in by the queue's thread. Must stay valid until
+	ws_queue_wait() returns.
+*/
+typedef struct ws_queue_future
+{
+	int status;
+	unsigned char data[WS_BLOCK_SIZE];
+	int done;
+
+	ws_queue_cb callback;				// Set for ws_queue_read_async()
+	void* user;
+	struct ws_queue_future* next;		// Next waiter for the same read
+} ws_queue_future;
+
+
+/**
+	Starts the thread. The device must have been initialised for reading, and must not
+	be used by anything else until ws_queue_stop().
+
+	Return:
+		- WS_ERR_THREAD			The thread could not be started
+*/
+int ws_queue_start(ws_device* dev);
+
+/**
+	Stops the thread once the read in progress is finished. Requests still queued
+	fail with WS_ERR_NOT_RUNNING.
+*/
+void ws_queue_stop(void);
+
+/**
+	Queues a read, to be waited for with ws_queue_wait().
+
+	Parameters:
+		address		The address of the block (rounded down to a block)
+		priority	A ws_queue_priority
+		flags		WS_QUEUE_STABLE or 0
+		future		Filled in when the read is done
+
+	Return:
+		- WS_ERR_NOT_RUNNING	The thread isn't running
+		- WS_ERR_QUEUE_FULL		There are already WS_QUEUE_MAX_REQUESTS requests queued (or
+								WS_QUEUE_MAX_REQUESTS - WS_QUEUE_RESERVED for backfill)
+*/
+int ws_queue_read(int address, int priority, int flags, ws_queue_future* future);
+
+/**
+	Waits for a read queued by ws_queue_read().
+
+	Return:
+		The status of the read
+*/
+int ws_queue_wait(ws_queue_future* future);
+
+/**
+	Queues a read, calling a callback on the queue's thread when it is done.
+
+	Return:
+		- WS_ERR_NOT_RUNNING	The thread isn't running
+		- WS_ERR_QUEUE_FULL		There are already too many requests queued, as ws_queue_read()
+		- WS_ERR_FILE_IO		Out of memory
+*/
+int ws_queue_read_async(int address, int priority, int flags, ws_queue_cb callback, void* user);
+
+/**
+	Reads a block through the queue, waiting for it.
+
+	Parameters:
+		address		The address of the block
+		priority	A ws_queue_priority
+		flags		WS_QUEUE_STABLE or 0
+		data		Filled with the block (WS_BLOCK_SIZE bytes)
+
+	Return:
+		- Any error from ws_queue_read() or the read
+*/
+int ws_queue_read_block(int address, int priority, int flags, unsigned char* data);
+
+/**
+	Whether the thread is running, so reads have to go through the queue.
+*/
+int ws_queue_is_running(void);
+
+/**
+	Reads a block through the queue if it is running, otherwise straight from the device,
+	so the same code can read with or without the queue.
+
+	Parameters:
+		dev			The device to read if the queue isn't running
+		address		The address of the block (rounded down to a block)
+		priority	A ws_queue_priority
+		flags		WS_QUEUE_STABLE or 0
+		data		Filled with the block (WS_BLOCK_SIZE bytes)
+
+	Return:
+		- WS_ERR_TOO_LITTLE_DATA_READ	Less than a block was read
+		- Any error from ws_queue_read_block(), ws_read_block() or ws_read_stable_block()
+*/
+int ws_queue_device_read(ws_device* dev, int address, int priority, int flags, unsigned char* data);
+
+#endif
@@ -0,0 +1,191 @@
+#include "ws_schedule.h"
+#include "ws_sync.h"
+#include "ws_queue.h"
+#include <string.h>
+#include <errno.h>
+
+void ws_schedule_init(ws_schedule* schedule)
+{
+	memset(schedule, 0, sizeof(ws_schedule));
+	schedule->read_period = 30;
+	schedule->position = -1;
+}
+
+/* Predicts the next write from the latest record's delay alone */
+static void ws_schedule_estimate(ws_schedule* schedule, time_t now)
+{
+	// The delay counts whole minutes, so the last write was up to a minute before it says
+	time_t last_start = now - (time_t)(schedule->delay + 1) * 60;
+	time_t last_end = now - (time_t)schedule->delay * 60;
+
+	schedule->window_start = last_start + (time_t)schedule->read_period * 60;
+	schedule->window_end = last_end + (time_t)schedule->read_period * 60;
+
+	// The station is late, so it could write at any moment
+	if (schedule->window_end < now)
+	{
+		schedule->window_start = now;
+		schedule->window_end = now + 60;
+	}
+
+	schedule->probed = 0;
+}
+
+int ws_schedule_poll(ws_schedule* schedule, ws_device* dev, int* new_records)
+{
+	*new_records = 0;
+
+	// A probe is made while the station may be writing, when a stable read would keep finding
+	// the block changed, so it reads once and only falls back to a stable read if that read
+	// doesn't make sense
+	time_t probe_time = time(NULL);
+	int probing = schedule->position >= 0 && probe_time >= schedule->window_start && probe_time <= schedule->window_end;
+
+	unsigned char fixed[WS_BLOCK_SIZE];
+	ws_sync_plan plan;
+	int status = WS_ERR_TOO_LITTLE_DATA_READ;
+
+	if (probing)
+	{
+		status = ws_queue_device_read(dev, 0, WS_QUEUE_LIVE, 0, fixed);
+		if (status == WS_SUCCESS)
+		{
+			ws_sync_plan_decode(fixed, probe_time, &plan);
+		}
+	}
+
+	if (status != WS_SUCCESS || plan.current_address < 0)
+	{
+		status = ws_queue_device_read(dev, 0, WS_QUEUE_LIVE, WS_QUEUE_STABLE, fixed);
+		if (status != WS_SUCCESS)
+		{
+			return status;
+		}
+		ws_sync_plan_decode(fixed, probe_time, &plan);
+	}
+
+	if (plan.current_address < 0)
+	{
+		return WS_ERR_TOO_LITTLE_DATA_READ;
+	}
+
+	int read_period = plan.read_period;
+	int position = plan.current_address;
+
+	// Only the delay is needed from the latest record, so a single read is enough
+	unsigned char data[WS_BLOCK_SIZE];
+	int block = position - (position % WS_BLOCK_SIZE);
+	status = ws_queue_device_read(dev, block, WS_QUEUE_LIVE, 0, data);
+	if (status != WS_SUCCESS)
+	{
+		return status;
+	}
+
+	time_t now = time(NULL);
+	int first = schedule->position < 0;
+	int history_size = WS_MEMORY_SIZE - WS_RECORDS_START;
+
+	if (!first)
+	{
+		*new_records = (((position - schedule->position) % history_size + history_size) % history_size) / WS_RECORD_SIZE;
+	}
+
+	int period_changed = read_period != schedule->read_period;
+	schedule->read_period = read_period;
+	schedule->position = position;
+	schedule->delay = data[position - block];
+
+	if (first || period_changed || *new_records > 1)
+	{
+		ws_schedule_estimate(schedule, now);
+	} else if (*new_records == 1) {
+		// The record was written since the last poll, inside the window
+		time_t written_start = (schedule->last_poll > schedule->window_start) ? schedule->last_poll : schedule->window_start;
+		time_t written_end = (now < schedule->window_end) ? now : schedule->window_end;
+
+		if (written_start > written_end)
+		{
+			ws_schedule_estimate(schedule, now);
+		} else {
+			schedule->window_start = written_start + (time_t)read_period * 60 - WS_SCHEDULE_DRIFT;
+			schedule->window_end = written_end + (time_t)read_period * 60 + WS_SCHEDULE_DRIFT;
+			schedule->probed = 0;
+		}
+	} else if (now > schedule->window_end) {
+		// Nothing was written in the window, so the prediction was wrong
+		ws_schedule_estimate(schedule, now);
+	} else {
+		// Nothing written yet, so the record comes later in the window
+		schedule->window_start = (now > schedule->window_start) ? now : schedule->window_start;
+		schedule->probed = 1;
+	}
+
+	schedule->last_poll = now;
+	return WS_SUCCESS;
+}
+
+time_t ws_schedule_next(const ws_schedule* schedule)
+{
+	if (schedule->position < 0)
+	{
+		return time(NULL);
+	}
+
+	// While the window is wide, look once in the middle of it to narrow it down for next time
+	time_t width = schedule->window_end - schedule->window_start;
+	if (!schedule->probed && width > 2 * WS_SCHEDULE_MARGIN)
+	{
+		return schedule->window_start + width / 2;
+	}
+
+	return schedule->window_end + WS_SCHEDULE_MARGIN;
+}
+
+int ws_schedule_in_write_window(const ws_schedule* schedule, time_t time)
+{
+	return schedule->position >= 0 && time >= schedule->window_start - WS_SCHEDULE_MARGIN &&
+	       time <= schedule->window_end + WS_SCHEDULE_MARGIN;
+}
+
+void ws_schedule_avoid_write_window(ws_schedule* schedule)
+{
+	if (schedule->position < 0)
+	{
+		return;
+	}
+
+	// Without polls the window isn't moved on, but the station still writes every read_period minutes
+	time_t now = time(NULL);
+	time_t period = (time_t)schedule->read_period * 60;
+	while (now > schedule->window_end + WS_SCHEDULE_MARGIN)
+	{
+		schedule->window_start += period;
+		schedule->window_end += period;
+	}
+
+	if (!ws_schedule_in_write_window(schedule, now))
+	{
+		return;
+	}
+
+	struct timespec delay = { schedule->window_end + WS_SCHEDULE_MARGIN + 1 - now, 0 };
+	while (nanosleep(&delay, &delay) != 0 && errno == EINTR)
+	{
+	}
+}
+
+void ws_schedule_wait(const ws_schedule* schedule)
+{
+	time_t next = ws_schedule_next(schedule);
+	time_t now = time(NULL);
+
+	if (next <= now)
+	{
+		return;
+	}
+
+	struct timespec delay = { next - now, 0 };
+	while (nanosleep(&delay, &delay) != 0 && errno == EINTR)
+	{
+	}
+}
@@ -0,0 +1,85 @@
+#ifndef WS_SCHEDULE_H
+#define WS_SCHEDULE_H
+
+#include "ws.h"
+#include <time.h>
+
+// Seconds after the latest possible write time before the station is read
+#define WS_SCHEDULE_MARGIN 3
+
+// Seconds added to each side of the write window every record, to allow for clock drift
+#define WS_SCHEDULE_DRIFT 1
+
+/**
+	Works out when the station will next write a record, so it can be read just after
+	instead of on a fixed cadence.
+
+	The station writes a record every read_period minutes, and the first byte of the record
+	being written to counts the minutes since the last one. That gives the next write time to
+	within a minute. The window is then narrowed each record by probing it once in the middle,
+	until the station is read a few seconds after each write.
+*/
+typedef struct
+{
+	int read_period;			// Minutes between records
+	int position;				// Address of the latest record, -1 before the first poll
+	int delay;					// Minutes the latest record has been written to
+
+	time_t window_start;		// Earliest the next record can be written
+	time_t window_end;			// Latest the next record can be written
+	time_t last_poll;			// When the station was last read
+	int probed;					// Non zero once the window has been probed for the next record
+} ws_schedule;
+
+
+/**
+	Initialises a schedule. The first poll should be made straight away.
+*/
+void ws_schedule_init(ws_schedule* schedule);
+
+/**
+	Reads where the station is up to and updates the predicted write window. Only the
+	first block and the block of the latest record are read. A poll made inside the write
+	window (the probe) reads the first block once rather than with ws_read_stable_block().
+
+	Parameters:
+		schedule		The schedule
+		dev				The device, which must have been initialised for reading
+		new_records		Set to the number of records written since the last poll
+
+	Return:
+		- Any error from ws_queue_device_read()
+*/
+int ws_schedule_poll(ws_schedule* schedule, ws_device* dev, int* new_records);
+
+/**
+	Gets when the station should next be read.
+
+	Return:
+		The time of the next poll
+*/
+time_t ws_schedule_next(const ws_schedule* schedule);
+
+/**
+	Checks whether the station could be writing a record at a time, in which case other
+	reads should be put off to avoid ws_read_stable_block() retrying.
+
+	Return:
+		Non zero if the time is inside the write window (with the margin either side)
+*/
+int ws_schedule_in_write_window(const ws_schedule* schedule, time_t time);
+
+/**
+	Sleeps until the write window is over if the station could be writing now, so that a
+	stable read made next isn't retried while the block changes under it. For a schedule that
+	is polled once and then used for a long run of reads (a download), as the window is moved
+	on by read_period minutes at a time once it has passed.
+*/
+void ws_schedule_avoid_write_window(ws_schedule* schedule);
+
+/**
+	Sleeps until the next poll is due.
+*/
+void ws_schedule_wait(const ws_schedule* schedule);
+
+#endif
@@ -0,0 +1,762 @@
+#include "ws_seglog.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+// Frames read at once when scanning a segment
+#define WS_SEGLOG_CHUNK 4096
+
+/**
+	The journal file. check is a hash of the address and hash.
+*/
+typedef struct __attribute__((packed))
+{
+	int64_t address;
+	uint64_t hash;
+	uint32_t check;
+} ws_seglog_journal_file;
+
+/* FNV-1a. Never 0 for a frame of zeros, so a zero filled tail left by a crash is always torn. */
+static uint32_t ws_seglog_check(const void* data, size_t size)
+{
+	const unsigned char* bytes = data;
+	uint32_t hash = 2166136261u;
+
+	for (size_t i = 0; i < size; i++)
+	{
+		hash = (hash ^ bytes[i]) * 16777619u;
+	}
+
+	return hash;
+}
+
+static int ws_seglog_frame_valid(const ws_seglog_frame* frame)
+{
+	return frame->check == ws_seglog_check(frame, offsetof(ws_seglog_frame, check));
+}
+
+static void ws_seglog_path(const ws_seglog* log, uint32_t segment, char* path, size_t size)
+{
+	snprintf(path, size, "%s/%.8u.wslog", log->directory, segment);
+}
+
+static void ws_seglog_journal_path(const ws_seglog* log, char* path, size_t size)
+{
+	snprintf(path, size, "%s/journal", log->directory);
+}
+
+static int ws_seglog_sync_directory(const ws_seglog* log)
+{
+	int fd = open(log->directory, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0)
+	{
+		return WS_ERR_FILE_IO;
+	}
+
+	int status = (fsync(fd) == 0) ? WS_SUCCESS : WS_ERR_FILE_IO;
+	close(fd);
+	return status;
+}
+
+static int ws_seglog_write_all(int fd, const void* data, size_t size, off_t offset)
+{
+	const char* bytes = data;
+	while (size > 0)
+	{
+		ssize_t written = pwrite(fd, bytes, size, offset);
+		if (written < 0 && errno == EINTR)
+		{
+			continue;
+		}
+
+		if (written <= 0)
+		{
+			return WS_ERR_FILE_IO;
+		}
+
+		bytes += written;
+		size -= written;
+		offset += written;
+	}
+
+	return WS_SUCCESS;
+}
+
+static int ws_seglog_add_index(ws_seglog* log, int64_t epoch, uint32_t segment, uint32_t record)
+{
+	if (log->index_count == log->index_capacity)
+	{
+		int capacity = log->index_capacity ? log->index_capacity * 2 : 256;
+		ws_seglog_index_entry* index = realloc(log->index, capacity * sizeof(ws_seglog_index_entry));
+		if (index == NULL)
+		{
+			return WS_ERR_FILE_IO;
+		}
+
+		log->index = index;
+		log->index_capacity = capacity;
+	}
+
+	ws_seglog_index_entry* entry = &log->index[log->index_count++];
+	entry->epoch = epoch;
+	entry->segment = segment;
+	entry->record = record;
+	return WS_SUCCESS;
+}
+
+/* Adds a segment to the end of the list. Segments are numbered consecutively. */
+static int ws_seglog_add_segment(ws_seglog* log, uint32_t records)
+{
+	uint32_t* segment_records = realloc(log->segment_records, (log->segment_count + 1) * sizeof(uint32_t));
+	if (segment_records == NULL)
+	{
+		return WS_ERR_FILE_IO;
+	}
+
+	log->segment_records = segment_records;
+	log->segment_records[log->segment_count++] = records;
+	log->segment = log->first_segment + log->segment_count - 1;
+	return WS_SUCCESS;
+}
+
+/* Creates the next segment and makes it the one appended to */
+static int ws_seglog_start_segment(ws_seglog* log)
+{
+	uint32_t number = (log->segment_count == 0) ? log->first_segment : log->segment + 1;
+
+	char path[PATH_MAX + 32];
+	ws_seglog_path(log, number, path, sizeof(path));
+
+	int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0)
+	{
+		return WS_ERR_FILE_IO;
+	}
+
+	ws_seglog_header header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, WS_SEGLOG_MAGIC, 4);
+	header.version = WS_SEGLOG_VERSION;
+	header.frame_size = sizeof(ws_seglog_frame);
+	header.segment = number;
+
+	// The segment must exist before any record in it is counted as committed
+	if (ws_seglog_write_all(fd, &header, sizeof(header), 0) != WS_SUCCESS || fdatasync(fd) != 0 ||
+	    ws_seglog_sync_directory(log) != WS_SUCCESS || ws_seglog_add_segment(log, 0) != WS_SUCCESS)
+	{
+		close(fd);
+		return WS_ERR_FILE_IO;
+	}
+
+	if (log->fd >= 0)
+	{
+		close(log->fd);
+	}
+
+	log->fd = fd;
+	return WS_SUCCESS;
+}
+
+static int ws_seglog_header_valid(int fd, uint32_t segment)
+{
+	ws_seglog_header header;
+	return pread(fd, &header, sizeof(header), 0) == sizeof(header) && memcmp(header.magic, WS_SEGLOG_MAGIC, 4) == 0 &&
+	       header.version == WS_SEGLOG_VERSION && header.frame_size == sizeof(ws_seglog_frame) && header.segment == segment;
+}
+
+/* A segment before the last was synced in full before the next was started, so only the
+   frames the sparse index needs are read */
+static int ws_seglog_load_sealed(ws_seglog* log, uint32_t segment)
+{
+	char path[PATH_MAX + 32];
+	ws_seglog_path(log, segment, path, sizeof(path));
+
+	uint32_t count = 0;
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	struct stat info;
+
+	if (fd >= 0 && fstat(fd, &info) == 0 && ws_seglog_header_valid(fd, segment))
+	{
+		count = (uint32_t)(info.st_size / sizeof(ws_seglog_frame)) - 1;
+	}
+
+	int status = WS_SUCCESS;
+	for (uint32_t record = 0; record < count && status == WS_SUCCESS; record += WS_SEGLOG_INDEX_STRIDE)
+	{
+		ws_seglog_frame frame;
+		if (pread(fd, &frame, sizeof(frame), (off_t)(record + 1) * sizeof(frame)) != sizeof(frame))
+		{
+			status = WS_ERR_FILE_IO;
+			break;
+		}
+
+		status = ws_seglog_add_index(log, frame.record.epoch, segment, record);
+	}
+
+	if (status == WS_SUCCESS && count > 0)
+	{
+		ws_seglog_frame frame;
+		if (pread(fd, &frame, sizeof(frame), (off_t)count * sizeof(frame)) == sizeof(frame))
+		{
+			log->latest_epoch = frame.record.epoch;
+		}
+	}
+
+	if (fd >= 0)
+	{
+		close(fd);
+	}
+
+	log->record_count += count;
+	return (status == WS_SUCCESS) ? ws_seglog_add_segment(log, count) : status;
+}
+
+/* The last segment may end in frames that were being written when the program stopped.
+   Everything from the first bad frame on is cut off. */
+static int ws_seglog_recover_last(ws_seglog* log, uint32_t segment)
+{
+	char path[PATH_MAX + 32];
+	ws_seglog_path(log, segment, path, sizeof(path));
+
+	int fd = open(path, O_RDWR | O_CLOEXEC);
+	if (fd < 0)
+	{
+		return WS_ERR_FILE_IO;
+	}
+
+	struct stat info;
+	if (fstat(fd, &info) != 0)
+	{
+		close(fd);
+		return WS_ERR_FILE_IO;
+	}
+
+	// A segment whose header never made it to disk is started again
+	if (!ws_seglog_header_valid(fd, segment))
+	{
+		close(fd);
+		if (unlink(path) != 0)
+		{
+			return WS_ERR_FILE_IO;
+		}
+		return ws_seglog_start_segment(log);
+	}
+
+	ws_seglog_frame* frames = malloc(WS_SEGLOG_CHUNK * sizeof(ws_seglog_frame));
+	if (frames == NULL)
+	{
+		close(fd);
+		return WS_ERR_FILE_IO;
+	}
+
+	uint32_t available = (uint32_t)(info.st_size / sizeof(ws_seglog_frame)) - 1;
+	uint32_t count = 0;
+	int torn = 0;
+	int status = WS_SUCCESS;
+
+	while (count < available && !torn && status == WS_SUCCESS)
+	{
+		uint32_t chunk = (available - count < WS_SEGLOG_CHUNK) ? available - count : WS_SEGLOG_CHUNK;
+		ssize_t size = pread(fd, frames, chunk * sizeof(ws_seglog_frame), (off_t)(count + 1) * sizeof(ws_seglog_frame));
+		if (size != (ssize_t)(chunk * sizeof(ws_seglog_frame)))
+		{
+			status = WS_ERR_FILE_IO;
+			break;
+		}
+
+		for (uint32_t i = 0; i < chunk; i++)
+		{
+			if (!ws_seglog_frame_valid(&frames[i]) || frames[i].record.epoch <= log->latest_epoch)
+			{
+				torn = 1;
+				break;
+			}
+
+			if (count % WS_SEGLOG_INDEX_STRIDE == 0)
+			{
+				status = ws_seglog_add_index(log, frames[i].record.epoch, segment, count);
+			}
+
+			log->latest_epoch = frames[i].record.epoch;
+			count++;
+		}
+	}
+
+	free(frames);
+
+	off_t length = (off_t)(count + 1) * sizeof(ws_seglog_frame);
+	if (status == WS_SUCCESS && info.st_size != length && (ftruncate(fd, length) != 0 || fdatasync(fd) != 0))
+	{
+		status = WS_ERR_FILE_IO;
+	}
+
+	if (status == WS_SUCCESS)
+	{
+		status = ws_seglog_add_segment(log, count);
+	}
+
+	if (status != WS_SUCCESS)
+	{
+		close(fd);
+		return status;
+	}
+
+	log->fd = fd;
+	log->record_count += count;
+	return WS_SUCCESS;
+}
+
+static int ws_seglog_compare_segments(const void* a, const void* b)
+{
+	uint32_t x = *(const uint32_t*)a;
+	uint32_t y = *(const uint32_t*)b;
+	return (x > y) - (x < y);
+}
+
+/* Lists the numbers of the segments in the directory, in order */
+static int ws_seglog_list(const ws_seglog* log, uint32_t** segments, int* count)
+{
+	*segments = NULL;
+	*count = 0;
+
+	DIR* directory = opendir(log->directory);
+	if (directory == NULL)
+	{
+		return WS_ERR_FILE_IO;
+	}
+
+	int capacity = 0;
+	struct dirent* entry;
+	while ((entry = readdir(directory)) != NULL)
+	{
+		unsigned int number;
+		int length = 0;
+		if (sscanf(entry->d_name, "%8u.wslog%n", &number, &length) != 1 || length != (int)strlen(entry->d_name))
+		{
+			continue;
+		}
+
+		if (*count == capacity)
+		{
+			capacity = capacity ? capacity * 2 : 64;
+			uint32_t* grown = realloc(*segments, capacity * sizeof(uint32_t));
+			if (grown == NULL)
+			{
+				closedir(directory);
+				return WS_ERR_FILE_IO;
+			}
+			*segments = grown;
+		}
+
+		(*segments)[(*count)++] = number;
+	}
+
+	closedir(directory);
+	qsort(*segments, *count, sizeof(uint32_t), ws_seglog_compare_segments);
+	return WS_SUCCESS;
+}
+
+int ws_seglog_open(ws_seglog* log, const char* directory)
+{
+	memset(log, 0, sizeof(ws_seglog));
+	log->fd = -1;
+	log->latest_epoch = INT64_MIN;
+	snprintf(log->directory, sizeof(log->directory), "%s", directory);
+
+	if (mkdir(directory, 0755) != 0 && errno != EEXIST)
+	{
+		return WS_ERR_FILE_IO;
+	}
+
+	uint32_t* segments;
+	int count;
+	int status = ws_seglog_list(log, &segments, &count);
+	if (status != WS_SUCCESS)
+	{
+		return status;
+	}
+
+	if (count > 0)
+	{
+		log->first_segment = segments[0];
+	}
+
+	// A segment missing from the middle is taken as empty, so the numbers stay consecutive
+	for (int i = 0; i < count && status == WS_SUCCESS; i++)
+	{
+		uint32_t last = segments[count - 1];
+		uint32_t segment = segments[0] + log->segment_count;
+
+		while (segment < segments[i] && status == WS_SUCCESS)
+		{
+			status = ws_seglog_add_segment(log, 0);
+			segment++;
+		}
+
+		if (status == WS_SUCCESS)
+		{
+			status = (segment == last) ? ws_seglog_recover_last(log, segment) : ws_seglog_load_sealed(log, segment);
+		}
+	}
+
+	free(segments);
+
+	if (status != WS_SUCCESS)
+	{
+		ws_seglog_close(log);
+	}
+
+	return status;
+}
+
+int ws_seglog_close(ws_seglog* log)
+{
+	if (log->fd >= 0)
+	{
+		close(log->fd);
+		log->fd = -1;
+	}
+
+	free(log->segment_records);
+	free(log->index);
+	free(log->pending);
+
+	log->segment_records = NULL;
+	log->index = NULL;
+	log->pending = NULL;
+	log->segment_count = 0;
+	log->index_count = log->index_capacity = 0;
+	log->pending_count = log->pending_capacity = 0;
+	return WS_SUCCESS;
+}
+
+int ws_seglog_append(ws_seglog* log, const ws_packed_record* records, int count)
+{
+	for (int i = 0; i < count; i++)
+	{
+		int64_t newest = (log->pending_count > 0) ? log->pending[log->pending_count - 1].record.epoch : log->latest_epoch;
+		if (records[i].epoch <= newest)
+		{
+			continue;
+		}
+
+		if (log->pending_count == log->pending_capacity)
+		{
+			int capacity = log->pending_capacity ? log->pending_capacity * 2 : 256;
+			ws_seglog_frame* pending = realloc(log->pending, capacity * sizeof(ws_seglog_frame));
+			if (pending == NULL)
+			{
+				return WS_ERR_FILE_IO;
+			}
+
+			log->pending = pending;
+			log->pending_capacity = capacity;
+		}
+
+		ws_seglog_frame* frame = &log->pending[log->pending_count++];
+		memset(frame, 0, sizeof(ws_seglog_frame));
+		frame->record = records[i];
+	}
+
+	return WS_SUCCESS;
+}
+
+int ws_seglog_mark_suspect(ws_seglog* log, time_t epoch, int* found)
+{
+	*found = 0;
+
+	for (int i = log->pending_count - 1; i >= 0 && !*found; i--)
+	{
+		if (log->pending[i].record.epoch == epoch)
+		{
+			log->pending[i].record.flags |= WS_PACKED_SUSPECT;
+			*found = 1;
+		}
+	}
+
+	return WS_SUCCESS;
+}
+
+static int ws_seglog_write_journal(ws_seglog* log)
+{
+	char path[PATH_MAX + 32];
+	ws_seglog_journal_path(log, path, sizeof(path));
+
+	if (log->journal_change == 2)
+	{
+		return (unlink(path) == 0 || errno == ENOENT) ? WS_SUCCESS : WS_ERR_FILE_IO;
+	}
+
+	ws_seglog_journal_file file;
+	file.address = log->journal.address;
+	file.hash = log->journal.hash;
+	file.check = ws_seglog_check(&file, offsetof(ws_seglog_journal_file, check));
+
+	// The journal is small enough to be rewritten in place. A torn write fails the check,
+	// which only means the download starts from the beginning again.
+	int fd = open(path, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0)
+	{
+		return WS_ERR_FILE_IO;
+	}
+
+	int status = ws_seglog_write_all(fd, &file, sizeof(file), 0);
+	if (status == WS_SUCCESS && fdatasync(fd) != 0)
+	{
+		status = WS_ERR_FILE_IO;
+	}
+
+	close(fd);
+	return status;
+}
+
+int ws_seglog_commit(ws_seglog* log)
+{
+	int status = WS_SUCCESS;
+	int written = 0;
+
+	while (written < log->pending_count)
+	{
+		if (log->segment_count == 0 || log->fd < 0 || log->segment_records[log->segment_count - 1] == WS_SEGLOG_SEGMENT_RECORDS)
+		{
+			status = ws_seglog_start_segment(log);
+			if (status != WS_SUCCESS)
+			{
+				break;
+			}
+		}
+
+		uint32_t* records = &log->segment_records[log->segment_count - 1];
+		int room = WS_SEGLOG_SEGMENT_RECORDS - *records;
+		int count = (log->pending_count - written < room) ? log->pending_count - written : room;
+
+		for (int i = 0; i < count; i++)
+		{
+			ws_seglog_frame* frame = &log->pending[written + i];
+			frame->check = ws_seglog_check(frame, offsetof(ws_seglog_frame, check));
+		}
+
+		status = ws_seglog_write_all(log->fd, &log->pending[written], count * sizeof(ws_seglog_frame),
+		                             (off_t)(*records + 1) * sizeof(ws_seglog_frame));
+
+		// A full segment is synced before the next is started, as only the last is checked when opening
+		if (status == WS_SUCCESS && count == room && fdatasync(log->fd) != 0)
+		{
+			status = WS_ERR_FILE_IO;
+		}
+
+		if (status != WS_SUCCESS)
+		{
+			break;
+		}
+
+		for (int i = 0; i < count && status == WS_SUCCESS; i++)
+		{
+			if ((*records + i) % WS_SEGLOG_INDEX_STRIDE == 0)
+			{
+				status = ws_seglog_add_index(log, log->pending[written + i].record.epoch, log->segment, *records + i);
+			}
+		}
+
+		*records += count;
+		written += count;
+	}
+
+	// The one sync for the batch
+	if (status == WS_SUCCESS && log->pending_count > 0 && fdatasync(log->fd) != 0)
+	{
+		status = WS_ERR_FILE_IO;
+	}
+
+	if (status == WS_SUCCESS && log->pending_count > 0)
+	{
+		log->latest_epoch = log->pending[log->pending_count - 1].record.epoch;
+		log->record_count += log->pending_count;
+		log->syncs++;
+	}
+
+	// The journal can only move on once the records it covers are on disk
+	if (status == WS_SUCCESS && log->journal_change != 0)
+	{
+		status = ws_seglog_write_journal(log);
+	}
+
+	log->pending_count = 0;
+	log->journal_change = 0;
+	return (status == WS_SUCCESS) ? WS_SUCCESS : WS_ERR_FILE_IO;
+}
+
+void ws_seglog_rollback(ws_seglog* log)
+{
+	log->pending_count = 0;
+	log->journal_change = 0;
+}
+
+int ws_seglog_reset(ws_seglog* log)
+{
+	ws_seglog_rollback(log);
+
+	if (log->fd >= 0)
+	{
+		close(log->fd);
+		log->fd = -1;
+	}
+
+	char path[PATH_MAX + 32];
+	for (int i = 0; i < log->segment_count; i++)
+	{
+		ws_seglog_path(log, log->first_segment + i, path, sizeof(path));
+		if (unlink(path) != 0 && errno != ENOENT)
+		{
+			return WS_ERR_FILE_IO;
+		}
+	}
+
+	ws_seglog_journal_path(log, path, sizeof(path));
+	if (unlink(path) != 0 && errno != ENOENT)
+	{
+		return WS_ERR_FILE_IO;
+	}
+
+	log->first_segment = 0;
+	log->segment = 0;
+	log->segment_count = 0;
+	log->index_count = 0;
+	log->record_count = 0;
+	log->latest_epoch = INT64_MIN;
+
+	return ws_seglog_sync_directory(log);
+}
+
+int ws_seglog_query(ws_seglog* log, time_t from, time_t to, ws_seglog_record_cb callback, void* user)
+{
+	if (log->segment_count == 0 || to <= from)
+	{
+		return WS_SUCCESS;
+	}
+
+	// Start from the last index entry at or before the start of the range
+	uint32_t segment = log->first_segment;
+	uint32_t record = 0;
+	int low = 0;
+	int high = log->index_count - 1;
+
+	while (low <= high)
+	{
+		int middle = low + (high - low) / 2;
+		if (log->index[middle].epoch <= from)
+		{
+			segment = log->index[middle].segment;
+			record = log->index[middle].record;
+			low = middle + 1;
+		} else {
+			high = middle - 1;
+		}
+	}
+
+	ws_seglog_frame* frames = malloc(WS_SEGLOG_CHUNK * sizeof(ws_seglog_frame));
+	if (frames == NULL)
+	{
+		return WS_ERR_FILE_IO;
+	}
+
+	int status = WS_SUCCESS;
+	int done = 0;
+
+	for (; segment <= log->segment && !done && status == WS_SUCCESS; segment++, record = 0)
+	{
+		uint32_t count = log->segment_records[segment - log->first_segment];
+		if (record >= count)
+		{
+			continue;
+		}
+
+		int fd = log->fd;
+		if (segment != log->segment || fd < 0)
+		{
+			char path[PATH_MAX + 32];
+			ws_seglog_path(log, segment, path, sizeof(path));
+			fd = open(path, O_RDONLY | O_CLOEXEC);
+			if (fd < 0)
+			{
+				status = WS_ERR_FILE_IO;
+				break;
+			}
+		}
+
+		while (record < count && !done)
+		{
+			uint32_t chunk = (count - record < WS_SEGLOG_CHUNK) ? count - record : WS_SEGLOG_CHUNK;
+			ssize_t size = pread(fd, frames, chunk * sizeof(ws_seglog_frame), (off_t)(record + 1) * sizeof(ws_seglog_frame));
+			if (size != (ssize_t)(chunk * sizeof(ws_seglog_frame)))
+			{
+				status = WS_ERR_FILE_IO;
+				break;
+			}
+
+			for (uint32_t i = 0; i < chunk && !done; i++)
+			{
+				if (frames[i].record.epoch < from)
+				{
+					continue;
+				}
+
+				done = frames[i].record.epoch >= to || callback(&frames[i].record, user);
+			}
+
+			record += chunk;
+		}
+
+		if (fd != log->fd)
+		{
+			close(fd);
+		}
+	}
+
+	free(frames);
+	return status;
+}
+
+int ws_seglog_load_journal(ws_seglog* log, ws_store_journal* journal, int* found)
+{
+	*found = 0;
+
+	char path[PATH_MAX + 32];
+	ws_seglog_journal_path(log, path, sizeof(path));
+
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+	{
+		return (errno == ENOENT) ? WS_SUCCESS : WS_ERR_FILE_IO;
+	}
+
+	ws_seglog_journal_file file;
+	if (pread(fd, &file, sizeof(file), 0) == sizeof(file) && file.check == ws_seglog_check(&file, offsetof(ws_seglog_journal_file, check)))
+	{
+		journal->address = (int)file.address;
+		journal->hash = file.hash;
+		*found = 1;
+	}
+
+	close(fd);
+	return WS_SUCCESS;
+}
+
+int ws_seglog_save_journal(ws_seglog* log, const ws_store_journal* journal)
+{
+	log->journal = *journal;
+	log->journal_change = 1;
+	return WS_SUCCESS;
+}
+
+int ws_seglog_clear_journal(ws_seglog* log)
+{
+	log->journal_change = 2;
+	return WS_SUCCESS;
+}
@@ -0,0 +1,165 @@
+#ifndef WS_SEGLOG_H
+#define WS_SEGLOG_H
+
+#include "ws.h"
+#include "ws_store.h"
+#include <time.h>
+#include <limits.h>
+
+#define WS_SEGLOG_MAGIC "WSLG"
+#define WS_SEGLOG_VERSION 1
+
+// Records in a segment before a new one is started (2MiB of frames)
+#define WS_SEGLOG_SEGMENT_RECORDS 65536
+
+// Records between entries of the sparse time index
+#define WS_SEGLOG_INDEX_STRIDE 256
+
+/**
+	A record as it is stored in a segment. check is a hash of the rest of the frame, so a
+	frame that was only partly written before a crash is spotted when the log is opened.
+	Segments start with a ws_seglog_header, which is the same size as a frame, so frame n
+	is at (n + 1) * sizeof(ws_seglog_frame).
+*/
+typedef struct __attribute__((packed))
+{
+	ws_packed_record record;
+	uint16_t reserved;
+	uint32_t check;
+} ws_seglog_frame;
+
+typedef struct __attribute__((packed))
+{
+	char magic[4];						// WS_SEGLOG_MAGIC
+	uint16_t version;					// WS_SEGLOG_VERSION
+	uint16_t frame_size;				// sizeof(ws_seglog_frame)
+	uint32_t segment;					// Number of the segment, also in its file name
+	uint8_t reserved[20];
+} ws_seglog_header;
+
+/**
+	An entry of the sparse time index, kept in memory and rebuilt when the log is opened
+*/
+typedef struct
+{
+	int64_t epoch;
+	uint32_t segment;
+	uint32_t record;
+} ws_seglog_index_entry;
+
+/**
+	An append-only log of weather records, held in a directory of numbered segment files.
+	Records are kept in time order and only records newer than the latest are appended,
+	so replaying part of a download adds nothing.
+
+	Appended records are buffered until ws_seglog_commit(), which writes them and syncs
+	once for the whole batch.
+*/
+typedef struct
+{
+	char directory[PATH_MAX];
+	int fd;								// The segment being appended to, -1 if none is open
+	uint32_t first_segment;
+	uint32_t segment;					// The last segment
+	uint32_t* segment_records;			// Records in each segment from first_segment
+	int segment_count;
+
+	int64_t latest_epoch;				// The latest record committed
+	uint64_t record_count;				// Records committed
+
+	ws_seglog_index_entry* index;
+	int index_count;
+	int index_capacity;
+
+	ws_seglog_frame* pending;
+	int pending_count;
+	int pending_capacity;
+
+	ws_store_journal journal;
+	int journal_change;					// 0 for none, 1 to save the journal, 2 to remove it
+	uint64_t syncs;						// fdatasync() calls made for commits
+} ws_seglog;
+
+/**
+	Called for each record of ws_seglog_query(). Return 0 to carry on, anything else to stop.
+*/
+typedef int (*ws_seglog_record_cb)(const ws_packed_record* record, void* user);
+
+
+/**
+	Opens a log, creating the directory if needed. The last segment is checked frame by
+	frame and cut short at the first frame that is torn or out of order, and the sparse
+	index is rebuilt from every WS_SEGLOG_INDEX_STRIDE'th frame of the others.
+
+	Return:
+		- WS_ERR_FILE_IO	The directory or a segment could not be read
+*/
+int ws_seglog_open(ws_seglog* log, const char* directory);
+
+/**
+	Closes a log, dropping anything not committed
+*/
+int ws_seglog_close(ws_seglog* log);
+
+/**
+	Buffers records to be appended by the next ws_seglog_commit(). Records no newer than
+	the latest in the log are skipped.
+
+	Parameters:
+		log 		The log
+		records		The records, oldest first, with their epoch set
+		count		The number of records
+*/
+int ws_seglog_append(ws_seglog* log, const ws_packed_record* records, int count);
+
+/**
+	Sets WS_PACKED_SUSPECT on a record that hasn't been committed yet. Committed records
+	can't be changed, so found is 0 for one that was skipped as already in the log.
+
+	Parameters:
+		log 		The log
+		epoch		The time of the record
+		found		Set to 1 if the record was found and marked, otherwise 0
+*/
+int ws_seglog_mark_suspect(ws_seglog* log, time_t epoch, int* found);
+
+/**
+	Writes the buffered records with a single fdatasync(), then saves or removes the
+	journal if that was asked for.
+
+	Return:
+		- WS_ERR_FILE_IO	A write or sync failed. The log should be reopened to recover.
+*/
+int ws_seglog_commit(ws_seglog* log);
+
+/**
+	Drops the buffered records and any journal change
+*/
+void ws_seglog_rollback(ws_seglog* log);
+
+/**
+	Removes every record and the journal
+*/
+int ws_seglog_reset(ws_seglog* log);
+
+/**
+	Passes every committed record in a time range to a callback, oldest first
+
+	Parameters:
+		log 		The log
+		from		Start of the range (inclusive)
+		to			End of the range (exclusive)
+		callback	Called for each record
+		user		Passed to the callback
+*/
+int ws_seglog_query(ws_seglog* log, time_t from, time_t to, ws_seglog_record_cb callback, void* user);
+
+/**
+	The journal is held in its own file. Saving or clearing it only takes effect at the
+	next ws_seglog_commit(), after the records before it are on disk.
+*/
+int ws_seglog_load_journal(ws_seglog* log, ws_store_journal* journal, int* found);
+int ws_seglog_save_journal(ws_seglog* log, const ws_store_journal* journal);
+int ws_seglog_clear_journal(ws_seglog* log);
+
+#endif
@@ -0,0 +1,938 @@
+#include "ws_shard.h"
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <unistd.h>
+
+#define WS_SHARD_SQL_MAX 1024
+
+// The download journal and the anomalies aren't split by month, so they are kept in one more database
+#define WS_SHARD_META "WeatherDB-meta.sqlite"
+
+typedef struct
+{
+	int key;				// year * 100 + month, 0 if the slot is free
+	uint64_t used;			// When the month was last used, for choosing which to detach
+} ws_shard_slot;
+
+static pthread_mutex_t ws_shard_lock = PTHREAD_MUTEX_INITIALIZER;
+static sqlite3* ws_shard_hub = NULL;
+static char ws_shard_directory[PATH_MAX];
+static ws_shard_slot ws_shard_attached[WS_SHARD_MAX_ATTACHED];
+static uint64_t ws_shard_clock = 0;
+
+static pthread_t ws_shard_thread;
+static pthread_cond_t ws_shard_wake = PTHREAD_COND_INITIALIZER;
+static int ws_shard_retaining = 0;
+static ws_shard_tier ws_shard_tiers[WS_SHARD_MAX_TIERS];
+static int ws_shard_tier_count = 0;
+
+static int ws_shard_month_key(time_t time)
+{
+	struct tm date_time;
+	localtime_r(&time, &date_time);
+	return (date_time.tm_year + 1900) * 100 + date_time.tm_mon + 1;
+}
+
+static int ws_shard_next_key(int key)
+{
+	return (key % 100 == 12) ? (key / 100 + 1) * 100 + 1 : key + 1;
+}
+
+static int ws_shard_previous_key(int key)
+{
+	return (key % 100 == 1) ? (key / 100 - 1) * 100 + 12 : key - 1;
+}
+
+/* Midnight at the start of a month, local time */
+static time_t ws_shard_month_start(int key)
+{
+	struct tm date_time;
+	memset(&date_time, 0, sizeof(date_time));
+	date_time.tm_year = key / 100 - 1900;
+	date_time.tm_mon = key % 100 - 1;
+	date_time.tm_mday = 1;
+	date_time.tm_isdst = -1;
+	return mktime(&date_time);
+}
+
+static void ws_shard_path(int key, char* path, int size)
+{
+	snprintf(path, size, "%s/WeatherDB-%.4i-%.2i.sqlite", ws_shard_directory, key / 100, key % 100);
+}
+
+static void ws_shard_schema(int key, char* schema)
+{
+	snprintf(schema, 16, "m%.6i", key);
+}
+
+/* Finds the slot of an attached month, or -1 */
+static int ws_shard_find(int key)
+{
+	for (int i = 0; i < WS_SHARD_MAX_ATTACHED; i++)
+	{
+		if (ws_shard_attached[i].key == key)
+		{
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+static int ws_shard_detach(int slot)
+{
+	char sql[64];
+	snprintf(sql, sizeof(sql), "DETACH DATABASE m%.6i", ws_shard_attached[slot].key);
+
+	int status = ws_store_query(&ws_shard_hub, sql, sizeof(sql));
+	if (status != WS_SUCCESS)
+	{
+		return status;
+	}
+
+	ws_shard_attached[slot].key = 0;
+	return WS_SUCCESS;
+}
+
+/* Attaches a month, detaching the least recently used one if there's no room. Without create,
+   a month with no database isn't attached and found is set to 0. Must not be called in a transaction. */
+static int ws_shard_attach(int key, int create, char* schema, int* found)
+{
+	ws_shard_schema(key, schema);
+	*found = 1;
+
+	int slot = ws_shard_find(key);
+	if (slot >= 0)
+	{
+		ws_shard_attached[slot].used = ++ws_shard_clock;
+		return WS_SUCCESS;
+	}
+
+	char path[PATH_MAX + 32];
+	ws_shard_path(key, path, sizeof(path));
+
+	if (!create && access(path, F_OK) != 0)
+	{
+		*found = 0;
+		return WS_SUCCESS;
+	}
+
+	slot = 0;
+	for (int i = 0; i < WS_SHARD_MAX_ATTACHED; i++)
+	{
+		if (ws_shard_attached[i].key == 0)
+		{
+			slot = i;
+			break;
+		}
+
+		if (ws_shard_attached[i].used < ws_shard_attached[slot].used)
+		{
+			slot = i;
+		}
+	}
+
+	int status;
+	if (ws_shard_attached[slot].key != 0)
+	{
+		status = ws_shard_detach(slot);
+		if (status != WS_SUCCESS)
+		{
+			return status;
+		}
+	}
+
+	char sql[128];
+	snprintf(sql, sizeof(sql), "ATTACH DATABASE ?1 AS %s", schema);
+
+	sqlite3_stmt* statement;
+	status = ws_store_create_statement(&ws_shard_hub, sql, sizeof(sql), &statement);
+	if (status != WS_SUCCESS)
+	{
+		return status;
+	}
+
+	sqlite3_bind_text(statement, 1, path, -1, SQLITE_TRANSIENT);
+	status = ws_store_execute_query(&ws_shard_hub, &statement);
+	ws_store_delete_stmt(&ws_shard_hub, &statement);
+	if (status != WS_SUCCESS)
+	{
+		return status;
+	}
+
+	ws_shard_attached[slot].key = key;
+	ws_shard_attached[slot].used = ++ws_shard_clock;
+
+	return ws_store_create_data_table(ws_shard_hub, schema);
+}
+
+/* Mean of wind directions in degrees, taken as unit vectors so that 350 and 10 average to 0 */
+typedef struct
+{
+	double x;
+	double y;
+	int count;
+} ws_shard_direction;
+
+static void ws_shard_direction_step(sqlite3_context* context, int argc, sqlite3_value** argv)
+{
+	ws_shard_direction* sum = sqlite3_aggregate_context(context, sizeof(ws_shard_direction));
+	if (sum == NULL || sqlite3_value_type(argv[0]) == SQLITE_NULL)
+	{
+		return;
+	}
+
+	double radians = sqlite3_value_double(argv[0]) * M_PI / 180.0;
+	sum->x += cos(radians);
+	sum->y += sin(radians);
+	sum->count++;
+}
+
+static void ws_shard_direction_final(sqlite3_context* context)
+{
+	ws_shard_direction* sum = sqlite3_aggregate_context(context, 0);
+	if (sum == NULL || sum->count == 0)
+	{
+		sqlite3_result_null(context);
+		return;
+	}
+
+	double degrees = atan2(sum->y, sum->x) * 180.0 / M_PI;
+	sqlite3_result_double(context, (degrees < 0) ? degrees + 360.0 : degrees);
+}
+
+/* Attaches the meta database for as long as the shards are open. Its tables are the only ones
+   with their names, so the ws_store_ functions find them without a schema. */
+static int ws_shard_attach_meta(void)
+{
+	char path[PATH_MAX + 32];
+	snprintf(path, sizeof(path), "%s/" WS_SHARD_META, ws_shard_directory);
+
+	char sql[] = "ATTACH DATABASE ?1 AS meta";
+	sqlite3_stmt* statement;
+	int status = ws_store_create_statement(&ws_shard_hub, sql, sizeof(sql), &statement);
+	if (status != WS_SUCCESS)
+	{
+		return status;
+	}
+
+	sqlite3_bind_text(statement, 1, path, -1, SQLITE_TRANSIENT);
+	status = ws_store_execute_query(&ws_shard_hub, &statement);
+	ws_store_delete_stmt(&ws_shard_hub, &statement);
+	if (status != WS_SUCCESS)
+	{
+		return status;
+	}
+
+	char anomalies[] = "CREATE TABLE IF NOT EXISTS meta.WeatherAnomalies(RecordDateTime TEXT PRIMARY KEY, Metrics INTEGER NOT NULL)";
+	status = ws_store_query(&ws_shard_hub, anomalies, sizeof(anomalies) / sizeof(anomalies[0]));
+	if (status != WS_SUCCESS)
+	{
+		return status;
+	}
+
+	char journal[] = "CREATE TABLE IF NOT EXISTS meta.DownloadJournal(Id INTEGER PRIMARY KEY CHECK (Id = 0), Address INTEGER NOT NULL, Hash INTEGER NOT NULL)";
+	return ws_store_query(&ws_shard_hub, journal, sizeof(journal) / sizeof(journal[0]));
+}
+
+int ws_shard_open(const char* directory)
+{
+	int status = sqlite3_open_v2(":memory:", &ws_shard_hub, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, NULL);
+	if (status != SQLITE_OK)
+	{
+		db_error(ws_shard_hub, "ws_shard_open");
+		return WS_ERR_DB_OPEN;
+	}
+
+	sqlite3_create_function(ws_shard_hub, "ws_mean_direction", 1, SQLITE_UTF8, NULL, NULL,
+	                        ws_shard_direction_step, ws_shard_direction_final);
+
+	snprintf(ws_shard_directory, sizeof(ws_shard_directory), "%s", directory);
+	memset(ws_shard_attached, 0, sizeof(ws_shard_attached));
+
+	status = ws_shard_attach_meta();
+	if (status != WS_SUCCESS)
+	{
+		ws_store_close_db(&ws_shard_hub);
+		ws_shard_hub = NULL;
+	}
+	return status;
+}
+
+int ws_shard_close(void)
+{
+	ws_shard_stop_retention();
+
+	if (ws_shard_hub == NULL)
+	{
+		return WS_SUCCESS;
+	}
+
+	int status = ws_store_close_db(&ws_shard_hub);
+	ws_shard_hub = NULL;
+	return status;
+}
+
+static int ws_shard_rollback(void)
+{
+	char sql[] = "ROLLBACK";
+	return ws_store_query(&ws_shard_hub, sql, sizeof(sql) / sizeof(sql[0]));
+}
+
+int ws_shard_add_packed_records(const ws_packed_record* records, int count)
+{
+	int status = WS_SUCCESS;
+	pthread_mutex_lock(&ws_shard_lock);
+
+	// Records come in time order, so each run of records from the same month is stored together
+	for (int start = 0; start < count && status == WS_SUCCESS; )
+	{
+		int key = ws_shard_month_key((time_t)records[start].epoch);
+		int end = start + 1;
+		while (end < count && ws_shard_month_key((time_t)records[end].epoch) == key)
+		{
+			end++;
+		}
+
+		char schema[16];
+		int found;
+		status = ws_shard_attach(key, 1, schema, &found);
+		if (status != WS_SUCCESS)
+		{
+			break;
+		}
+
+		status = ws_store_begin_transaction(&ws_shard_hub);
+		if (status != WS_SUCCESS)
+		{
+			break;
+		}
+
+		status = ws_store_add_packed_records_to(ws_shard_hub, schema, records + start, end - start);
+		if (status != WS_SUCCESS)
+		{
+			ws_shard_rollback();
+			break;
+		}
+
+		status = ws_store_end_transaction(&ws_shard_hub);
+		start = end;
+	}
+
+	pthread_mutex_unlock(&ws_shard_lock);
+	return status;
+}
+
+int ws_shard_tag_anomaly(time_t record_time, uint32_t metrics)
+{
+	pthread_mutex_lock(&ws_shard_lock);
+	int status = ws_store_tag_anomaly(ws_shard_hub, record_time, metrics);
+	pthread_mutex_unlock(&ws_shard_lock);
+	return status;
+}
+
+int ws_shard_load_journal(ws_store_journal* journal, int* found)
+{
+	pthread_mutex_lock(&ws_shard_lock);
+	int status = ws_store_load_journal(ws_shard_hub, journal, found);
+	pthread_mutex_unlock(&ws_shard_lock);
+	return status;
+}
+
+int ws_shard_save_journal(const ws_store_journal* journal)
+{
+	pthread_mutex_lock(&ws_shard_lock);
+	int status = ws_store_save_journal(ws_shard_hub, journal);
+	pthread_mutex_unlock(&ws_shard_lock);
+	return status;
+}
+
+int ws_shard_clear_journal(void)
+{
+	pthread_mutex_lock(&ws_shard_lock);
+	int status = ws_store_clear_journal(ws_shard_hub);
+	pthread_mutex_unlock(&ws_shard_lock);
+	return status;
+}
+
+/* The state of a query across months */
+typedef struct
+{
+	const ws_store_range_query* query;
+	ws_store_row_cb row_callback;
+	ws_store_batch* batch;
+	ws_store_batch_cb batch_callback;
+	void* user;
+
+	int emitted;
+	int stopped;					// The callback asked to stop
+	int full;						// The limit has been reached
+
+	// Aggregate rows are held back one row, in case the next month's first row is the same bucket
+	ws_store_row pending;
+	int has_pending;
+	int first_in_month;
+	int pending_in_month;			// The pending row came from the month being queried
+	double pending_counts[WS_METRIC_COUNT];		// Rows in the pending row, for combining averages
+	double head_counts[WS_METRIC_COUNT];		// Rows in the first bucket of the month being queried
+} ws_shard_fold;
+
+static void ws_shard_emit(ws_shard_fold* fold, const ws_store_row* row)
+{
+	const ws_store_range_query* query = fold->query;
+
+	if (fold->batch == NULL)
+	{
+		fold->stopped = fold->row_callback(row, fold->user);
+	} else {
+		ws_store_batch* batch = fold->batch;
+		batch->time[batch->count] = row->time;
+		for (int m = 0; m < WS_METRIC_COUNT; m++)
+		{
+			if (query->metrics & WS_METRIC_BIT(m))
+			{
+				batch->values[m][batch->count] = row->values[m];
+			}
+		}
+
+		if (++batch->count == WS_STORE_BATCH_SIZE)
+		{
+			fold->stopped = fold->batch_callback(batch, fold->user);
+			batch->count = 0;
+		}
+	}
+
+	fold->emitted++;
+	if (query->limit > 0 && fold->emitted >= query->limit)
+	{
+		fold->full = 1;
+	}
+}
+
+/* Combines two aggregates of the same bucket from neighbouring months */
+static void ws_shard_merge(ws_shard_fold* fold, const ws_store_row* row)
+{
+	ws_store_row* pending = &fold->pending;
+
+	if (row->time < pending->time)
+	{
+		pending->time = row->time;
+	}
+
+	for (int m = 0; m < WS_METRIC_COUNT; m++)
+	{
+		if (!(fold->query->metrics & WS_METRIC_BIT(m)))
+		{
+			continue;
+		}
+
+		double a = pending->values[m];
+		double b = row->values[m];
+
+		switch (fold->query->aggregate)
+		{
+			case WS_AGG_MIN:
+				pending->values[m] = fmin(a, b);
+				break;
+			case WS_AGG_MAX:
+				pending->values[m] = fmax(a, b);
+				break;
+			case WS_AGG_AVG:
+			{
+				double a_count = isnan(a) ? 0 : fold->pending_counts[m];
+				double b_count = isnan(b) ? 0 : fold->head_counts[m];
+				double total = a_count + b_count;
+
+				pending->values[m] = (total > 0) ? ((a_count > 0 ? a * a_count : 0) + (b_count > 0 ? b * b_count : 0)) / total : NAN;
+				fold->pending_counts[m] = total;
+				break;
+			}
+			default:
+				pending->values[m] = isnan(a) ? b : (isnan(b) ? a : a + b);
+				break;
+		}
+	}
+}
+
+static int ws_shard_row(const ws_store_row* row, void* user)
+{
+	ws_shard_fold* fold = user;
+	const ws_store_range_query* query = fold->query;
+
+	if (query->aggregate == WS_AGG_NONE)
+	{
+		ws_shard_emit(fold, row);
+		return fold->stopped || fold->full;
+	}
+
+	int first = fold->first_in_month;
+	fold->first_in_month = 0;
+
+	// Only the first row of a month can share a bucket with the last row of the month before
+	if (first && fold->has_pending && (query->bucket_seconds <= 0 || row->time == fold->pending.time))
+	{
+		ws_shard_merge(fold, row);
+		return 0;
+	}
+
+	if (fold->has_pending)
+	{
+		ws_shard_emit(fold, &fold->pending);
+		if (fold->stopped || fold->full)
+		{
+			fold->has_pending = 0;
+			return 1;
+		}
+	}
+
+	fold->pending = *row;
+	fold->has_pending = 1;
+	fold->pending_in_month = 1;
+	return 0;
+}
+
+static int ws_shard_count_row(const ws_store_row* row, void* user)
+{
+	memcpy(user, row->values, sizeof(row->values));
+	return 0;
+}
+
+/* Counts the rows of each metric in part of a month, for weighting averages */
+static int ws_shard_count(const ws_store_range_query* query, const char* schema, time_t from, time_t to, double* counts)
+{
+	memset(counts, 0, sizeof(double) * WS_METRIC_COUNT);
+
+	ws_store_range_query count_query;
+	memset(&count_query, 0, sizeof(count_query));
+	count_query.from = from;
+	count_query.to = to;
+	count_query.metrics = query->metrics;
+	count_query.aggregate = WS_AGG_COUNT;
+	count_query.schema = schema;
+
+	return ws_store_query_range(ws_shard_hub, &count_query, ws_shard_count_row, counts);
+}
+
+/* The part of [from, to) in the bucket holding a time. Buckets start at multiples of
+   bucket_seconds in local time, the same as in ws_store_range_sql(). */
+static void ws_shard_bucket(time_t time, int bucket_seconds, time_t from, time_t to, time_t* start, time_t* end)
+{
+	struct tm date_time;
+	localtime_r(&time, &date_time);
+
+	time_t local = time + date_time.tm_gmtoff;
+	*start = local - (local % bucket_seconds) - date_time.tm_gmtoff;
+	*end = *start + bucket_seconds;
+
+	*start = (*start < from) ? from : *start;
+	*end = (*end > to) ? to : *end;
+}
+
+static int ws_shard_run(const ws_store_range_query* query, ws_store_row_cb row_callback,
+                        ws_store_batch* batch, ws_store_batch_cb batch_callback, void* user)
+{
+	if (query->to <= query->from)
+	{
+		return WS_SUCCESS;
+	}
+
+	ws_shard_fold fold;
+	memset(&fold, 0, sizeof(fold));
+	fold.query = query;
+	fold.row_callback = row_callback;
+	fold.batch = batch;
+	fold.batch_callback = batch_callback;
+	fold.user = user;
+
+	if (batch != NULL)
+	{
+		batch->count = 0;
+	}
+
+	int aggregate = query->aggregate != WS_AGG_NONE;
+	int first_key = ws_shard_month_key(query->from);
+	int last_key = ws_shard_month_key(query->to - 1);
+	int descending = query->descending && (!aggregate || query->bucket_seconds > 0);
+	int status = WS_SUCCESS;
+
+	pthread_mutex_lock(&ws_shard_lock);
+
+	for (int key = descending ? last_key : first_key; !fold.stopped && !fold.full; )
+	{
+		ws_store_range_query month_query = *query;
+		time_t month_start = ws_shard_month_start(key);
+		time_t month_end = ws_shard_month_start(ws_shard_next_key(key));
+
+		month_query.from = (query->from > month_start) ? query->from : month_start;
+		month_query.to = (query->to < month_end) ? query->to : month_end;
+		month_query.limit = aggregate ? 0 : query->limit - fold.emitted;
+
+		char schema[16];
+		int found;
+		status = ws_shard_attach(key, 0, schema, &found);
+		if (status != WS_SUCCESS)
+		{
+			break;
+		}
+
+		if (found)
+		{
+			month_query.schema = schema;
+
+			// Averages can only be combined knowing how many rows went into each
+			double tail_counts[WS_METRIC_COUNT];
+			if (query->aggregate == WS_AGG_AVG)
+			{
+				time_t head_from = month_query.from;
+				time_t head_to = month_query.to;
+				time_t tail_from = month_query.from;
+				time_t tail_to = month_query.to;
+
+				if (query->bucket_seconds > 0)
+				{
+					ws_shard_bucket(descending ? month_query.to - 1 : month_query.from, query->bucket_seconds,
+					                month_query.from, month_query.to, &head_from, &head_to);
+					ws_shard_bucket(descending ? month_query.from : month_query.to - 1, query->bucket_seconds,
+					                month_query.from, month_query.to, &tail_from, &tail_to);
+				}
+
+				status = ws_shard_count(query, schema, head_from, head_to, fold.head_counts);
+				if (status == WS_SUCCESS)
+				{
+					status = ws_shard_count(query, schema, tail_from, tail_to, tail_counts);
+				}
+
+				if (status != WS_SUCCESS)
+				{
+					break;
+				}
+			}
+
+			fold.first_in_month = 1;
+			fold.pending_in_month = 0;
+
+			status = ws_store_query_range(ws_shard_hub, &month_query, ws_shard_row, &fold);
+			if (status != WS_SUCCESS)
+			{
+				break;
+			}
+
+			// The month's last row is the one that may be combined with the next month's first
+			if (query->aggregate == WS_AGG_AVG && fold.pending_in_month)
+			{
+				memcpy(fold.pending_counts, tail_counts, sizeof(tail_counts));
+			}
+		}
+
+		if (key == (descending ? first_key : last_key))
+		{
+			break;
+		}
+
+		key = descending ? ws_shard_previous_key(key) : ws_shard_next_key(key);
+	}
+
+	if (status == WS_SUCCESS && fold.has_pending && !fold.stopped && !fold.full)
+	{
+		ws_shard_emit(&fold, &fold.pending);
+	}
+
+	pthread_mutex_unlock(&ws_shard_lock);
+
+	if (status == WS_SUCCESS && batch != NULL && batch->count > 0 && !fold.stopped)
+	{
+		batch_callback(batch, user);
+	}
+
+	return status;
+}
+
+int ws_shard_query_range(const ws_store_range_query* query, ws_store_row_cb callback, void* user)
+{
+	return ws_shard_run(query, callback, NULL, NULL, user);
+}
+
+int ws_shard_query_range_batch(const ws_store_range_query* query, ws_store_batch* batch, ws_store_batch_cb callback, void* user)
+{
+	return ws_shard_run(query, NULL, batch, callback, user);
+}
+
+/* Checks whether a month has a record that isn't at the start of a bucket. Once downsampled it 
+   has none, until records are stored in it again by a resync, gap fill or import. */
+static int ws_shard_has_partial_buckets(const char* schema, int bucket_seconds, int* found)
+{
+	char sql[WS_SHARD_SQL_MAX];
+	snprintf(sql, sizeof(sql), "SELECT 1 FROM %s.WeatherData WHERE CAST(strftime('%%s', RecordDateTime) AS INTEGER) %% %i != 0 LIMIT 1",
+	         schema, bucket_seconds);
+
+	sqlite3_stmt* statement;
+	int status = ws_store_create_statement(&ws_shard_hub, sql, sizeof(sql), &statement);
+	if (status != WS_SUCCESS)
+	{
+		return status;
+	}
+
+	status = ws_store_execute_query(&ws_shard_hub, &statement);
+	*found = (status == WS_DB_ROW);
+	if (status == WS_DB_ROW)
+	{
+		status = WS_SUCCESS;
+	}
+
+	ws_store_delete_stmt(&ws_shard_hub, &statement);
+	return status;
+}
+
+/* Statements are prepared on each call rather than cached, as the schema a month is attached as
+   changes from call to call */
+static int ws_shard_downsample_month(int key, int bucket_seconds)
+{
+	char schema[16];
+	int found;
+	int status = ws_shard_attach(key, 0, schema, &found);
+	if (status != WS_SUCCESS || !found)
+	{
+		return status;
+	}
+
+	int partial;
+	status = ws_shard_has_partial_buckets(schema, bucket_seconds, &partial);
+	if (status != WS_SUCCESS || !partial)
+	{
+		return status;
+	}
+
+	status = ws_store_begin_transaction(&ws_shard_hub);
+	if (status != WS_SUCCESS)
+	{
+		return status;
+	}
+
+	char sql[WS_SHARD_SQL_MAX];
+	snprintf(sql, sizeof(sql), "CREATE TEMP TABLE ws_shard_buckets AS SELECT "
+	         "datetime((CAST(strftime('%%s', RecordDateTime) AS INTEGER) / %i) * %i, 'unixepoch'), "
+	         "ROUND(AVG(IndoorHumidity)), ROUND(AVG(OutdoorHumidity)), AVG(IndoorTemperature), AVG(OutdoorTemperature), "
+	         "AVG(DewPoint), AVG(AbsolutePressure), AVG(WindSpeed), MAX(GuestSpeed), ws_mean_direction(WindDirection), "
+	         "MAX(TotalRain), MAX(SensorContactError), MAX(RainCounterOverflow) FROM %s.WeatherData GROUP BY 1",
+	         bucket_seconds, bucket_seconds, schema);
+	status = ws_store_query(&ws_shard_hub, sql, sizeof(sql));
+
+	if (status == WS_SUCCESS)
+	{
+		snprintf(sql, sizeof(sql), "DELETE FROM %s.WeatherData", schema);
+		status = ws_store_query(&ws_shard_hub, sql, sizeof(sql));
+	}
+
+	if (status == WS_SUCCESS)
+	{
+		snprintf(sql, sizeof(sql), "INSERT INTO %s.WeatherData SELECT * FROM temp.ws_shard_buckets", schema);
+		status = ws_store_query(&ws_shard_hub, sql, sizeof(sql));
+	}
+
+	if (status == WS_SUCCESS)
+	{
+		snprintf(sql, sizeof(sql), "DROP TABLE temp.ws_shard_buckets");
+		status = ws_store_query(&ws_shard_hub, sql, sizeof(sql));
+	}
+
+	if (status != WS_SUCCESS)
+	{
+		ws_shard_rollback();
+		return status;
+	}
+
+	status = ws_store_end_transaction(&ws_shard_hub);
+	if (status != WS_SUCCESS)
+	{
+		return status;
+	}
+
+	// Give the space back, as the month is now a fraction of its size
+	snprintf(sql, sizeof(sql), "VACUUM %s", schema);
+	return ws_store_query(&ws_shard_hub, sql, sizeof(sql));
+}
+
+int ws_shard_downsample(int year, int month, int bucket_seconds)
+{
+	pthread_mutex_lock(&ws_shard_lock);
+	int status = ws_shard_downsample_month(year * 100 + month, bucket_seconds);
+	pthread_mutex_unlock(&ws_shard_lock);
+	return status;
+}
+
+int ws_shard_migrate(const char* path)
+{
+	pthread_mutex_lock(&ws_shard_lock);
+
+	char sql[WS_SHARD_SQL_MAX];
+	snprintf(sql, sizeof(sql), "ATTACH DATABASE ?1 AS source");
+
+	sqlite3_stmt* statement;
+	int status = ws_store_create_statement(&ws_shard_hub, sql, sizeof(sql), &statement);
+	if (status != WS_SUCCESS)
+	{
+		pthread_mutex_unlock(&ws_shard_lock);
+		return status;
+	}
+
+	sqlite3_bind_text(statement, 1, path, -1, SQLITE_TRANSIENT);
+	status = ws_store_execute_query(&ws_shard_hub, &statement);
+	ws_store_delete_stmt(&ws_shard_hub, &statement);
+	if (status != WS_SUCCESS)
+	{
+		pthread_mutex_unlock(&ws_shard_lock);
+		return status;
+	}
+
+	// RecordDateTime is the key, so each month is a range of it
+	snprintf(sql, sizeof(sql), "SELECT MIN(RecordDateTime), MAX(RecordDateTime) FROM source.WeatherData");
+	status = ws_store_create_statement(&ws_shard_hub, sql, sizeof(sql), &statement);
+
+	time_t first = 0;
+	time_t last = -1;
+	if (status == WS_SUCCESS)
+	{
+		status = ws_store_execute_query(&ws_shard_hub, &statement);
+		if (status == WS_DB_ROW)
+		{
+			if (!ws_store_parse_date((const char*)sqlite3_column_text(statement, 0), &first) ||
+			    !ws_store_parse_date((const char*)sqlite3_column_text(statement, 1), &last))
+			{
+				last = -1;
+			}
+			status = WS_SUCCESS;
+		}
+		ws_store_delete_stmt(&ws_shard_hub, &statement);
+	}
+
+	for (int key = ws_shard_month_key(first); status == WS_SUCCESS && last >= first; key = ws_shard_next_key(key))
+	{
+		char schema[16];
+		int found;
+		status = ws_shard_attach(key, 1, schema, &found);
+		if (status != WS_SUCCESS)
+		{
+			break;
+		}
+
+		snprintf(sql, sizeof(sql), "INSERT OR REPLACE INTO %s.WeatherData SELECT * FROM source.WeatherData "
+		         "WHERE RecordDateTime >= '%.4i-%.2i-01 00:00:00' AND RecordDateTime < '%.4i-%.2i-01 00:00:00'",
+		         schema, key / 100, key % 100, ws_shard_next_key(key) / 100, ws_shard_next_key(key) % 100);
+		status = ws_store_query(&ws_shard_hub, sql, sizeof(sql));
+
+		if (key == ws_shard_month_key(last))
+		{
+			break;
+		}
+	}
+
+	snprintf(sql, sizeof(sql), "DETACH DATABASE source");
+	ws_store_query(&ws_shard_hub, sql, sizeof(sql));
+
+	pthread_mutex_unlock(&ws_shard_lock);
+	return status;
+}
+
+/* Downsamples every month in the directory that is old enough for one of the tiers */
+static void ws_shard_retain(time_t now)
+{
+	DIR* directory = opendir(ws_shard_directory);
+	if (directory == NULL)
+	{
+		return;
+	}
+
+	struct dirent* entry;
+	while ((entry = readdir(directory)) != NULL)
+	{
+		int year;
+		int month;
+		int length = 0;
+
+		if (sscanf(entry->d_name, "WeatherDB-%4d-%2d.sqlite%n", &year, &month, &length) != 2 ||
+		    length != (int)strlen(entry->d_name) || month < 1 || month > 12)
+		{
+			continue;
+		}
+
+		time_t month_end = ws_shard_month_start(ws_shard_next_key(year * 100 + month));
+		int bucket_seconds = 0;
+
+		pthread_mutex_lock(&ws_shard_lock);
+		for (int i = 0; i < ws_shard_tier_count; i++)
+		{
+			if (now - month_end >= ws_shard_tiers[i].older_than && ws_shard_tiers[i].bucket_seconds > bucket_seconds)
+			{
+				bucket_seconds = ws_shard_tiers[i].bucket_seconds;
+			}
+		}
+
+		if (bucket_seconds > 0 && ws_shard_retaining)
+		{
+			ws_shard_downsample_month(year * 100 + month, bucket_seconds);
+		}
+		pthread_mutex_unlock(&ws_shard_lock);
+	}
+
+	closedir(directory);
+}
+
+static void* ws_shard_retention_loop(void* arg)
+{
+	pthread_mutex_lock(&ws_shard_lock);
+	while (ws_shard_retaining)
+	{
+		pthread_mutex_unlock(&ws_shard_lock);
+		ws_shard_retain(time(NULL));
+		pthread_mutex_lock(&ws_shard_lock);
+
+		struct timespec wake;
+		clock_gettime(CLOCK_REALTIME, &wake);
+		wake.tv_sec += WS_SHARD_RETENTION_INTERVAL;
+
+		while (ws_shard_retaining && pthread_cond_timedwait(&ws_shard_wake, &ws_shard_lock, &wake) != ETIMEDOUT)
+		{
+		}
+	}
+	pthread_mutex_unlock(&ws_shard_lock);
+
+	return NULL;
+}
+
+int ws_shard_start_retention(const ws_shard_tier* tiers, int count)
+{
+	pthread_mutex_lock(&ws_shard_lock);
+	ws_shard_tier_count = (count < WS_SHARD_MAX_TIERS) ? count : WS_SHARD_MAX_TIERS;
+	memcpy(ws_shard_tiers, tiers, sizeof(ws_shard_tier) * ws_shard_tier_count);
+	ws_shard_retaining = 1;
+	pthread_mutex_unlock(&ws_shard_lock);
+
+	if (pthread_create(&ws_shard_thread, NULL, ws_shard_retention_loop, NULL) != 0)
+	{
+		ws_shard_retaining = 0;
+		return WS_ERR_THREAD;
+	}
+
+	return WS_SUCCESS;
+}
+
+void ws_shard_stop_retention(void)
+{
+	pthread_mutex_lock(&ws_shard_lock);
+	if (!ws_shard_retaining)
+	{
+		pthread_mutex_unlock(&ws_shard_lock);
+		return;
+	}
+
+	ws_shard_retaining = 0;
+	pthread_cond_signal(&ws_shard_wake);
+	pthread_mutex_unlock(&ws_shard_lock);
+
+	pthread_join(ws_shard_thread, NULL);
+}
@@ -0,0 +1,139 @@
+#ifndef WS_SHARD_H
+#define WS_SHARD_H
+
+#include "ws.h"
+#include "ws_store.h"
+#include <time.h>
+
+/*
+	Weather records split into a database per month, named WeatherDB-YYYY-MM.sqlite in a
+	directory. The month databases are attached on demand to a single connection, at most
+	WS_SHARD_MAX_ATTACHED at once, so writes only ever touch a month's worth of rows and a
+	query only reads the months its range overlaps.
+
+	Months past a certain age can be downsampled, replacing their records with one record
+	per bucket, in the background.
+
+	The anomalies and the download journal are kept in WeatherDB-meta.sqlite, which is
+	attached for as long as the months are open.
+*/
+
+// Most month databases attached at once. SQLite allows 10 by default, and one is the meta database.
+#define WS_SHARD_MAX_ATTACHED 8
+
+// Most retention tiers
+#define WS_SHARD_MAX_TIERS 4
+
+// Seconds between retention passes
+#define WS_SHARD_RETENTION_INTERVAL 3600
+
+/**
+	A retention tier. Months that ended more than older_than seconds ago are downsampled
+	to buckets of bucket_seconds.
+*/
+typedef struct
+{
+	time_t older_than;
+	int bucket_seconds;
+} ws_shard_tier;
+
+
+/**
+	Opens the month databases in a directory, which must already exist.
+
+	Return:
+		- WS_ERR_DB_OPEN	The connection could not be opened
+		- Any error from attaching the meta database
+*/
+int ws_shard_open(const char* directory);
+
+/**
+	Stops the retention thread, if it was started, and closes every month database.
+*/
+int ws_shard_close(void);
+
+/**
+	Stores records in the databases of their months, creating them as needed. Each month's
+	records are stored in a single transaction.
+
+	Parameters:
+		records		The records, with their epoch set
+		count		The number of records
+*/
+int ws_shard_add_packed_records(const ws_packed_record* records, int count);
+
+/**
+	Tags a record as looking like a sensor glitch, as ws_store_tag_anomaly()
+*/
+int ws_shard_tag_anomaly(time_t record_time, uint32_t metrics);
+
+/**
+	Loads, replaces and removes the download journal, as ws_store_load_journal(),
+	ws_store_save_journal() and ws_store_clear_journal(). Each change is committed
+	straight away, so it should only be made once the records it describes are stored.
+*/
+int ws_shard_load_journal(ws_store_journal* journal, int* found);
+int ws_shard_save_journal(const ws_store_journal* journal);
+int ws_shard_clear_journal(void);
+
+/**
+	Runs a query over a time range, as ws_store_query_range(), across the months the range
+	overlaps. Aggregates of buckets that span two months (and whole range aggregates) are
+	combined, so the rows are the same as from a single database. The query's schema is
+	ignored.
+
+	The callback is called with the shard lock held, so it must not call any ws_shard_ function.
+*/
+int ws_shard_query_range(const ws_store_range_query* query, ws_store_row_cb callback, void* user);
+
+/**
+	Runs a query over a time range, as ws_store_query_range_batch(), across the months the
+	range overlaps. Batches are full except for the last.
+*/
+int ws_shard_query_range_batch(const ws_store_range_query* query, ws_store_batch* batch, ws_store_batch_cb callback, void* user);
+
+/**
+	Replaces the records of a month with one per bucket. Humidities, temperatures, pressure
+	and wind speed are averaged, wind direction is the mean of the directions as vectors,
+	and gust speed, rain and the flags take the largest value. Does nothing if every record of
+	the month is already at the start of a bucket, so a month that has records stored in it
+	after being downsampled is downsampled again.
+
+	Parameters:
+		year			The year
+		month			The month (1 - 12)
+		bucket_seconds	The size of each bucket
+
+	Return:
+		- Any error from the database
+*/
+int ws_shard_downsample(int year, int month, int bucket_seconds);
+
+/**
+	Copies the records of a single WeatherDB database into the month databases.
+
+	Parameters:
+		path 		The database to copy from
+*/
+int ws_shard_migrate(const char* path);
+
+/**
+	Starts a thread that downsamples every month by the coarsest tier it is old enough for,
+	every WS_SHARD_RETENTION_INTERVAL seconds. Only one month is locked at a time, so
+	writes and queries carry on between them.
+
+	Parameters:
+		tiers		The tiers, at most WS_SHARD_MAX_TIERS
+		count		The number of tiers
+
+	Return:
+		- WS_ERR_THREAD			The thread could not be started
+*/
+int ws_shard_start_retention(const ws_shard_tier* tiers, int count);
+
+/**
+	Stops the thread started by ws_shard_start_retention()
+*/
+void ws_shard_stop_retention(void);
+
+#endif
@@ -0,0 +1,260 @@
+#include "ws_sketch.h"
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#define WS_SKETCH_HEADER_BYTES ((int)(sizeof(int32_t) + 3 * sizeof(double)))
+
+void ws_sketch_init(ws_sketch* sketch)
+{
+	sketch->count = 0;
+	sketch->sorted = 0;
+	sketch->total = 0;
+	sketch->min = INFINITY;
+	sketch->max = -INFINITY;
+}
+
+static int ws_sketch_compare(const void* a, const void* b)
+{
+	double x = ((const ws_sketch_centroid*)a)->mean;
+	double y = ((const ws_sketch_centroid*)b)->mean;
+	return (x > y) - (x < y);
+}
+
+/* The highest quantile a centroid starting at q can reach, from the k1 scale function
+   k(q) = compression / 2pi * asin(2q - 1): each centroid spans at most 1 of k */
+static double ws_sketch_limit(double q)
+{
+	double k = WS_SKETCH_COMPRESSION / (2 * M_PI) * asin(2 * q - 1) + 1;
+	if (k >= WS_SKETCH_COMPRESSION / 4.0)
+	{
+		return 1;
+	}
+	return (sin(k * 2 * M_PI / WS_SKETCH_COMPRESSION) + 1) / 2;
+}
+
+/* Sorts the centroids and merges neighbours as far as the scale function allows */
+static void ws_sketch_compress(ws_sketch* sketch)
+{
+	if (sketch->count == 0)
+	{
+		return;
+	}
+
+	ws_sketch_centroid* centroids = sketch->centroids;
+	if (sketch->sorted < sketch->count)
+	{
+		qsort(centroids, sketch->count, sizeof(ws_sketch_centroid), ws_sketch_compare);
+	}
+
+	ws_sketch_centroid current = centroids[0];
+	double before = 0;
+	double limit = sketch->total * ws_sketch_limit(0);
+	int count = 0;
+
+	for (int i = 1; i < sketch->count; i++)
+	{
+		if (before + current.weight + centroids[i].weight <= limit)
+		{
+			current.weight += centroids[i].weight;
+			current.mean += (centroids[i].mean - current.mean) * centroids[i].weight / current.weight;
+			continue;
+		}
+
+		// count only ever trails i, so centroids not yet looked at aren't overwritten
+		centroids[count++] = current;
+		before += current.weight;
+		limit = sketch->total * ws_sketch_limit(before / sketch->total);
+		current = centroids[i];
+	}
+
+	centroids[count++] = current;
+	sketch->count = count;
+	sketch->sorted = count;
+}
+
+static void ws_sketch_add_centroid(ws_sketch* sketch, double mean, double weight)
+{
+	if (sketch->count == WS_SKETCH_CENTROIDS)
+	{
+		ws_sketch_compress(sketch);
+	}
+
+	sketch->centroids[sketch->count].mean = mean;
+	sketch->centroids[sketch->count].weight = weight;
+	sketch->count++;
+	sketch->total += weight;
+}
+
+void ws_sketch_add(ws_sketch* sketch, double value)
+{
+	if (isnan(value))
+	{
+		return;
+	}
+
+	ws_sketch_add_centroid(sketch, value, 1);
+	sketch->min = (value < sketch->min) ? value : sketch->min;
+	sketch->max = (value > sketch->max) ? value : sketch->max;
+}
+
+void ws_sketch_merge(ws_sketch* sketch, const ws_sketch* other)
+{
+	if (sketch->count + other->count > WS_SKETCH_CENTROIDS)
+	{
+		ws_sketch_compress(sketch);
+	}
+
+	// Sorted sketches (such as those read back) are merged in order from the end, so merging 
+	// many of them only compresses when the centroids run out and never sorts
+	if (sketch->sorted == sketch->count && other->sorted == other->count && sketch->count + other->count <= WS_SKETCH_CENTROIDS)
+	{
+		ws_sketch_centroid* to = sketch->centroids;
+		const ws_sketch_centroid* from = other->centroids;
+		int i = sketch->count - 1;
+		int j = other->count - 1;
+
+		for (int k = sketch->count + other->count - 1; j >= 0; k--)
+		{
+			to[k] = (i >= 0 && to[i].mean > from[j].mean) ? to[i--] : from[j--];
+		}
+
+		sketch->count += other->count;
+		sketch->sorted = sketch->count;
+		sketch->total += other->total;
+	}
+	else
+	{
+		for (int i = 0; i < other->count; i++)
+		{
+			ws_sketch_add_centroid(sketch, other->centroids[i].mean, other->centroids[i].weight);
+		}
+	}
+
+	sketch->min = (other->min < sketch->min) ? other->min : sketch->min;
+	sketch->max = (other->max > sketch->max) ? other->max : sketch->max;
+}
+
+/* Sorts the centroids, and only compresses them once there are more than compressing would leave. Until
+   then every value is kept exactly, and adding a few values to a small sketch stays cheap */
+static void ws_sketch_tidy(ws_sketch* sketch)
+{
+	if (sketch->count > WS_SKETCH_COMPRESSION)
+	{
+		ws_sketch_compress(sketch);
+	}
+	else if (sketch->sorted < sketch->count)
+	{
+		qsort(sketch->centroids, sketch->count, sizeof(ws_sketch_centroid), ws_sketch_compare);
+		sketch->sorted = sketch->count;
+	}
+}
+
+double ws_sketch_quantile(ws_sketch* sketch, double q)
+{
+	if (sketch->count == 0)
+	{
+		return NAN;
+	}
+
+	ws_sketch_tidy(sketch);
+
+	const ws_sketch_centroid* c = sketch->centroids;
+	int n = sketch->count;
+	double index = q * sketch->total;
+
+	if (q <= 0)
+	{
+		return sketch->min;
+	}
+
+	if (q >= 1)
+	{
+		return sketch->max;
+	}
+
+	// Between the ends and the centres of the first and last centroids, the values are spread out linearly
+	if (index < c[0].weight / 2)
+	{
+		return sketch->min + (c[0].mean - sketch->min) * index / (c[0].weight / 2);
+	}
+
+	if (index > sketch->total - c[n - 1].weight / 2)
+	{
+		return sketch->max - (sketch->max - c[n - 1].mean) * (sketch->total - index) / (c[n - 1].weight / 2);
+	}
+
+	double centre = c[0].weight / 2;
+	for (int i = 0; i < n - 1; i++)
+	{
+		double gap = (c[i].weight + c[i + 1].weight) / 2;
+		if (centre + gap < index)
+		{
+			centre += gap;
+			continue;
+		}
+
+		// A centroid of weight 1 is a single value, which has the half of the gap next to it to itself
+		double left = index - centre;
+		double right = centre + gap - index;
+		if (c[i].weight == 1 && left < 0.5)
+		{
+			return c[i].mean;
+		}
+
+		if (c[i + 1].weight == 1 && right <= 0.5)
+		{
+			return c[i + 1].mean;
+		}
+
+		left -= (c[i].weight == 1) ? 0.5 : 0;
+		right -= (c[i + 1].weight == 1) ? 0.5 : 0;
+		return (c[i].mean * right + c[i + 1].mean * left) / (left + right);
+	}
+
+	return sketch->max;
+}
+
+int ws_sketch_size(ws_sketch* sketch)
+{
+	ws_sketch_tidy(sketch);
+	return WS_SKETCH_HEADER_BYTES + sketch->count * (int)sizeof(ws_sketch_centroid);
+}
+
+int ws_sketch_write(ws_sketch* sketch, unsigned char* data)
+{
+	ws_sketch_tidy(sketch);
+
+	int32_t count = sketch->count;
+	memcpy(data, &count, sizeof(count));
+	memcpy(data + sizeof(int32_t), &sketch->total, sizeof(double));
+	memcpy(data + sizeof(int32_t) + sizeof(double), &sketch->min, sizeof(double));
+	memcpy(data + sizeof(int32_t) + 2 * sizeof(double), &sketch->max, sizeof(double));
+	memcpy(data + WS_SKETCH_HEADER_BYTES, sketch->centroids, count * sizeof(ws_sketch_centroid));
+
+	return WS_SKETCH_HEADER_BYTES + count * (int)sizeof(ws_sketch_centroid);
+}
+
+int ws_sketch_read(ws_sketch* sketch, const unsigned char* data, int size)
+{
+	int32_t count;
+	if (size < WS_SKETCH_HEADER_BYTES)
+	{
+		return -1;
+	}
+
+	memcpy(&count, data, sizeof(count));
+	if (count < 0 || count > WS_SKETCH_CENTROIDS || size < WS_SKETCH_HEADER_BYTES + count * (int)sizeof(ws_sketch_centroid))
+	{
+		return -1;
+	}
+
+	sketch->count = count;
+	sketch->sorted = count;
+	memcpy(&sketch->total, data + sizeof(int32_t), sizeof(double));
+	memcpy(&sketch->min, data + sizeof(int32_t) + sizeof(double), sizeof(double));
+	memcpy(&sketch->max, data + sizeof(int32_t) + 2 * sizeof(double), sizeof(double));
+	memcpy(sketch->centroids, data + WS_SKETCH_HEADER_BYTES, count * sizeof(ws_sketch_centroid));
+
+	return WS_SKETCH_HEADER_BYTES + count * (int)sizeof(ws_sketch_centroid);
+}
@@ -0,0 +1,100 @@
+#ifndef WS_SKETCH_H
+#define WS_SKETCH_H
+
+#include <stdint.h>
+
+/*
+	A t-digest: a mergeable summary of a set of values that estimates their quantiles. Values
+	are kept as centroids (a mean and a weight), which are small near the ends of the
+	distribution and larger towards the middle, so the extreme percentiles are the most
+	accurate. A digest holds at most about WS_SKETCH_COMPRESSION centroids however many
+	values went into it, and until then every value is kept exactly.
+
+	Digests of different sets can be merged into a digest of their union, so the store keeps
+	one per metric per day and per month and merges those of a range (see
+	ws_store_range_sketches()).
+*/
+
+// Larger keeps more centroids and gives smaller errors
+#define WS_SKETCH_COMPRESSION 200
+
+// The compressed centroids (at most about WS_SKETCH_COMPRESSION) and room for added ones
+#define WS_SKETCH_CENTROIDS 512
+
+typedef struct
+{
+	double mean;
+	double weight;
+} ws_sketch_centroid;
+
+typedef struct
+{
+	int count;					// Centroids used
+	int sorted;					// The first sorted centroids are in order of mean
+	double total;				// Total weight
+	double min;
+	double max;
+	ws_sketch_centroid centroids[WS_SKETCH_CENTROIDS];
+} ws_sketch;
+
+/**
+	Sets up an empty sketch.
+*/
+void ws_sketch_init(ws_sketch* sketch);
+
+/**
+	Adds a value. NaNs (values that aren't known) are left out.
+*/
+void ws_sketch_add(ws_sketch* sketch, double value);
+
+/**
+	Adds every value summarised by another sketch.
+*/
+void ws_sketch_merge(ws_sketch* sketch, const ws_sketch* other);
+
+/**
+	Estimates a quantile.
+
+	Parameters:
+		sketch		The sketch, which is sorted (and compressed if it has more than WS_SKETCH_COMPRESSION centroids) first
+		q			The quantile, from 0 (the minimum) to 1 (the maximum)
+
+	Return:
+		The estimate, or NAN if the sketch is empty
+*/
+double ws_sketch_quantile(ws_sketch* sketch, double q);
+
+/**
+	The bytes ws_sketch_write() needs for a sketch. At most WS_SKETCH_BYTES_MAX.
+*/
+int ws_sketch_size(ws_sketch* sketch);
+
+#define WS_SKETCH_BYTES_MAX ((int)(sizeof(int32_t) + 3 * sizeof(double) + WS_SKETCH_CENTROIDS * sizeof(ws_sketch_centroid)))
+
+/**
+	Writes a sketch out, in the machine's byte order. It is sorted first, and compressed
+	if it has more than WS_SKETCH_COMPRESSION centroids.
+
+	Parameters:
+		sketch		The sketch
+		data		Where to write it, with room for ws_sketch_size() bytes
+
+	Return:
+		The number of bytes written
+*/
+int ws_sketch_write(ws_sketch* sketch, unsigned char* data);
+
+/**
+	Reads a sketch written by ws_sketch_write().
+
+	Parameters:
+		sketch		The sketch
+		data		What was written
+		size		The bytes available in data
+
+	Return:
+		The number of bytes read, or -1 if data doesn't hold a whole sketch
+*/
+int ws_sketch_read(ws_sketch* sketch, const unsigned char* data, int size);
+
+#endif
@@ -0,0 +1,255 @@
+#include "ws_slots.h"
+#include "ws_store.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define WS_SLOTS_DAY_SECONDS (24 * 60 * 60)
+
+/* floor(a / b) for b > 0 */
+static inline int64_t ws_slots_floor_div(int64_t a, int64_t b)
+{
+	return (a >= 0) ? a / b : -((-a + b - 1) / b);
+}
+
+/* The slot a time falls in: the nearest centre */
+static inline int64_t ws_slots_slot(const ws_slots* slots, time_t time)
+{
+	return ws_slots_floor_div((int64_t)time - slots->origin + slots->period * 30, (int64_t)slots->period * 60);
+}
+
+/* The start of the times that fall in a slot */
+static inline time_t ws_slots_start(const ws_slots* slots, int64_t slot)
+{
+	return (time_t)(slots->origin + slot * slots->period * 60 - slots->period * 30);
+}
+
+/* The day a slot is in, by the time it is centred on */
+static inline int64_t ws_slots_day_of(const ws_slots* slots, int64_t slot)
+{
+	return ws_slots_floor_div(slots->origin + slot * slots->period * 60, WS_SLOTS_DAY_SECONDS);
+}
+
+/* The first slot of a day: the first centred on or after its start */
+static inline int64_t ws_slots_first(const ws_slots* slots, int64_t day)
+{
+	int64_t period = (int64_t)slots->period * 60;
+	return ws_slots_floor_div(day * WS_SLOTS_DAY_SECONDS - slots->origin + period - 1, period);
+}
+
+void ws_slots_init(ws_slots* slots, int period, time_t origin)
+{
+	memset(slots, 0, sizeof(ws_slots));
+	slots->period = (period > 0 && period <= WS_SLOTS_DAY_SECONDS / 60) ? period : 30;
+
+	// Only where the centres fall matters, so the origin is kept small
+	slots->origin = (time_t)(origin - ws_slots_floor_div(origin, (int64_t)slots->period * 60) * slots->period * 60);
+}
+
+void ws_slots_free(ws_slots* slots)
+{
+	free(slots->days);
+	slots->days = NULL;
+	slots->day_count = 0;
+}
+
+/* Makes sure the days from first to last are held */
+static int ws_slots_reserve(ws_slots* slots, int64_t first, int64_t last)
+{
+	if (slots->day_count > 0)
+	{
+		first = (first < slots->first_day) ? first : slots->first_day;
+		last = (last > slots->first_day + slots->day_count - 1) ? last : slots->first_day + slots->day_count - 1;
+		if (first == slots->first_day && last - first + 1 == slots->day_count)
+		{
+			return WS_SUCCESS;
+		}
+	}
+
+	int64_t count = last - first + 1;
+	if (count <= 0 || count > INT32_MAX / (int64_t)sizeof(ws_slots_day))
+	{
+		return WS_ERR_FILE_IO;
+	}
+
+	ws_slots_day* days = realloc(slots->days, count * sizeof(ws_slots_day));
+	if (days == NULL)
+	{
+		return WS_ERR_FILE_IO;
+	}
+
+	// Days are only added before or after those held, so the held ones move up by the days added before
+	int before = (slots->day_count > 0) ? (int)(slots->first_day - first) : 0;
+	memmove(&days[before], days, slots->day_count * sizeof(ws_slots_day));
+	memset(days, 0, before * sizeof(ws_slots_day));
+	memset(&days[before + slots->day_count], 0, (count - before - slots->day_count) * sizeof(ws_slots_day));
+
+	slots->days = days;
+	slots->first_day = first;
+	slots->day_count = (int)count;
+	return WS_SUCCESS;
+}
+
+int ws_slots_has(const ws_slots* slots, time_t time)
+{
+	int64_t slot = ws_slots_slot(slots, time);
+	int64_t day = ws_slots_day_of(slots, slot);
+	int64_t index = day - slots->first_day;
+
+	if (index < 0 || index >= slots->day_count)
+	{
+		return 0;
+	}
+
+	int64_t bit = slot - ws_slots_first(slots, day);
+	return (slots->days[index].bits[bit / 64] >> (bit % 64)) & 1;
+}
+
+int ws_slots_mark(ws_slots* slots, time_t time, int* duplicate)
+{
+	int64_t slot = ws_slots_slot(slots, time);
+	int64_t day = ws_slots_day_of(slots, slot);
+
+	int status = ws_slots_reserve(slots, day, day);
+	if (status != WS_SUCCESS)
+	{
+		return status;
+	}
+
+	int64_t bit = slot - ws_slots_first(slots, day);
+	uint64_t* word = &slots->days[day - slots->first_day].bits[bit / 64];
+	int was_set = (*word >> (bit % 64)) & 1;
+
+	*word |= (uint64_t)1 << (bit % 64);
+	slots->duplicates += was_set;
+
+	if (duplicate != NULL)
+	{
+		*duplicate = was_set;
+	}
+
+	return WS_SUCCESS;
+}
+
+int ws_slots_load(ws_slots* slots, sqlite3* info, time_t from, time_t to)
+{
+	if (to <= from)
+	{
+		return WS_SUCCESS;
+	}
+
+	// Every day of the range is needed anyway, so they are made room for at once
+	int status = ws_slots_reserve(slots, ws_slots_day_of(slots, ws_slots_slot(slots, from)), ws_slots_day_of(slots, ws_slots_slot(slots, to - 1)));
+	if (status != WS_SUCCESS)
+	{
+		return status;
+	}
+
+	sqlite3_stmt* statement;
+	status = ws_store_cached_statement(info, "SELECT RecordDateTime FROM main.WeatherData WHERE RecordDateTime >= ?1 AND RecordDateTime < ?2", &statement);
+	if (status != WS_SUCCESS)
+	{
+		return status;
+	}
+
+	char from_date[20];
+	char to_date[20];
+	struct tm date_time;
+
+	localtime_r(&from, &date_time);
+	ws_store_format_date(&date_time, from_date);
+	localtime_r(&to, &date_time);
+	ws_store_format_date(&date_time, to_date);
+
+	sqlite3_bind_text(statement, 1, from_date, -1, SQLITE_TRANSIENT);
+	sqlite3_bind_text(statement, 2, to_date, -1, SQLITE_TRANSIENT);
+
+	while ((status = ws_store_execute_query(&info, &statement)) == WS_DB_ROW)
+	{
+		time_t time;
+		if (ws_store_parse_date((const char*)sqlite3_column_text(statement, 0), &time))
+		{
+			status = ws_slots_mark(slots, time, NULL);
+			if (status != WS_SUCCESS)
+			{
+				break;
+			}
+		}
+	}
+
+	sqlite3_reset(statement);
+	return (status == WS_DB_ROW) ? WS_SUCCESS : status;
+}
+
+/* Finds the first slot from slot up to end that has a record (stored = 1) or hasn't (stored = 0), or end if there isn't one */
+static int64_t ws_slots_find(const ws_slots* slots, int64_t slot, int64_t end, int stored)
+{
+	uint64_t flip = stored ? 0 : ~(uint64_t)0;
+
+	while (slot < end)
+	{
+		int64_t day = ws_slots_day_of(slots, slot);
+		int64_t day_end = ws_slots_first(slots, day + 1);
+		int64_t limit = (day_end < end) ? day_end : end;
+		int64_t index = day - slots->first_day;
+
+		// A day that isn't held has no records
+		if (index < 0 || index >= slots->day_count)
+		{
+			if (!stored)
+			{
+				return slot;
+			}
+			slot = limit;
+			continue;
+		}
+
+		const uint64_t* bits = slots->days[index].bits;
+		int64_t bit = slot - ws_slots_first(slots, day);
+
+		while (slot < limit)
+		{
+			// Bits past the end of the day may be set in the flipped word, but are past limit
+			uint64_t word = (bits[bit / 64] ^ flip) & (~(uint64_t)0 << (bit % 64));
+			int64_t word_start = slot - bit % 64;
+
+			int64_t found = (word != 0) ? word_start + __builtin_ctzll(word) : limit;
+			if (found < limit)
+			{
+				return found;
+			}
+
+			slot = word_start + 64;
+			bit += 64 - bit % 64;
+		}
+
+		slot = limit;
+	}
+
+	return end;
+}
+
+int ws_slots_gaps(const ws_slots* slots, time_t from, time_t to, ws_slots_gap* gaps, int max_gaps)
+{
+	if (to <= from)
+	{
+		return 0;
+	}
+
+	int64_t slot = ws_slots_slot(slots, from);
+	int64_t end = ws_slots_slot(slots, to - 1) + 1;
+	int count = 0;
+
+	while ((slot = ws_slots_find(slots, slot, end, 0)) < end)
+	{
+		int64_t gap_end = ws_slots_find(slots, slot, end, 1);
+		if (count < max_gaps)
+		{
+			gaps[count].from = ws_slots_start(slots, slot);
+			gaps[count].to = ws_slots_start(slots, gap_end);
+		}
+		count++;
+		slot = gap_end;
+	}
+
+	return count;
+}
@@ -0,0 +1,112 @@
+#ifndef WS_SLOTS_H
+#define WS_SLOTS_H
+
+#include "ws.h"
+#include <sqlite3.h>
+#include <stdint.h>
+#include <time.h>
+
+/*
+	Which sample slots have a record stored, one bit per slot per day.
+
+	Record times are worked out backwards from when the station was read, so the same record
+	read twice can be given times a few minutes apart. Slots are read_period minutes long and
+	centred on an origin (the time of a stored record) plus multiples of read_period, so each
+	record falls in the same slot whichever read it came from. A record for a slot that
+	already has one is a duplicate, and a slot with no record is a gap.
+
+	Days are UTC days, so every day has the same slots whatever the time zone or daylight
+	saving. Looking up a slot is O(1), and gaps are found a word of slots at a time.
+*/
+
+// One bit per minute of the day, enough for any read period
+#define WS_SLOTS_WORDS ((24 * 60 + 63) / 64)
+
+typedef struct
+{
+	uint64_t bits[WS_SLOTS_WORDS];
+} ws_slots_day;
+
+typedef struct
+{
+	int period;					// Minutes between records
+	time_t origin;				// Slots are centred on origin plus multiples of period
+	int64_t first_day;			// Day (since the epoch) of days[0]
+	int day_count;
+	ws_slots_day* days;
+	int duplicates;				// Records marked for a slot that already had one
+} ws_slots;
+
+/**
+	A run of slots with no record. Records with a time in [from, to) would fill it.
+*/
+typedef struct
+{
+	time_t from;
+	time_t to;
+} ws_slots_gap;
+
+/**
+	Sets up an empty index.
+
+	Parameters:
+		slots 		The index
+		period		Minutes between records (the station's read_period)
+		origin		The time of any record, to centre the slots on
+*/
+void ws_slots_init(ws_slots* slots, int period, time_t origin);
+
+/**
+	Frees the memory held by an index.
+*/
+void ws_slots_free(ws_slots* slots);
+
+/**
+	Returns 1 if the slot a time falls in has a record.
+*/
+int ws_slots_has(const ws_slots* slots, time_t time);
+
+/**
+	Marks the slot a time falls in as having a record.
+
+	Parameters:
+		slots 		The index
+		time		The time of the record
+		duplicate	Optional (may be NULL), set to 1 if the slot already had a record, 0 if not
+
+	Return:
+		- WS_ERR_FILE_IO	No memory for the day
+*/
+int ws_slots_mark(ws_slots* slots, time_t time, int* duplicate);
+
+/**
+	Marks every record stored in WeatherData with a time in a range.
+
+	Parameters:
+		slots 		The index
+		info		The database
+		from		Start of the range (inclusive)
+		to			End of the range (exclusive)
+
+	Return:
+		- WS_ERR_FILE_IO	No memory for the days
+		- Any error from reading the records
+*/
+int ws_slots_load(ws_slots* slots, sqlite3* info, time_t from, time_t to);
+
+/**
+	Finds the gaps in the slots that times in a range fall in, oldest first.
+
+	Parameters:
+		slots 		The index
+		from		Start of the range (inclusive)
+		to			End of the range (exclusive)
+		gaps		Filled with the gaps
+		max_gaps	The room in gaps
+
+	Return:
+		The number of gaps, which can be more than max_gaps - only the first max_gaps are filled in
+*/
+int ws_slots_gaps(const ws_slots* slots, time_t from, time_t to, ws_slots_gap* gaps, int max_gaps);
+
+#endif
@@ -0,0 +1,412 @@
+#include "ws_snapshot.h"
+#include "ws_shard.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Values are stored to the resolution of the station (see ws_packed_record)
+static const int32_t ws_snapshot_scales[WS_METRIC_COUNT] = { 1, 1, 10, 10, 10, 10, 10, 10, 10, 10 };
+
+typedef struct
+{
+	size_t rows;
+	size_t capacity;
+	int64_t* timestamps;
+	int32_t* columns[WS_METRIC_COUNT];
+	int failed;
+} ws_snapshot_builder;
+
+static int ws_snapshot_grow(ws_snapshot_builder* builder, size_t rows)
+{
+	if (rows <= builder->capacity)
+	{
+		return 1;
+	}
+
+	size_t capacity = builder->capacity ? builder->capacity : 4096;
+	while (capacity < rows)
+	{
+		capacity *= 2;
+	}
+
+	int64_t* timestamps = realloc(builder->timestamps, capacity * sizeof(int64_t));
+	if (timestamps == NULL)
+	{
+		return 0;
+	}
+	builder->timestamps = timestamps;
+
+	for (int m = 0; m < WS_METRIC_COUNT; m++)
+	{
+		int32_t* column = realloc(builder->columns[m], capacity * sizeof(int32_t));
+		if (column == NULL)
+		{
+			return 0;
+		}
+		builder->columns[m] = column;
+	}
+
+	builder->capacity = capacity;
+	return 1;
+}
+
+static int ws_snapshot_add_batch(const ws_store_batch* batch, void* user)
+{
+	ws_snapshot_builder* builder = user;
+	if (!ws_snapshot_grow(builder, builder->rows + batch->count))
+	{
+		builder->failed = 1;
+		return 1;
+	}
+
+	for (int i = 0; i < batch->count; i++)
+	{
+		builder->timestamps[builder->rows + i] = batch->time[i];
+	}
+
+	for (int m = 0; m < WS_METRIC_COUNT; m++)
+	{
+		int32_t* column = &builder->columns[m][builder->rows];
+		for (int i = 0; i < batch->count; i++)
+		{
+			double value = batch->values[m][i];
+			column[i] = isnan(value) ? WS_SNAPSHOT_NONE : (int32_t)lround(value * ws_snapshot_scales[m]);
+		}
+	}
+
+	builder->rows += batch->count;
+	return 0;
+}
+
+static inline uint64_t ws_snapshot_align(uint64_t offset)
+{
+	return (offset + 7) & ~(uint64_t)7;
+}
+
+static int ws_snapshot_write_at(int fd, const void* data, size_t size, off_t offset)
+{
+	const unsigned char* bytes = data;
+	while (size > 0)
+	{
+		ssize_t written = pwrite(fd, bytes, size, offset);
+		if (written <= 0)
+		{
+			return WS_ERR_FILE_IO;
+		}
+
+		bytes += written;
+		offset += written;
+		size -= written;
+	}
+
+	return WS_SUCCESS;
+}
+
+static int ws_snapshot_save(const ws_snapshot_builder* builder, int fd)
+{
+	ws_snapshot_header header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, WS_SNAPSHOT_MAGIC, 4);
+	header.version = WS_SNAPSHOT_VERSION;
+	header.metric_count = WS_METRIC_COUNT;
+	header.created_at = time(NULL);
+	header.rows = builder->rows;
+	header.index_stride = WS_SNAPSHOT_INDEX_STRIDE;
+	header.index_count = (builder->rows + WS_SNAPSHOT_INDEX_STRIDE - 1) / WS_SNAPSHOT_INDEX_STRIDE;
+
+	uint64_t offset = ws_snapshot_align(sizeof(header));
+	header.timestamps_offset = offset;
+	offset = ws_snapshot_align(offset + builder->rows * sizeof(int64_t));
+
+	for (int m = 0; m < WS_METRIC_COUNT; m++)
+	{
+		header.column_offset[m] = offset;
+		header.scale[m] = ws_snapshot_scales[m];
+		offset = ws_snapshot_align(offset + builder->rows * sizeof(int32_t));
+	}
+
+	header.index_offset = offset;
+
+	int64_t* index = malloc((header.index_count ? header.index_count : 1) * sizeof(int64_t));
+	if (index == NULL)
+	{
+		return WS_ERR_FILE_IO;
+	}
+
+	for (uint32_t i = 0; i < header.index_count; i++)
+	{
+		index[i] = builder->timestamps[(size_t)i * WS_SNAPSHOT_INDEX_STRIDE];
+	}
+
+	int status = ws_snapshot_write_at(fd, &header, sizeof(header), 0);
+	if (status == WS_SUCCESS)
+	{
+		status = ws_snapshot_write_at(fd, builder->timestamps, builder->rows * sizeof(int64_t), header.timestamps_offset);
+	}
+
+	for (int m = 0; m < WS_METRIC_COUNT && status == WS_SUCCESS; m++)
+	{
+		status = ws_snapshot_write_at(fd, builder->columns[m], builder->rows * sizeof(int32_t), header.column_offset[m]);
+	}
+
+	if (status == WS_SUCCESS)
+	{
+		status = ws_snapshot_write_at(fd, index, header.index_count * sizeof(int64_t), header.index_offset);
+	}
+
+	// Make sure the file is the full size even if the last column was empty
+	if (status == WS_SUCCESS && ftruncate(fd, header.index_offset + header.index_count * sizeof(int64_t)) != 0)
+	{
+		status = WS_ERR_FILE_IO;
+	}
+
+	free(index);
+	return status;
+}
+
+/* Writes a snapshot of the records of a database, or of the month databases if info is NULL */
+static int ws_snapshot_write_from(sqlite3* info, const char* path)
+{
+	ws_snapshot_builder builder;
+	memset(&builder, 0, sizeof(builder));
+
+	ws_store_range_query query;
+	memset(&query, 0, sizeof(query));
+	query.from = 0;
+	query.to = INT32_MAX;
+	query.metrics = WS_METRIC_ALL;
+	query.aggregate = WS_AGG_NONE;
+
+	ws_store_batch* batch = malloc(sizeof(ws_store_batch));
+	int status = WS_ERR_FILE_IO;
+	if (batch != NULL && info != NULL)
+	{
+		status = ws_store_query_range_batch(info, &query, batch, ws_snapshot_add_batch, &builder);
+	} else if (batch != NULL) {
+		status = ws_shard_query_range_batch(&query, batch, ws_snapshot_add_batch, &builder);
+	}
+	free(batch);
+
+	if (status == WS_SUCCESS && builder.failed)
+	{
+		status = WS_ERR_FILE_IO;
+	}
+
+	char temp_path[4096];
+	snprintf(temp_path, sizeof(temp_path), "%s.tmp", path);
+
+	int fd = -1;
+	if (status == WS_SUCCESS)
+	{
+		fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		status = (fd < 0) ? WS_ERR_FILE_IO : ws_snapshot_save(&builder, fd);
+	}
+
+	// The data must be on disk before the rename makes it the current snapshot
+	if (status == WS_SUCCESS && fsync(fd) != 0)
+	{
+		status = WS_ERR_FILE_IO;
+	}
+
+	if (fd >= 0 && close(fd) != 0 && status == WS_SUCCESS)
+	{
+		status = WS_ERR_FILE_IO;
+	}
+
+	if (status == WS_SUCCESS && rename(temp_path, path) != 0)
+	{
+		status = WS_ERR_FILE_IO;
+	}
+
+	if (status != WS_SUCCESS && fd >= 0)
+	{
+		unlink(temp_path);
+	}
+
+	free(builder.timestamps);
+	for (int m = 0; m < WS_METRIC_COUNT; m++)
+	{
+		free(builder.columns[m]);
+	}
+
+	return status;
+}
+
+int ws_snapshot_write(sqlite3* info, const char* path)
+{
+	return ws_snapshot_write_from(info, path);
+}
+
+int ws_snapshot_write_shards(const char* path)
+{
+	return ws_snapshot_write_from(NULL, path);
+}
+
+static int ws_snapshot_valid(const ws_snapshot_header* header, size_t size)
+{
+	if (size < sizeof(ws_snapshot_header) || memcmp(header->magic, WS_SNAPSHOT_MAGIC, 4) != 0 ||
+	    header->version != WS_SNAPSHOT_VERSION || header->metric_count != WS_METRIC_COUNT ||
+	    header->index_stride != WS_SNAPSHOT_INDEX_STRIDE)
+	{
+		return 0;
+	}
+
+	if (header->index_count != (header->rows + WS_SNAPSHOT_INDEX_STRIDE - 1) / WS_SNAPSHOT_INDEX_STRIDE ||
+	    header->timestamps_offset + header->rows * sizeof(int64_t) > size ||
+	    header->index_offset + header->index_count * sizeof(int64_t) > size)
+	{
+		return 0;
+	}
+
+	for (int m = 0; m < WS_METRIC_COUNT; m++)
+	{
+		if (header->column_offset[m] + header->rows * sizeof(int32_t) > size || header->scale[m] <= 0)
+		{
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+int ws_snapshot_open(const char* path, ws_snapshot* snapshot)
+{
+	memset(snapshot, 0, sizeof(ws_snapshot));
+
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+	{
+		return WS_ERR_FILE_IO;
+	}
+
+	struct stat st;
+	void* base = MAP_FAILED;
+	if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(ws_snapshot_header))
+	{
+		base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	}
+
+	// The mapping stays valid after the file is closed (and after it is replaced)
+	close(fd);
+
+	if (base == MAP_FAILED)
+	{
+		return WS_ERR_FILE_IO;
+	}
+
+	const ws_snapshot_header* header = base;
+	if (!ws_snapshot_valid(header, st.st_size))
+	{
+		munmap(base, st.st_size);
+		return WS_ERR_FILE_IO;
+	}
+
+	const char* bytes = base;
+	snapshot->base = base;
+	snapshot->size = st.st_size;
+	snapshot->device = st.st_dev;
+	snapshot->inode = st.st_ino;
+	snapshot->header = header;
+	snapshot->rows = header->rows;
+	snapshot->timestamps = (const int64_t*)(bytes + header->timestamps_offset);
+	snapshot->index = (const int64_t*)(bytes + header->index_offset);
+
+	for (int m = 0; m < WS_METRIC_COUNT; m++)
+	{
+		snapshot->columns[m] = (const int32_t*)(bytes + header->column_offset[m]);
+	}
+
+	// Columns are scanned from start to end
+	madvise(base, st.st_size, MADV_SEQUENTIAL);
+	return WS_SUCCESS;
+}
+
+void ws_snapshot_close(ws_snapshot* snapshot)
+{
+	if (snapshot->base != NULL)
+	{
+		munmap((void*)snapshot->base, snapshot->size);
+	}
+
+	memset(snapshot, 0, sizeof(ws_snapshot));
+}
+
+int ws_snapshot_refresh(const char* path, ws_snapshot* snapshot, int* changed)
+{
+	if (changed != NULL)
+	{
+		*changed = 0;
+	}
+
+	struct stat st;
+	if (stat(path, &st) != 0)
+	{
+		return WS_ERR_FILE_IO;
+	}
+
+	if (snapshot->base != NULL && st.st_dev == snapshot->device && st.st_ino == snapshot->inode)
+	{
+		return WS_SUCCESS;
+	}
+
+	ws_snapshot fresh;
+	int status = ws_snapshot_open(path, &fresh);
+	if (status != WS_SUCCESS)
+	{
+		return status;
+	}
+
+	ws_snapshot_close(snapshot);
+	*snapshot = fresh;
+
+	if (changed != NULL)
+	{
+		*changed = 1;
+	}
+
+	return WS_SUCCESS;
+}
+
+/* First row with a timestamp at or after time */
+static size_t ws_snapshot_lower_bound(const ws_snapshot* snapshot, time_t time)
+{
+	// The index narrows the search down to a single stride of rows
+	size_t low = 0;
+	size_t high = snapshot->header->index_count;
+	while (low < high)
+	{
+		size_t middle = low + (high - low) / 2;
+		if (snapshot->index[middle] < time)
+		{
+			low = middle + 1;
+		} else {
+			high = middle;
+		}
+	}
+
+	size_t row = (low > 0) ? (low - 1) * WS_SNAPSHOT_INDEX_STRIDE : 0;
+	size_t end = low * WS_SNAPSHOT_INDEX_STRIDE;
+	end = (end > snapshot->rows) ? snapshot->rows : end;
+
+	while (row < end && snapshot->timestamps[row] < time)
+	{
+		row++;
+	}
+
+	return row;
+}
+
+size_t ws_snapshot_range(const ws_snapshot* snapshot, time_t from, time_t to, size_t* first)
+{
+	*first = ws_snapshot_lower_bound(snapshot, from);
+	if (to <= from)
+	{
+		return 0;
+	}
+
+	return ws_snapshot_lower_bound(snapshot, to) - *first;
+}
@@ -0,0 +1,135 @@
+#ifndef WS_SNAPSHOT_H
+#define WS_SNAPSHOT_H
+
+#include "ws.h"
+#include "ws_store.h"
+#include <sys/types.h>
+
+#define WS_SNAPSHOT_MAGIC "WSSN"
+#define WS_SNAPSHOT_VERSION 1
+
+// Rows between entries of the sparse time index
+#define WS_SNAPSHOT_INDEX_STRIDE 256
+
+// Value of a fixed point column where the database held NULL
+#define WS_SNAPSHOT_NONE INT32_MIN
+
+/**
+	Header at the start of a snapshot file. It is followed by the columns, each aligned to
+	8 bytes at the offsets given here. Values are stored in the byte order of the host that
+	wrote the snapshot, so that the columns can be used straight from the mapping. A snapshot
+	from a host of the other byte order fails the version check when it is opened.
+
+	- timestamps:	int64_t[rows], seconds since the Unix epoch, ascending
+	- columns:		int32_t[rows] for each metric, value * scale[metric] (WS_SNAPSHOT_NONE for no value)
+	- index:		int64_t[index_count], the timestamp of every WS_SNAPSHOT_INDEX_STRIDE'th row
+*/
+typedef struct __attribute__((packed))
+{
+	char magic[4];							// WS_SNAPSHOT_MAGIC
+	uint16_t version;						// WS_SNAPSHOT_VERSION
+	uint16_t metric_count;					// WS_METRIC_COUNT
+	int64_t created_at;						// When the snapshot was written
+	uint64_t rows;
+	uint32_t index_stride;					// WS_SNAPSHOT_INDEX_STRIDE
+	uint32_t index_count;
+	uint64_t timestamps_offset;
+	uint64_t index_offset;
+	uint64_t column_offset[WS_METRIC_COUNT];
+	int32_t scale[WS_METRIC_COUNT];
+} ws_snapshot_header;
+
+/**
+	A snapshot mapped read only. The columns point straight into the mapping.
+*/
+typedef struct
+{
+	const void* base;
+	size_t size;
+	dev_t device;							// Identify the file that is mapped, to spot a new snapshot
+	ino_t inode;
+
+	const ws_snapshot_header* header;
+	const int64_t* timestamps;
+	const int64_t* index;
+	const int32_t* columns[WS_METRIC_COUNT];
+	size_t rows;
+} ws_snapshot;
+
+
+/**
+	Writes every record in WeatherData to a new snapshot. The snapshot is written to a
+	temporary file next to path and renamed over path once it is complete and synced, so
+	readers only ever see a whole snapshot.
+
+	Parameters:
+		info 		The database
+		path		The snapshot file
+
+	Return:
+		- WS_ERR_FILE_IO		The snapshot could not be written
+		- Any error from ws_store_query_range_batch()
+*/
+int ws_snapshot_write(sqlite3* info, const char* path);
+
+/**
+	Writes every record in the month databases (see ws_shard.h) to a new snapshot, as
+	ws_snapshot_write(). The month databases must have been opened with ws_shard_open().
+
+	Return:
+		- WS_ERR_FILE_IO		The snapshot could not be written
+		- Any error from ws_shard_query_range_batch()
+*/
+int ws_snapshot_write_shards(const char* path);
+
+/**
+	Maps a snapshot read only.
+
+	Return:
+		- WS_ERR_FILE_IO		The file could not be mapped or is not a snapshot
+*/
+int ws_snapshot_open(const char* path, ws_snapshot* snapshot);
+
+/**
+	Unmaps a snapshot. Pointers into its columns must not be used afterwards.
+*/
+void ws_snapshot_close(ws_snapshot* snapshot);
+
+/**
+	Maps the snapshot at path again if it has been replaced since it was opened. The old
+	snapshot stays mapped (and valid) until this returns.
+
+	Parameters:
+		path		The snapshot file
+		snapshot	An open snapshot
+		changed		Optional (may be NULL), set to 1 if a new snapshot was mapped
+
+	Return:
+		- WS_ERR_FILE_IO		The new snapshot could not be mapped. The old one is kept.
+*/
+int ws_snapshot_refresh(const char* path, ws_snapshot* snapshot, int* changed);
+
+/**
+	Finds the rows in a time range, using the sparse index to narrow down the search.
+
+	Parameters:
+		snapshot	The snapshot
+		from		Start of the range (inclusive)
+		to			End of the range (exclusive)
+		first		Set to the first row in the range
+
+	Return:
+		The number of rows in the range, which are rows first to first + count - 1 of every column
+*/
+size_t ws_snapshot_range(const ws_snapshot* snapshot, time_t from, time_t to, size_t* first);
+
+/**
+	Gets a value from a column as a double, NAN where there is no value.
+*/
+static inline double ws_snapshot_value(const ws_snapshot* snapshot, int metric, size_t row)
+{
+	int32_t value = snapshot->columns[metric][row];
+	return (value == WS_SNAPSHOT_NONE) ? NAN : (double)value / snapshot->header->scale[metric];
+}
+
+#endif
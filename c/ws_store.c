@@ -1,10 +1,140 @@
 #include "ws_store.h"
+#include "ws_metrics.h"
+#include "ws_log.h"
+#include "ws_aggcache.h"
+#include "ws_sketch.h"
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
 #include <sqlite3.h>
 
 void db_error(sqlite3* info, const char* extra)
 {
-	printf("[SQLITE3 ERR] %s (%s)\n",sqlite3_errmsg(info), extra);
+	ws_metrics_add(WS_CTR_DB_ERRORS, 1);
+	ws_log(WS_EVENT_DB_ERROR, sqlite3_errcode(info), extra, sqlite3_errmsg(info));
+}
+
+#define WS_STORE_STMT_CACHE 16
+
+typedef struct
+{
+	sqlite3_stmt* statement;
+	uint64_t last_used;
+	char sql[WS_STORE_SQL_MAX];
+} ws_store_cached_stmt;
+
+/**
+	Cache of prepared statements for one connection. The list of caches is locked, but a
+	connection is only used by one thread at a time, so its own entries need no locking.
+*/
+typedef struct ws_store_stmt_cache
+{
+	sqlite3* info;
+	uint64_t clock;
+	ws_store_cached_stmt entries[WS_STORE_STMT_CACHE];
+	struct ws_store_stmt_cache* next;
+} ws_store_stmt_cache;
+
+static ws_store_stmt_cache* ws_store_stmt_caches = NULL;
+static pthread_mutex_t ws_store_stmt_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static ws_store_stmt_cache* ws_store_find_cache(sqlite3* info, int create)
+{
+	pthread_mutex_lock(&ws_store_stmt_lock);
+
+	ws_store_stmt_cache* cache = ws_store_stmt_caches;
+	while (cache != NULL && cache->info != info)
+	{
+		cache = cache->next;
+	}
+
+	if (cache == NULL && create)
+	{
+		cache = calloc(1, sizeof(ws_store_stmt_cache));
+		if (cache != NULL)
+		{
+			cache->info = info;
+			cache->next = ws_store_stmt_caches;
+			ws_store_stmt_caches = cache;
+		}
+	}
+
+	pthread_mutex_unlock(&ws_store_stmt_lock);
+	return cache;
+}
+
+static void ws_store_free_cache(sqlite3* info)
+{
+	pthread_mutex_lock(&ws_store_stmt_lock);
+
+	ws_store_stmt_cache* cache = NULL;
+	for (ws_store_stmt_cache** link = &ws_store_stmt_caches; *link != NULL; link = &(*link)->next)
+	{
+		if ((*link)->info == info)
+		{
+			cache = *link;
+			*link = cache->next;
+			break;
+		}
+	}
+
+	pthread_mutex_unlock(&ws_store_stmt_lock);
+
+	if (cache != NULL)
+	{
+		for (int i = 0; i < WS_STORE_STMT_CACHE; i++)
+		{
+			if (cache->entries[i].statement != NULL)
+			{
+				sqlite3_finalize(cache->entries[i].statement);
+			}
+		}
+		free(cache);
+	}
+}
+
+static const char* ws_store_extreme_names[] = {
+#define GENERATE_EXTREME_NAME(FIELD, NAME) NAME,
+	FOREACH_WS_EXTREME(GENERATE_EXTREME_NAME)
+#undef GENERATE_EXTREME_NAME
+};
+
+static const size_t ws_store_extreme_offsets[] = {
+#define GENERATE_EXTREME_OFFSET(FIELD, NAME) offsetof(ws_weather_extremes, FIELD),
+	FOREACH_WS_EXTREME(GENERATE_EXTREME_OFFSET)
+#undef GENERATE_EXTREME_OFFSET
+};
+
+static const char* ws_store_metric_columns[] = {
+#define GENERATE_STORE_METRIC_COLUMN(ENUM, COLUMN) COLUMN,
+	FOREACH_WS_STORE_METRIC(GENERATE_STORE_METRIC_COLUMN)
+#undef GENERATE_STORE_METRIC_COLUMN
+};
+
+/* The WeatherData columns after RecordDateTime and their placeholders, from the record's fields */
+#define WS_STORE_SQL_int "INTEGER"
+#define WS_STORE_SQL_double "REAL"
+#define GENERATE_FIELD_COLUMN(TYPE, NAME, COLUMN, LABEL, UNIT, DECODE) ", " COLUMN " " WS_STORE_SQL_##TYPE
+#define GENERATE_FIELD_PLACEHOLDER(TYPE, NAME, COLUMN, LABEL, UNIT, DECODE) ", ?"
+
+#define WS_STORE_FIELD_COLUMNS FOREACH_WS_RECORD_FIELD(GENERATE_FIELD_COLUMN) FOREACH_WS_STATUS_FIELD(GENERATE_FIELD_COLUMN)
+#define WS_STORE_FIELD_PLACEHOLDERS FOREACH_WS_RECORD_FIELD(GENERATE_FIELD_PLACEHOLDER) FOREACH_WS_STATUS_FIELD(GENERATE_FIELD_PLACEHOLDER)
+
+/* Binds the record's fields to an INSERT INTO WeatherData, after the date */
+static void ws_store_bind_record(sqlite3_stmt* statement, const ws_weather_record* record)
+{
+	int column = 2;
+
+#define BIND_FIELD(TYPE, NAME, COLUMN, LABEL, UNIT, DECODE) sqlite3_bind_##TYPE(statement, column++, record->NAME);
+#define BIND_STATUS_FIELD(TYPE, NAME, COLUMN, LABEL, UNIT, DECODE) sqlite3_bind_##TYPE(statement, column++, record->status.NAME);
+	FOREACH_WS_RECORD_FIELD(BIND_FIELD)
+	FOREACH_WS_STATUS_FIELD(BIND_STATUS_FIELD)
+#undef BIND_FIELD
+#undef BIND_STATUS_FIELD
 }
 
 int ws_store_open_db(sqlite3** info)
@@ -12,15 +142,35 @@ int ws_store_open_db(sqlite3** info)
 	int status = sqlite3_open_v2("WeatherDB.sqlite", info, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, NULL);
 	if (status != SQLITE_OK)
 	{
+		// SQLite allocates a handle even when the open fails, so it is closed here and the caller has nothing to close
 		db_error(*info, "ws_store_open_db");
+		sqlite3_close(*info);
+		*info = NULL;
 		return WS_ERR_DB_OPEN;
 	}
 
+	ws_aggcache_attach(*info);
 	return WS_SUCCESS;
 }
 
+static int ws_store_flush_pending(sqlite3* info);
+static void ws_store_drop_pending(sqlite3* info);
+
 int ws_store_close_db(sqlite3** info)
 {
+	// Sketches still pending are for records that were never committed
+	ws_store_drop_pending(*info);
+
+	// Every statement must be finalized before the database can be closed, including any
+	// that weren't cached
+	ws_store_free_cache(*info);
+
+	sqlite3_stmt* statement;
+	while ((statement = sqlite3_next_stmt(*info, NULL)) != NULL)
+	{
+		sqlite3_finalize(statement);
+	}
+
 	int status = sqlite3_close(*info);
 	if (status != SQLITE_OK)
 	{
@@ -110,15 +260,36 @@ int ws_store_begin_transaction(sqlite3** info)
 
 int ws_store_end_transaction(sqlite3** info)
 {
-	char sql[] = "COMMIT";
-	int status = ws_store_query(info, sql, sizeof(sql) / sizeof(sql[0]));
+	// The sketches of the records added in the transaction are merged once, here, so that they are
+	// committed with the records
+	int status = ws_store_flush_pending(*info);
+
+	uint64_t start = ws_metrics_now();
+	if (status == WS_SUCCESS)
+	{
+		char sql[] = "COMMIT";
+		status = ws_store_query(info, sql, sizeof(sql) / sizeof(sql[0]));
+	}
+
+	// On an error nothing is committed, so the caller knows the records aren't stored
 	if (status != WS_SUCCESS)
 	{
+		ws_store_drop_pending(*info);
+		if (!sqlite3_get_autocommit(*info))
+		{
+			char rollback[] = "ROLLBACK";
+			ws_store_query(info, rollback, sizeof(rollback) / sizeof(rollback[0]));
+		}
 		return status;
 	}
+
+	ws_metrics_observe(WS_HIST_COMMIT, ws_metrics_now() - start);
+	ws_metrics_add(WS_CTR_COMMITS, 1);
 	return WS_SUCCESS;
 }
 
+static int ws_store_backfill_sketches(sqlite3* info);
+
 int ws_store_prepare_db(sqlite3** info)
 {
 	int status;
@@ -145,15 +316,46 @@ int ws_store_prepare_db(sqlite3** info)
 	{
 		return status;
 	}
+
+	// The fingerprints describe what is in WeatherData, so they go with it
+	char sql_test2[] = "DROP TABLE IF EXISTS BlockFingerprints";
+	status = ws_store_query(info, sql_test2, sizeof(sql_test2) / sizeof(sql_test2[0]));
+	if (status != WS_SUCCESS)
+	{
+		return status;
+	}
+
+	char sql_test3[] = "DROP TABLE IF EXISTS WeatherAnomalies";
+	status = ws_store_query(info, sql_test3, sizeof(sql_test3) / sizeof(sql_test3[0]));
+	if (status != WS_SUCCESS)
+	{
+		return status;
+	}
+
+	char sql_test4[] = "DROP TABLE IF EXISTS DailySketches";
+	status = ws_store_query(info, sql_test4, sizeof(sql_test4) / sizeof(sql_test4[0]));
+	if (status != WS_SUCCESS)
+	{
+		return status;
+	}
+
+	char sql_test5[] = "DROP TABLE IF EXISTS MonthlySketches";
+	status = ws_store_query(info, sql_test5, sizeof(sql_test5) / sizeof(sql_test5[0]));
+	if (status != WS_SUCCESS)
+	{
+		return status;
+	}
 	/******************** END TESTING ********************/
 
+	ws_aggcache_invalidate(*info);
+	return ws_store_create_tables(info);
+}
+
+int ws_store_create_tables(sqlite3** info)
+{
+	int status;
 
-	/* Create the table for storing weather records */
-	char sql[] = "CREATE TABLE IF NOT EXISTS WeatherData( RecordDateTime TEXT PRIMARY KEY, IndoorHumidity INTEGER, OutdoorHumidity INTEGER,"
-				"IndoorTemperature REAL, OutdoorTemperature REAL, DewPoint REAL, AbsolutePressure REAL, WindSpeed REAL,"
-				"GuestSpeed REAL, WindDirection REAL, TotalRain REAL, SensorContactError INTEGER, RainCounterOverflow INTEGER )";
-		
-	status = ws_store_query(info, sql, sizeof(sql) / sizeof(sql[0]));
+	status = ws_store_create_data_table(*info, "main");
 	if (status != WS_SUCCESS)
 	{
 		return status;
@@ -168,41 +370,1342 @@ int ws_store_prepare_db(sqlite3** info)
 		return status;
 	}
 
+	/* Create the table for storing every change to the weather extremes */
+	char sql2_history[] = "CREATE TABLE IF NOT EXISTS WeatherExtremesHistory(ChangedAt TEXT, Name TEXT, MinValue REAL, MinDateTime TEXT, "
+	                      "MaxValue REAL, MaxDateTime TEXT)";
+
+	status = ws_store_query(info, sql2_history, sizeof(sql2_history) / sizeof(sql2_history[0]));
+	if (status != WS_SUCCESS)
+	{
+		return status;
+	}
+
+	/* Create the table for storing the fingerprint of each block of the station's memory */
+	char sql3[] = "CREATE TABLE IF NOT EXISTS BlockFingerprints(Address INTEGER PRIMARY KEY, Hash INTEGER NOT NULL)";
+
+	status = ws_store_query(info, sql3, sizeof(sql3) / sizeof(sql3[0]));
+	if (status != WS_SUCCESS)
+	{
+		return status;
+	}
+
+	/* Create the table for tagging records that look like sensor glitches. Metrics is a bitmap of WS_METRIC_BIT()s */
+	char sql4[] = "CREATE TABLE IF NOT EXISTS WeatherAnomalies(RecordDateTime TEXT PRIMARY KEY, Metrics INTEGER NOT NULL)";
+
+	status = ws_store_query(info, sql4, sizeof(sql4) / sizeof(sql4[0]));
+	if (status != WS_SUCCESS)
+	{
+		return status;
+	}
+
+	// Single row table holding the progress of an unfinished download
+	char sql5[] = "CREATE TABLE IF NOT EXISTS DownloadJournal(Id INTEGER PRIMARY KEY CHECK (Id = 0), Address INTEGER NOT NULL, Hash INTEGER NOT NULL)";
+
+	status = ws_store_query(info, sql5, sizeof(sql5) / sizeof(sql5[0]));
+	if (status != WS_SUCCESS)
+	{
+		return status;
+	}
+
+	/* Create the tables for the quantile sketches of each (local) day's and month's records. Sketches holds a 
+	   ws_sketch per metric, in metric order, and Records is the number of records they were made from. The rows
+	   are kilobytes long, so unlike WeatherData these are rowid tables */
+	char sql6[] = "CREATE TABLE IF NOT EXISTS DailySketches(Day TEXT PRIMARY KEY, Records INTEGER NOT NULL, Sketches BLOB NOT NULL)";
+
+	status = ws_store_query(info, sql6, sizeof(sql6) / sizeof(sql6[0]));
+	if (status != WS_SUCCESS)
+	{
+		return status;
+	}
+
+	char sql7[] = "CREATE TABLE IF NOT EXISTS MonthlySketches(Month TEXT PRIMARY KEY, Records INTEGER NOT NULL, Sketches BLOB NOT NULL)";
+
+	status = ws_store_query(info, sql7, sizeof(sql7) / sizeof(sql7[0]));
+	if (status != WS_SUCCESS)
+	{
+		return status;
+	}
+
+	return ws_store_backfill_sketches(*info);
+}
+
+void ws_store_format_date(const struct tm* date_time, char* date)
+{
+	// Room for any int year, then cut to the 19 characters of a record date
+	char buffer[64];
+	snprintf(buffer, sizeof(buffer), "%.4i-%.2i-%.2i %.2i:%.2i:%.2i", date_time->tm_year + 1900, date_time->tm_mon + 1, 
+																	  date_time->tm_mday, date_time->tm_hour, date_time->tm_min, 0);
+	size_t length = strlen(buffer);
+	if (length > 19)
+	{
+		length = 19;
+	}
+	memcpy(date, buffer, length);
+	date[length] = '\0';
+}
+
+#define COUNT_FIELD(TYPE, NAME, COLUMN, LABEL, UNIT, DECODE) + 1
+_Static_assert(WS_METRIC_COUNT == 0 FOREACH_WS_RECORD_FIELD(COUNT_FIELD), "The metrics are the record's fields, in the same order");
+#undef COUNT_FIELD
+
+/* Whether a record at date replaces one already stored, only asked when the aggregate cache holds its range */
+static int ws_store_replaces(sqlite3* info, const char* date)
+{
+	sqlite3_stmt* statement;
+	if (ws_store_cached_statement(info, "SELECT 1 FROM main.WeatherData WHERE RecordDateTime = ?", &statement) != WS_SUCCESS)
+	{
+		// Not knowing, the cache drops what it has of the range
+		return 1;
+	}
+
+	sqlite3_bind_text(statement, 1, date, -1, SQLITE_TRANSIENT);
+	int status = ws_store_execute_query(&info, &statement);
+	sqlite3_reset(statement);
+	return status != WS_SUCCESS;
+}
+
+/* The metric columns of WeatherData, after RecordDateTime */
+#define GENERATE_STORE_METRIC_SELECT(ENUM, COLUMN) ", " COLUMN
+#define WS_STORE_METRIC_COLUMNS FOREACH_WS_STORE_METRIC(GENERATE_STORE_METRIC_SELECT)
+
+/* The records of one day added to a database, not yet merged into its stored sketches */
+typedef struct
+{
+	sqlite3* info;
+	char day[11];
+	int records;
+	ws_sketch sketches[WS_METRIC_COUNT];
+} ws_store_day_sketches;
+
+/* Scratch space for the sketches. Records added in a transaction are kept pending until it ends. */
+typedef struct
+{
+	ws_store_day_sketches pending;
+	ws_sketch month[WS_METRIC_COUNT];
+	ws_sketch stored;
+	unsigned char blob[WS_METRIC_COUNT * WS_SKETCH_BYTES_MAX];
+} ws_store_sketch_scratch;
+
+// Too big for the stack, and only needed by the threads that store or query records
+static __thread ws_store_sketch_scratch* ws_store_scratch = NULL;
+
+/* Allocates the thread's scratch space if it hasn't been yet */
+static int ws_store_alloc_scratch(void)
+{
+	if (ws_store_scratch == NULL)
+	{
+		ws_store_scratch = calloc(1, sizeof(ws_store_sketch_scratch));
+	}
+
+	return (ws_store_scratch != NULL) ? WS_SUCCESS : WS_ERR_FILE_IO;
+}
+
+/* Merges the wanted metrics of a stored Sketches blob into sketches */
+static int ws_store_merge_blob(const unsigned char* blob, int size, uint32_t metrics, ws_sketch* sketches)
+{
+	for (int m = 0; m < WS_METRIC_COUNT; m++)
+	{
+		int read = ws_sketch_read(&ws_store_scratch->stored, blob, size);
+		if (read < 0)
+		{
+			return WS_ERR_DB_QUERY;
+		}
+
+		if (metrics & WS_METRIC_BIT(m))
+		{
+			ws_sketch_merge(&sketches[m], &ws_store_scratch->stored);
+		}
+		blob += read;
+		size -= read;
+	}
+
 	return WS_SUCCESS;
 }
 
-int ws_store_add_weather_record(sqlite3* info, ws_weather_record record)
+/* Merges the Sketches blob of every row of a query (column 0) into sketches */
+static int ws_store_merge_blobs(sqlite3* info, sqlite3_stmt* statement, uint32_t metrics, ws_sketch* sketches)
 {
-	char sql[512];
-	char date[20];
+	int status;
+	while ((status = ws_store_execute_query(&info, &statement)) == WS_DB_ROW)
+	{
+		status = ws_store_merge_blob(sqlite3_column_blob(statement, 0), sqlite3_column_bytes(statement, 0), metrics, sketches);
+		if (status != WS_SUCCESS)
+		{
+			break;
+		}
+	}
 
-	// Format the date
-	snprintf(date, 20, "%.4i-%.2i-%.2i %.2i:%.2i:%.2i.%.3i", record.date_time->tm_year + 1900, record.date_time->tm_mon + 1, 
-															 record.date_time->tm_mday, record.date_time->tm_hour, record.date_time->tm_min, 0, 0);
+	sqlite3_reset(statement);
+	return status;
+}
+
+/* Adds the metrics of each row of a query (from column 1 on) to sketches, counting the rows */
+static int ws_store_sketch_rows(sqlite3* info, sqlite3_stmt* statement, uint32_t metrics, ws_sketch* sketches, int* records)
+{
+	int status;
+	while ((status = ws_store_execute_query(&info, &statement)) == WS_DB_ROW)
+	{
+		for (int m = 0; m < WS_METRIC_COUNT; m++)
+		{
+			if ((metrics & WS_METRIC_BIT(m)) && sqlite3_column_type(statement, m + 1) != SQLITE_NULL)
+			{
+				ws_sketch_add(&sketches[m], sqlite3_column_double(statement, m + 1));
+			}
+		}
+		(*records)++;
+	}
+
+	sqlite3_reset(statement);
+	return status;
+}
 
-	snprintf(sql, 512, "INSERT INTO WeatherData VALUES('%s', '%i', '%i', '%f', '%f', '%f', '%f', '%f', '%f', '%f', '%f', '%i', '%i')", 
-		     date, record.indoor_humidity, record.outdoor_humidity, record.indoor_temperature, record.outdoor_temperature, 
-		     record.dew_point, record.absolute_pressure, record.wind_speed, record.gust_speed, record.wind_direction, 
-		     record.total_rain, record.status.sensor_contact_error, record.status.rain_counter_overflow);
+/* Stores the sketches of a day (table DailySketches) or month (MonthlySketches), made from the given number of records */
+static int ws_store_write_sketches(sqlite3* info, const char* table, const char* key, int records, ws_sketch* sketches)
+{
+	char sql[WS_STORE_SQL_MAX];
+	snprintf(sql, sizeof(sql), "INSERT OR REPLACE INTO main.%s VALUES(?, ?, ?)", table);
 
 	sqlite3_stmt* statement;
-	int status = ws_store_create_statement(&info, sql, 512, &statement);
+	int status = ws_store_cached_statement(info, sql, &statement);
 	if (status != WS_SUCCESS)
 	{
 		return status;
 	}
 
+	int size = 0;
+	for (int m = 0; m < WS_METRIC_COUNT; m++)
+	{
+		size += ws_sketch_write(&sketches[m], ws_store_scratch->blob + size);
+	}
+
+	sqlite3_bind_text(statement, 1, key, -1, SQLITE_TRANSIENT);
+	sqlite3_bind_int(statement, 2, records);
+	sqlite3_bind_blob(statement, 3, ws_store_scratch->blob, size, SQLITE_STATIC);
+
 	status = ws_store_execute_query(&info, &statement);
-	if (status != WS_SUCCESS && status != WS_DB_ROW)
+	sqlite3_reset(statement);
+	return status;
+}
+
+/* Makes the sketches of a day again from its records in WeatherData */
+static int ws_store_rebuild_day(sqlite3* info, const char* day)
+{
+	sqlite3_stmt* statement;
+	int status = ws_store_cached_statement(info, "SELECT RecordDateTime" WS_STORE_METRIC_COLUMNS " FROM main.WeatherData "
+	                                             "WHERE RecordDateTime >= ?1 AND RecordDateTime < date(?1, '+1 day')", &statement);
+	if (status != WS_SUCCESS)
+	{
+		return status;
+	}
+
+	// The pending sketches have been flushed (or are for this day), so they are reused
+	ws_sketch* sketches = ws_store_scratch->pending.sketches;
+	int records = 0;
+
+	for (int m = 0; m < WS_METRIC_COUNT; m++)
+	{
+		ws_sketch_init(&sketches[m]);
+	}
+
+	sqlite3_bind_text(statement, 1, day, -1, SQLITE_TRANSIENT);
+	status = ws_store_sketch_rows(info, statement, WS_METRIC_ALL, sketches, &records);
+	if (status != WS_SUCCESS)
+	{
+		return status;
+	}
+
+	return ws_store_write_sketches(info, "DailySketches", day, records, sketches);
+}
+
+/* Makes the sketches of a month (YYYY-MM) again by merging those of its days */
+static int ws_store_rebuild_month(sqlite3* info, const char* month)
+{
+	sqlite3_stmt* statement;
+	int status = ws_store_cached_statement(info, "SELECT Sketches, Records FROM main.DailySketches WHERE Day >= ?1 || '-01' AND Day <= ?1 || '-31'", &statement);
+	if (status != WS_SUCCESS)
+	{
+		return status;
+	}
+
+	ws_sketch* sketches = ws_store_scratch->month;
+	int records = 0;
+
+	for (int m = 0; m < WS_METRIC_COUNT; m++)
+	{
+		ws_sketch_init(&sketches[m]);
+	}
+
+	sqlite3_bind_text(statement, 1, month, -1, SQLITE_TRANSIENT);
+	while ((status = ws_store_execute_query(&info, &statement)) == WS_DB_ROW)
+	{
+		status = ws_store_merge_blob(sqlite3_column_blob(statement, 0), sqlite3_column_bytes(statement, 0), WS_METRIC_ALL, sketches);
+		if (status != WS_SUCCESS)
+		{
+			break;
+		}
+		records += sqlite3_column_int(statement, 1);
+	}
+
+	sqlite3_reset(statement);
+	if (status != WS_SUCCESS)
+	{
+		return status;
+	}
+
+	return ws_store_write_sketches(info, "MonthlySketches", month, records, sketches);
+}
+
+/* Merges the pending records into the stored sketches of their day and month. When the stored
+   sketches and the pending records don't add up to the records in WeatherData (one was replaced,
+   or an earlier flush failed), they are made again from the records (or days) instead */
+static int ws_store_flush_day(sqlite3* info)
+{
+	ws_store_day_sketches* pending = &ws_store_scratch->pending;
+	int added = pending->records;
+	if (added == 0)
+	{
+		return WS_SUCCESS;
+	}
+
+	pending->records = 0;
+
+	char month[8];
+	memcpy(month, pending->day, 7);
+	month[7] = '\0';
+
+	sqlite3_stmt* statement;
+	int status = ws_store_cached_statement(info, "SELECT (SELECT COUNT(*) FROM main.WeatherData WHERE RecordDateTime >= ?1 AND RecordDateTime < date(?1, '+1 day')), "
+	                                             "(SELECT COALESCE(SUM(Records), 0) FROM main.DailySketches WHERE Day >= ?2 || '-01' AND Day <= ?2 || '-31' AND Day != ?1), "
+	                                             "d.Records, d.Sketches, m.Records, m.Sketches FROM (SELECT 1) "
+	                                             "LEFT JOIN main.DailySketches d ON d.Day = ?1 LEFT JOIN main.MonthlySketches m ON m.Month = ?2", &statement);
+	if (status != WS_SUCCESS)
+	{
+		return status;
+	}
+
+	sqlite3_bind_text(statement, 1, pending->day, -1, SQLITE_TRANSIENT);
+	sqlite3_bind_text(statement, 2, month, -1, SQLITE_TRANSIENT);
+	status = ws_store_execute_query(&info, &statement);
+	if (status != WS_DB_ROW)
 	{
+		sqlite3_reset(statement);
 		return status;
 	}
 
-	status = ws_store_delete_stmt(&info, &statement);
+	int records = sqlite3_column_int(statement, 0);
+	int month_records = records + sqlite3_column_int(statement, 1);
+	int day_added = (sqlite3_column_int(statement, 2) + added == records);
+	int month_added = (sqlite3_column_int(statement, 4) + added == month_records);
+
+	// The month first, while the pending sketches only hold the records added
+	for (int m = 0; m < WS_METRIC_COUNT && month_added; m++)
+	{
+		ws_sketch_init(&ws_store_scratch->month[m]);
+		ws_sketch_merge(&ws_store_scratch->month[m], &pending->sketches[m]);
+	}
+
+	if (month_added && sqlite3_column_type(statement, 5) != SQLITE_NULL)
+	{
+		month_added = (ws_store_merge_blob(sqlite3_column_blob(statement, 5), sqlite3_column_bytes(statement, 5), WS_METRIC_ALL, ws_store_scratch->month) == WS_SUCCESS);
+	}
+
+	if (day_added && sqlite3_column_type(statement, 3) != SQLITE_NULL)
+	{
+		day_added = (ws_store_merge_blob(sqlite3_column_blob(statement, 3), sqlite3_column_bytes(statement, 3), WS_METRIC_ALL, pending->sketches) == WS_SUCCESS);
+	}
+
+	sqlite3_reset(statement);
+
+	status = day_added ? ws_store_write_sketches(info, "DailySketches", pending->day, records, pending->sketches) : ws_store_rebuild_day(info, pending->day);
 	if (status != WS_SUCCESS)
 	{
 		return status;
 	}
+
+	return month_added ? ws_store_write_sketches(info, "MonthlySketches", month, month_records, ws_store_scratch->month) : ws_store_rebuild_month(info, month);
+}
+
+/* Adds a stored record to the pending sketches of its day, flushing the day before if it is another
+   (or of another database, which is still open as closing it drops them) */
+static int ws_store_sketch_record(sqlite3* info, const char* date, const double* values)
+{
+	ws_store_day_sketches* pending = &ws_store_scratch->pending;
+
+	if (pending->records > 0 && (pending->info != info || strncmp(pending->day, date, 10) != 0))
+	{
+		int status = ws_store_flush_day(pending->info);
+		if (status != WS_SUCCESS)
+		{
+			return status;
+		}
+	}
+
+	if (pending->records == 0)
+	{
+		pending->info = info;
+		memcpy(pending->day, date, 10);
+		pending->day[10] = '\0';
+
+		for (int m = 0; m < WS_METRIC_COUNT; m++)
+		{
+			ws_sketch_init(&pending->sketches[m]);
+		}
+	}
+
+	for (int m = 0; m < WS_METRIC_COUNT; m++)
+	{
+		ws_sketch_add(&pending->sketches[m], values[m]);
+	}
+
+	pending->records++;
 	return WS_SUCCESS;
+}
+
+/* Flushes the pending sketches if they are for this database */
+static int ws_store_flush_pending(sqlite3* info)
+{
+	if (ws_store_scratch == NULL || ws_store_scratch->pending.info != info)
+	{
+		return WS_SUCCESS;
+	}
+
+	return ws_store_flush_day(info);
+}
+
+/* Forgets the pending sketches if they are for this database. Their day's sketches are made again
+   from its records when it is next flushed, as they won't add up. */
+static void ws_store_drop_pending(sqlite3* info)
+{
+	if (ws_store_scratch != NULL && ws_store_scratch->pending.info == info)
+	{
+		ws_store_scratch->pending.records = 0;
+		ws_store_scratch->pending.info = NULL;
+	}
+}
 
+/* Starts a savepoint, which works whether or not the caller has a transaction open */
+static int ws_store_savepoint(sqlite3* info, const char* name)
+{
+	char sql[64];
+	snprintf(sql, sizeof(sql), "SAVEPOINT %s", name);
+	return ws_store_query(&info, sql, sizeof(sql));
 }
+
+/* Ends a savepoint, keeping its changes if status is WS_SUCCESS and undoing them otherwise */
+static int ws_store_end_savepoint(sqlite3* info, const char* name, int status)
+{
+	char sql[64];
+	if (status == WS_SUCCESS)
+	{
+		snprintf(sql, sizeof(sql), "RELEASE %s", name);
+		status = ws_store_query(&info, sql, sizeof(sql));
+		if (status == WS_SUCCESS)
+		{
+			return status;
+		}
+	}
+
+	snprintf(sql, sizeof(sql), "ROLLBACK TO %s", name);
+	ws_store_query(&info, sql, sizeof(sql));
+	snprintf(sql, sizeof(sql), "RELEASE %s", name);
+	ws_store_query(&info, sql, sizeof(sql));
+	return status;
+}
+
+/* Runs a query of one text column and calls rebuild with each row */
+static int ws_store_rebuild_each(sqlite3* info, char* sql, int sql_size, int (*rebuild)(sqlite3*, const char*))
+{
+	sqlite3_stmt* statement = NULL;
+	int status = ws_store_create_statement(&info, sql, sql_size, &statement);
+
+	while (status == WS_SUCCESS && (status = ws_store_execute_query(&info, &statement)) == WS_DB_ROW)
+	{
+		char key[11];
+		snprintf(key, sizeof(key), "%s", (const char*)sqlite3_column_text(statement, 0));
+		status = rebuild(info, key);
+	}
+
+	sqlite3_finalize(statement);
+	return status;
+}
+
+/* Makes every day's and month's sketches when there are records but no sketches (a database from before they were kept) */
+static int ws_store_backfill_sketches(sqlite3* info)
+{
+	sqlite3_stmt* statement;
+	int status = ws_store_cached_statement(info, "SELECT EXISTS (SELECT 1 FROM main.WeatherData) AND "
+	                                             "NOT (EXISTS (SELECT 1 FROM main.DailySketches) AND EXISTS (SELECT 1 FROM main.MonthlySketches))", &statement);
+	if (status != WS_SUCCESS)
+	{
+		return status;
+	}
+
+	status = ws_store_execute_query(&info, &statement);
+	int needed = (status == WS_DB_ROW && sqlite3_column_int(statement, 0));
+	sqlite3_reset(statement);
+	if (!needed)
+	{
+		return (status == WS_DB_ROW) ? WS_SUCCESS : status;
+	}
+
+	status = ws_store_alloc_scratch();
+	if (status != WS_SUCCESS)
+	{
+		return status;
+	}
+
+	status = ws_store_savepoint(info, "ws_store_backfill");
+	if (status != WS_SUCCESS)
+	{
+		return status;
+	}
+
+	char days[] = "SELECT DISTINCT substr(RecordDateTime, 1, 10) FROM main.WeatherData";
+	status = ws_store_rebuild_each(info, days, sizeof(days), ws_store_rebuild_day);
+
+	if (status == WS_SUCCESS)
+	{
+		char months[] = "SELECT DISTINCT substr(Day, 1, 7) FROM main.DailySketches";
+		status = ws_store_rebuild_each(info, months, sizeof(months), ws_store_rebuild_month);
+	}
+
+	return ws_store_end_savepoint(info, "ws_store_backfill", status);
+}
+
+/* The value of each metric of a record */
+static void ws_store_record_values(const ws_weather_record* record, double* values)
+{
+	int m = 0;
+
+#define VALUE_FIELD(TYPE, NAME, COLUMN, LABEL, UNIT, DECODE) values[m++] = record->NAME;
+	FOREACH_WS_RECORD_FIELD(VALUE_FIELD)
+#undef VALUE_FIELD
+}
+
+int ws_store_add_weather_record(sqlite3* info, ws_weather_record record)
+{
+	char date[20];
+
+	// Format the date
+	ws_store_format_date(record.date_time, date);
+
+	sqlite3_stmt* statement;
+	int status = ws_store_cached_statement(info, "INSERT OR REPLACE INTO WeatherData VALUES(?" WS_STORE_FIELD_PLACEHOLDERS ")", &statement);
+	if (status != WS_SUCCESS)
+	{
+		return status;
+	}
+
+	status = ws_store_alloc_scratch();
+	if (status != WS_SUCCESS)
+	{
+		return status;
+	}
+
+	int replaced = ws_aggcache_covers(info, date) && ws_store_replaces(info, date);
+
+	// In a transaction the record's sketches are merged with the others added when it ends. On its
+	// own, the record and its day's sketches are stored in a savepoint so they are committed together.
+	int alone = sqlite3_get_autocommit(info);
+	if (alone)
+	{
+		status = ws_store_savepoint(info, "ws_store_add");
+		if (status != WS_SUCCESS)
+		{
+			return status;
+		}
+	}
+
+	sqlite3_bind_text(statement, 1, date, -1, SQLITE_TRANSIENT);
+	ws_store_bind_record(statement, &record);
+
+	status = ws_store_execute_query(&info, &statement);
+	sqlite3_reset(statement);
+
+	double values[WS_METRIC_COUNT];
+	ws_store_record_values(&record, values);
+
+	if (status == WS_SUCCESS || status == WS_DB_ROW)
+	{
+		status = ws_store_sketch_record(info, date, values);
+	}
+
+	if (alone)
+	{
+		if (status == WS_SUCCESS)
+		{
+			status = ws_store_flush_day(info);
+		}
+		status = ws_store_end_savepoint(info, "ws_store_add", status);
+	}
+
+	if (status != WS_SUCCESS)
+	{
+		return status;
+	}
+
+	ws_aggcache_add(info, date, values, replaced);
+	ws_metrics_add(WS_CTR_ROWS_INSERTED, 1);
+	return WS_SUCCESS;
+
+}
+
+
+int ws_store_load_fingerprints(sqlite3* info, uint64_t* hashes)
+{
+	memset(hashes, 0, WS_BLOCK_COUNT * sizeof(uint64_t));
+
+	char sql[] = "SELECT Address, Hash FROM BlockFingerprints";
+	sqlite3_stmt* statement;
+	int status = ws_store_create_statement(&info, sql, sizeof(sql) / sizeof(sql[0]), &statement);
+	if (status != WS_SUCCESS)
+	{
+		return status;
+	}
+
+	while ((status = ws_store_execute_query(&info, &statement)) == WS_DB_ROW)
+	{
+		int address = sqlite3_column_int(statement, 0);
+		if (address >= 0 && address < WS_MEMORY_SIZE)
+		{
+			hashes[address / WS_BLOCK_SIZE] = (uint64_t)sqlite3_column_int64(statement, 1);
+		}
+	}
+
+	if (status != WS_SUCCESS)
+	{
+		ws_store_delete_stmt(&info, &statement);
+		return status;
+	}
+
+	return ws_store_delete_stmt(&info, &statement);
+}
+
+int ws_store_save_fingerprint(sqlite3* info, int address, uint64_t hash)
+{
+	sqlite3_stmt* statement;
+	int status = ws_store_cached_statement(info, "INSERT OR REPLACE INTO BlockFingerprints VALUES(?, ?)", &statement);
+	if (status != WS_SUCCESS)
+	{
+		return status;
+	}
+
+	sqlite3_bind_int(statement, 1, address - (address % WS_BLOCK_SIZE));
+	sqlite3_bind_int64(statement, 2, (sqlite3_int64)hash);
+
+	return ws_store_execute_query(&info, &statement);
+}
+
+int ws_store_load_journal(sqlite3* info, ws_store_journal* journal, int* found)
+{
+	*found = 0;
+
+	sqlite3_stmt* statement;
+	int status = ws_store_cached_statement(info, "SELECT Address, Hash FROM DownloadJournal WHERE Id = 0", &statement);
+	if (status != WS_SUCCESS)
+	{
+		return status;
+	}
+
+	status = ws_store_execute_query(&info, &statement);
+	if (status == WS_DB_ROW)
+	{
+		journal->address = sqlite3_column_int(statement, 0);
+		journal->hash = (uint64_t)sqlite3_column_int64(statement, 1);
+		*found = 1;
+		status = WS_SUCCESS;
+	}
+
+	sqlite3_reset(statement);
+	return status;
+}
+
+int ws_store_save_journal(sqlite3* info, const ws_store_journal* journal)
+{
+	sqlite3_stmt* statement;
+	int status = ws_store_cached_statement(info, "INSERT OR REPLACE INTO DownloadJournal VALUES(0, ?, ?)", &statement);
+	if (status != WS_SUCCESS)
+	{
+		return status;
+	}
+
+	sqlite3_bind_int(statement, 1, journal->address);
+	sqlite3_bind_int64(statement, 2, (sqlite3_int64)journal->hash);
+
+	return ws_store_execute_query(&info, &statement);
+}
+
+int ws_store_clear_journal(sqlite3* info)
+{
+	sqlite3_stmt* statement;
+	int status = ws_store_cached_statement(info, "DELETE FROM DownloadJournal", &statement);
+	if (status != WS_SUCCESS)
+	{
+		return status;
+	}
+
+	return ws_store_execute_query(&info, &statement);
+}
+
+int ws_store_create_data_table(sqlite3* info, const char* schema)
+{
+	/* Create the table for storing weather records. The table is stored in RecordDateTime order 
+	   (WITHOUT ROWID), so every time range query is a covering scan of the primary key */
+	char sql[WS_STORE_SQL_MAX];
+	snprintf(sql, sizeof(sql), "CREATE TABLE IF NOT EXISTS %s.WeatherData( RecordDateTime TEXT PRIMARY KEY" WS_STORE_FIELD_COLUMNS " ) WITHOUT ROWID", schema);
+
+	return ws_store_query(&info, sql, sizeof(sql));
+}
+
+int ws_store_add_packed_records(sqlite3* info, const ws_packed_record* records, int count)
+{
+	return ws_store_add_packed_records_to(info, "main", records, count);
+}
+
+int ws_store_add_packed_records_to(sqlite3* info, const char* schema, const ws_packed_record* records, int count)
+{
+	char sql[WS_STORE_SQL_MAX];
+	snprintf(sql, sizeof(sql), "INSERT OR REPLACE INTO %s.WeatherData VALUES(?" WS_STORE_FIELD_PLACEHOLDERS ")", schema);
+
+	sqlite3_stmt* statement;
+	int status = ws_store_cached_statement(info, sql, &statement);
+	if (status != WS_SUCCESS)
+	{
+		return status;
+	}
+
+	// Only the main database is cached and has sketches
+	int is_main = (strcmp(schema, "main") == 0);
+	if (is_main)
+	{
+		status = ws_store_alloc_scratch();
+		if (status != WS_SUCCESS)
+		{
+			return status;
+		}
+	}
+
+	for (int i = 0; i < count; i++)
+	{
+		ws_weather_record record;
+		char date[20];
+		struct tm date_time;
+
+		ws_unpack_record(&records[i], &record, &date_time);
+		ws_store_format_date(&date_time, date);
+
+		int replaced = is_main && ws_aggcache_covers(info, date) && ws_store_replaces(info, date);
+
+		sqlite3_bind_text(statement, 1, date, -1, SQLITE_TRANSIENT);
+		ws_store_bind_record(statement, &record);
+
+		status = ws_store_execute_query(&info, &statement);
+		if (status != WS_SUCCESS)
+		{
+			return status;
+		}
+
+		sqlite3_reset(statement);
+		ws_metrics_add(WS_CTR_ROWS_INSERTED, 1);
+
+		if (is_main)
+		{
+			double values[WS_METRIC_COUNT];
+			ws_store_record_values(&record, values);
+			ws_aggcache_add(info, date, values, replaced);
+
+			status = ws_store_sketch_record(info, date, values);
+			if (status != WS_SUCCESS)
+			{
+				return status;
+			}
+		}
+	}
+
+	// In a transaction the sketches are flushed when it ends
+	return (is_main && sqlite3_get_autocommit(info)) ? ws_store_flush_day(info) : WS_SUCCESS;
+}
+
+int ws_store_cached_statement(sqlite3* info, const char* sql, sqlite3_stmt** statement)
+{
+	ws_store_stmt_cache* cache = ws_store_find_cache(info, 1);
+	if (cache == NULL)
+	{
+		return WS_ERR_DB_PREPARE;
+	}
+
+	ws_store_cached_stmt* oldest = &cache->entries[0];
+	cache->clock++;
+
+	for (int i = 0; i < WS_STORE_STMT_CACHE; i++)
+	{
+		ws_store_cached_stmt* entry = &cache->entries[i];
+		if (entry->statement != NULL && strcmp(entry->sql, sql) == 0)
+		{
+			sqlite3_reset(entry->statement);
+			sqlite3_clear_bindings(entry->statement);
+			entry->last_used = cache->clock;
+			*statement = entry->statement;
+			return WS_SUCCESS;
+		}
+
+		if (entry->statement == NULL || (oldest->statement != NULL && entry->last_used < oldest->last_used))
+		{
+			oldest = entry;
+		}
+	}
+
+	int length = strlen(sql);
+	int status = ws_store_create_statement(&info, (char*)sql, length + 1, statement);
+	if (status != WS_SUCCESS || length >= WS_STORE_SQL_MAX)
+	{
+		// Too long to cache, so the statement can't be returned as a cached one
+		if (status == WS_SUCCESS)
+		{
+			sqlite3_finalize(*statement);
+			status = WS_ERR_DB_PREPARE;
+		}
+		return status;
+	}
+
+	// Replace the least recently used statement
+	if (oldest->statement != NULL)
+	{
+		sqlite3_finalize(oldest->statement);
+	}
+
+	oldest->statement = *statement;
+	oldest->last_used = cache->clock;
+	memcpy(oldest->sql, sql, length + 1);
+
+	return WS_SUCCESS;
+}
+
+int ws_store_parse_date(const char* date, time_t* time)
+{
+	// YYYY-MM-DD HH:MM:SS
+	int fields[6];
+	static const int positions[6] = { 0, 5, 8, 11, 14, 17 };
+	static const int lengths[6] = { 4, 2, 2, 2, 2, 2 };
+
+	if (date == NULL || strlen(date) < 19)
+	{
+		return 0;
+	}
+
+	for (int f = 0; f < 6; f++)
+	{
+		fields[f] = 0;
+		for (int i = 0; i < lengths[f]; i++)
+		{
+			char c = date[positions[f] + i];
+			if (c < '0' || c > '9')
+			{
+				return 0;
+			}
+			fields[f] = fields[f] * 10 + (c - '0');
+		}
+	}
+
+	struct tm date_time;
+	memset(&date_time, 0, sizeof(date_time));
+	date_time.tm_year = fields[0] - 1900;
+	date_time.tm_mon = fields[1] - 1;
+	date_time.tm_mday = fields[2];
+	date_time.tm_hour = fields[3];
+	date_time.tm_min = fields[4];
+	date_time.tm_sec = fields[5];
+	date_time.tm_isdst = -1;
+
+	*time = mktime(&date_time);
+	return 1;
+}
+
+/* Builds the SQL for a range query. Everything that changes between runs of the same kind
+   of query is a bound parameter, so the SQL works as the key of the statement cache */
+static int ws_store_range_sql(const ws_store_range_query* query, char* sql, int size)
+{
+	static const char* aggregates[] = { "", "MIN", "MAX", "AVG", "SUM", "COUNT" };
+	int aggregate = (query->aggregate > WS_AGG_NONE && query->aggregate <= WS_AGG_COUNT);
+	int bucketed = aggregate && query->bucket_seconds > 0;
+	int length;
+
+	if (!aggregate)
+	{
+		length = snprintf(sql, size, "SELECT RecordDateTime");
+	} else if (bucketed) {
+		length = snprintf(sql, size, "SELECT datetime((CAST(strftime('%%s', RecordDateTime) AS INTEGER) / ?3) * ?3, 'unixepoch')");
+	} else {
+		length = snprintf(sql, size, "SELECT MIN(RecordDateTime)");
+	}
+
+	for (int m = 0; m < WS_METRIC_COUNT && length < size; m++)
+	{
+		if (!(query->metrics & WS_METRIC_BIT(m)))
+		{
+			continue;
+		}
+
+		if (aggregate)
+		{
+			length += snprintf(sql + length, size - length, ", %s(%s)", aggregates[query->aggregate], ws_store_metric_columns[m]);
+		} else {
+			length += snprintf(sql + length, size - length, ", %s", ws_store_metric_columns[m]);
+		}
+	}
+
+	if (length < size)
+	{
+		length += snprintf(sql + length, size - length, " FROM %s.WeatherData WHERE RecordDateTime >= ?1 AND RecordDateTime < ?2%s%s LIMIT ?4",
+		                   (query->schema != NULL) ? query->schema : "main", bucketed ? " GROUP BY 1" : "",
+		                   (!aggregate || bucketed) ? (query->descending ? " ORDER BY 1 DESC" : " ORDER BY 1 ASC") : "");
+	}
+
+	return (length < size) ? WS_SUCCESS : WS_ERR_DB_PREPARE;
+}
+
+typedef struct
+{
+	const ws_store_range_query* query;
+	ws_store_batch* batch;
+	ws_store_batch_cb callback;
+	void* user;
+	int stopped;
+} ws_store_batch_fill;
+
+/* Adds a row from the aggregate cache to a batch */
+static int ws_store_fill_batch(const ws_store_row* row, void* user)
+{
+	ws_store_batch_fill* fill = user;
+	ws_store_batch* batch = fill->batch;
+
+	batch->time[batch->count] = row->time;
+	for (int m = 0; m < WS_METRIC_COUNT; m++)
+	{
+		if (fill->query->metrics & WS_METRIC_BIT(m))
+		{
+			batch->values[m][batch->count] = row->values[m];
+		}
+	}
+
+	if (++batch->count == WS_STORE_BATCH_SIZE)
+	{
+		fill->stopped = fill->callback(batch, fill->user);
+		batch->count = 0;
+	}
+
+	return fill->stopped;
+}
+
+/* Runs a range query, giving each row to either the row callback or the batch */
+static int ws_store_run_range(sqlite3* info, const ws_store_range_query* query, ws_store_row_cb row_callback, 
+                              ws_store_batch* batch, ws_store_batch_cb batch_callback, void* user)
+{
+	if (ws_aggcache_cacheable(query))
+	{
+		if (batch == NULL)
+		{
+			return ws_aggcache_query(info, query, row_callback, user);
+		}
+
+		ws_store_batch_fill fill = { query, batch, batch_callback, user, 0 };
+		batch->count = 0;
+
+		int status = ws_aggcache_query(info, query, ws_store_fill_batch, &fill);
+		if (status == WS_SUCCESS && batch->count > 0 && !fill.stopped)
+		{
+			batch_callback(batch, user);
+		}
+		return status;
+	}
+
+	char sql[WS_STORE_SQL_MAX];
+	int status = ws_store_range_sql(query, sql, sizeof(sql));
+	if (status != WS_SUCCESS)
+	{
+		return status;
+	}
+
+	sqlite3_stmt* statement;
+	status = ws_store_cached_statement(info, sql, &statement);
+	if (status != WS_SUCCESS)
+	{
+		return status;
+	}
+
+	char from[20];
+	char to[20];
+	struct tm date_time;
+
+	localtime_r(&query->from, &date_time);
+	ws_store_format_date(&date_time, from);
+	localtime_r(&query->to, &date_time);
+	ws_store_format_date(&date_time, to);
+
+	sqlite3_bind_text(statement, 1, from, -1, SQLITE_TRANSIENT);
+	sqlite3_bind_text(statement, 2, to, -1, SQLITE_TRANSIENT);
+	if (query->aggregate != WS_AGG_NONE && query->bucket_seconds > 0)
+	{
+		sqlite3_bind_int(statement, 3, query->bucket_seconds);
+	}
+	sqlite3_bind_int(statement, 4, (query->limit > 0) ? query->limit : -1);
+
+	ws_store_row row;
+	int stopped = 0;
+
+	if (batch != NULL)
+	{
+		batch->count = 0;
+	}
+
+	while (!stopped && (status = ws_store_execute_query(&info, &statement)) == WS_DB_ROW)
+	{
+		// A whole range aggregate of no rows gives a single row of NULLs
+		const char* date = (const char*)sqlite3_column_text(statement, 0);
+		if (!ws_store_parse_date(date, &row.time))
+		{
+			continue;
+		}
+
+		int column = 1;
+		for (int m = 0; m < WS_METRIC_COUNT; m++)
+		{
+			if (query->metrics & WS_METRIC_BIT(m))
+			{
+				row.values[m] = (sqlite3_column_type(statement, column) == SQLITE_NULL) ? NAN : sqlite3_column_double(statement, column);
+				column++;
+			}
+		}
+
+		if (batch == NULL)
+		{
+			stopped = row_callback(&row, user);
+			continue;
+		}
+
+		batch->time[batch->count] = row.time;
+		for (int m = 0; m < WS_METRIC_COUNT; m++)
+		{
+			if (query->metrics & WS_METRIC_BIT(m))
+			{
+				batch->values[m][batch->count] = row.values[m];
+			}
+		}
+
+		if (++batch->count == WS_STORE_BATCH_SIZE)
+		{
+			stopped = batch_callback(batch, user);
+			batch->count = 0;
+		}
+	}
+
+	// Leave the statement ready for the next use, releasing its read lock
+	sqlite3_reset(statement);
+
+	if (status != WS_SUCCESS && status != WS_DB_ROW)
+	{
+		return status;
+	}
+
+	if (batch != NULL && batch->count > 0 && !stopped)
+	{
+		batch_callback(batch, user);
+	}
+
+	return WS_SUCCESS;
+}
+
+int ws_store_query_range(sqlite3* info, const ws_store_range_query* query, ws_store_row_cb callback, void* user)
+{
+	return ws_store_run_range(info, query, callback, NULL, NULL, user);
+}
+
+int ws_store_query_range_batch(sqlite3* info, const ws_store_range_query* query, ws_store_batch* batch, ws_store_batch_cb callback, void* user)
+{
+	return ws_store_run_range(info, query, NULL, batch, callback, user);
+}
+
+/* Formats the date of a time (YYYY-MM-DD), and the first day on or after it that starts at midnight */
+static void ws_store_format_days(time_t time, char* day, char* first_day)
+{
+	struct tm date_time;
+	localtime_r(&time, &date_time);
+	strftime(day, 11, "%Y-%m-%d", &date_time);
+
+	if (date_time.tm_hour != 0 || date_time.tm_min != 0)
+	{
+		date_time.tm_mday++;
+		date_time.tm_hour = 0;
+		date_time.tm_min = 0;
+		date_time.tm_sec = 0;
+		date_time.tm_isdst = -1;
+		mktime(&date_time);
+	}
+
+	strftime(first_day, 11, "%Y-%m-%d", &date_time);
+}
+
+int ws_store_range_sketches(sqlite3* info, time_t from, time_t to, uint32_t metrics, ws_sketch* sketches)
+{
+	for (int m = 0; m < WS_METRIC_COUNT; m++)
+	{
+		ws_sketch_init(&sketches[m]);
+	}
+
+	if (to <= from)
+	{
+		return WS_SUCCESS;
+	}
+
+	int status = ws_store_alloc_scratch();
+	if (status == WS_SUCCESS)
+	{
+		// Records added in a transaction that is still open only count once their sketches are merged
+		status = ws_store_flush_pending(info);
+	}
+
+	if (status != WS_SUCCESS)
+	{
+		return status;
+	}
+
+	char from_date[20];
+	char to_date[20];
+	char from_day[11];
+	char first_day[11];
+	char to_day[11];
+	char ignored[11];
+	struct tm date_time;
+
+	localtime_r(&from, &date_time);
+	ws_store_format_date(&date_time, from_date);
+	localtime_r(&to, &date_time);
+	ws_store_format_date(&date_time, to_date);
+
+	// Whole days are [first_day, to_day) and whole months [first_month, to_month)
+	ws_store_format_days(from, from_day, first_day);
+	ws_store_format_days(to, to_day, ignored);
+
+	// Room for any int year and month, though a real month is 10 characters
+	char first_month[2 * 11 + 5];
+	char to_month[11];
+	snprintf(first_month, sizeof(first_month), "%.7s-01", first_day);
+	snprintf(to_month, sizeof(to_month), "%.7s-01", to_day);
+
+	if (strcmp(first_month, first_day) != 0)
+	{
+		int year;
+		int month;
+		sscanf(first_day, "%d-%d", &year, &month);
+		snprintf(first_month, sizeof(first_month), "%.4d-%.2d-01", year + month / 12, month % 12 + 1);
+	}
+
+	// Each level holds what is inside the range [?1, ?2) but outside the whole units [?3, ?4) of the level above 
+	sqlite3_stmt* months;
+	sqlite3_stmt* days;
+	sqlite3_stmt* rows;
+
+	status = ws_store_cached_statement(info, "SELECT Sketches FROM main.MonthlySketches WHERE Month >= substr(?1, 1, 7) AND Month < substr(?2, 1, 7)", &months);
+	if (status != WS_SUCCESS)
+	{
+		return status;
+	}
+
+	sqlite3_bind_text(months, 1, first_month, -1, SQLITE_TRANSIENT);
+	sqlite3_bind_text(months, 2, to_month, -1, SQLITE_TRANSIENT);
+
+	status = ws_store_merge_blobs(info, months, metrics, sketches);
+	if (status != WS_SUCCESS)
+	{
+		return status;
+	}
+
+	status = ws_store_cached_statement(info, "SELECT Sketches FROM main.DailySketches WHERE Day >= ?1 AND Day < min(?2, ?3) "
+	                                         "UNION ALL SELECT Sketches FROM main.DailySketches WHERE Day >= max(?1, ?3, ?4) AND Day < ?2", &days);
+	if (status != WS_SUCCESS)
+	{
+		return status;
+	}
+
+	sqlite3_bind_text(days, 1, first_day, -1, SQLITE_TRANSIENT);
+	sqlite3_bind_text(days, 2, to_day, -1, SQLITE_TRANSIENT);
+	sqlite3_bind_text(days, 3, first_month, -1, SQLITE_TRANSIENT);
+	sqlite3_bind_text(days, 4, to_month, -1, SQLITE_TRANSIENT);
+
+	status = ws_store_merge_blobs(info, days, metrics, sketches);
+	if (status != WS_SUCCESS)
+	{
+		return status;
+	}
+
+	status = ws_store_cached_statement(info, "SELECT RecordDateTime" WS_STORE_METRIC_COLUMNS " FROM main.WeatherData WHERE RecordDateTime >= ?1 AND RecordDateTime < min(?2, ?3) "
+	                                         "UNION ALL SELECT RecordDateTime" WS_STORE_METRIC_COLUMNS " FROM main.WeatherData WHERE RecordDateTime >= max(?1, ?3, ?4) AND RecordDateTime < ?2", &rows);
+	if (status != WS_SUCCESS)
+	{
+		return status;
+	}
+
+	sqlite3_bind_text(rows, 1, from_date, -1, SQLITE_TRANSIENT);
+	sqlite3_bind_text(rows, 2, to_date, -1, SQLITE_TRANSIENT);
+	sqlite3_bind_text(rows, 3, first_day, -1, SQLITE_TRANSIENT);
+	sqlite3_bind_text(rows, 4, to_day, -1, SQLITE_TRANSIENT);
+
+	int records = 0;
+	return ws_store_sketch_rows(info, rows, metrics, sketches, &records);
+}
+
+int ws_store_tag_anomaly(sqlite3* info, time_t record_time, uint32_t metrics)
+{
+	char date[20];
+	struct tm date_time;
+	localtime_r(&record_time, &date_time);
+	ws_store_format_date(&date_time, date);
+
+	sqlite3_stmt* statement;
+	int status;
+
+	if (metrics == 0)
+	{
+		status = ws_store_cached_statement(info, "DELETE FROM WeatherAnomalies WHERE RecordDateTime = ?", &statement);
+	} else {
+		status = ws_store_cached_statement(info, "INSERT OR REPLACE INTO WeatherAnomalies VALUES(?, ?)", &statement);
+	}
+
+	if (status != WS_SUCCESS)
+	{
+		return status;
+	}
+
+	sqlite3_bind_text(statement, 1, date, -1, SQLITE_TRANSIENT);
+	if (metrics != 0)
+	{
+		sqlite3_bind_int64(statement, 2, metrics);
+	}
+
+	return ws_store_execute_query(&info, &statement);
+}
+
+ws_min_max* ws_store_extreme_field(ws_weather_extremes* extremes, int extreme)
+{
+	return (ws_min_max*)((char*)extremes + ws_store_extreme_offsets[extreme]);
+}
+
+/* Formats a time decoded from the station (two digit year) as a RecordDateTime. Blank times give 0. */
+static int ws_store_format_ws_time(ws_time time, char* date)
+{
+	if (time.year == 0 && time.month == 0 && time.day == 0)
+	{
+		return 0;
+	}
+
+	// The fields are BCD digit pairs, so never more than 2 digits
+	snprintf(date, 20, "%.4u-%.2u-%.2u %.2u:%.2u:00", 2000 + (unsigned)time.year % 100, (unsigned)time.month % 100,
+	         (unsigned)time.day % 100, (unsigned)time.hour % 100, (unsigned)time.minute % 100);
+	return 1;
+}
+
+static ws_time ws_store_parse_ws_time(const char* date)
+{
+	ws_time time;
+	memset(&time, 0, sizeof(time));
+
+	if (date != NULL && sscanf(date, "%d-%d-%d %d:%d", &time.year, &time.month, &time.day, &time.hour, &time.minute) == 5)
+	{
+		time.year -= 2000;
+	} else {
+		memset(&time, 0, sizeof(time));
+	}
+
+	return time;
+}
+
+int ws_store_load_extremes(sqlite3* info, ws_weather_extremes* extremes, uint32_t* present)
+{
+	memset(extremes, 0, sizeof(ws_weather_extremes));
+	*present = 0;
+
+	sqlite3_stmt* statement;
+	int status = ws_store_cached_statement(info, "SELECT Name, MinValue, MinDateTime, MaxValue, MaxDateTime FROM WeatherExtremes", &statement);
+	if (status != WS_SUCCESS)
+	{
+		return status;
+	}
+
+	while ((status = ws_store_execute_query(&info, &statement)) == WS_DB_ROW)
+	{
+		const char* name = (const char*)sqlite3_column_text(statement, 0);
+		for (int e = 0; name != NULL && e < WS_EXTREME_COUNT; e++)
+		{
+			if (strcmp(name, ws_store_extreme_names[e]) != 0)
+			{
+				continue;
+			}
+
+			ws_min_max* value = ws_store_extreme_field(extremes, e);
+			value->min = sqlite3_column_double(statement, 1);
+			value->min_time = ws_store_parse_ws_time((const char*)sqlite3_column_text(statement, 2));
+			value->max = sqlite3_column_double(statement, 3);
+			value->max_time = ws_store_parse_ws_time((const char*)sqlite3_column_text(statement, 4));
+			*present |= (1u << e);
+			break;
+		}
+	}
+
+	sqlite3_reset(statement);
+	return (status == WS_SUCCESS) ? WS_SUCCESS : status;
+}
+
+/* Binds a ws_min_max to parameters first (MinValue) to first + 3 (MaxDateTime) */
+static void ws_store_bind_min_max(sqlite3_stmt* statement, int first, const ws_min_max* value)
+{
+	char min_date[20];
+	char max_date[20];
+
+	sqlite3_bind_double(statement, first, value->min);
+	if (ws_store_format_ws_time(value->min_time, min_date))
+	{
+		sqlite3_bind_text(statement, first + 1, min_date, -1, SQLITE_TRANSIENT);
+	}
+
+	sqlite3_bind_double(statement, first + 2, value->max);
+	if (ws_store_format_ws_time(value->max_time, max_date))
+	{
+		sqlite3_bind_text(statement, first + 3, max_date, -1, SQLITE_TRANSIENT);
+	}
+}
+
+int ws_store_save_extreme(sqlite3* info, int extreme, const ws_min_max* value, time_t changed_at)
+{
+	sqlite3_stmt* statement;
+	int status = ws_store_cached_statement(info, "INSERT OR REPLACE INTO WeatherExtremes VALUES(?, ?, ?, ?, ?)", &statement);
+	if (status != WS_SUCCESS)
+	{
+		return status;
+	}
+
+	sqlite3_bind_text(statement, 1, ws_store_extreme_names[extreme], -1, SQLITE_STATIC);
+	ws_store_bind_min_max(statement, 2, value);
+
+	status = ws_store_execute_query(&info, &statement);
+	if (status != WS_SUCCESS)
+	{
+		return status;
+	}
+
+	status = ws_store_cached_statement(info, "INSERT INTO WeatherExtremesHistory VALUES(?, ?, ?, ?, ?, ?)", &statement);
+	if (status != WS_SUCCESS)
+	{
+		return status;
+	}
+
+	char date[20];
+	struct tm date_time;
+	localtime_r(&changed_at, &date_time);
+	ws_store_format_date(&date_time, date);
+
+	sqlite3_bind_text(statement, 1, date, -1, SQLITE_TRANSIENT);
+	sqlite3_bind_text(statement, 2, ws_store_extreme_names[extreme], -1, SQLITE_STATIC);
+	ws_store_bind_min_max(statement, 3, value);
+
+	return ws_store_execute_query(&info, &statement);
+}
\ No newline at end of file
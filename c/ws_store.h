@@ -2,7 +2,114 @@
 #define WS_STORE_H
 
 #include "ws.h"
+#include "ws_sketch.h"
 #include <sqlite3.h>
+#include <time.h>
+
+/**
+	Metrics (columns of WeatherData) that can be queried. Each entry is the enum name 
+	and the column name.
+*/
+#define FOREACH_WS_STORE_METRIC(METRIC) 							\
+	METRIC(WS_METRIC_INDOOR_HUMIDITY, "IndoorHumidity")				\
+	METRIC(WS_METRIC_OUTDOOR_HUMIDITY, "OutdoorHumidity")			\
+	METRIC(WS_METRIC_INDOOR_TEMPERATURE, "IndoorTemperature")		\
+	METRIC(WS_METRIC_OUTDOOR_TEMPERATURE, "OutdoorTemperature")		\
+	METRIC(WS_METRIC_DEW_POINT, "DewPoint")							\
+	METRIC(WS_METRIC_ABSOLUTE_PRESSURE, "AbsolutePressure")			\
+	METRIC(WS_METRIC_WIND_SPEED, "WindSpeed")						\
+	METRIC(WS_METRIC_GUST_SPEED, "GuestSpeed")						\
+	METRIC(WS_METRIC_WIND_DIRECTION, "WindDirection")				\
+	METRIC(WS_METRIC_TOTAL_RAIN, "TotalRain")						\
+
+#define GENERATE_STORE_METRIC_ENUM(ENUM, COLUMN) ENUM,
+
+enum ws_store_metric {
+	FOREACH_WS_STORE_METRIC(GENERATE_STORE_METRIC_ENUM)
+	WS_METRIC_COUNT
+};
+
+/**
+	Rows of the WeatherExtremes table. Each entry is the field of ws_weather_extremes and
+	the name stored in the table.
+*/
+#define FOREACH_WS_EXTREME(EXTREME) 								\
+	EXTREME(indoor_humidity, "IndoorHumidity")						\
+	EXTREME(outdoor_humidity, "OutdoorHumidity")					\
+	EXTREME(indoor_temperature, "IndoorTemperature")				\
+	EXTREME(outdoor_temperature, "OutdoorTemperature")				\
+	EXTREME(wind_chill, "WindChill")								\
+	EXTREME(dew_point, "DewPoint")									\
+	EXTREME(absolute_pressure, "AbsolutePressure")					\
+	EXTREME(relative_pressure, "RelativePressure")					\
+	EXTREME(wind_speed, "WindSpeed")								\
+	EXTREME(gust_speed, "GustSpeed")								\
+	EXTREME(rain_hourly, "RainHourly")								\
+	EXTREME(rain_daily, "RainDaily")								\
+	EXTREME(rain_weekly, "RainWeekly")								\
+	EXTREME(rain_monthly, "RainMonthly")							\
+	EXTREME(rain_total, "RainTotal")								\
+
+#define GENERATE_EXTREME_ENUM(FIELD, NAME) WS_EXTREME_##FIELD,
+
+enum ws_store_extreme {
+	FOREACH_WS_EXTREME(GENERATE_EXTREME_ENUM)
+	WS_EXTREME_COUNT
+};
+
+#define WS_METRIC_BIT(metric) (1u << (metric))
+#define WS_METRIC_ALL ((1u << WS_METRIC_COUNT) - 1)
+
+/**
+	Aggregates that can be worked out by the database rather than by the caller
+*/
+enum ws_store_aggregate {
+	WS_AGG_NONE, WS_AGG_MIN, WS_AGG_MAX, WS_AGG_AVG, WS_AGG_SUM, WS_AGG_COUNT
+};
+
+/**
+	A query for the records in a time range.
+*/
+typedef struct
+{
+	time_t from;						// Start of the range (inclusive)
+	time_t to;							// End of the range (exclusive)
+	uint32_t metrics;					// WS_METRIC_BIT()s of the metrics wanted
+	int limit;							// Maximum rows returned, 0 for no limit
+	int descending;						// Non zero for newest first
+	enum ws_store_aggregate aggregate;	// Aggregate to apply to each metric
+	int bucket_seconds;					// With an aggregate, the size of each bucket. 0 aggregates the whole range.
+	const char* schema;					// The attached database to query, NULL for the main one
+} ws_store_range_query;
+
+/**
+	A single row of a query. Only the metrics in the query are set. For a bucketed aggregate
+	the time is the start of the bucket; for a whole-range aggregate it is the time of the first record.
+*/
+typedef struct
+{
+	time_t time;
+	double values[WS_METRIC_COUNT];
+} ws_store_row;
+
+#define WS_STORE_BATCH_SIZE 256
+
+/**
+	Rows of a query in columns. values[metric][i] is the value of the metric in row i.
+*/
+typedef struct
+{
+	int count;
+	time_t time[WS_STORE_BATCH_SIZE];
+	double values[WS_METRIC_COUNT][WS_STORE_BATCH_SIZE];
+} ws_store_batch;
+
+/**
+	Callbacks for ws_store_query_range() and ws_store_query_range_batch(). Return 0 to 
+	carry on, anything else to stop the query.
+*/
+typedef int (*ws_store_row_cb)(const ws_store_row* row, void* user);
+typedef int (*ws_store_batch_cb)(const ws_store_batch* batch, void* user);
 
 void db_error(sqlite3*, const char* extra);
 
@@ -14,8 +121,201 @@ int ws_store_delete_stmt(sqlite3** info, sqlite3_stmt** statement);
 int ws_store_query(sqlite3** info, char* sql, int sql_size);
 
 int ws_store_prepare_db(sqlite3** info);
+int ws_store_create_tables(sqlite3** info);
 int ws_store_add_weather_record(sqlite3* info, ws_weather_record record);
+
+/**
+	Stores an array of packed records, reusing a single prepared statement. Records are
+	stored as given - invalid records should be removed by the caller.
+
+	Parameters:
+		info 		The database
+		records		The records, with their epoch set
+		count		The number of records
+*/
+int ws_store_add_packed_records(sqlite3* info, const ws_packed_record* records, int count);
+
+/**
+	Stores an array of packed records in the WeatherData table of an attached database.
+
+	Parameters:
+		info 		The database
+		schema		The name the database is attached as ("main" for the main database)
+		records		The records, with their epoch set
+		count		The number of records
+*/
+int ws_store_add_packed_records_to(sqlite3* info, const char* schema, const ws_packed_record* records, int count);
+
+/**
+	Creates the WeatherData table in a database, if it doesn't already exist.
+
+	Parameters:
+		info 		The database
+		schema		The name the database is attached as ("main" for the main database)
+*/
+int ws_store_create_data_table(sqlite3* info, const char* schema);
+
+/**
+	Formats a time in the format used for RecordDateTime. date must have room for 20 characters.
+*/
+void ws_store_format_date(const struct tm* date_time, char* date);
+
 int ws_store_begin_transaction(sqlite3** info);
+
+/**
+	Commits a transaction, first merging the sketches of the records stored in it. If either
+	fails the transaction is rolled back, so on an error nothing has been committed.
+*/
 int ws_store_end_transaction(sqlite3** info);
 
+/**
+	Loads the stored fingerprint of every block in the station's memory. Blocks
+	with no stored fingerprint are set to 0.
+
+	Parameters:
+		info 		The database
+		hashes		Array of WS_BLOCK_COUNT fingerprints, indexed by address / WS_BLOCK_SIZE
+*/
+int ws_store_load_fingerprints(sqlite3* info, uint64_t* hashes);
+
+/**
+	Stores the fingerprint of the block at the given address, replacing any old one.
+*/
+int ws_store_save_fingerprint(sqlite3* info, int address, uint64_t hash);
+
+/**
+	Progress of an unfinished history download. The history up to and including the record
+	at address has been stored, and hash is the fingerprint of the block holding it.
+*/
+typedef struct
+{
+	int address;
+	uint64_t hash;
+} ws_store_journal;
+
+/**
+	Loads the download journal.
+
+	Parameters:
+		info 		The database
+		journal		Filled with the journal
+		found		Set to 1 if there was an unfinished download, 0 otherwise
+*/
+int ws_store_load_journal(sqlite3* info, ws_store_journal* journal, int* found);
+
+/**
+	Replaces the download journal. Saved in the same transaction as the records it 
+	describes, so that the two are always committed together.
+*/
+int ws_store_save_journal(sqlite3* info, const ws_store_journal* journal);
+
+/**
+	Removes the download journal once a download has finished.
+*/
+int ws_store_clear_journal(sqlite3* info);
+
+// Longest SQL ws_store_cached_statement() will cache
+#define WS_STORE_SQL_MAX 1024
+
+/**
+	Gets a prepared statement from the connection's cache, preparing it the first time. The 
+	statement is reset and its bindings cleared. It must not be finalized by the caller - 
+	ws_store_close_db() finalizes the cached statements of the database.
+
+	Parameters:
+		info 		The database
+		sql			The SQL of the statement, which is also its key in the cache
+		statement	The statement
+*/
+int ws_store_cached_statement(sqlite3* info, const char* sql, sqlite3_stmt** statement);
+
+/**
+	Runs a query over a time range, passing each row to a callback. Statements are cached, 
+	and no memory is allocated per row.
+
+	Parameters:
+		info 		The database
+		query		The query
+		callback	Called for each row. The row is only valid during the call.
+		user		Passed to the callback
+*/
+int ws_store_query_range(sqlite3* info, const ws_store_range_query* query, ws_store_row_cb callback, void* user);
+
+/**
+	Runs a query over a time range, filling a column batch and passing it to a callback
+	each time it is full (and once more at the end for the remaining rows).
+
+	Parameters:
+		info 		The database
+		query		The query
+		batch		The batch to fill. It is reused for every call.
+		callback	Called for each batch
+		user		Passed to the callback
+*/
+int ws_store_query_range_batch(sqlite3* info, const ws_store_range_query* query, ws_store_batch* batch, ws_store_batch_cb callback, void* user);
+
+/**
+	Gets quantile sketches of the metrics over a time range, for percentiles without reading 
+	every record. The months and days wholly in the range come from the sketches kept in 
+	MonthlySketches and DailySketches as records are stored, and only the records of the part 
+	days at either end are read. The sketches of records stored in a transaction are updated 
+	once per day when it ends, rather than for every record.
+
+	Parameters:
+		info 		The database
+		from		Start of the range (inclusive)
+		to			End of the range (exclusive)
+		metrics		WS_METRIC_BIT()s of the metrics wanted
+		sketches	WS_METRIC_COUNT sketches, indexed by metric. Those not wanted are left empty.
+
+	Return:
+		- WS_ERR_DB_QUERY	A stored sketch is corrupt
+		- Any error from the queries
+*/
+int ws_store_range_sketches(sqlite3* info, time_t from, time_t to, uint32_t metrics, ws_sketch* sketches);
+
+/**
+	Tags the record at a time as suspicious, without changing the record itself.
+
+	Parameters:
+		info 			The database
+		record_time		The time of the record
+		metrics			WS_METRIC_BIT()s of the suspicious metrics. 0 removes the tag.
+*/
+int ws_store_tag_anomaly(sqlite3* info, time_t record_time, uint32_t metrics);
+
+/**
+	Gets a single extreme out of ws_weather_extremes by its ws_store_extreme number
+*/
+ws_min_max* ws_store_extreme_field(ws_weather_extremes* extremes, int extreme);
+
+/**
+	Loads the extremes stored in WeatherExtremes.
+
+	Parameters:
+		info 		The database
+		extremes	Filled with the stored extremes
+		present		Bitmap of (1 << ws_store_extreme) for the extremes that were stored
+*/
+int ws_store_load_extremes(sqlite3* info, ws_weather_extremes* extremes, uint32_t* present);
+
+/**
+	Upserts a single extreme in WeatherExtremes and records the change in WeatherExtremesHistory.
+
+	Parameters:
+		info 		The database
+		extreme		The ws_store_extreme being stored
+		value		The new min and max
+		changed_at	When the change was seen
+*/
+int ws_store_save_extreme(sqlite3* info, int extreme, const ws_min_max* value, time_t changed_at);
+
+/**
+	Parses a time in the RecordDateTime format.
+
+	Return:
+		0 if the date could not be parsed, otherwise 1.
+*/
+int ws_store_parse_date(const char* date, time_t* time);
+
 #endif  
\ No newline at end of file
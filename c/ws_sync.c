@@ -0,0 +1,147 @@
+#include "ws_sync.h"
+#include "ws_queue.h"
+
+#define WS_SYNC_HISTORY_SIZE (WS_MEMORY_SIZE - WS_RECORDS_START)
+
+static inline int ws_sync_wrap(int address)
+{
+	return WS_RECORDS_START + ((address - WS_RECORDS_START) % WS_SYNC_HISTORY_SIZE + WS_SYNC_HISTORY_SIZE) % WS_SYNC_HISTORY_SIZE;
+}
+
+void ws_sync_plan_decode(const unsigned char* fixed_block, time_t latest_time, ws_sync_plan* plan)
+{
+	int data_count = fixed_block[0x1B] | (fixed_block[0x1C] << 8);
+	int current_pos = fixed_block[0x1E] | (fixed_block[0x1F] << 8);
+
+	plan->read_period = fixed_block[0x10] ? fixed_block[0x10] : 30;
+	plan->current_address = current_pos - (current_pos % WS_RECORD_SIZE);
+	plan->latest_time = latest_time;
+
+	// data_count includes the record being written to
+	plan->record_count = ((data_count > WS_HISTORY_RECORDS) ? WS_HISTORY_RECORDS : data_count) - 1;
+	plan->record_count = (plan->record_count > 0) ? plan->record_count : 0;
+
+	// A position outside of the history means there are no records to trust
+	if (current_pos < WS_RECORDS_START || current_pos >= WS_MEMORY_SIZE)
+	{
+		plan->record_count = 0;
+		plan->current_address = -1;
+	}
+
+	plan->latest_address = ws_sync_wrap(((plan->current_address >= 0) ? plan->current_address : WS_RECORDS_START) - WS_RECORD_SIZE);
+
+	plan->oldest_address = ws_sync_wrap(plan->latest_address - (plan->record_count - 1) * WS_RECORD_SIZE);
+}
+
+int ws_sync_plan_read(ws_device* dev, ws_sync_plan* plan)
+{
+	unsigned char fixed[WS_BLOCK_SIZE];
+	unsigned char data[WS_BLOCK_SIZE];
+
+	int status = ws_queue_device_read(dev, 0, WS_QUEUE_LIVE, WS_QUEUE_STABLE, fixed);
+	if (status != WS_SUCCESS)
+	{
+		return status;
+	}
+
+	int current_pos = fixed[0x1E] | (fixed[0x1F] << 8);
+	if (current_pos < WS_RECORDS_START || current_pos >= WS_MEMORY_SIZE)
+	{
+		return WS_ERR_INVALID_ADDR;
+	}
+
+	// The delay is all that is needed from the record being written to
+	int current_address = current_pos - (current_pos % WS_RECORD_SIZE);
+	int block = current_address - (current_address % WS_BLOCK_SIZE);
+	status = ws_queue_device_read(dev, block, WS_QUEUE_LIVE, WS_QUEUE_STABLE, data);
+	if (status != WS_SUCCESS)
+	{
+		return status;
+	}
+
+	ws_sync_plan_decode(fixed, time(NULL) - (time_t)data[current_address - block] * 60, plan);
+	return WS_SUCCESS;
+}
+
+int ws_sync_address(const ws_sync_plan* plan, int index)
+{
+	return ws_sync_wrap(plan->oldest_address + index * WS_RECORD_SIZE);
+}
+
+int ws_sync_index(const ws_sync_plan* plan, int address)
+{
+	if (address < WS_RECORDS_START || address >= WS_MEMORY_SIZE)
+	{
+		return -1;
+	}
+
+	int index = (ws_sync_wrap(address - (address % WS_RECORD_SIZE)) - plan->oldest_address + WS_SYNC_HISTORY_SIZE) % WS_SYNC_HISTORY_SIZE / WS_RECORD_SIZE;
+	return (index < plan->record_count) ? index : -1;
+}
+
+time_t ws_sync_time(const ws_sync_plan* plan, int index)
+{
+	return plan->latest_time - (time_t)(plan->record_count - 1 - index) * plan->read_period * 60;
+}
+
+/* floor(a / b) for b > 0 */
+static inline time_t ws_sync_floor_div(time_t a, time_t b)
+{
+	return (a >= 0) ? a / b : -((-a + b - 1) / b);
+}
+
+int ws_sync_blocks(const ws_sync_plan* plan, time_t from, time_t to, int* blocks, int max_blocks, int* first_index, int* last_index)
+{
+	if (plan->record_count == 0 || to <= from || from > plan->latest_time)
+	{
+		return 0;
+	}
+
+	// Records are read_period apart going back from the latest, so the range is worked out directly
+	time_t period = (time_t)plan->read_period * 60;
+	time_t furthest_back = ws_sync_floor_div(plan->latest_time - from, period);
+	time_t nearest_back = (to > plan->latest_time) ? 0 : ws_sync_floor_div(plan->latest_time - to, period) + 1;
+
+	if (furthest_back > plan->record_count - 1)
+	{
+		furthest_back = plan->record_count - 1;
+	}
+
+	if (nearest_back > furthest_back)
+	{
+		return 0;
+	}
+
+	int first = plan->record_count - 1 - (int)furthest_back;
+	int last = plan->record_count - 1 - (int)nearest_back;
+	int count = 0;
+
+	for (int index = first; index <= last && count < max_blocks; index++)
+	{
+		int block = ws_sync_address(plan, index);
+		block -= block % WS_BLOCK_SIZE;
+
+		if (count == 0 || blocks[count - 1] != block)
+		{
+			blocks[count++] = block;
+		}
+	}
+
+	// When the buffer is full the oldest and latest records can share a block, which is then already listed
+	if (count > 1 && blocks[count - 1] == blocks[0])
+	{
+		count--;
+	}
+
+	if (first_index != NULL)
+	{
+		*first_index = first;
+	}
+
+	if (last_index != NULL)
+	{
+		*last_index = last;
+	}
+
+	return count;
+}
@@ -0,0 +1,83 @@
+#ifndef WS_SYNC_H
+#define WS_SYNC_H
+
+#include "ws.h"
+#include <time.h>
+
+/**
+	Where the station's history is in its circular buffer, from the fixed block. Records
+	are numbered by index, 0 being the oldest and record_count - 1 the latest completed
+	one. The record being written to (at current_pos) can still change, so it isn't part
+	of the plan.
+*/
+typedef struct
+{
+	int read_period;			// Minutes between records
+	int record_count;			// Records completed (data_count less the one being written to)
+	int latest_address;			// Address of the latest completed record
+	int oldest_address;
+	int current_address;		// Address of the record being written to (current_pos), -1 if outside of the history
+	time_t latest_time;			// The time of the latest completed record
+} ws_sync_plan;
+
+
+/**
+	Works out the plan from the fixed block.
+
+	Parameters:
+		fixed_block 	At least the first WS_BLOCK_SIZE bytes of the fixed block
+		latest_time		The time of the latest completed record
+		plan			The plan
+*/
+void ws_sync_plan_decode(const unsigned char* fixed_block, time_t latest_time, ws_sync_plan* plan);
+
+/**
+	Reads the first block of the fixed block (which holds read_period, data_count and
+	current_pos) and works out the plan. The first byte of the record being written to
+	counts the minutes since the latest record was completed, so that record is read too
+	and the latest record is taken to be for that many minutes ago, as when it is polled.
+
+	Return:
+		- WS_ERR_INVALID_ADDR	The station's current_pos is outside of the history
+		- Any error from ws_queue_device_read()
+*/
+int ws_sync_plan_read(ws_device* dev, ws_sync_plan* plan);
+
+/**
+	Gets the address of a record by its index
+*/
+int ws_sync_address(const ws_sync_plan* plan, int index);
+
+/**
+	Gets the index of the record at an address, or -1 if there is no record there
+*/
+int ws_sync_index(const ws_sync_plan* plan, int address);
+
+/**
+	Gets the time of a record by its index
+*/
+time_t ws_sync_time(const ws_sync_plan* plan, int index);
+
+/**
+	Works out which blocks need reading for the records in a time range. Each block is only
+	listed once, even where it holds two of the records, and blocks are in the order of the
+	records they hold (oldest first, following the buffer around the wrap).
+	Every record in a block whose index is in the range should be used, as a block can
+	hold records from both ends of the range.
+
+	Parameters:
+		plan 			The plan
+		from			Start of the range (inclusive)
+		to				End of the range (exclusive)
+		blocks			Filled with the block addresses. Needs room for WS_HISTORY_RECORDS / 2 + 1 blocks
+						to be sure of holding any range.
+		max_blocks		The room in blocks
+		first_index		Optional (may be NULL), set to the index of the first record in the range
+		last_index		Optional (may be NULL), set to the index of the last record in the range
+
+	Return:
+		The number of blocks, 0 if there are no records in the range
+*/
+int ws_sync_blocks(const ws_sync_plan* plan, time_t from, time_t to, int* blocks, int max_blocks, int* first_index, int* last_index);
+
+#endif
@@ -0,0 +1,158 @@
+#include "ws_units.h"
+#include <math.h>
+#include <pthread.h>
+
+#define WS_UNITS_TEMP 2
+#define WS_UNITS_RAIN 2
+#define WS_UNITS_PRESSURE 3
+#define WS_UNITS_SPEED 5
+
+// Lowest speed of Beaufort numbers 1 - 12, in 0.1 m/s
+static const uint16_t ws_beaufort_limits[] = { 3, 16, 34, 55, 80, 108, 139, 172, 208, 245, 285, 327 };
+
+static ws_unit_plan ws_unit_plans[WS_UNITS_TEMP][WS_UNITS_TEMP][WS_UNITS_RAIN][WS_UNITS_PRESSURE][WS_UNITS_SPEED];
+static pthread_once_t ws_unit_plans_once = PTHREAD_ONCE_INIT;
+
+double ws_units_temperature(double celsius, enum ws_unit_temp unit)
+{
+	return (unit == FAHRENHEIT) ? celsius * 1.8 + 32 : celsius;
+}
+
+double ws_units_pressure(double hpa, enum ws_unit_pressure unit)
+{
+	switch (unit)
+	{
+		case INCH_MERCURY:
+			return hpa * 0.0295299830714;
+		case MILLIMETER_MERCURY:
+			return hpa * 0.750061683;
+		default:
+			return hpa;
+	}
+}
+
+/* Converts a speed in 0.1 m/s to the Beaufort scale, without branching */
+static inline int ws_units_beaufort(uint16_t speed)
+{
+	int beaufort = 0;
+	for (size_t i = 0; i < sizeof(ws_beaufort_limits) / sizeof(ws_beaufort_limits[0]); i++)
+	{
+		beaufort += (speed >= ws_beaufort_limits[i]);
+	}
+
+	return beaufort;
+}
+
+double ws_units_speed(double metres_second, enum ws_unit_speed unit)
+{
+	switch (unit)
+	{
+		case KILOMETERS_HOUR:
+			return metres_second * 3.6;
+		case KNOT:
+			return metres_second * 1.94384449;
+		case MILES_HOUR:
+			return metres_second * 2.23693629;
+		case BEAUFORT:
+			return ws_units_beaufort((metres_second <= 0) ? 0 : (metres_second >= 6553.5) ? UINT16_MAX : lround(metres_second * 10));
+		default:
+			return metres_second;
+	}
+}
+
+double ws_units_rain(double mm, enum ws_unit_volume unit)
+{
+	return (unit == INCH) ? mm / 25.4 : mm;
+}
+
+static void ws_units_build_plans(void)
+{
+	for (int in = 0; in < WS_UNITS_TEMP; in++)
+	for (int out = 0; out < WS_UNITS_TEMP; out++)
+	for (int rain = 0; rain < WS_UNITS_RAIN; rain++)
+	for (int pressure = 0; pressure < WS_UNITS_PRESSURE; pressure++)
+	for (int speed = 0; speed < WS_UNITS_SPEED; speed++)
+	{
+		ws_unit_plan* plan = &ws_unit_plans[in][out][rain][pressure][speed];
+
+		plan->units.indoor_temp_unit = in;
+		plan->units.outdoor_temp_unit = out;
+		plan->units.rain_unit = rain;
+		plan->units.pressure_unit = pressure;
+		plan->units.wind_speed_unit = speed;
+
+		// All of the conversions are linear (apart from Beaufort), so work out the line from two points
+		plan->indoor_temp_offset = ws_units_temperature(0, in);
+		plan->indoor_temp_scale = ws_units_temperature(0.1, in) - plan->indoor_temp_offset;
+		plan->outdoor_temp_offset = ws_units_temperature(0, out);
+		plan->outdoor_temp_scale = ws_units_temperature(0.1, out) - plan->outdoor_temp_offset;
+		plan->pressure_scale = ws_units_pressure(0.1, pressure);
+		plan->rain_scale = ws_units_rain(0.3, rain);
+		plan->speed_beaufort = (speed == BEAUFORT);
+		plan->speed_scale = plan->speed_beaufort ? 1 : ws_units_speed(0.1, speed);
+	}
+}
+
+const ws_unit_plan* ws_units_plan(const ws_data_info* units)
+{
+	pthread_once(&ws_unit_plans_once, ws_units_build_plans);
+
+	int in = (units->indoor_temp_unit == FAHRENHEIT);
+	int out = (units->outdoor_temp_unit == FAHRENHEIT);
+	int rain = (units->rain_unit == INCH);
+	int pressure = (units->pressure_unit < WS_UNITS_PRESSURE) ? units->pressure_unit : HECTOPASCALS;
+	int speed = (units->wind_speed_unit < WS_UNITS_SPEED) ? units->wind_speed_unit : METRES_SECOND;
+
+	return &ws_unit_plans[in][out][rain][pressure][speed];
+}
+
+void ws_units_convert(const ws_unit_plan* plan, const ws_packed_record* records, int count, ws_unit_columns* out)
+{
+	// Copy the plan into locals so the compiler knows they can't change inside the loop
+	const double in_scale = plan->indoor_temp_scale, in_offset = plan->indoor_temp_offset;
+	const double out_scale = plan->outdoor_temp_scale, out_offset = plan->outdoor_temp_offset;
+	const double pressure_scale = plan->pressure_scale;
+	const double speed_scale = plan->speed_scale;
+	const double rain_scale = plan->rain_scale;
+	const int beaufort = plan->speed_beaufort;
+
+	for (int i = 0; i < count; i++)
+	{
+		const ws_packed_record* r = &records[i];
+
+		if (out->indoor_temperature != NULL)
+		{
+			out->indoor_temperature[i] = r->indoor_temperature * in_scale + in_offset;
+		}
+
+		if (out->outdoor_temperature != NULL)
+		{
+			out->outdoor_temperature[i] = r->outdoor_temperature * out_scale + out_offset;
+		}
+
+		if (out->dew_point != NULL)
+		{
+			out->dew_point[i] = (r->dew_point == WS_PACKED_NONE) ? NAN : r->dew_point * out_scale + out_offset;
+		}
+
+		if (out->absolute_pressure != NULL)
+		{
+			out->absolute_pressure[i] = r->absolute_pressure * pressure_scale;
+		}
+
+		if (out->wind_speed != NULL)
+		{
+			out->wind_speed[i] = beaufort ? ws_units_beaufort(r->wind_speed) : r->wind_speed * speed_scale;
+		}
+
+		if (out->gust_speed != NULL)
+		{
+			out->gust_speed[i] = beaufort ? ws_units_beaufort(r->gust_speed) : r->gust_speed * speed_scale;
+		}
+
+		if (out->total_rain != NULL)
+		{
+			out->total_rain[i] = r->total_rain * rain_scale;
+		}
+	}
+}
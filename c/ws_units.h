@@ -0,0 +1,75 @@
+#ifndef WS_UNITS_H
+#define WS_UNITS_H
+
+#include "ws.h"
+
+/**
+	How to convert each kind of value from the units records are stored in (°C, hPa, m/s
+	and mm) to a set of display units. Plans are built once for every combination of units
+	and cached, so they should be got through ws_units_plan().
+*/
+typedef struct
+{
+	ws_data_info units;
+
+	// Converted value = raw fixed point value * scale + offset
+	double indoor_temp_scale;
+	double indoor_temp_offset;
+	double outdoor_temp_scale;
+	double outdoor_temp_offset;
+	double pressure_scale;
+	double speed_scale;
+	double rain_scale;
+
+	int speed_beaufort;			// Non zero if speeds are converted to the Beaufort scale
+} ws_unit_plan;
+
+/**
+	Output columns for ws_units_convert(). Each column is an array with room for all of the
+	records being converted. Columns that are not needed can be left NULL and are skipped.
+*/
+typedef struct
+{
+	double* indoor_temperature;
+	double* outdoor_temperature;
+	double* dew_point;
+	double* absolute_pressure;
+	double* wind_speed;
+	double* gust_speed;
+	double* total_rain;
+} ws_unit_columns;
+
+
+/**
+	Gets the cached conversion plan for a set of units.
+
+	Parameters:
+		units 		The units to convert to, for example from ws_read_data_info()
+
+	Return:
+		The plan. This is never freed and can be shared between threads.
+*/
+const ws_unit_plan* ws_units_plan(const ws_data_info* units);
+
+/**
+	Converts an array of records into columns of values in the plan's units, in a single
+	pass over the records.
+
+	Parameters:
+		plan 		The plan from ws_units_plan()
+		records		The records to convert
+		count		The number of records
+		out			The columns to write to
+*/
+void ws_units_convert(const ws_unit_plan* plan, const ws_packed_record* records, int count, ws_unit_columns* out);
+
+/**
+	Converts single values, given in the units used by ws_weather_record, for values
+	that are not part of a record (for example ws_weather_extremes).
+*/
+double ws_units_temperature(double celsius, enum ws_unit_temp unit);
+double ws_units_pressure(double hpa, enum ws_unit_pressure unit);
+double ws_units_speed(double metres_second, enum ws_unit_speed unit);
+double ws_units_rain(double mm, enum ws_unit_volume unit);
+
+#endif